@@ -0,0 +1,1295 @@
+// Benchmark.cpp : Renders a set of standard scenes and reports how fast.
+//
+// Usage: benchmark [options]
+//   --scene NAME     render only this scene (may be repeated; default: all)
+//   --list           print the scene names and exit
+//   --width N        image width in pixels (default 640)
+//   --height N       image height in pixels (default 480)
+//   --aa N           anti-alias factor (default 2)
+//   --adaptive THRESHOLD  supersample only pixels whose neighbors' contrast
+//                    exceeds THRESHOLD (Scene::SetAdaptiveAntiAliasing), and
+//                    report the camera rays traced against the aa*aa per
+//                    pixel uniform sampling traces; 0 for uniform (default);
+//                    not with --progressive, which always samples uniformly
+//   --frames N       timed frames per scene (default 3)
+//   --threads N      render threads, 0 for one per core (default 0)
+//   --wavefront      trace rays breadth-first (Scene::SetWavefrontRendering)
+//   --light-culling  skip insignificant lights (Scene::SetLightCulling)
+//   --light-samples N  shadow rays per surface, 0 for every light
+//                    (Scene::SetLightSampleCount; default 0)
+//   --progressive    render with Scene::RenderProgressive and also report
+//                    how long the first preview took; no images are kept
+//   --animation      render the frames with Scene::RenderAnimation, which
+//                    refits the hierarchy for each frame and writes one
+//                    frame's image while tracing the next; the scenes stand
+//                    still, and with --images the frames are DIR/NAME_0000.png...
+//   --scene-files DIR  save each scene as DIR/NAME.scene (Scene::SaveSceneFile)
+//                    and render a copy loaded from it; build s then
+//                    counts loading the file, hierarchies included,
+//                    instead of making the scene
+//   --images DIR     keep each scene's image as DIR/NAME.png; with
+//                    IMAGER_STATISTICS, also its cost heatmap as DIR/NAME_cost.png
+//   --reference DIR  compare each scene's image with DIR/NAME.png, e.g. the
+//                    --images of a DOUBLE build at the same size, and exit
+//                    with status 1 if more than one pixel in 10000 has a color
+//                    component that differs by more than the tolerance, or the
+//                    mean difference of all the components is more than the
+//                    mean tolerance; not with --progressive
+//   --tolerance N    difference allowed, in PNG levels 0-255 (default 32)
+//   --mean-tolerance X  mean difference allowed, in PNG levels (default 0.5);
+//                    FLOAT and MIXED builds stay within both
+//   --json FILE      write the results as JSON to FILE ("-" for stdout)
+//   --label TEXT     copied into the JSON, e.g. a commit id
+//   --check-meshes   load small OBJ and PLY files, written to the current
+//                    directory, check the meshes they make and exit; a PLY
+//                    header that claims billions of vertices must be rejected
+//
+// Scene files hold only spheres, so --scene-files builds the mesh
+// scenes directly.
+
+#include"Imager.h"
+#include<algorithm>
+#include<chrono>
+#include<cstdio>
+#include<cstdlib>
+#include<cstring>
+#include<fstream>
+#include<iostream>
+#include<iterator>
+#include<new>
+#include<sstream>
+
+#if defined(_WIN32)
+#include<windows.h>
+#include<psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include<sys/resource.h>
+#endif
+
+using namespace Imager;
+
+namespace
+{
+	// A small generator that gives the same scenes on every platform.
+	class Random
+	{
+	public:
+		explicit Random(unsigned int seed)
+			: state(seed)
+		{}
+
+		// Uniform in [low, high).
+		double Next(double low, double high)
+		{
+			state=state*1103515245u+12345u;
+			return low+(high-low)*(((state >> 8) & 0xffffu)/65536.0);
+		}
+
+	private:
+		unsigned int state;
+	};
+
+	Color RandomColor(Random& random)
+	{
+		return Color(random.Next(0.2,1.0),random.Next(0.2,1.0),random.Next(0.2,1.0));
+	}
+
+	// Thousands of small matte and glassy spheres; stresses the hierarchy.
+	void BuildManySpheres(Scene& scene)
+	{
+		Random random(12345);
+		for (int k = 0; k < 4000; ++k)
+		{
+			const Vector3 center(random.Next(-15.0,15.0),random.Next(-10.0,10.0),random.Next(-50.0,-20.0));
+			Sphere* sphere=new Sphere(center,random.Next(0.1,0.5));
+			if (k % 5 == 0)
+			{
+				sphere->SetOptics(0.4);
+			}
+			sphere->SetMatteGlossBalance(0.3,RandomColor(random),Color(1.0,1.0,1.0));
+			scene.AddSolidObject(sphere);
+		}
+		scene.AddLightSource(LightSource(Vector3(-20.0,20.0,10.0),Color(1.0,1.0,1.0,400.0)));
+		scene.AddLightSource(LightSource(Vector3(25.0,5.0,0.0),Color(1.0,0.9,0.7,200.0)));
+	}
+
+	// The same spheres as BuildManySpheres, as one SphereBatch.
+	void BuildManySpheresBatch(Scene& scene)
+	{
+		Random random(12345);
+		SphereBatch* batch=new SphereBatch();
+		batch->ReserveSpheres(4000);
+		for (int k = 0; k < 4000; ++k)
+		{
+			const Vector3 center(random.Next(-15.0,15.0),random.Next(-10.0,10.0),random.Next(-50.0,-20.0));
+			const double radius=random.Next(0.1,0.5);
+			Optics optics;
+			if (k % 5 == 0)
+			{
+				optics.SetOpacity(0.4);
+			}
+			optics.SetMatteGlossBalance(0.3,RandomColor(random),Color(1.0,1.0,1.0));
+			batch->AddSphere(center,radius,batch->AddMaterial(optics));
+		}
+		scene.AddSolidObject(batch);
+		scene.AddLightSource(LightSource(Vector3(-20.0,20.0,10.0),Color(1.0,1.0,1.0,400.0)));
+		scene.AddLightSource(LightSource(Vector3(25.0,5.0,0.0),Color(1.0,0.9,0.7,200.0)));
+	}
+
+	// Glass spheres inside glass spheres in front of a colorful backdrop;
+	// stresses refraction and working out which medium a ray is in.
+	void BuildNestedRefraction(Scene& scene)
+	{
+		const double refraction[4]={REFRACTION_GLASS,REFRACTION_WATER,REFRACTION_DIAMOND,REFRACTION_ICE};
+		for (int row = 0; row < 3; ++row)
+		{
+			for (int column = 0; column < 3; ++column)
+			{
+				const Vector3 center(-5.0+5.0*column,-3.5+3.5*row,-25.0);
+				for (int shell = 0; shell < 4; ++shell)
+				{
+					Sphere* sphere=new Sphere(center,2.0-0.45*shell);
+					sphere->SetMatteGlossBalance(0.1,Color(0.9,0.9,1.0),Color(1.0,1.0,1.0));
+					sphere->SetOptics(0.05);
+					sphere->SetRefraction(refraction[(shell+row+column) % 4]);
+					scene.AddSolidObject(sphere);
+				}
+			}
+		}
+
+		Random random(777);
+		for (int k = 0; k < 200; ++k)
+		{
+			const Vector3 center(random.Next(-20.0,20.0),random.Next(-15.0,15.0),random.Next(-60.0,-45.0));
+			Sphere* sphere=new Sphere(center,random.Next(0.5,1.5));
+			sphere->SetFullMatte(RandomColor(random));
+			scene.AddSolidObject(sphere);
+		}
+		scene.AddLightSource(LightSource(Vector3(0.0,30.0,0.0),Color(1.0,1.0,1.0,900.0)));
+	}
+
+	// A few spheres lit by a hundred lights; stresses shadow rays.
+	void BuildManyLights(Scene& scene)
+	{
+		Random random(4242);
+		for (int k = 0; k < 60; ++k)
+		{
+			const Vector3 center(random.Next(-8.0,8.0),random.Next(-6.0,6.0),random.Next(-30.0,-18.0));
+			Sphere* sphere=new Sphere(center,random.Next(0.5,1.5));
+			sphere->SetMatteGlossBalance(0.2,RandomColor(random),Color(1.0,1.0,1.0));
+			scene.AddSolidObject(sphere);
+		}
+
+		// Lights on a ring high above and around the spheres.
+		const int numLights=100;
+		for (int k = 0; k < numLights; ++k)
+		{
+			const double angle=2.0*PI*k/numLights;
+			const Vector3 location(30.0*cos(angle),15.0+random.Next(0.0,10.0),-24.0+30.0*sin(angle));
+			const Color color=RandomColor(random);
+			scene.AddLightSource(LightSource(location,Color(color.red,color.green,color.blue,8.0)));
+		}
+	}
+
+	// The camera sits inside a mirrored sphere, so no ray escapes:
+	// each one bounces until it fades or reaches MAX_OPTICAL_RECURSION_DEPTH.
+	void BuildReflectionChain(Scene& scene)
+	{
+		Sphere* room=new Sphere(Vector3(0.0,0.0,-15.0),40.0);
+		room->SetMatteGlossBalance(0.9,Color(0.3,0.3,0.35),Color(1.0,1.0,1.0));
+		scene.AddSolidObject(room);
+
+		Random random(99);
+		for (int k = 0; k < 8; ++k)
+		{
+			const double angle=2.0*PI*k/8;
+			Sphere* sphere=new Sphere(Vector3(8.0*cos(angle),8.0*sin(angle),-25.0),3.0);
+			sphere->SetMatteGlossBalance(0.6,RandomColor(random),Color(1.0,1.0,1.0));
+			scene.AddSolidObject(sphere);
+		}
+		scene.AddLightSource(LightSource(Vector3(0.0,20.0,-10.0),Color(1.0,1.0,1.0,600.0)));
+	}
+
+	// A cube from -1 to 1: vertex k has x, y and z set by its bits 0, 1
+	// and 2.  Each face runs counterclockwise seen from outside.
+	const int CUBE_VERTEX_COUNT=8;
+	const int CUBE_FACE_COUNT=6;
+	const int CUBE_FACES[CUBE_FACE_COUNT][4]=
+	{
+		{0,4,6,2}, {1,3,7,5},
+		{0,1,5,4}, {2,6,7,3},
+		{0,2,3,1}, {4,5,7,6},
+	};
+
+	Vector3 CubeVertex(int k)
+	{
+		return Vector3((k & 1) ? 1.0 : -1.0,(k & 2) ? 1.0 : -1.0,(k & 4) ? 1.0 : -1.0);
+	}
+
+	TriangleMesh* MakeCube(const Vector3& center, double halfSize)
+	{
+		TriangleMesh* mesh=new TriangleMesh(center);
+		for (int k = 0; k < CUBE_VERTEX_COUNT; ++k)
+		{
+			mesh->AddVertex(center+halfSize*CubeVertex(k));
+		}
+		for (int f = 0; f < CUBE_FACE_COUNT; ++f)
+		{
+			const int* face=CUBE_FACES[f];
+			mesh->AddTriangle(face[0],face[1],face[2]);
+			mesh->AddTriangle(face[0],face[2],face[3]);
+		}
+		return mesh;
+	}
+
+	// A closed ring around the z axis through center.
+	TriangleMesh* MakeTorus(const Vector3& center, double ringRadius, double tubeRadius, int ringSegments, int tubeSegments)
+	{
+		TriangleMesh* mesh=new TriangleMesh(center);
+		mesh->ReserveVertices(ringSegments*tubeSegments);
+		mesh->ReserveTriangles(2*ringSegments*tubeSegments);
+		for (int i = 0; i < ringSegments; ++i)
+		{
+			const double u=2.0*PI*i/ringSegments;
+			for (int j = 0; j < tubeSegments; ++j)
+			{
+				const double v=2.0*PI*j/tubeSegments;
+				const double distance=ringRadius+tubeRadius*cos(v);
+				mesh->AddVertex(center+Vector3(distance*cos(u),distance*sin(u),tubeRadius*sin(v)));
+			}
+		}
+
+		// Stepping around the ring, then around the tube, turns outward.
+		for (int i = 0; i < ringSegments; ++i)
+		{
+			const int nextI=(i+1) % ringSegments;
+			for (int j = 0; j < tubeSegments; ++j)
+			{
+				const int nextJ=(j+1) % tubeSegments;
+				const size_t a=i*tubeSegments+j;
+				const size_t b=nextI*tubeSegments+j;
+				const size_t c=nextI*tubeSegments+nextJ;
+				const size_t d=i*tubeSegments+nextJ;
+				mesh->AddTriangle(a,b,c);
+				mesh->AddTriangle(a,c,d);
+			}
+		}
+		return mesh;
+	}
+
+	void SetGlass(SolidObject& solid, double refraction)
+	{
+		solid.SetMatteGlossBalance(0.1,Color(0.9,0.9,1.0),Color(1.0,1.0,1.0));
+		solid.SetOptics(0.05);
+		solid.SetRefraction(refraction);
+	}
+
+	// A glass ring, and a glass cube with a water sphere inside it, in
+	// front of a colorful backdrop; stresses triangle meshes, and
+	// working out which medium a ray is in when some are meshes.
+	void BuildGlassMesh(Scene& scene)
+	{
+		TriangleMesh* ring=MakeTorus(Vector3(-4.0,0.0,-25.0),3.0,1.2,96,48);
+		ring->RotateX(60.0);
+		SetGlass(*ring,REFRACTION_GLASS);
+		scene.AddSolidObject(ring);
+
+		TriangleMesh* cube=MakeCube(Vector3(4.5,0.0,-25.0),2.0);
+		cube->RotateY(25.0);
+		cube->RotateX(15.0);
+		SetGlass(*cube,REFRACTION_GLASS);
+		scene.AddSolidObject(cube);
+
+		Sphere* drop=new Sphere(Vector3(4.5,0.0,-25.0),1.0);
+		SetGlass(*drop,REFRACTION_WATER);
+		scene.AddSolidObject(drop);
+
+		Random random(777);
+		for (int k = 0; k < 200; ++k)
+		{
+			const Vector3 center(random.Next(-20.0,20.0),random.Next(-15.0,15.0),random.Next(-60.0,-45.0));
+			Sphere* sphere=new Sphere(center,random.Next(0.5,1.5));
+			sphere->SetFullMatte(RandomColor(random));
+			scene.AddSolidObject(sphere);
+		}
+		scene.AddLightSource(LightSource(Vector3(0.0,30.0,0.0),Color(1.0,1.0,1.0,900.0)));
+	}
+
+	// Thousands of copies of one ring mesh and one cluster of spheres,
+	// each scaled, turned and colored differently; stresses the two
+	// levels of hierarchy and carrying rays into the copies' coordinates.
+	// The scene stores the ring once and the cluster's materials once.
+	void BuildInstancedMeshes(Scene& scene)
+	{
+		std::shared_ptr<TriangleMesh> ring(MakeTorus(Vector3(),0.4,0.15,48,24));
+
+		Random random(2468);
+		std::shared_ptr<SphereBatch> cluster(new SphereBatch());
+		for (int k = 0; k < 12; ++k)
+		{
+			Optics optics;
+			optics.SetMatteGlossBalance(0.4,RandomColor(random),Color(1.0,1.0,1.0));
+			const Vector3 center(random.Next(-0.4,0.4),random.Next(-0.4,0.4),random.Next(-0.4,0.4));
+			cluster->AddSphere(center,random.Next(0.1,0.2),cluster->AddMaterial(optics));
+		}
+
+		for (int k = 0; k < 3000; ++k)
+		{
+			const Vector3 center(random.Next(-15.0,15.0),random.Next(-10.0,10.0),random.Next(-50.0,-20.0));
+			const double scale=random.Next(0.6,1.4);
+			const Transform transform=
+				Transform::Translation(center.x,center.y,center.z)*
+				Transform::RotationY(random.Next(0.0,360.0))*
+				Transform::RotationX(random.Next(0.0,360.0))*
+				Transform::Scaling(scale,scale*random.Next(0.5,1.0),scale);
+			Instance* instance=new Instance((k % 3 == 0) ? std::shared_ptr<const SolidObject>(cluster) : std::shared_ptr<const SolidObject>(ring),transform);
+			instance->SetMatteGlossBalance(0.3,RandomColor(random),Color(1.0,1.0,1.0));
+			scene.AddSolidObject(instance);
+		}
+		scene.AddLightSource(LightSource(Vector3(-20.0,20.0,10.0),Color(1.0,1.0,1.0,400.0)));
+		scene.AddLightSource(LightSource(Vector3(25.0,5.0,0.0),Color(1.0,0.9,0.7,200.0)));
+	}
+
+	struct SceneInfo
+	{
+		const char* name;
+		void (*build)(Scene&);
+		bool isSpheresOnly;         // can be stored in a scene file
+	};
+
+	const SceneInfo SCENE_LIST[]=
+	{
+		{"many_spheres", BuildManySpheres, true},
+		{"many_spheres_batch", BuildManySpheresBatch, true},
+		{"nested_refraction", BuildNestedRefraction, true},
+		{"many_lights", BuildManyLights, true},
+		{"reflection_chain", BuildReflectionChain, true},
+		{"glass_mesh", BuildGlassMesh, false},
+		{"instanced_meshes", BuildInstancedMeshes, false},
+	};
+	const size_t SCENE_COUNT=sizeof(SCENE_LIST)/sizeof(SCENE_LIST[0]);
+
+	struct Settings
+	{
+		std::vector<std::string> sceneNameList;
+		size_t width;
+		size_t height;
+		size_t antiAliasFactor;
+		double adaptiveThreshold;
+		size_t frames;
+		size_t threads;
+		bool isWavefront;
+		bool isLightCulling;
+		size_t lightSamples;
+		bool isProgressive;
+		bool isAnimation;
+		std::string sceneFileDir;
+		std::string imageDir;
+		std::string referenceDir;
+		size_t tolerance;
+		double meanTolerance;
+		std::string jsonFileName;
+		std::string label;
+
+		Settings()
+			: width(640)
+			, height(480)
+			, antiAliasFactor(2)
+			, adaptiveThreshold(0.0)
+			, frames(3)
+			, threads(0)
+			, isWavefront(false)
+			, isLightCulling(false)
+			, lightSamples(0)
+			, isProgressive(false)
+			, isAnimation(false)
+			, tolerance(32)
+			, meanTolerance(0.5)
+		{}
+	};
+
+	// How an image differs from its reference, in PNG levels.
+	struct ImageComparison
+	{
+		int largest;                // -1 if not compared
+		size_t pixelsOverTolerance;
+		size_t pixelsAllowedOver;   // one in 10000, where rays can pass the other side of an edge
+		double mean;
+
+		ImageComparison()
+			: largest(-1)
+			, pixelsOverTolerance(0)
+			, pixelsAllowedOver(0)
+			, mean(0.0)
+		{}
+	};
+
+	struct Result
+	{
+		std::string name;
+		double buildSeconds;        // making the scene, or loading its file, and its bounding volume hierarchy
+		double bestFrameSeconds;
+		double meanFrameSeconds;
+		double firstPreviewSeconds;  // best of the frames; 0 unless progressive
+		size_t cameraRays;          // per frame
+		size_t secondaryRays;
+		size_t shadowRays;
+		size_t materialCount;
+		size_t peakMemoryBytes;
+		ImageComparison comparison; // against --reference
+		RenderStatistics statistics;  // all zero without IMAGER_STATISTICS
+	};
+
+	unsigned int ReadBigEndian(const std::string& data, size_t offset)
+	{
+		return (static_cast<unsigned int>(static_cast<unsigned char>(data[offset])) << 24) |
+			(static_cast<unsigned int>(static_cast<unsigned char>(data[offset+1])) << 16) |
+			(static_cast<unsigned int>(static_cast<unsigned char>(data[offset+2])) << 8) |
+			static_cast<unsigned int>(static_cast<unsigned char>(data[offset+3]));
+	}
+
+	// Reads an image as PngWriter writes it: 8-bit RGB, unfiltered rows
+	// and stored deflate blocks.  Other PNG files are not accepted.
+	void ReadPng(const std::string& fileName, size_t& width, size_t& height, std::string& rgb)
+	{
+		std::ifstream input(fileName.c_str(),std::ios::in | std::ios::binary);
+		if (!input)
+		{
+			throw ImageException("Cannot open image to compare.");
+		}
+		const std::string file((std::istreambuf_iterator<char>(input)),std::istreambuf_iterator<char>());
+
+		static const char signature[8]={'\x89','P','N','G','\r','\n','\x1a','\n'};
+		if ((file.size() < 8) || (file.compare(0,8,signature,8) != 0))
+		{
+			throw ImageException("Image to compare is not a PNG file.");
+		}
+
+		// The chunks' CRCs are not checked; the image data is.
+		std::string zlibData;
+		width=0;
+		height=0;
+		size_t offset=8;
+		for (;;)
+		{
+			if (file.size()-offset < 12)
+			{
+				throw ImageException("Image to compare ends early.");
+			}
+			const size_t length=ReadBigEndian(file,offset);
+			const std::string type=file.substr(offset+4,4);
+			if (file.size()-offset-12 < length)
+			{
+				throw ImageException("Image to compare ends early.");
+			}
+			const size_t dataOffset=offset+8;
+			offset=dataOffset+length+4;
+
+			if (type == "IHDR")
+			{
+				if ((length != 13) || (file.compare(dataOffset+8,5,"\x08\x02\x00\x00\x00",5) != 0))
+				{
+					throw ImageException("Image to compare was not written by PngWriter.");
+				}
+				width=ReadBigEndian(file,dataOffset);
+				height=ReadBigEndian(file,dataOffset+4);
+			}
+			else if (type == "IDAT")
+			{
+				zlibData.append(file,dataOffset,length);
+			}
+			else if (type == "IEND")
+			{
+				break;
+			}
+		}
+
+		// A 2-byte zlib header, then stored blocks of a 5-byte header
+		// and the raw bytes each, then the Adler-32 checksum.
+		std::string raw;
+		size_t position=2;
+		bool isFinal=false;
+		while (!isFinal)
+		{
+			if (zlibData.size() < position+5)
+			{
+				throw ImageException("Image to compare ends early.");
+			}
+			const unsigned char blockHeader=static_cast<unsigned char>(zlibData[position]);
+			if ((blockHeader & 6) != 0)
+			{
+				throw ImageException("Image to compare was not written by PngWriter.");
+			}
+			isFinal=((blockHeader & 1) != 0);
+			const size_t length=static_cast<unsigned char>(zlibData[position+1]) |
+				(static_cast<size_t>(static_cast<unsigned char>(zlibData[position+2])) << 8);
+			position+=5;
+			if (zlibData.size()-position < length)
+			{
+				throw ImageException("Image to compare ends early.");
+			}
+			raw.append(zlibData,position,length);
+			position+=length;
+		}
+
+		const size_t rowBytes=1+3*width;
+		if ((width == 0) || (raw.size()/rowBytes != height) || (raw.size()%rowBytes != 0))
+		{
+			throw ImageException("Image to compare has the wrong amount of data.");
+		}
+		rgb.clear();
+		rgb.reserve(3*width*height);
+		for (size_t row = 0; row < height; ++row)
+		{
+			if (raw[row*rowBytes] != 0)
+			{
+				throw ImageException("Image to compare was not written by PngWriter.");
+			}
+			rgb.append(raw,row*rowBytes+1,3*width);
+		}
+	}
+
+	// Compares the color components of two images of the same size.
+	ImageComparison CompareImages(const std::string& fileName, const std::string& referenceFileName, size_t tolerance)
+	{
+		size_t width=0;
+		size_t height=0;
+		std::string rgb;
+		ReadPng(fileName,width,height,rgb);
+
+		size_t referenceWidth=0;
+		size_t referenceHeight=0;
+		std::string referenceRgb;
+		ReadPng(referenceFileName,referenceWidth,referenceHeight,referenceRgb);
+
+		if ((width != referenceWidth) || (height != referenceHeight))
+		{
+			throw ImageException("Reference image is a different size.");
+		}
+
+		ImageComparison comparison;
+		comparison.largest=0;
+		comparison.pixelsAllowedOver=width*height/10000;
+		size_t total=0;
+		for (size_t k = 0; k < rgb.size(); k+=3)
+		{
+			int pixelLargest=0;
+			for (size_t c = k; c < k+3; ++c)
+			{
+				const int difference=abs(static_cast<unsigned char>(rgb[c])-static_cast<unsigned char>(referenceRgb[c]));
+				pixelLargest=std::max(pixelLargest,difference);
+				total+=difference;
+			}
+			comparison.largest=std::max(comparison.largest,pixelLargest);
+			if (static_cast<size_t>(pixelLargest) > tolerance)
+			{
+				++comparison.pixelsOverTolerance;
+			}
+		}
+		comparison.mean=static_cast<double>(total)/rgb.size();
+		return comparison;
+	}
+
+	// Starts a new peak memory measurement where the
+	// system allows it; elsewhere the peak is for the whole run.
+	void ResetPeakMemory()
+	{
+#if defined(__linux__)
+		std::ofstream clearRefs("/proc/self/clear_refs");
+		clearRefs << "5";
+#endif
+	}
+
+	size_t PeakMemoryBytes()
+	{
+#if defined(_WIN32)
+		PROCESS_MEMORY_COUNTERS counters;
+		if (GetProcessMemoryInfo(GetCurrentProcess(),&counters,sizeof(counters)))
+		{
+			return counters.PeakWorkingSetSize;
+		}
+		return 0;
+#else
+#if defined(__linux__)
+		std::ifstream status("/proc/self/status");
+		std::string line;
+		while (std::getline(status,line))
+		{
+			if (line.compare(0,6,"VmHWM:") == 0)
+			{
+				return static_cast<size_t>(atol(line.c_str()+6))*1024;
+			}
+		}
+#endif
+		struct rusage usage;
+		if (getrusage(RUSAGE_SELF,&usage) != 0)
+		{
+			return 0;
+		}
+#if defined(__APPLE__)
+		return static_cast<size_t>(usage.ru_maxrss);
+#else
+		return static_cast<size_t>(usage.ru_maxrss)*1024;
+#endif
+#endif
+	}
+
+	double SecondsSince(std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+	}
+
+	Result RunScene(const SceneInfo& info, const Settings& settings)
+	{
+		ResetPeakMemory();
+
+		Result result;
+		result.name=info.name;
+
+		Scene scene(Color(0.1,0.1,0.2));
+		scene.SetThreadCount(settings.threads);
+		scene.SetWavefrontRendering(settings.isWavefront);
+		scene.SetLightCulling(settings.isLightCulling);
+		scene.SetLightSampleCount(settings.lightSamples);
+		scene.SetAdaptiveAntiAliasing(settings.adaptiveThreshold);
+
+		std::chrono::steady_clock::time_point start;
+		if (settings.sceneFileDir.empty() || !info.isSpheresOnly)
+		{
+			start=std::chrono::steady_clock::now();
+			info.build(scene);
+			scene.RebuildAccelerationStructure();
+		}
+		else
+		{
+			const std::string sceneFileName=settings.sceneFileDir+"/"+info.name+".scene";
+			{
+				Scene original(Color(0.1,0.1,0.2));
+				info.build(original);
+				original.SaveSceneFile(sceneFileName.c_str());
+			}
+			ResetPeakMemory();
+
+			start=std::chrono::steady_clock::now();
+			// The file holds the scene's hierarchy, so there is nothing to rebuild.
+			scene.LoadSceneFile(sceneFileName.c_str());
+		}
+		result.buildSeconds=SecondsSince(start);
+
+		const std::string fileName=settings.imageDir.empty() ?
+			std::string("benchmark_frame.png") :
+			(settings.imageDir+"/"+info.name+".png");
+		const std::string prefix=settings.imageDir.empty() ?
+			std::string("benchmark_frame_") :
+			(settings.imageDir+"/"+info.name+"_");
+
+#if IMAGER_STATISTICS
+		if (!settings.imageDir.empty())
+		{
+			const std::string costFileName=settings.imageDir+"/"+info.name+"_cost.png";
+			scene.SetCostHeatmapFile(costFileName.c_str());
+		}
+#endif
+
+		result.bestFrameSeconds=HUGE_VAL;
+		result.firstPreviewSeconds=0.0;
+		double totalSeconds=0.0;
+		if (settings.isAnimation)
+		{
+			// A frame runs from one update to the next; the last one
+			// ends when its image has been written.
+			start=std::chrono::steady_clock::now();
+			const std::chrono::steady_clock::time_point animationStart=start;
+			scene.RenderAnimation(prefix.c_str(),settings.frames,settings.width,settings.height,3.0,settings.antiAliasFactor,
+				[&](size_t frame)
+				{
+					if (frame > 0)
+					{
+						const double seconds=SecondsSince(start);
+						if (seconds < result.bestFrameSeconds)
+						{
+							result.bestFrameSeconds=seconds;
+						}
+						start=std::chrono::steady_clock::now();
+					}
+				});
+			const double seconds=SecondsSince(start);
+			if (seconds < result.bestFrameSeconds)
+			{
+				result.bestFrameSeconds=seconds;
+			}
+			totalSeconds=SecondsSince(animationStart);
+		}
+		for (size_t frame = 0; !settings.isAnimation && (frame < settings.frames); ++frame)
+		{
+			start=std::chrono::steady_clock::now();
+			if (settings.isProgressive)
+			{
+				double previewSeconds=0.0;
+				scene.RenderProgressive(settings.width,settings.height,3.0,settings.antiAliasFactor,
+					[&](const ImageBuffer&, const Scene::RenderProgress& progress)
+					{
+						if (progress.pass == 0)
+						{
+							previewSeconds=SecondsSince(start);
+						}
+						return true;
+					});
+				if ((frame == 0) || (previewSeconds < result.firstPreviewSeconds))
+				{
+					result.firstPreviewSeconds=previewSeconds;
+				}
+			}
+			else
+			{
+				scene.SaveImage(fileName.c_str(),settings.width,settings.height,3.0,settings.antiAliasFactor);
+			}
+			const double seconds=SecondsSince(start);
+
+			totalSeconds+=seconds;
+			if (seconds < result.bestFrameSeconds)
+			{
+				result.bestFrameSeconds=seconds;
+			}
+		}
+		result.meanFrameSeconds=totalSeconds/settings.frames;
+
+		// Every frame traces the same rays, and after an animation
+		// the counts are the last frame's.
+		result.cameraRays=scene.GetCameraRayCount();
+		result.secondaryRays=scene.GetSecondaryRayCount();
+		result.shadowRays=scene.GetShadowRayCount();
+		result.materialCount=scene.GetMaterialCount();
+		result.statistics=scene.GetRenderStatistics();
+		result.peakMemoryBytes=PeakMemoryBytes();
+
+		// The scenes stand still, so every frame of an animation is the same.
+		if (!settings.referenceDir.empty())
+		{
+			const std::string imageFileName=settings.isAnimation ? (prefix+"0000.png") : fileName;
+			result.comparison=CompareImages(imageFileName,settings.referenceDir+"/"+info.name+".png",settings.tolerance);
+		}
+
+		if (settings.imageDir.empty() && !settings.isAnimation)
+		{
+			std::remove(fileName.c_str());
+		}
+		for (size_t frame = 0; settings.imageDir.empty() && settings.isAnimation && (frame < settings.frames); ++frame)
+		{
+			char frameFileName[64];
+			snprintf(frameFileName,sizeof(frameFileName),"%s%04lu.png",prefix.c_str(),static_cast<unsigned long>(frame));
+			std::remove(frameFileName);
+		}
+		return result;
+	}
+
+	void WriteLittleEndian(std::ostream& output, unsigned int value)
+	{
+		for (int k = 0; k < 4; ++k)
+		{
+			output.put(static_cast<char>((value >> (8*k)) & 0xff));
+		}
+	}
+
+	// Prints what went wrong and returns false unless isPassed.
+	bool Check(bool isPassed, const char* what)
+	{
+		if (!isPassed)
+		{
+			fprintf(stderr,"Mesh check failed: %s\n",what);
+		}
+		return isPassed;
+	}
+
+	// A loaded cube should be the one CUBE_FACES describes: closed,
+	// facing outward, and containing only the points inside it.
+	bool CheckCube(TriangleMesh& mesh, const char* format)
+	{
+		bool isPassed=true;
+		isPassed=Check(mesh.GetVertexCount() == CUBE_VERTEX_COUNT,format) && isPassed;
+		isPassed=Check(mesh.GetTriangleCount() == 2*CUBE_FACE_COUNT,format) && isPassed;
+		if (!isPassed)
+		{
+			return false;
+		}
+
+		mesh.Prepare();
+		isPassed=Check(mesh.Contains(Vector3(0.1,0.2,0.3)),"cube does not contain its middle") && isPassed;
+		isPassed=Check(!mesh.Contains(Vector3(0.1,0.2,1.5)),"cube contains a point above it") && isPassed;
+		isPassed=Check(!mesh.Contains(Vector3(1.5,0.2,0.3)),"cube contains a point beside it") && isPassed;
+
+		// A ray along a diagonal of the bottom face crosses the shared edge.
+		const Vector3 vantage(0.0,0.0,-5.0);
+		const Vector3 direction(0.0,0.0,1.0);
+		RayHit hit;
+		Intersection intersection;
+		if (Check(mesh.FindClosestHit(vantage,direction,HUGE_VAL,hit) == 1,"ray through a shared edge misses the cube"))
+		{
+			mesh.CompleteIntersection(vantage,direction,hit,intersection);
+			isPassed=Check(fabs(hit.t-4.0) < 1.0e-6,"ray hits the cube at the wrong place") && isPassed;
+			isPassed=Check(intersection.surfaceNormal.z < -0.99,"cube faces inward") && isPassed;
+		}
+		else
+		{
+			isPassed=false;
+		}
+		return isPassed;
+	}
+
+	// Returns true if every mesh loader check passes.
+	bool CheckMeshLoaders()
+	{
+		const char* objFileName="benchmark_cube.obj";
+		const char* plyFileName="benchmark_cube.ply";
+		const char* truncatedFileName="benchmark_truncated.ply";
+		bool isPassed=true;
+		try
+		{
+			// Faces in the forms OBJ exporters write, one counting back from the end.
+			{
+				std::ofstream obj(objFileName);
+				obj << "# cube\n";
+				for (int k = 0; k < CUBE_VERTEX_COUNT; ++k)
+				{
+					const Vector3 v=CubeVertex(k);
+					obj << "v " << v.x << " " << v.y << " " << v.z << "\n";
+				}
+				obj << "vn 0 0 1\nvt 0 0\n";
+				for (int f = 0; f < CUBE_FACE_COUNT; ++f)
+				{
+					const int* face=CUBE_FACES[f];
+					obj << "f";
+					for (int k = 0; k < 4; ++k)
+					{
+						if (f == CUBE_FACE_COUNT-1)     obj << " " << face[k]-CUBE_VERTEX_COUNT;
+						else if (f % 2 == 0)            obj << " " << face[k]+1 << "/1/1";
+						else                            obj << " " << face[k]+1 << "//1";
+					}
+					obj << "\n";
+				}
+			}
+			TriangleMesh objMesh;
+			objMesh.LoadObj(objFileName);
+			isPassed=CheckCube(objMesh,"OBJ cube has the wrong size") && isPassed;
+
+			// Binary, with a property the mesh does not use.
+			{
+				std::ofstream ply(plyFileName,std::ios::out | std::ios::binary);
+				ply << "ply\nformat binary_little_endian 1.0\ncomment cube\n"
+					"element vertex 8\nproperty float x\nproperty float y\nproperty float z\nproperty uchar red\n"
+					"element face 6\nproperty list uchar int vertex_indices\nend_header\n";
+				for (int k = 0; k < CUBE_VERTEX_COUNT; ++k)
+				{
+					const Vector3 v=CubeVertex(k);
+					const float xyz[3]={static_cast<float>(v.x),static_cast<float>(v.y),static_cast<float>(v.z)};
+					for (int a = 0; a < 3; ++a)
+					{
+						unsigned int bits;
+						memcpy(&bits,&xyz[a],sizeof(bits));
+						WriteLittleEndian(ply,bits);
+					}
+					ply.put(static_cast<char>(200));
+				}
+				for (int f = 0; f < CUBE_FACE_COUNT; ++f)
+				{
+					ply.put(4);
+					for (int k = 0; k < 4; ++k)
+					{
+						WriteLittleEndian(ply,CUBE_FACES[f][k]);
+					}
+				}
+			}
+			TriangleMesh plyMesh;
+			plyMesh.LoadPly(plyFileName);
+			isPassed=CheckCube(plyMesh,"PLY cube has the wrong size") && isPassed;
+
+			// A header claiming billions of vertices and faces, with
+			// the data cut off, must fail without reserving room for them.
+			{
+				std::ofstream ply(truncatedFileName,std::ios::out | std::ios::binary);
+				ply << "ply\nformat binary_little_endian 1.0\n"
+					"element vertex 4000000000\nproperty float x\nproperty float y\nproperty float z\n"
+					"element face 4000000000\nproperty list uchar int vertex_indices\nend_header\n";
+				WriteLittleEndian(ply,0);
+				WriteLittleEndian(ply,0);
+			}
+			try
+			{
+				TriangleMesh truncatedMesh;
+				truncatedMesh.LoadPly(truncatedFileName);
+				isPassed=Check(false,"truncated PLY file loaded");
+			}
+			catch (const ImageException&)
+			{
+			}
+			catch (const std::bad_alloc&)
+			{
+				isPassed=Check(false,"truncated PLY file's header counts were allocated");
+			}
+		}
+		catch (const ImageException& error)
+		{
+			isPassed=Check(false,error.GetMessage());
+		}
+		std::remove(objFileName);
+		std::remove(plyFileName);
+		std::remove(truncatedFileName);
+		return isPassed;
+	}
+
+	// Camera rays a frame takes without adaptive anti-aliasing.
+	size_t UniformCameraRays(const Settings& settings)
+	{
+		return settings.width*settings.height*settings.antiAliasFactor*settings.antiAliasFactor;
+	}
+
+	bool IsOverTolerance(const ImageComparison& comparison, const Settings& settings)
+	{
+		return (comparison.largest >= 0) &&
+			((comparison.pixelsOverTolerance > comparison.pixelsAllowedOver) || (comparison.mean > settings.meanTolerance));
+	}
+
+	double PerSecond(size_t count, double seconds)
+	{
+		return (seconds > 0.0) ? (count/seconds) : 0.0;
+	}
+
+	const char* PrecisionName()
+	{
+#if IMAGER_PRECISION == IMAGER_PRECISION_FLOAT
+		return "float";
+#elif IMAGER_PRECISION == IMAGER_PRECISION_MIXED
+		return "mixed";
+#else
+		return "double";
+#endif
+	}
+
+	const char* SimdLevelName(SimdLevel level)
+	{
+		switch (level)
+		{
+		case SIMD_SSE2:     return "sse2";
+		case SIMD_AVX2:     return "avx2";
+		case SIMD_AVX512:   return "avx512";
+		default:            return "scalar";
+		}
+	}
+
+	std::string JsonString(const std::string& text)
+	{
+		std::string quoted="\"";
+		for (size_t i = 0; i < text.size(); ++i)
+		{
+			const char c=text[i];
+			if ((c == '"') || (c == '\\'))
+			{
+				quoted+='\\';
+				quoted+=c;
+			}
+			else if (static_cast<unsigned char>(c) < 0x20)
+			{
+				char escape[8];
+				snprintf(escape,sizeof(escape),"\\u%04x",c);
+				quoted+=escape;
+			}
+			else
+			{
+				quoted+=c;
+			}
+		}
+		return quoted+"\"";
+	}
+
+	std::string FormatJson(const Settings& settings, const std::vector<Result>& resultList)
+	{
+		std::ostringstream json;
+		json.precision(9);
+		json << "{\n";
+		json << "  \"label\": " << JsonString(settings.label) << ",\n";
+		json << "  \"precision\": \"" << PrecisionName() << "\",\n";
+		json << "  \"simd\": \"" << SimdLevelName(PacketKernels::GetSimdLevel()) << "\",\n";
+		json << "  \"threads\": " << settings.threads << ",\n";
+		json << "  \"wavefront\": " << (settings.isWavefront?"true":"false") << ",\n";
+		json << "  \"light_culling\": " << (settings.isLightCulling?"true":"false") << ",\n";
+		json << "  \"light_samples\": " << settings.lightSamples << ",\n";
+		json << "  \"progressive\": " << (settings.isProgressive?"true":"false") << ",\n";
+		json << "  \"animation\": " << (settings.isAnimation?"true":"false") << ",\n";
+		json << "  \"scene_files\": " << (settings.sceneFileDir.empty()?"false":"true") << ",\n";
+		json << "  \"width\": " << settings.width << ",\n";
+		json << "  \"height\": " << settings.height << ",\n";
+		json << "  \"anti_alias_factor\": " << settings.antiAliasFactor << ",\n";
+		json << "  \"adaptive_threshold\": " << settings.adaptiveThreshold << ",\n";
+		json << "  \"uniform_camera_rays\": " << UniformCameraRays(settings) << ",\n";
+		json << "  \"frames\": " << settings.frames << ",\n";
+		if (!settings.referenceDir.empty())
+		{
+			json << "  \"tolerance\": " << settings.tolerance << ",\n";
+			json << "  \"mean_tolerance\": " << settings.meanTolerance << ",\n";
+		}
+		json << "  \"scenes\": [";
+		for (size_t i = 0; i < resultList.size(); ++i)
+		{
+			const Result& r=resultList[i];
+			const size_t totalRays=r.cameraRays+r.secondaryRays+r.shadowRays;
+			json << ((i > 0) ? ",\n" : "\n");
+			json << "    {\n";
+			json << "      \"name\": " << JsonString(r.name) << ",\n";
+			json << "      \"build_seconds\": " << r.buildSeconds << ",\n";
+			json << "      \"best_frame_seconds\": " << r.bestFrameSeconds << ",\n";
+			json << "      \"mean_frame_seconds\": " << r.meanFrameSeconds << ",\n";
+			json << "      \"first_preview_seconds\": " << r.firstPreviewSeconds << ",\n";
+			json << "      \"camera_rays\": " << r.cameraRays << ",\n";
+			json << "      \"secondary_rays\": " << r.secondaryRays << ",\n";
+			json << "      \"shadow_rays\": " << r.shadowRays << ",\n";
+			json << "      \"camera_rays_per_second\": " << PerSecond(r.cameraRays,r.bestFrameSeconds) << ",\n";
+			json << "      \"secondary_rays_per_second\": " << PerSecond(r.secondaryRays,r.bestFrameSeconds) << ",\n";
+			json << "      \"shadow_rays_per_second\": " << PerSecond(r.shadowRays,r.bestFrameSeconds) << ",\n";
+			json << "      \"rays_per_second\": " << PerSecond(totalRays,r.bestFrameSeconds) << ",\n";
+			json << "      \"materials\": " << r.materialCount << ",\n";
+#if IMAGER_STATISTICS
+			json << "      \"intersection_tests\": " << r.statistics.intersectionTests << ",\n";
+			json << "      \"shadow_tests\": " << r.statistics.shadowTests << ",\n";
+			json << "      \"containment_tests\": " << r.statistics.containmentTests << ",\n";
+			json << "      \"ambiguous_pixels\": " << r.statistics.ambiguousPixels << ",\n";
+			json << "      \"total_internal_reflections\": " << r.statistics.totalInternalReflections << ",\n";
+#endif
+			if (r.comparison.largest >= 0)
+			{
+				json << "      \"image_difference\": " << r.comparison.largest << ",\n";
+				json << "      \"pixels_over_tolerance\": " << r.comparison.pixelsOverTolerance << ",\n";
+				json << "      \"pixels_allowed_over_tolerance\": " << r.comparison.pixelsAllowedOver << ",\n";
+				json << "      \"mean_image_difference\": " << r.comparison.mean << ",\n";
+			}
+			json << "      \"peak_memory_bytes\": " << r.peakMemoryBytes << "\n";
+			json << "    }";
+		}
+		json << "\n  ]\n}\n";
+		return json.str();
+	}
+
+	void PrintUsage()
+	{
+		fprintf(stderr,
+			"usage: benchmark [--scene NAME]... [--list] [--width N] [--height N] [--aa N] [--adaptive THRESHOLD]\n"
+			"                 [--frames N] [--threads N] [--wavefront] [--light-culling] [--light-samples N]\n"
+			"                 [--progressive] [--animation] [--scene-files DIR] [--images DIR]\n"
+			"                 [--reference DIR] [--tolerance N] [--mean-tolerance X] [--json FILE] [--label TEXT]\n"
+			"       benchmark --check-meshes\n");
+	}
+
+	// Returns false if the command line is not valid.
+	bool ParseCommandLine(int argc, const char* argv[], Settings& settings, bool& listOnly, bool& checkMeshesOnly)
+	{
+		listOnly=false;
+		checkMeshesOnly=false;
+		for (int i = 1; i < argc; ++i)
+		{
+			const std::string option=argv[i];
+			if (option == "--list")
+			{
+				listOnly=true;
+				continue;
+			}
+			if (option == "--check-meshes")
+			{
+				checkMeshesOnly=true;
+				continue;
+			}
+			if (option == "--wavefront")
+			{
+				settings.isWavefront=true;
+				continue;
+			}
+			if (option == "--light-culling")
+			{
+				settings.isLightCulling=true;
+				continue;
+			}
+			if (option == "--progressive")
+			{
+				settings.isProgressive=true;
+				continue;
+			}
+			if (option == "--animation")
+			{
+				settings.isAnimation=true;
+				continue;
+			}
+
+			if (i+1 >= argc)
+			{
+				return false;
+			}
+			const char* value=argv[++i];
+
+			if (option == "--scene")            settings.sceneNameList.push_back(value);
+			else if (option == "--width")       settings.width=strtoul(value,NULL,10);
+			else if (option == "--height")      settings.height=strtoul(value,NULL,10);
+			else if (option == "--aa")          settings.antiAliasFactor=strtoul(value,NULL,10);
+			else if (option == "--adaptive")    settings.adaptiveThreshold=strtod(value,NULL);
+			else if (option == "--frames")      settings.frames=strtoul(value,NULL,10);
+			else if (option == "--threads")     settings.threads=strtoul(value,NULL,10);
+			else if (option == "--light-samples") settings.lightSamples=strtoul(value,NULL,10);
+			else if (option == "--scene-files") settings.sceneFileDir=value;
+			else if (option == "--images")      settings.imageDir=value;
+			else if (option == "--reference")   settings.referenceDir=value;
+			else if (option == "--tolerance")   settings.tolerance=strtoul(value,NULL,10);
+			else if (option == "--mean-tolerance") settings.meanTolerance=strtod(value,NULL);
+			else if (option == "--json")        settings.jsonFileName=value;
+			else if (option == "--label")       settings.label=value;
+			else return false;
+		}
+		if (settings.isProgressive && !settings.isAnimation && !settings.referenceDir.empty())
+		{
+			// RenderProgressive keeps no image to compare.
+			return false;
+		}
+		if (settings.isProgressive && !settings.isAnimation && (settings.adaptiveThreshold > 0.0))
+		{
+			// Nor does it sample adaptively.
+			return false;
+		}
+		return (settings.width > 0) && (settings.height > 0) && (settings.antiAliasFactor > 0) && (settings.frames > 0) &&
+			(settings.adaptiveThreshold >= 0.0);
+	}
+}
+
+int main(int argc, const char* argv[])
+{
+	Settings settings;
+	bool listOnly=false;
+	bool checkMeshesOnly=false;
+	if (!ParseCommandLine(argc,argv,settings,listOnly,checkMeshesOnly))
+	{
+		PrintUsage();
+		return 1;
+	}
+
+	if (checkMeshesOnly)
+	{
+		if (!CheckMeshLoaders())
+		{
+			return 1;
+		}
+		printf("Mesh checks passed.\n");
+		return 0;
+	}
+
+	if (listOnly)
+	{
+		for (size_t s = 0; s < SCENE_COUNT; ++s)
+		{
+			printf("%s\n",SCENE_LIST[s].name);
+		}
+		return 0;
+	}
+
+	std::vector<const SceneInfo*> runList;
+	for (size_t s = 0; s < SCENE_COUNT; ++s)
+	{
+		bool isSelected=settings.sceneNameList.empty();
+		for (size_t n = 0; n < settings.sceneNameList.size(); ++n)
+		{
+			isSelected=isSelected || (settings.sceneNameList[n] == SCENE_LIST[s].name);
+		}
+		if (isSelected)
+		{
+			runList.push_back(&SCENE_LIST[s]);
+		}
+	}
+	if (runList.size() == 0)
+	{
+		fprintf(stderr,"No scene matches; try --list.\n");
+		return 1;
+	}
+
+	printf("%-20s %10s %10s %12s %12s %12s %10s %10s\n",
+		"scene","frame s","build s","camera Mr/s","second Mr/s","shadow Mr/s","peak MB","materials");
+
+	std::vector<Result> resultList;
+	try
+	{
+		for (size_t s = 0; s < runList.size(); ++s)
+		{
+			const Result r=RunScene(*runList[s],settings);
+			resultList.push_back(r);
+			printf("%-20s %10.3f %10.3f %12.2f %12.2f %12.2f %10.1f %10lu\n",
+				r.name.c_str(),
+				r.bestFrameSeconds,
+				r.buildSeconds,
+				PerSecond(r.cameraRays,r.bestFrameSeconds)/1.0e6,
+				PerSecond(r.secondaryRays,r.bestFrameSeconds)/1.0e6,
+				PerSecond(r.shadowRays,r.bestFrameSeconds)/1.0e6,
+				r.peakMemoryBytes/(1024.0*1024.0),
+				static_cast<unsigned long>(r.materialCount));
+			if (settings.isProgressive)
+			{
+				printf("%-20s %10.3f first preview\n","",r.firstPreviewSeconds);
+			}
+			if (settings.adaptiveThreshold > 0.0)
+			{
+				const size_t uniformRays=UniformCameraRays(settings);
+				printf("%-20s %10lu camera rays traced, %lu with uniform sampling (%.0f%%)\n","",
+					static_cast<unsigned long>(r.cameraRays),static_cast<unsigned long>(uniformRays),
+					100.0*r.cameraRays/uniformRays);
+			}
+			if (r.comparison.largest >= 0)
+			{
+				printf("%-20s %10d image difference, %lu pixels over %lu (%lu allowed), %.3f mean%s\n","",
+					r.comparison.largest,
+					static_cast<unsigned long>(r.comparison.pixelsOverTolerance),
+					static_cast<unsigned long>(settings.tolerance),
+					static_cast<unsigned long>(r.comparison.pixelsAllowedOver),
+					r.comparison.mean,
+					IsOverTolerance(r.comparison,settings)?", over tolerance":"");
+			}
+			fflush(stdout);
+		}
+	}
+	catch (const ImageException& error)
+	{
+		fprintf(stderr,"Render failed: %s\n",error.GetMessage());
+		return 1;
+	}
+
+#if IMAGER_STATISTICS
+	for (size_t s = 0; s < resultList.size(); ++s)
+	{
+		std::cout << "\n" << resultList[s].name << " (last frame):\n";
+		resultList[s].statistics.Print(std::cout);
+	}
+	std::cout.flush();
+#endif
+
+	if (!settings.jsonFileName.empty())
+	{
+		const std::string json=FormatJson(settings,resultList);
+		if (settings.jsonFileName == "-")
+		{
+			fputs(json.c_str(),stdout);
+		}
+		else
+		{
+			std::ofstream output(settings.jsonFileName.c_str());
+			output << json;
+			if (!output)
+			{
+				fprintf(stderr,"Cannot write %s\n",settings.jsonFileName.c_str());
+				return 1;
+			}
+		}
+	}
+
+	for (size_t s = 0; s < resultList.size(); ++s)
+	{
+		if (IsOverTolerance(resultList[s].comparison,settings))
+		{
+			fprintf(stderr,"%s differs from its reference by more than %lu at too many pixels, or by more than %g on average.\n",
+				resultList[s].name.c_str(),static_cast<unsigned long>(settings.tolerance),settings.meanTolerance);
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,45 @@
+#include"Algebra.h"
+#include<cmath>
+
+namespace Algebra
+{
+	const double TOLERANCE = 1.0e-8;
+
+	inline bool IsZero(double x)
+	{
+		return fabs(x) < TOLERANCE;
+	}
+
+	int SolveQuadraticEquation(double a, double b, double c, double roots[2])
+	{
+		if (IsZero(a))
+		{
+			if (IsZero(b))
+			{
+				// The equation degenerates to "c = 0"; no usable root.
+				return 0;
+			}
+
+			roots[0] = -c / b;
+			return 1;
+		}
+
+		const double radicand = b*b - 4.0*a*c;
+		if (IsZero(radicand))
+		{
+			roots[0] = -b / (2.0*a);
+			return 1;
+		}
+
+		if (radicand > 0.0)
+		{
+			const double r = sqrt(radicand);
+			const double d = 2.0*a;
+			roots[0] = (-b + r) / d;
+			roots[1] = (-b - r) / d;
+			return 2;
+		}
+
+		return 0;
+	}
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+namespace Algebra
+{
+	// Finds the real roots of a*x^2 + b*x + c = 0.
+	// Stores them in roots[] and returns how many were found (0, 1 or 2).
+	// Degenerates to the linear case when a is (nearly) zero.
+	int SolveQuadraticEquation(
+		double a,
+		double b,
+		double c,
+		double roots[2]);
+}
@@ -0,0 +1,304 @@
+#include"Imager.h"
+#include<algorithm>
+
+namespace Imager
+{
+	namespace
+	{
+		// Number of buckets the surface area heuristic sorts centroids into
+		// along each axis when looking for a split.
+		const int SAH_BIN_COUNT = 16;
+
+		// Estimated cost of visiting an interior node, relative to
+		// the cost of testing a ray against one primitive.
+		const double SAH_TRAVERSAL_COST = 0.125;
+
+		inline double Component(const Vector3& v, int axis)
+		{
+			return (axis == 0) ? v.x : ((axis == 1) ? v.y : v.z);
+		}
+
+		struct SahBin
+		{
+			BoundingBox bounds;
+			size_t count;
+
+			SahBin()
+				: count(0)
+			{}
+		};
+	}
+
+	BoundingVolumeHierarchy::BoundingVolumeHierarchy()
+	{
+	}
+
+	void BoundingVolumeHierarchy::Build(const std::vector<BoundingBox>& primitiveBounds)
+	{
+		Clear();
+
+		const size_t count = primitiveBounds.size();
+		if (count == 0)
+		{
+			return;
+		}
+
+		std::vector<BuildItem> itemList(count);
+		for (size_t i = 0; i < count; ++i)
+		{
+			itemList[i].bounds = primitiveBounds[i];
+			itemList[i].centroid = primitiveBounds[i].Centroid();
+			itemList[i].primitiveIndex = static_cast<unsigned int>(i);
+		}
+
+		// A binary tree with leaves of at least one primitive
+		// never has more than 2n-1 nodes.
+		nodeList.Edit().reserve(2*count - 1);
+		primitiveIndexList.Edit().reserve(count);
+
+		BuildNode(itemList, 0, count, 0);
+	}
+
+	unsigned int BoundingVolumeHierarchy::BuildNode(std::vector<BuildItem>& itemList, size_t first, size_t last, int depth)
+	{
+		std::vector<Node>& nodes = nodeList.Edit();
+		const unsigned int nodeIndex = static_cast<unsigned int>(nodes.size());
+		nodes.push_back(Node());
+
+		BoundingBox bounds;
+		BoundingBox centroidBounds;
+		for (size_t i = first; i < last; ++i)
+		{
+			bounds.Include(itemList[i].bounds);
+			centroidBounds.Include(itemList[i].centroid);
+		}
+		nodes[nodeIndex].bounds = bounds;
+
+		const size_t count = last - first;
+		size_t middle = first;
+
+		if ((count > 1) && (depth < MAX_DEPTH - 1))
+		{
+			// Find the cheapest split plane among the bin boundaries on all three axes.
+			const double parentArea = bounds.SurfaceArea();
+			double bestCost = HUGE_VAL;
+			int bestAxis = -1;
+			int bestBoundary = 0;
+
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				const double low = Component(centroidBounds.minCorner, axis);
+				const double high = Component(centroidBounds.maxCorner, axis);
+				if (!(high > low))
+				{
+					// All centroids coincide along this axis.
+					continue;
+				}
+
+				const double scale = SAH_BIN_COUNT / (high - low);
+				SahBin bin[SAH_BIN_COUNT];
+				for (size_t i = first; i < last; ++i)
+				{
+					int b = static_cast<int>((Component(itemList[i].centroid, axis) - low) * scale);
+					if (b >= SAH_BIN_COUNT) b = SAH_BIN_COUNT - 1;
+					bin[b].bounds.Include(itemList[i].bounds);
+					++bin[b].count;
+				}
+
+				// Sweep from the right to get the area and count of every right-hand side...
+				double rightArea[SAH_BIN_COUNT];
+				size_t rightCount[SAH_BIN_COUNT];
+				BoundingBox rightBounds;
+				size_t rightTotal = 0;
+				for (int b = SAH_BIN_COUNT - 1; b > 0; --b)
+				{
+					rightBounds.Include(bin[b].bounds);
+					rightTotal += bin[b].count;
+					rightArea[b] = rightBounds.SurfaceArea();
+					rightCount[b] = rightTotal;
+				}
+
+				// ...then sweep from the left and price each boundary.
+				BoundingBox leftBounds;
+				size_t leftTotal = 0;
+				for (int b = 1; b < SAH_BIN_COUNT; ++b)
+				{
+					leftBounds.Include(bin[b-1].bounds);
+					leftTotal += bin[b-1].count;
+					if ((leftTotal == 0) || (rightCount[b] == 0))
+					{
+						continue;
+					}
+
+					const double cost = leftBounds.SurfaceArea()*leftTotal + rightArea[b]*rightCount[b];
+					if (cost < bestCost)
+					{
+						bestCost = cost;
+						bestAxis = axis;
+						bestBoundary = b;
+					}
+				}
+			}
+
+			const double leafCost = static_cast<double>(count);
+			const double splitCost = (parentArea > 0.0) ?
+				(SAH_TRAVERSAL_COST + bestCost/parentArea) :
+				HUGE_VAL;
+
+			if ((bestAxis >= 0) && ((splitCost < leafCost) || (count > MAX_LEAF_SIZE)))
+			{
+				const double low = Component(centroidBounds.minCorner, bestAxis);
+				const double scale = SAH_BIN_COUNT / (Component(centroidBounds.maxCorner, bestAxis) - low);
+				BuildItem* split = std::partition(
+					&itemList[0] + first,
+					&itemList[0] + last,
+					[=](const BuildItem& item)
+					{
+						int b = static_cast<int>((Component(item.centroid, bestAxis) - low) * scale);
+						if (b >= SAH_BIN_COUNT) b = SAH_BIN_COUNT - 1;
+						return b < bestBoundary;
+					});
+				middle = split - &itemList[0];
+			}
+			else if (count > MAX_LEAF_SIZE)
+			{
+				// Too many primitives for one leaf, but their centroids are
+				// indistinguishable: split the list in half.
+				middle = first + count/2;
+			}
+		}
+
+		if ((middle == first) || (middle == last))
+		{
+			std::vector<unsigned int>& primitiveIndexes = primitiveIndexList.Edit();
+			nodes[nodeIndex].offset = static_cast<unsigned int>(primitiveIndexes.size());
+			nodes[nodeIndex].count = static_cast<unsigned int>(count);
+			for (size_t i = first; i < last; ++i)
+			{
+				primitiveIndexes.push_back(itemList[i].primitiveIndex);
+			}
+		}
+		else
+		{
+			BuildNode(itemList, first, middle, depth + 1);
+			const unsigned int secondChild = BuildNode(itemList, middle, last, depth + 1);
+			nodes[nodeIndex].offset = secondChild;
+			nodes[nodeIndex].count = 0;
+		}
+
+		return nodeIndex;
+	}
+
+	void BoundingVolumeHierarchy::Refit(const std::vector<BoundingBox>& primitiveBounds)
+	{
+		if (primitiveBounds.size() != primitiveIndexList.Size())
+		{
+			throw ImageException("Cannot refit bounding volume hierarchy to a different number of primitives.");
+		}
+
+		// Children always come after their parent in the array,
+		// so walking it backwards visits children first.
+		std::vector<Node>& nodes = nodeList.Edit();
+		for (size_t n = nodes.size(); n > 0; --n)
+		{
+			Node& node = nodes[n-1];
+			BoundingBox bounds;
+			if (node.count > 0)
+			{
+				for (unsigned int k = 0; k < node.count; ++k)
+				{
+					bounds.Include(primitiveBounds[primitiveIndexList[node.offset + k]]);
+				}
+			}
+			else
+			{
+				bounds.Include(nodes[n].bounds);
+				bounds.Include(nodes[node.offset].bounds);
+			}
+			node.bounds = bounds;
+		}
+	}
+
+	void BoundingVolumeHierarchy::Borrow(const Node * nodes, size_t nodeCount, const unsigned int * primitiveOrder, size_t primitiveCount)
+	{
+		for (size_t k = 0; k < primitiveCount; ++k)
+		{
+			if (primitiveOrder[k] >= primitiveCount)
+			{
+				throw ImageException("Hierarchy primitive order is out of range.");
+			}
+		}
+		if ((nodeCount > 0) && (CheckSubtree(nodes, nodeCount, primitiveCount, 0, 0) != nodeCount))
+		{
+			throw ImageException("Hierarchy nodes do not form a tree.");
+		}
+
+		nodeList.Borrow(nodes, nodeCount);
+		primitiveIndexList.Borrow(primitiveOrder, primitiveCount);
+	}
+
+	size_t BoundingVolumeHierarchy::CheckSubtree(const Node * nodes, size_t nodeCount, size_t primitiveCount, size_t index, int depth)
+	{
+		if (index >= nodeCount)
+		{
+			return 0;
+		}
+		const Node& node = nodes[index];
+		if (node.count > 0)
+		{
+			const bool isInRange = (node.offset <= primitiveCount) && (node.count <= primitiveCount - node.offset);
+			return isInRange ? (index + 1) : 0;
+		}
+
+		// Build only splits above the last level, so the traversal stack
+		// never holds more than MAX_DEPTH subtrees, and it places the
+		// second child right after the first child's subtree.
+		if (depth >= MAX_DEPTH - 1)
+		{
+			return 0;
+		}
+		const size_t firstEnd = CheckSubtree(nodes, nodeCount, primitiveCount, index + 1, depth + 1);
+		if ((firstEnd == 0) || (node.offset != firstEnd))
+		{
+			return 0;
+		}
+		return CheckSubtree(nodes, nodeCount, primitiveCount, node.offset, depth + 1);
+	}
+
+	void BoundingVolumeHierarchy::Clear()
+	{
+		nodeList.Clear();
+		primitiveIndexList.Clear();
+	}
+
+	bool BoundingVolumeHierarchy::IsEmpty() const
+	{
+		return nodeList.IsEmpty();
+	}
+
+	size_t BoundingVolumeHierarchy::GetNodeCount() const
+	{
+		return nodeList.Size();
+	}
+
+	const BoundingVolumeHierarchy::Node * BoundingVolumeHierarchy::GetNodes() const
+	{
+		return nodeList.Data();
+	}
+
+	size_t BoundingVolumeHierarchy::GetPrimitiveCount() const
+	{
+		return primitiveIndexList.Size();
+	}
+
+	const BoundingBox& BoundingVolumeHierarchy::GetBounds() const
+	{
+		static const BoundingBox emptyBounds;
+		return nodeList.IsEmpty() ? emptyBounds : nodeList[0].bounds;
+	}
+
+	const CopyOnWriteArray<unsigned int>& BoundingVolumeHierarchy::GetPrimitiveOrder() const
+	{
+		return primitiveIndexList;
+	}
+}
@@ -0,0 +1,107 @@
+#include"Imager.h"
+
+namespace Imager
+{
+	FrameEncoder::FrameEncoder(const WriteFunction & _write)
+		: write(_write)
+	{
+		isSlotFull = false;
+		isWriting = false;
+		isShuttingDown = false;
+		slotMaxColorValue = 0.0;
+
+		// Started last, once everything the loop reads is set.
+		thread = std::thread(&FrameEncoder::EncoderLoop, this);
+	}
+
+	FrameEncoder::~FrameEncoder()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			isShuttingDown = true;
+		}
+		slotChanged.notify_all();
+		thread.join();
+	}
+
+	void FrameEncoder::Submit(const std::string & fileName, std::vector<Color>& averageList, double maxColorValue)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			slotChanged.wait(lock, [this]() { return !isSlotFull; });
+			if (firstError)
+			{
+				std::rethrow_exception(firstError);
+			}
+
+			slotFileName = fileName;
+			slotList.swap(averageList);
+			slotMaxColorValue = maxColorValue;
+			isSlotFull = true;
+		}
+		slotChanged.notify_all();
+	}
+
+	void FrameEncoder::Finish()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		slotChanged.wait(lock, [this]() { return !isSlotFull && !isWriting; });
+		if (firstError)
+		{
+			std::rethrow_exception(firstError);
+		}
+	}
+
+	void FrameEncoder::EncoderLoop()
+	{
+		// The image being written; its memory goes back through the slot.
+		std::vector<Color> averageList;
+		for (;;)
+		{
+			std::string fileName;
+			double maxColorValue;
+			bool hasFailed;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				slotChanged.wait(lock, [this]() { return isSlotFull || isShuttingDown; });
+				if (!isSlotFull)
+				{
+					return;
+				}
+
+				fileName.swap(slotFileName);
+				averageList.swap(slotList);
+				maxColorValue = slotMaxColorValue;
+				isSlotFull = false;
+				isWriting = true;
+				hasFailed = static_cast<bool>(firstError);
+			}
+			slotChanged.notify_all();
+
+			// After a failure, images are still taken from the slot, so
+			// Submit never waits forever, but no more are written.
+			std::exception_ptr error;
+			if (!hasFailed)
+			{
+				try
+				{
+					write(fileName, averageList, maxColorValue);
+				}
+				catch (...)
+				{
+					error = std::current_exception();
+				}
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (error && !firstError)
+				{
+					firstError = error;
+				}
+				isWriting = false;
+			}
+			slotChanged.notify_all();
+		}
+	}
+}
@@ -1,4 +1,6 @@
 #include"Imager.h"
+#include<cstdint>
+#include<new>
 
 namespace Imager
 {
@@ -6,23 +8,72 @@ namespace Imager
 	{
 		pixelsWide=_pixelWide;
 		pixelsHigh=_pixelHigh;
-		numPixels=_pixelHigh*_pixelWide;
-		array=new PixelData[numPixels];
+		Allocate(_pixelHigh);
+	}
+
+	ImageBuffer::ImageBuffer(size_t _pixelWide, size_t _pixelHigh, size_t _bandHigh, const Color & backgroundColor)
+	{
+		pixelsWide=_pixelWide;
+		pixelsHigh=_pixelHigh;
+		Allocate(_bandHigh);
+	}
+
+	void ImageBuffer::Allocate(size_t _bandHigh)
+	{
+		static_assert(IMAGE_TILE_PIXELS == 8*sizeof(unsigned long long), "One mask word per tile.");
+
+		bandTop=0;
+		bandHigh=(_bandHigh < pixelsHigh)?_bandHigh:pixelsHigh;
+		tilesWide=(pixelsWide+IMAGE_TILE_SIZE-1)/IMAGE_TILE_SIZE;
+		firstTileRow=0;
+
+		// A band that does not start on a tile boundary
+		// reaches into one more row of tiles.
+		const size_t imageTileRows=(pixelsHigh+IMAGE_TILE_SIZE-1)/IMAGE_TILE_SIZE;
+		tileRowsHeld=(bandHigh+IMAGE_TILE_SIZE-1)/IMAGE_TILE_SIZE+1;
+		if (tileRowsHeld > imageTileRows)
+		{
+			tileRowsHeld=imageTileRows;
+		}
+		numTiles=tileRowsHeld*tilesWide;
+
+		// A tile is a whole number of cache lines, so with the array
+		// aligned, threads filling different tiles never share a line.
+		const size_t numPixels=numTiles*IMAGE_TILE_PIXELS;
+		storage=new unsigned char[numPixels*sizeof(PixelData)+CACHE_LINE_BYTES];
+		const size_t misalignment=reinterpret_cast<uintptr_t>(storage)%CACHE_LINE_BYTES;
+		array=reinterpret_cast<PixelData*>(storage+((misalignment > 0)?(CACHE_LINE_BYTES-misalignment):0));
+		for (size_t k = 0; k < numPixels; ++k)
+		{
+			new(&array[k]) PixelData();
+		}
+
+		ambiguousMask=new std::atomic<unsigned long long>[numTiles];
+		for (size_t t = 0; t < numTiles; ++t)
+		{
+			ambiguousMask[t].store(0,std::memory_order_relaxed);
+		}
 	}
 
 	ImageBuffer::~ImageBuffer()
 	{
-		delete[] array;
+		// PixelData needs no destructor.
+		delete[] storage;
+		delete[] ambiguousMask;
+		storage=NULL;
 		array=NULL;
+		ambiguousMask=NULL;
 		pixelsWide = 0;
 		pixelsHigh = 0;
-		numPixels = 0;
+		bandTop = 0;
+		bandHigh = 0;
+		numTiles = 0;
 	}
 
 	PixelData & ImageBuffer::Pixel(size_t i, size_t j) const
 	{
-		if ((i < pixelsWide) && (j < pixelsHigh)) {
-			return array[(j*pixelsWide)+i];
+		if ((i < pixelsWide) && (j >= bandTop) && (j-bandTop < bandHigh) && (j < pixelsHigh)) {
+			return array[Index(i,j)];
 		}
 		else
 		{
@@ -38,23 +89,102 @@ namespace Imager
 	{
 		return pixelsHigh;
 	}
-	double ImageBuffer::MaxColorValue() const
+	size_t ImageBuffer::GetBandTop() const
 	{
-		double max = 0.0;
-		for (size_t i = 0; i < numPixels; ++i)
+		return bandTop;
+	}
+	size_t ImageBuffer::GetBandHigh() const
+	{
+		return bandHigh;
+	}
+	void ImageBuffer::MoveBand(size_t newBandTop)
+	{
+		if (newBandTop < bandTop)
+		{
+			throw ImageException("Image bands can only move down.");
+		}
+
+		// Rows of tiles that stay in the band move up in the array; the rest
+		// start over.  Rows below the old band were never written, so only
+		// whole rows of tiles need clearing.
+		const size_t newFirstTileRow=newBandTop/IMAGE_TILE_SIZE;
+		const size_t shift=newFirstTileRow-firstTileRow;
+		const size_t tileRowPixels=tilesWide*IMAGE_TILE_PIXELS;
+		for (size_t row = 0; (shift > 0) && (row < tileRowsHeld); ++row)
 		{
-			array[i].color.Validate();
-			if (array[i].color.red > max)
+			PixelData* target=array+(row*tileRowPixels);
+			std::atomic<unsigned long long>* targetMask=ambiguousMask+(row*tilesWide);
+			if (row+shift < tileRowsHeld)
 			{
-				max = array[i].color.red;
+				const PixelData* source=array+((row+shift)*tileRowPixels);
+				const std::atomic<unsigned long long>* sourceMask=ambiguousMask+((row+shift)*tilesWide);
+				for (size_t k = 0; k < tileRowPixels; ++k)
+				{
+					target[k]=source[k];
+				}
+				for (size_t t = 0; t < tilesWide; ++t)
+				{
+					targetMask[t].store(sourceMask[t].load(std::memory_order_relaxed),std::memory_order_relaxed);
+				}
 			}
-			if (array[i].color.green > max)
+			else
 			{
-				max = array[i].color.green;
+				for (size_t k = 0; k < tileRowPixels; ++k)
+				{
+					target[k]=PixelData();
+				}
+				for (size_t t = 0; t < tilesWide; ++t)
+				{
+					targetMask[t].store(0,std::memory_order_relaxed);
+				}
 			}
-			if (array[i].color.blue > max)
+		}
+		firstTileRow=newFirstTileRow;
+		bandTop=newBandTop;
+	}
+	void ImageBuffer::Reset()
+	{
+		const size_t numPixels=numTiles*IMAGE_TILE_PIXELS;
+		for (size_t k = 0; k < numPixels; ++k)
+		{
+			array[k]=PixelData();
+		}
+		for (size_t t = 0; t < numTiles; ++t)
+		{
+			ambiguousMask[t].store(0,std::memory_order_relaxed);
+		}
+		firstTileRow=0;
+		bandTop=0;
+	}
+	double ImageBuffer::MaxColorValue() const
+	{
+		// Rows of the held tiles outside the band may hold stale pixels.
+		const size_t bandEnd=(bandTop+bandHigh < pixelsHigh)?(bandTop+bandHigh):pixelsHigh;
+		double max = 0.0;
+		for (size_t j = bandTop; j < bandEnd; ++j)
+		{
+			// The row's pixels in each tile are next to each other.
+			for (size_t iTile = 0; iTile < pixelsWide; iTile += IMAGE_TILE_SIZE)
 			{
-				max = array[i].color.blue;
+				const PixelData* segment=array+Index(iTile,j);
+				const size_t count=(iTile+IMAGE_TILE_SIZE < pixelsWide)?IMAGE_TILE_SIZE:(pixelsWide-iTile);
+				for (size_t k = 0; k < count; ++k)
+				{
+					const Color& color=segment[k].color;
+					color.Validate();
+					if (color.red > max)
+					{
+						max = color.red;
+					}
+					if (color.green > max)
+					{
+						max = color.green;
+					}
+					if (color.blue > max)
+					{
+						max = color.blue;
+					}
+				}
 			}
 		}
 		if (max == 0.0)
@@ -66,4 +196,4 @@ namespace Imager
 		}
 		return max;
 	}
-}
\ No newline at end of file
+}
@@ -2,14 +2,27 @@
 #include<cmath>
 #include<string>
 #include<vector>
+#include<deque>
+#include<functional>
+#include<mutex>
+#include<condition_variable>
+#include<thread>
+#include<exception>
+#include<limits>
+#include<unordered_map>
+#include<atomic>
+#include<fstream>
+#include<memory>
+#include"PacketKernels.h"
 
 namespace Imager
 {
 
-	const double EPSILON = 1.0e-6;
 	// Forward declarations
 	class SolidObject;
 	class ImageBuffer;
+	struct PixelData;
+	class PngWriter;
 
 	const int MAX_OPTICAL_RECURSION_DEPTH = 20;
 
@@ -27,47 +40,107 @@ namespace Imager
 		const char* const message;
 	};
 
-	class AmbiguousIntersectionException
-	{};
-
-	class Vector3
+	// Precision of the vectors and colors the renderer stores and shades
+	// with, chosen at compile time by defining IMAGER_PRECISION:
+	//   IMAGER_PRECISION_DOUBLE  double everywhere (the default; reference renders).
+	//   IMAGER_PRECISION_FLOAT   float everywhere, for memory bandwidth.
+	//   IMAGER_PRECISION_MIXED   float storage and shading, but ray/surface
+	//                            intersections are solved in double.
+#define IMAGER_PRECISION_DOUBLE 0
+#define IMAGER_PRECISION_FLOAT  1
+#define IMAGER_PRECISION_MIXED  2
+
+#ifndef IMAGER_PRECISION
+#define IMAGER_PRECISION IMAGER_PRECISION_DOUBLE
+#endif
+
+#if IMAGER_PRECISION == IMAGER_PRECISION_FLOAT
+	typedef float Scalar;
+	typedef float SolveScalar;
+#elif IMAGER_PRECISION == IMAGER_PRECISION_MIXED
+	typedef float Scalar;
+	typedef double SolveScalar;
+#else
+	typedef double Scalar;
+	typedef double SolveScalar;
+#endif
+
+	// Tolerance for self-intersections and ties.  It has to exceed the
+	// rounding error of a stored point, which for float is far larger.
+#if IMAGER_PRECISION == IMAGER_PRECISION_DOUBLE
+	const double EPSILON = 1.0e-6;
+#else
+	const double EPSILON = 1.0e-4;
+#endif
+
+	// How far outside its bounding box a solid's Contains may still return
+	// true: the EPSILON that Sphere::Contains allows, and as much again
+	// for rounding.  Point queries grow their boxes by this much.
+	const double CONTAINMENT_MARGIN = 2.0*EPSILON;
+
+	// Define IMAGER_STATISTICS as 1 to have the renderer count rays and
+	// intersection tests (see RenderStatistics).  The counting code is
+	// compiled out otherwise, so it costs nothing by default.
+#ifndef IMAGER_STATISTICS
+#define IMAGER_STATISTICS 0
+#endif
+
+#if IMAGER_STATISTICS
+#define IMAGER_STATISTIC(statement) statement
+#else
+#define IMAGER_STATISTIC(statement)
+#endif
+
+	template <typename T>
+	class Vector3T
 	{
 	public:
-		double x;
-		double y;
-		double z;
+		typedef T ScalarType;
+
+		T x;
+		T y;
+		T z;
 
-		Vector3()
+		Vector3T()
 		{
 			x=0.0f;
 			y=0.0f;
 			z=0.0f;
 		}
 
-		Vector3(double _x, double _y, double _z)
+		Vector3T(T _x, T _y, T _z)
 		{
 			x=_x;
 			y=_y;
 			z=_z;
 		}
 
-		const double MagnetitudeSquared() const
+		// Converts between precisions.
+		template <typename U>
+		explicit Vector3T(const Vector3T<U>& other)
+		{
+			x=static_cast<T>(other.x);
+			y=static_cast<T>(other.y);
+			z=static_cast<T>(other.z);
+		}
+
+		const T MagnetitudeSquared() const
 		{
 			return(x*x+y*y+z*z);
 		}
 
-		const double Magnitude() const
+		const T Magnitude() const
 		{
 			return sqrt(MagnetitudeSquared());
 		}
 
-		const Vector3 UnitVector() const
+		const Vector3T UnitVector() const
 		{
-			double mag=Magnitude();
-			return Vector3(x/mag,y/mag,z/mag);
+			T mag=Magnitude();
+			return Vector3T(x/mag,y/mag,z/mag);
 		}
 
-		Vector3& operator +=(const Vector3& other)
+		Vector3T& operator +=(const Vector3T& other)
 		{
 			x+=other.x;
 			y+=other.y;
@@ -75,7 +148,7 @@ namespace Imager
 			return *this;
 		}
 
-		Vector3& operator *=(const Vector3& other)
+		Vector3T& operator *=(const Vector3T& other)
 		{
 			x *= other.x;
 			y *= other.y;
@@ -88,82 +161,107 @@ namespace Imager
 		
 	};
 
+	// The vector type the renderer stores points and directions in,
+	// and the one intersections are solved in.
+	typedef Vector3T<Scalar> Vector3;
+	typedef Vector3T<SolveScalar> SolveVector3;
+
 
-	inline Vector3 operator+ (const Vector3 &a, const Vector3 &b)
+	template <typename T>
+	inline Vector3T<T> operator+ (const Vector3T<T> &a, const Vector3T<T> &b)
 	{
-		return Vector3(a.x + b.x, a.y + b.y, a.z + b.z);
+		return Vector3T<T>(a.x + b.x, a.y + b.y, a.z + b.z);
 	}
 
-	inline Vector3 operator - (const Vector3 &a, const Vector3 &b)
+	template <typename T>
+	inline Vector3T<T> operator - (const Vector3T<T> &a, const Vector3T<T> &b)
 	{
-		return Vector3(a.x - b.x, a.y - b.y, a.z - b.z);
+		return Vector3T<T>(a.x - b.x, a.y - b.y, a.z - b.z);
 	}
 
-	inline Vector3 operator - (const Vector3& a)
+	template <typename T>
+	inline Vector3T<T> operator - (const Vector3T<T>& a)
 	{
-		return Vector3(-a.x, -a.y, -a.z);
+		return Vector3T<T>(-a.x, -a.y, -a.z);
 	}
 
-	inline double DotProduct(const Vector3 &a, const Vector3 &b)
+	template <typename T>
+	inline T DotProduct(const Vector3T<T> &a, const Vector3T<T> &b)
 	{
 		return (a.x*b.x) + (a.y*b.y) + (a.z*b.z);
 	}
 
-	inline Vector3 CrossProduct(const Vector3 &a, const Vector3 &b)
+	template <typename T>
+	inline Vector3T<T> CrossProduct(const Vector3T<T> &a, const Vector3T<T> &b)
 	{
-		return Vector3(
-			(a.y*b.z) - (a.z - b.y),
-			(a.x*b.z) - (a.z*b.z),
+		return Vector3T<T>(
+			(a.y*b.z) - (a.z*b.y),
+			(a.z*b.x) - (a.x*b.z),
 			(a.x*b.y) - (a.y*b.x)
 		);
 	}
 
-	inline Vector3 operator * (double s, const Vector3& v)
+	// The scalar's type is taken from the vector, so 2.0*v works for float vectors.
+	template <typename T>
+	inline Vector3T<T> operator * (typename Vector3T<T>::ScalarType s, const Vector3T<T>& v)
 	{
-		return Vector3(s*v.x, s*v.y, s*v.z);
+		return Vector3T<T>(s*v.x, s*v.y, s*v.z);
 	}
 
-	inline Vector3 operator / (const Vector3& v, double s)
+	template <typename T>
+	inline Vector3T<T> operator / (const Vector3T<T>& v, typename Vector3T<T>::ScalarType s)
 	{
-		return Vector3(v.x / s, v.y / s, v.z / s);
+		return Vector3T<T>(v.x / s, v.y / s, v.z / s);
 	}
 
+	const double PI = 3.14159265358979323846;
 
-	struct  Color
+	inline double RadiansFromDegrees(double degrees)
 	{
-		double red;
-		double green;
-		double blue;
+		return degrees*(PI/180.0);
+	}
+
+
+	template <typename T>
+	struct  ColorT
+	{
+		typedef T ScalarType;
 
-		Color(double _red, double _green, double _blue,double _luminosity=1.0)
+		T red;
+		T green;
+		T blue;
+
+		ColorT(T _red, T _green, T _blue,T _luminosity=1.0)
 		{
 			red=_red*_luminosity;
 			green=_green*_luminosity;
 			blue=_blue*_luminosity;
 		}
 
-		Color()
+		ColorT()
 		{
 			red=0.0;
 			green=0.0;
 			blue=0.0;
 		}
 
-		Color& operator+=(const Color& other)
+		ColorT& operator+=(const ColorT& other)
 		{
 			red += other.red;
 			green += other.green;
 			blue += other.blue;
+			return *this;
 		}
 
-		Color& operator*=(const Color& other)
+		ColorT& operator*=(const ColorT& other)
 		{
 			red*=other.red;
 			green*=other.green;
 			blue*=other.blue;
+			return *this;
 		}
 
-		Color& operator *= (double factor)
+		ColorT& operator *= (T factor)
 		{
 			red *= factor;
 			green *= factor;
@@ -171,11 +269,20 @@ namespace Imager
 			return *this;
 		}
 
-		Color& operator/=(const Color& other)
+		ColorT& operator/=(const ColorT& other)
 		{
 			red /= other.red;
 			green /= other.green;
 			blue /= other.blue;
+			return *this;
+		}
+
+		ColorT& operator /= (T denom)
+		{
+			red /= denom;
+			green /= denom;
+			blue /= denom;
+			return *this;
 		}
 
 		void Validate() const
@@ -183,16 +290,19 @@ namespace Imager
 			if ((red <0.0)||(green<0.0)||(blue<0.0))
 			{
 
-				throw new ImageException("Negative color not allowed");
+				throw ImageException("Negative color not allowed");
 			}
 		}
 			 
 
 	};
 
-	inline Color operator*(const Color& aColor, const Color& bColor)
+	typedef ColorT<Scalar> Color;
+
+	template <typename T>
+	inline ColorT<T> operator*(const ColorT<T>& aColor, const ColorT<T>& bColor)
 	{
-		return Color(
+		return ColorT<T>(
 			aColor.red*bColor.red,
 			aColor.green*bColor.green,
 			aColor.blue*bColor.blue
@@ -200,9 +310,10 @@ namespace Imager
 		);
 	}
 
-	inline Color operator*(double scalar, const Color& bColor)
+	template <typename T>
+	inline ColorT<T> operator*(typename ColorT<T>::ScalarType scalar, const ColorT<T>& bColor)
 	{
-		return Color(
+		return ColorT<T>(
 			scalar*bColor.red,
 			scalar*bColor.green,
 			scalar*bColor.blue
@@ -210,9 +321,10 @@ namespace Imager
 		);
 	}
 
-	inline Color operator + (const Color& a, const Color& b)
+	template <typename T>
+	inline ColorT<T> operator + (const ColorT<T>& a, const ColorT<T>& b)
 	{
-		return Color(
+		return ColorT<T>(
 			a.red + b.red,
 			a.green + b.green,
 			a.blue + b.blue);
@@ -302,7 +414,7 @@ namespace Imager
 		const Color& GetMatteColor() const;
 
 		const Color& GetGlossColor() const;
-		const double GetOpacity() const;
+		double GetOpacity() const;
 
 	protected:
 		void ValidateReflectionColor(const Color& color) const;
@@ -314,6 +426,28 @@ namespace Imager
 	};
 
 
+	// Optics as the lighting code reads them, with the terms it would
+	// otherwise work out on every hit computed once.  The scene keeps
+	// one for every material of every solid in its material table.
+	struct Material
+	{
+		Color matteColor;
+		Color glossColor;
+		Color opaqueMatteColor;             // opacity*matteColor
+		Color opaqueGlossColor;             // opacity*glossColor
+		double opacity;
+		double transparency;                // 1-opacity
+
+		explicit Material(const Optics& optics);
+	};
+
+	typedef std::vector<Material> MaterialList;
+
+	// Where the surface materials of each solid that instances share
+	// start in the scene's material table, so they are added only once.
+	typedef std::unordered_map<const SolidObject*, size_t> SharedMaterialMap;
+
+
 	struct  Intersection
 	{
 		double distanceSquared;
@@ -331,219 +465,2272 @@ namespace Imager
 		Intersection()
 		{
 			distanceSquared=1.0e+20;
-			
+			solid=NULL;
+			context=NULL;
 		}
 			 
 	};
 
 
+	// The part of an intersection a closest-hit search needs to compare
+	// candidates.  The point and surface normal are only worked out,
+	// by SolidObject::CompleteIntersection, for the hit that wins.
+	struct RayHit
+	{
+		double distanceSquared;
+
+		// The hit point is vantage + t*direction.
+		double t;
+
+		const SolidObject* solid;
+
+		const void* context;
+
+		RayHit()
+		{
+			distanceSquared=1.0e+20;
+			t=0.0;
+			solid=NULL;
+			context=NULL;
+		}
+	};
+
+
 	typedef std::vector<Intersection> IntersectionList;
 
 	int PickClosestIntersection(
 		const IntersectionList& list,
 		Intersection& intersection);
-	
-	class SolidObject:public Taggable
+
+
+	// An axis-aligned box.  A default-constructed box is empty,
+	// so it can be grown one point or box at a time with Include.
+	struct BoundingBox
 	{
-	public:
+		Vector3 minCorner;
+		Vector3 maxCorner;
 
-		SolidObject(const Vector3& _center=Vector3(),bool _isFullyEnclosed=true);
-		
-		virtual void AppendAllIntersections(const Vector3& vantage, const Vector3& direction, IntersectionList& intersectionList)const=0;
+		BoundingBox()
+			: minCorner(HUGE_VAL, HUGE_VAL, HUGE_VAL)
+			, maxCorner(-HUGE_VAL, -HUGE_VAL, -HUGE_VAL)
+		{}
 
-		int FindClosestIntersection(const Vector3& vantage, const Vector3& direction, Intersection& intersection)const;
+		BoundingBox(const Vector3& _minCorner, const Vector3& _maxCorner)
+			: minCorner(_minCorner)
+			, maxCorner(_maxCorner)
+		{}
 
-		virtual bool Contains(const Vector3& point)const;
+		// A box that contains all of space, for solids with no finite extent.
+		static BoundingBox Infinite()
+		{
+			return BoundingBox(
+				Vector3(-HUGE_VAL, -HUGE_VAL, -HUGE_VAL),
+				Vector3(HUGE_VAL, HUGE_VAL, HUGE_VAL));
+		}
 
-		virtual Optics SurfaceOptics(const Vector3& surfacePoint, const void *context)const;
+		bool IsEmpty() const
+		{
+			return (minCorner.x > maxCorner.x) || (minCorner.y > maxCorner.y) || (minCorner.z > maxCorner.z);
+		}
 
-		double GetRefractiveIndex() const;
+		bool IsFinite() const
+		{
+			return
+				(minCorner.x > -HUGE_VAL) && (minCorner.y > -HUGE_VAL) && (minCorner.z > -HUGE_VAL) &&
+				(maxCorner.x < HUGE_VAL) && (maxCorner.y < HUGE_VAL) && (maxCorner.z < HUGE_VAL);
+		}
 
-		virtual SolidObject& RotateX(double angleInDegrees)=0;
+		void Include(const Vector3& point)
+		{
+			if (point.x < minCorner.x) minCorner.x = point.x;
+			if (point.y < minCorner.y) minCorner.y = point.y;
+			if (point.z < minCorner.z) minCorner.z = point.z;
+			if (point.x > maxCorner.x) maxCorner.x = point.x;
+			if (point.y > maxCorner.y) maxCorner.y = point.y;
+			if (point.z > maxCorner.z) maxCorner.z = point.z;
+		}
 
-		virtual SolidObject& RotateY(double angleInDegrees) = 0;
+		void Include(const BoundingBox& other)
+		{
+			if (!other.IsEmpty())
+			{
+				Include(other.minCorner);
+				Include(other.maxCorner);
+			}
+		}
 
-		virtual SolidObject& RotateZ(double angleInDegrees) = 0;
+		Vector3 Centroid() const
+		{
+			return Vector3(
+				(minCorner.x + maxCorner.x) / 2.0,
+				(minCorner.y + maxCorner.y) / 2.0,
+				(minCorner.z + maxCorner.z) / 2.0);
+		}
 
-		virtual SolidObject& Translate(double dx,double dy, double dz);
+		double SurfaceArea() const
+		{
+			if (IsEmpty())
+			{
+				return 0.0;
+			}
+			const Vector3 d = maxCorner - minCorner;
+			return 2.0 * (d.x*d.y + d.y*d.z + d.z*d.x);
+		}
 
-		SolidObject& Move(double cx, double cy,double cz);
+		bool Contains(const Vector3& point) const
+		{
+			return
+				(point.x >= minCorner.x) && (point.x <= maxCorner.x) &&
+				(point.y >= minCorner.y) && (point.y <= maxCorner.y) &&
+				(point.z >= minCorner.z) && (point.z <= maxCorner.z);
+		}
 
-		SolidObject& Move(const Vector3& newCenter);
+		bool Overlaps(const BoundingBox& other) const
+		{
+			return
+				(other.minCorner.x <= maxCorner.x) && (other.maxCorner.x >= minCorner.x) &&
+				(other.minCorner.y <= maxCorner.y) && (other.maxCorner.y >= minCorner.y) &&
+				(other.minCorner.z <= maxCorner.z) && (other.maxCorner.z >= minCorner.z);
+		}
 
-		const Vector3& Center() const;
+		// The box grown by margin on every side.
+		BoundingBox Expanded(double margin) const
+		{
+			const Vector3 extent(margin, margin, margin);
+			return BoundingBox(minCorner - extent, maxCorner + extent);
+		}
 
-		void SetUniformOptics(const Optics& optics);
+		// Slab test for the ray vantage + t*direction, given the
+		// componentwise reciprocal of direction.  On a hit, stores the
+		// parameter where the ray enters the box (clamped to 0) in tEnter.
+		bool IntersectsRay(
+			const Vector3& vantage,
+			const Vector3& inverseDirection,
+			double tMax,
+			double& tEnter) const
+		{
+			double tNear = 0.0;
+			double tFar = tMax;
+
+			// Written so that a NaN (ray parallel to and touching a slab)
+			// fails both comparisons and leaves the interval alone.
+			double t0 = (minCorner.x - vantage.x) * inverseDirection.x;
+			double t1 = (maxCorner.x - vantage.x) * inverseDirection.x;
+			if (t0 > t1) { const double t = t0; t0 = t1; t1 = t; }
+			if (t0 > tNear) tNear = t0;
+			if (t1 < tFar) tFar = t1;
+
+			t0 = (minCorner.y - vantage.y) * inverseDirection.y;
+			t1 = (maxCorner.y - vantage.y) * inverseDirection.y;
+			if (t0 > t1) { const double t = t0; t0 = t1; t1 = t; }
+			if (t0 > tNear) tNear = t0;
+			if (t1 < tFar) tFar = t1;
+
+			t0 = (minCorner.z - vantage.z) * inverseDirection.z;
+			t1 = (maxCorner.z - vantage.z) * inverseDirection.z;
+			if (t0 > t1) { const double t = t0; t0 = t1; t1 = t; }
+			if (t0 > tNear) tNear = t0;
+			if (t1 < tFar) tFar = t1;
+
+			tEnter = tNear;
+			return tNear <= tFar;
+		}
+	};
 
-		void SetMatteGlossBalance(double glossFactor, const Color& rawMatte, const Color& rawGlossColor);
+	inline Vector3 InverseDirection(const Vector3& direction)
+	{
+		return Vector3(1.0 / direction.x, 1.0 / direction.y, 1.0 / direction.z);
+	}
 
-		void SetFullMatte(const Color& matteColor);
 
-		void SetOptics(const double opatics);
+	// An affine transform, stored as the top three rows of a 4x4 matrix:
+	// a linear part in the first three columns and a translation in the
+	// last.  A default-constructed transform is the identity.
+	struct Transform
+	{
+		double m[3][4];
 
-		void SetRefraction(const double refraction);
-	
-	protected:
-		const Optics& GetUniformOptics() const;
+		Transform()
+		{
+			for (int i = 0; i < 3; ++i)
+			{
+				for (int j = 0; j < 4; ++j)
+				{
+					m[i][j] = (i == j) ? 1.0 : 0.0;
+				}
+			}
+		}
 
-	private:
-		Vector3 center;
+		static Transform Translation(double dx, double dy, double dz)
+		{
+			Transform transform;
+			transform.m[0][3] = dx;
+			transform.m[1][3] = dy;
+			transform.m[2][3] = dz;
+			return transform;
+		}
 
-		Optics uniformOptics;
+		static Transform Scaling(double sx, double sy, double sz)
+		{
+			Transform transform;
+			transform.m[0][0] = sx;
+			transform.m[1][1] = sy;
+			transform.m[2][2] = sz;
+			return transform;
+		}
 
-		double refractiveIndex;
+		// Rotations about the origin, in the same sense as SolidObject::RotateX and friends.
+		static Transform RotationX(double angleInDegrees);
+		static Transform RotationY(double angleInDegrees);
+		static Transform RotationZ(double angleInDegrees);
 
-		const bool isFullyEnclosed;
+		// The transform that applies other first, then this one.
+		Transform operator*(const Transform& other) const;
+
+		// Throws an ImageException if the linear part cannot be inverted.
+		Transform Inverse() const;
+
+		Vector3 ApplyToPoint(const Vector3& point) const
+		{
+			return Vector3(
+				m[0][0]*point.x + m[0][1]*point.y + m[0][2]*point.z + m[0][3],
+				m[1][0]*point.x + m[1][1]*point.y + m[1][2]*point.z + m[1][3],
+				m[2][0]*point.x + m[2][1]*point.y + m[2][2]*point.z + m[2][3]);
+		}
+
+		// Leaves out the translation.
+		Vector3 ApplyToDirection(const Vector3& direction) const
+		{
+			return Vector3(
+				m[0][0]*direction.x + m[0][1]*direction.y + m[0][2]*direction.z,
+				m[1][0]*direction.x + m[1][1]*direction.y + m[1][2]*direction.z,
+				m[2][0]*direction.x + m[2][1]*direction.y + m[2][2]*direction.z);
+		}
+
+		// Applies the transpose of the linear part.  Surface normals go from
+		// one space to another by the transpose of the inverse transform, so
+		// call this on the inverse.  The result is not a unit vector.
+		Vector3 ApplyTransposeToDirection(const Vector3& direction) const
+		{
+			return Vector3(
+				m[0][0]*direction.x + m[1][0]*direction.y + m[2][0]*direction.z,
+				m[0][1]*direction.x + m[1][1]*direction.y + m[2][1]*direction.z,
+				m[0][2]*direction.x + m[1][2]*direction.y + m[2][2]*direction.z);
+		}
 
-		mutable IntersectionList cachedIntersectionList;
-		mutable IntersectionList enclosedList;
+		// The smallest box that holds the transformed box.
+		BoundingBox ApplyToBox(const BoundingBox& box) const;
 	};
 
 
-	class Sphere :public SolidObject
+	// A group of rays leaving the same vantage point, such as the
+	// camera rays for a small block of neighboring pixels.
+	// Directions are stored as separate arrays of components so the
+	// packet kernels can load several rays into one register.
+	struct RayPacket
 	{
-	public:
-		Sphere(const Vector3& _center,double radius);
+		enum { MAX_SIZE = PacketKernels::MAX_PACKET_SIZE };
 
-		virtual void AppendAllIntersections(const Vector3& vantage, const Vector3& direction, IntersectionList& intersectionList)const = 0;
+		Vector3 vantage;
 
-		virtual bool Contains(const Vector3& point) const;
+		// Only the first count entries are rays.  The rest are padding
+		// that kernels may read, and must still hold finite directions.
+		alignas(64) double dirX[MAX_SIZE];
+		alignas(64) double dirY[MAX_SIZE];
+		alignas(64) double dirZ[MAX_SIZE];
+		size_t count;
 
-		virtual SolidObject& RotateX(double angleInDegrees);
-		virtual SolidObject& RotateY(double angleInDegrees);
-		virtual SolidObject& RotateZ(double angleInDegrees);
+		RayPacket()
+			: count(0)
+		{}
 
-	private:
-		double radius;
+		Vector3 Direction(size_t k) const
+		{
+			return Vector3(dirX[k], dirY[k], dirZ[k]);
+		}
 	};
 
-	
-	class Scene
+
+	// An array that either owns its elements or reads them in place from
+	// memory that something else keeps alive, such as a memory-mapped
+	// scene file.  Reading works the same either way.  The first call to
+	// Edit on a borrowed array copies it, so borrowed memory is never written.
+	template <typename T>
+	class CopyOnWriteArray
 	{
 	public:
-		Scene(const Color& _backgroundColor=Color());
-
-		virtual ~Scene();
+		CopyOnWriteArray()
+			: borrowed(NULL)
+			, borrowedCount(0)
+		{}
+
+		// Reads count elements at data without copying them.  They must
+		// stay valid until the array is cleared or edited.
+		void Borrow(const T* data, size_t count)
+		{
+			std::vector<T>().swap(ownedList);
+			borrowed=data;
+			borrowedCount=count;
+		}
 
+		// The elements, as a vector the caller may change.
+		std::vector<T>& Edit()
+		{
+			if (borrowed != NULL)
+			{
+				ownedList.assign(borrowed,borrowed+borrowedCount);
+				borrowed=NULL;
+				borrowedCount=0;
+			}
+			return ownedList;
+		}
 
-		void AddLightSource(const LightSource &lightSource);
+		void Clear()
+		{
+			ownedList.clear();
+			borrowed=NULL;
+			borrowedCount=0;
+		}
 
-		SolidObject& AddSolidObject(SolidObject* solidObject);
+		bool IsBorrowed() const
+		{
+			return borrowed != NULL;
+		}
 
-		void SaveImage(const char* outPngFileName, size_t pixelWide,size_t pixelHigh,double zoom, size_t antiAliasFactor)const;
+		const T* Data() const
+		{
+			return (borrowed != NULL) ? borrowed : ownedList.data();
+		}
 
-		void SetAmbientRefraction(double refraction);
+		size_t Size() const
+		{
+			return (borrowed != NULL) ? borrowedCount : ownedList.size();
+		}
 
-		void AddDebugPoint(int iPixel,int jPixel);
+		bool IsEmpty() const
+		{
+			return Size() == 0;
+		}
 
+		const T& operator[](size_t i) const
+		{
+			return Data()[i];
+		}
 
-		
 	private:
-		void ClearSolidObjectList();
-		
-		int FindClosestIntersectionPoint(const Vector3& vantage,const Vector3& direction, Intersection& intersection) const;
+		std::vector<T> ownedList;
+		const T* borrowed;
+		size_t borrowedCount;
+	};
 
-		bool HasClearLineOfSight(const Vector3& point1, const Vector3& point2) const;
 
-		Color TarceRay(const Vector3& vantage, const Vector3& direction, double refractiveIndex, Color rayIntensity, int recurtionDepth) const;
+	// A bounding volume hierarchy over a list of primitive boxes,
+	// built with the surface area heuristic and flattened into one
+	// contiguous array of nodes in depth-first order: the first child
+	// of an interior node is always the next node in the array.
+	// The hierarchy knows nothing about what the primitives are;
+	// callers refer to them by their index in the list passed to Build.
+	class BoundingVolumeHierarchy
+	{
+	public:
+		struct Node
+		{
+			BoundingBox bounds;
 
-		Color CalculateLighting(const Intersection& intersection, const Vector3& direction, double refractiveIndex, Color rayIntensity, int recursionDepth)const;
+			// For a leaf: index of its first entry in the primitive index list.
+			// For an interior node: index of its second child.
+			unsigned int offset;
 
-		Color CalculateMatte(const Intersection& intersection) const;
+			// Number of primitives in a leaf; 0 for an interior node.
+			unsigned int count;
+		};
 
+		BoundingVolumeHierarchy();
 
-		Color CalculateReflection(
-			const Intersection& intersection,
-			const Vector3& incidentDir,
-			double refectiveIndex,
-			Color rayIntensity,
-			int recurtionDepth)const;
+		// Discards any existing tree and builds a new one over primitiveBounds.
+		void Build(const std::vector<BoundingBox>& primitiveBounds);
 
-		Color CalculateRefraction(
-			const Intersection& intersection,
-			const Vector3& direction,
-			double sourceRefectiveIndex,
-			Color rayIntensity,
-			int recurtionDepth,
-			double& outRefrectionFactor)const;
+		// Recomputes every node's box from new primitive boxes while
+		// keeping the tree's shape.  Much cheaper than Build when primitives
+		// have moved a little; the tree gets slower as they move further.
+		// primitiveBounds must have the same size as when the tree was built.
+		void Refit(const std::vector<BoundingBox>& primitiveBounds);
 
-		const SolidObject* PrimaryContainer(const Vector3& point) const;
+		// Uses nodes and a primitive order that an earlier Build produced,
+		// such as those stored in a scene file, in place without copying
+		// them.  They must stay valid until the next Build or Clear; Refit
+		// copies them first.  Throws if they are not a tree Build could
+		// have made over primitiveCount primitives, as traversal trusts them.
+		void Borrow(const Node* nodes, size_t nodeCount, const unsigned int* primitiveOrder, size_t primitiveCount);
 
-		double PolarizedReflection(
-			double n1,                           // source material's index of refraction
-			double n2,                          // target material's index of refraction
-			double cos_a1,                     // incident or outgoing ray angle cosine
-			double cos_a2)const;              // outgoing or incident ray angle cosine
+		void Clear();
 
-		void ResolveAmbiguousPixel(ImageBuffer& buffer, size_t i, size_t j) const;
+		bool IsEmpty() const;
 
-		// Convert a floating point color component value, 
-		// based on the maximum component value,
-		// to a byte RGB value in the range 0x00 to 0xff.
-		static unsigned char ConvertPixelValue(
-			double colorComponent,
-			double maxColorValue);
+		size_t GetNodeCount() const;
 
+		// The nodes in depth-first order.
+		const Node* GetNodes() const;
 
-		Color backgroundColor;
+		size_t GetPrimitiveCount() const;
 
-		typedef std::vector<SolidObject*> SolidObjectList;
-		typedef std::vector<LightSource> LightSourceList;
+		const BoundingBox& GetBounds() const;
 
-		struct PixelCoordinates
+		// Primitive indexes in the order the leaves list them.  Primitives
+		// next to each other in this list are close together in space.
+		const CopyOnWriteArray<unsigned int>& GetPrimitiveOrder() const;
+
+		// Calls visitor(primitiveIndex, tMax) for every primitive in every
+		// leaf whose box the ray vantage + t*direction enters with 0 <= t <= tMax,
+		// nearer leaves first.  The visitor may shrink tMax (it is passed by
+		// reference) to prune boxes further away than a hit it has found, and
+		// returns true to stop the traversal early.
+		template <typename Visitor>
+		void Traverse(const Vector3& vantage, const Vector3& direction, double tMax, Visitor& visitor) const
 		{
-			size_t i;
-			size_t j;
+			const unsigned int* primitiveIndexes = primitiveIndexList.Data();
+			auto leafVisitor = [&](unsigned int first, unsigned int count, double& leafTMax)
+			{
+				for (unsigned int k = 0; k < count; ++k)
+				{
+					if (visitor(primitiveIndexes[first + k], leafTMax))
+					{
+						return true;
+					}
+				}
+				return false;
+			};
+			TraverseLeaves(vantage, direction, tMax, leafVisitor);
+		}
 
-			PixelCoordinates(size_t _i, size_t _j)
+		// Like Traverse, but calls visitor(first, count, tMax) once per leaf.
+		// The leaf holds the primitives at positions first through
+		// first+count-1 of GetPrimitiveOrder(), which lets a caller that
+		// stores its primitives in that order test a whole leaf at once.
+		template <typename Visitor>
+		void TraverseLeaves(const Vector3& vantage, const Vector3& direction, double tMax, Visitor& visitor) const
+		{
+			if (nodeList.IsEmpty())
 			{
-				i=_i;
-				j=_j;
+				return;
 			}
 
-		};
+			const Node* nodes = nodeList.Data();
+			const Vector3 inverseDirection = InverseDirection(direction);
 
-		typedef std::vector<PixelCoordinates> PixelList;
+			double tEnter;
+			if (!nodes[0].bounds.IntersectsRay(vantage, inverseDirection, tMax, tEnter))
+			{
+				return;
+			}
 
-		SolidObjectList solidObjectList;
+			// Pending subtrees, with the ray parameter where the ray enters each.
+			unsigned int stack[MAX_DEPTH];
+			double stackEnter[MAX_DEPTH];
+			int stackSize = 0;
+			unsigned int nodeIndex = 0;
+			for(;;)
+			{
+				const Node& node = nodes[nodeIndex];
+				if (node.count > 0)
+				{
+					if (visitor(node.offset, node.count, tMax))
+					{
+						return;
+					}
+				}
+				else
+				{
+					const unsigned int firstChild = nodeIndex + 1;
+					const unsigned int secondChild = node.offset;
+					double tFirst, tSecond;
+					const bool hitFirst = nodes[firstChild].bounds.IntersectsRay(vantage, inverseDirection, tMax, tFirst);
+					const bool hitSecond = nodes[secondChild].bounds.IntersectsRay(vantage, inverseDirection, tMax, tSecond);
+					if (hitFirst && hitSecond)
+					{
+						// Visit the closer child first; it is more likely to
+						// produce a hit that lets us skip the other one.
+						if (tSecond < tFirst)
+						{
+							stack[stackSize] = firstChild;
+							stackEnter[stackSize] = tFirst;
+							nodeIndex = secondChild;
+						}
+						else
+						{
+							stack[stackSize] = secondChild;
+							stackEnter[stackSize] = tSecond;
+							nodeIndex = firstChild;
+						}
+						++stackSize;
+						continue;
+					}
+					else if (hitFirst)
+					{
+						nodeIndex = firstChild;
+						continue;
+					}
+					else if (hitSecond)
+					{
+						nodeIndex = secondChild;
+						continue;
+					}
+				}
+
+				// Pop the next subtree, skipping any that a hit found
+				// since it was pushed has put out of reach.
+				do
+				{
+					if (stackSize == 0)
+					{
+						return;
+					}
+					--stackSize;
+				} while (stackEnter[stackSize] > tMax);
+				nodeIndex = stack[stackSize];
+			}
+		}
 
-		LightSourceList lightSourceList;
+		// Calls visitor(primitiveIndex) for every primitive in every leaf
+		// whose box overlaps box, which may be a single point grown by a
+		// margin.  The visitor returns true to stop the traversal early.
+		template <typename Visitor>
+		void TraverseOverlapping(const BoundingBox& box, Visitor& visitor) const
+		{
+			const unsigned int* primitiveIndexes = primitiveIndexList.Data();
+			auto leafVisitor = [&](unsigned int first, unsigned int count)
+			{
+				for (unsigned int k = 0; k < count; ++k)
+				{
+					if (visitor(primitiveIndexes[first + k]))
+					{
+						return true;
+					}
+				}
+				return false;
+			};
+			TraverseOverlappingLeaves(box, leafVisitor);
+		}
 
+		// Like TraverseOverlapping, but calls visitor(first, count) once per
+		// leaf, as TraverseLeaves does.
+		template <typename Visitor>
+		void TraverseOverlappingLeaves(const BoundingBox& box, Visitor& visitor) const
+		{
+			if (nodeList.IsEmpty() || !nodeList[0].bounds.Overlaps(box))
+			{
+				return;
+			}
 
-		double ambientRefraction;
+			const Node* nodes = nodeList.Data();
+			unsigned int stack[MAX_DEPTH];
+			int stackSize = 0;
+			unsigned int nodeIndex = 0;
+			for(;;)
+			{
+				const Node& node = nodes[nodeIndex];
+				if (node.count > 0)
+				{
+					if (visitor(node.offset, node.count))
+					{
+						return;
+					}
+				}
+				else
+				{
+					const unsigned int firstChild = nodeIndex + 1;
+					const unsigned int secondChild = node.offset;
+					const bool hitFirst = nodes[firstChild].bounds.Overlaps(box);
+					const bool hitSecond = nodes[secondChild].bounds.Overlaps(box);
+					if (hitFirst && hitSecond)
+					{
+						stack[stackSize++] = secondChild;
+						nodeIndex = firstChild;
+						continue;
+					}
+					else if (hitFirst)
+					{
+						nodeIndex = firstChild;
+						continue;
+					}
+					else if (hitSecond)
+					{
+						nodeIndex = secondChild;
+						continue;
+					}
+				}
+
+				if (stackSize == 0)
+				{
+					return;
+				}
+				nodeIndex = stack[--stackSize];
+			}
+		}
 
-		mutable IntersectionList cachedIntersectionList;
+		// Packet version of Traverse.  Calls visitor(primitiveIndex) for every
+		// primitive in every leaf that at least one ray k of the packet enters
+		// with 0 <= t <= tMax[k].  The visitor may shrink entries of tMax,
+		// which must hold RayPacket::MAX_SIZE values.
+		template <typename Visitor>
+		void TraversePacket(const RayPacket& packet, const double* tMax, Visitor& visitor) const
+		{
+			const unsigned int* primitiveIndexes = primitiveIndexList.Data();
+			auto leafVisitor = [&](unsigned int first, unsigned int count)
+			{
+				for (unsigned int k = 0; k < count; ++k)
+				{
+					visitor(primitiveIndexes[first + k]);
+				}
+			};
+			TraversePacketLeaves(packet, tMax, leafVisitor);
+		}
 
-		struct DebugPoint
+		// Like TraversePacket, but calls visitor(first, count) once per leaf,
+		// with the same meaning as for TraverseLeaves.
+		template <typename Visitor>
+		void TraversePacketLeaves(const RayPacket& packet, const double* tMax, Visitor& visitor) const
 		{
-			int     iPixel;
-			int     jPixel;
+			if (nodeList.IsEmpty() || (packet.count == 0))
+			{
+				return;
+			}
 
-			DebugPoint(int _iPixel, int _jPixel)
-				: iPixel(_iPixel)
-				, jPixel(_jPixel)
-			{}
-		};
-		typedef std::vector<DebugPoint> DebugPointList;
-		DebugPointList debugPointList;
-		mutable const DebugPoint* activeDebugPoint;
+			const Node* nodes = nodeList.Data();
+			Vector3 inverseDirection[RayPacket::MAX_SIZE];
+			for (size_t k = 0; k < packet.count; ++k)
+			{
+				inverseDirection[k] = InverseDirection(packet.Direction(k));
+			}
 
-	};
+			// Reports whether any ray enters the box, and where the first such ray enters it.
+			auto hitsBox = [&](const BoundingBox& box, double& tEnter)
+			{
+				for (size_t k = 0; k < packet.count; ++k)
+				{
+					if (box.IntersectsRay(packet.vantage, inverseDirection[k], tMax[k], tEnter))
+					{
+						return true;
+					}
+				}
+				return false;
+			};
+
+			double tEnter;
+			if (!hitsBox(nodes[0].bounds, tEnter))
+			{
+				return;
+			}
 
+			unsigned int stack[MAX_DEPTH];
+			int stackSize = 0;
+			unsigned int nodeIndex = 0;
+			for(;;)
+			{
+				const Node& node = nodes[nodeIndex];
+				if (node.count > 0)
+				{
+					visitor(node.offset, node.count);
+				}
+				else
+				{
+					const unsigned int firstChild = nodeIndex + 1;
+					const unsigned int secondChild = node.offset;
+					double tFirst, tSecond;
+					const bool hitFirst = hitsBox(nodes[firstChild].bounds, tFirst);
+					const bool hitSecond = hitsBox(nodes[secondChild].bounds, tSecond);
+					if (hitFirst && hitSecond)
+					{
+						if (tSecond < tFirst)
+						{
+							stack[stackSize++] = firstChild;
+							nodeIndex = secondChild;
+						}
+						else
+						{
+							stack[stackSize++] = secondChild;
+							nodeIndex = firstChild;
+						}
+						continue;
+					}
+					else if (hitFirst)
+					{
+						nodeIndex = firstChild;
+						continue;
+					}
+					else if (hitSecond)
+					{
+						nodeIndex = secondChild;
+						continue;
+					}
+				}
+
+				// Each ray has its own reach, so a popped subtree is
+				// tested again rather than compared with one saved value.
+				do
+				{
+					if (stackSize == 0)
+					{
+						return;
+					}
+					nodeIndex = stack[--stackSize];
+				} while (!hitsBox(nodes[nodeIndex].bounds, tEnter));
+			}
+		}
 
-	struct PixelData
-	{
-		Color color;
-		bool isAmbiguous;
+	private:
+		// Build stops splitting at this depth, which bounds the traversal stack.
+		enum { MAX_DEPTH = 64 };
 
-		PixelData()
-			:color(),
-			isAmbiguous(false)
+		// Leaves are never split below this many primitives.
+		enum { MAX_LEAF_SIZE = 4 };
+
+		struct BuildItem
 		{
-		}
+			BoundingBox bounds;
+			Vector3 centroid;
+			unsigned int primitiveIndex;
+		};
+
+		unsigned int BuildNode(std::vector<BuildItem>& itemList, size_t first, size_t last, int depth);
+
+		// Returns the index just past the subtree of nodes at index, at
+		// the given depth, or 0 if the subtree is not laid out as Build
+		// lays it out or reaches primitives past primitiveCount.
+		static size_t CheckSubtree(const Node* nodes, size_t nodeCount, size_t primitiveCount, size_t index, int depth);
 
+		CopyOnWriteArray<Node> nodeList;
+		CopyOnWriteArray<unsigned int> primitiveIndexList;
 	};
+
 	
+	class SolidObject:public Taggable
+	{
+	public:
+
+		SolidObject(const Vector3& _center=Vector3(),bool _isFullyEnclosed=true);
+
+		virtual ~SolidObject() {}
+		
+		virtual void AppendAllIntersections(const Vector3& vantage, const Vector3& direction, IntersectionList& intersectionList)const=0;
+
+		int FindClosestIntersection(const Vector3& vantage, const Vector3& direction, Intersection& intersection)const;
+
+		// Closest-hit query for the render loop.  Looks only for intersections
+		// with distanceSquared less than maxDistanceSquared, stores the closest
+		// in hit, and returns how many are tied for closest (0 if none).
+		// The default builds the full intersection list; solids that can
+		// should override it to do the search without allocating.
+		virtual int FindClosestHit(const Vector3& vantage, const Vector3& direction, double maxDistanceSquared, RayHit& hit)const;
+
+		// Fills in intersection for a hit found by FindClosestHit
+		// on the same ray.
+		virtual void CompleteIntersection(const Vector3& vantage, const Vector3& direction, const RayHit& hit, Intersection& intersection)const;
+
+		// Packet version of FindClosestHit.  For each ray k in the packet,
+		// stores in hits[k] the closest intersection with distanceSquared less
+		// than maxDistanceSquared[k], and in numClosest[k] how many are tied.
+		// All three arrays hold RayPacket::MAX_SIZE entries.  The default
+		// calls FindClosestHit once per ray.
+		virtual void FindClosestHits(const RayPacket& packet, const double* maxDistanceSquared, RayHit* hits, int* numClosest)const;
+
+		// Any-hit query for shadow rays: returns true as soon as any
+		// intersection with distanceSquared less than maxDistanceSquared
+		// is found, without working out which one is closest.
+		virtual bool HasHitWithin(const Vector3& vantage, const Vector3& direction, double maxDistanceSquared)const;
+
+		// Must return false for points further than CONTAINMENT_MARGIN
+		// outside the solid's bounding box.
+		virtual bool Contains(const Vector3& point)const;
+
+		// Returns a box enclosing every point the solid's surface can occupy,
+		// used by the scene's bounding volume hierarchy.  The default is
+		// an infinite box, which makes the scene test the solid against every ray.
+		virtual BoundingBox GetBoundingBox() const;
+
+		// Caches whatever the intersection code derives from the solid's
+		// shape and position, so the render threads only read it.  The
+		// scene calls this on each solid, before GetBoundingBox, when it
+		// builds or refits its hierarchy.  The default does nothing.
+		virtual void Prepare() const;
+
+		// Adds the solid's materials to the end of the scene's material
+		// table, its uniform optics first, and remembers where they are.
+		// The scene calls this before every render.
+		void AppendMaterials(MaterialList& materialList, SharedMaterialMap& sharedMaterialMap) const;
+
+		// Adds the solid's surface materials the first time it is called
+		// with a given map, for an Instance, and returns where they start.
+		// Records nothing in the solid itself, which instances share.
+		size_t AppendSharedMaterials(MaterialList& materialList, SharedMaterialMap& sharedMaterialMap) const;
+
+		// Where AppendMaterials put the uniform optics.
+		size_t GetMaterialIndex() const { return materialIndex; }
+
+		// The table index of the material SurfaceMaterial calls offset.
+		size_t GetMaterialIndex(size_t offset) const
+		{
+			return (offset == 0) ? materialIndex : (surfaceMaterialIndex+offset-1);
+		}
+
+		// The material at an intersection with a non-NULL context: 0 for
+		// the uniform optics, or k+1 for the k-th surface material.  A NULL
+		// context means the uniform optics and is looked up without calling
+		// this, so solids whose optics vary over the surface must set one.
+		// The default returns 0.
+		virtual size_t SurfaceMaterial(const Vector3& surfacePoint, const void *context)const;
+
+		double GetRefractiveIndex() const;
+
+		virtual SolidObject& RotateX(double angleInDegrees)=0;
+
+		virtual SolidObject& RotateY(double angleInDegrees) = 0;
+
+		virtual SolidObject& RotateZ(double angleInDegrees) = 0;
+
+		virtual SolidObject& Translate(double dx,double dy, double dz);
+
+		SolidObject& Move(double cx, double cy,double cz);
+
+		SolidObject& Move(const Vector3& newCenter);
+
+		const Vector3& Center() const;
+
+		void SetUniformOptics(const Optics& optics);
+
+		void SetMatteGlossBalance(double glossFactor, const Color& rawMatte, const Color& rawGlossColor);
+
+		void SetFullMatte(const Color& matteColor);
+
+		void SetOptics(const double opatics);
+
+		void SetRefraction(const double refraction);
+
+		const Optics& GetUniformOptics() const;
+	
+	protected:
+		// Adds any materials SurfaceMaterial can return, in order, and
+		// returns where they start.  The default adds none.
+		virtual size_t AppendSurfaceMaterials(MaterialList& materialList, SharedMaterialMap& sharedMaterialMap) const;
+
+	private:
+		Vector3 center;
+
+		Optics uniformOptics;
+
+		mutable size_t materialIndex;
+		mutable size_t surfaceMaterialIndex;
+
+		double refractiveIndex;
+
+		const bool isFullyEnclosed;
+	};
+
+
+	class Sphere :public SolidObject
+	{
+	public:
+		Sphere(const Vector3& _center,double radius);
+
+		double GetRadius() const;
+
+		virtual void AppendAllIntersections(const Vector3& vantage, const Vector3& direction, IntersectionList& intersectionList)const;
+
+		virtual int FindClosestHit(const Vector3& vantage, const Vector3& direction, double maxDistanceSquared, RayHit& hit)const;
+
+		virtual void CompleteIntersection(const Vector3& vantage, const Vector3& direction, const RayHit& hit, Intersection& intersection)const;
+
+		virtual void FindClosestHits(const RayPacket& packet, const double* maxDistanceSquared, RayHit* hits, int* numClosest)const;
+
+		virtual bool HasHitWithin(const Vector3& vantage, const Vector3& direction, double maxDistanceSquared)const;
+
+		virtual bool Contains(const Vector3& point) const;
+
+		virtual BoundingBox GetBoundingBox() const;
+
+		virtual void Prepare() const;
+
+		virtual SolidObject& RotateX(double angleInDegrees);
+		virtual SolidObject& RotateY(double angleInDegrees);
+		virtual SolidObject& RotateZ(double angleInDegrees);
+
+		virtual SolidObject& Translate(double dx, double dy, double dz);
+
+	private:
+		// Everything the intersection code reads on every ray, derived
+		// from center and radius by Prepare and kept together, apart
+		// from the tag and optics.  Each is stored in the precision
+		// the formula that reads it works in.
+		struct HotData
+		{
+			SolveVector3 center;
+			SolveScalar radius;
+			SolveScalar inverseRadius;              // scales a surface point's offset to the normal
+			double radiusSquared;
+			SolveScalar containsRadiusSquared;      // (radius+EPSILON) squared
+		};
+
+		double radius;
+
+		mutable HotData hot;
+		mutable BoundingBox bounds;
+	};
+
+
+	// Many spheres stored as a single solid, for particle systems, molecules
+	// and other scenes with thousands of them.  Centers and radii live in
+	// parallel arrays rather than in separate Sphere objects.  The batch has
+	// its own bounding volume hierarchy over the spheres, and keeps the
+	// arrays in the hierarchy's order, so the spheres in each leaf are
+	// contiguous and are tested against a ray with one call to a vector
+	// kernel (PacketKernels::IntersectSphereBatch).
+	//
+	// Each sphere takes its surface optics from the batch's material list,
+	// or from the batch's uniform optics if it was added without a material.
+	// The materials are copied into the scene's material table when it renders.
+	// The whole batch has one refractive index.  Spheres may overlap;
+	// Contains treats the batch as their union.
+	class SphereBatch :public SolidObject
+	{
+	public:
+		// The batch rotates about center, and Move places center.
+		explicit SphereBatch(const Vector3& _center=Vector3());
+
+		// Returns the index to pass to AddSphere.
+		size_t AddMaterial(const Optics& optics);
+
+		// Adds a sphere that uses the batch's uniform optics.
+		void AddSphere(const Vector3& sphereCenter, double radius);
+
+		void AddSphere(const Vector3& sphereCenter, double radius, size_t materialIndex);
+
+		void ReserveSpheres(size_t count);
+
+		size_t GetSphereCount() const;
+
+		size_t GetMaterialCount() const;
+
+		const Optics& GetMaterial(size_t materialIndex) const;
+
+		// The spheres as Prepare leaves them: sorted into the order of the
+		// hierarchy's leaves, with padding after the last one so the kernel
+		// can read whole registers.  Scene files store a batch this way.
+		struct SphereArrays
+		{
+			const double* centerX;              // paddedCount entries each
+			const double* centerY;
+			const double* centerZ;
+			const double* radius;
+			const unsigned int* materialIndex;  // sphereCount entries: 0 for the uniform optics, k+1 for material k
+			size_t sphereCount;
+			size_t paddedCount;
+		};
+
+		// Prepares the batch and returns its arrays, which stay valid
+		// until the batch is next changed.
+		SphereArrays GetSphereArrays() const;
+
+		// Prepares the batch and returns its hierarchy.
+		const BoundingVolumeHierarchy& GetHierarchy() const;
+
+		// Replaces the batch's spheres with arrays laid out as GetSphereArrays
+		// returns them, and its hierarchy with one built over them, and reads
+		// both in place rather than copying them.  The batch keeps owner,
+		// which must keep the memory valid, for as long as it exists.
+		// Changing the batch afterwards copies whatever it changes.  Add
+		// the materials first: the arrays' material indexes are checked
+		// against them, and the hierarchy as BoundingVolumeHierarchy::Borrow
+		// checks it.
+		void BorrowSpheres(
+			const SphereArrays& arrays,
+			const BoundingVolumeHierarchy::Node* nodes,
+			size_t nodeCount,
+			const unsigned int* primitiveOrder,
+			const std::shared_ptr<const void>& owner);
+
+		virtual void AppendAllIntersections(const Vector3& vantage, const Vector3& direction, IntersectionList& intersectionList)const;
+
+		virtual int FindClosestHit(const Vector3& vantage, const Vector3& direction, double maxDistanceSquared, RayHit& hit)const;
+
+		virtual void CompleteIntersection(const Vector3& vantage, const Vector3& direction, const RayHit& hit, Intersection& intersection)const;
+
+		virtual void FindClosestHits(const RayPacket& packet, const double* maxDistanceSquared, RayHit* hits, int* numClosest)const;
+
+		virtual bool HasHitWithin(const Vector3& vantage, const Vector3& direction, double maxDistanceSquared)const;
+
+		virtual bool Contains(const Vector3& point) const;
+
+		// Also builds or refits the batch's hierarchy, and sorts the spheres
+		// to match, if spheres were added or moved since the last call.  The scene
+		// calls this before it renders, when it builds or refits its own
+		// hierarchy, so after changing a batch that is already in a scene,
+		// call Scene::RefitAccelerationStructure.
+		virtual BoundingBox GetBoundingBox() const;
+
+		// Builds or refits the batch's hierarchy, as GetBoundingBox does.
+		virtual void Prepare() const;
+
+		virtual size_t SurfaceMaterial(const Vector3& surfacePoint, const void *context)const;
+
+		virtual SolidObject& RotateX(double angleInDegrees);
+		virtual SolidObject& RotateY(double angleInDegrees);
+		virtual SolidObject& RotateZ(double angleInDegrees);
+
+		virtual SolidObject& Translate(double dx, double dy, double dz);
+
+	protected:
+		virtual size_t AppendSurfaceMaterials(MaterialList& materialList, SharedMaterialMap& sharedMaterialMap) const;
+
+	private:
+		// Most spheres handed to the kernel in one call; a leaf with more is split up.
+		enum { KERNEL_BATCH_SIZE = PacketKernels::MAX_REGISTER_WIDTH };
+
+		// Material offset of spheres that use the batch's uniform optics;
+		// materialList[k] is at offset k+1.
+		enum { UNIFORM_MATERIAL = 0 };
+
+		void PrepareHierarchy() const;
+		void BuildHierarchy() const;
+		void CollectSphereBounds(std::vector<BoundingBox>& boundsList) const;
+		void RemovePadding();
+		void CheckPrepared() const;
+		void RotateCenters(CopyOnWriteArray<double>& aArray, CopyOnWriteArray<double>& bArray, double pivotA, double pivotB, double angleInDegrees);
+		void SetKernelInput(PacketKernels::SphereBatchInput& input, const Vector3& vantage, const Vector3& direction) const;
+
+		size_t sphereCount;
+
+		// One entry per sphere, in the order of hierarchy.GetPrimitiveOrder()
+		// once the hierarchy is built, followed by enough padding for the
+		// kernel to read whole registers past the last leaf.  Padding has
+		// a NaN radius, which no ray can hit.  materialIndexList has no padding.
+		mutable CopyOnWriteArray<double> centerXList;
+		mutable CopyOnWriteArray<double> centerYList;
+		mutable CopyOnWriteArray<double> centerZList;
+		mutable CopyOnWriteArray<double> radiusList;
+		mutable CopyOnWriteArray<unsigned int> materialIndexList;
+
+		// Keeps borrowed arrays valid; see BorrowSpheres.
+		std::shared_ptr<const void> borrowedOwner;
+
+		std::vector<Optics> materialList;
+
+		mutable BoundingVolumeHierarchy hierarchy;
+		mutable bool isHierarchyStale;      // spheres were added
+		mutable bool isBoundsStale;         // spheres were moved
+	};
+
+
+	// A surface made of triangles that share a list of vertices, such as
+	// a model loaded from an OBJ or PLY file.  Each triangle is three
+	// indexes into the vertex list.  The mesh has its own bounding volume
+	// hierarchy over the triangles and keeps them in the hierarchy's order.
+	//
+	// Rays are tested with a watertight algorithm, so a ray through an
+	// edge or vertex shared by several triangles hits exactly one of them.
+	// That makes the crossing count Contains relies on exact for a closed
+	// mesh, and lets a closed mesh refract like any other solid.  Triangles
+	// whose vertices are counterclockwise seen from outside face outward.
+	// An open mesh contains nothing, and its normals face the incoming ray.
+	class TriangleMesh :public SolidObject
+	{
+	public:
+		// The mesh rotates about center, and Move places center.
+		explicit TriangleMesh(const Vector3& _center=Vector3(), bool _isClosed=true);
+
+		// Returns the index to pass to AddTriangle.
+		size_t AddVertex(const Vector3& point);
+
+		void AddTriangle(size_t a, size_t b, size_t c);
+
+		void ReserveVertices(size_t count);
+
+		void ReserveTriangles(size_t count);
+
+		// Add the file's vertices and faces to the mesh.  Faces with more
+		// than three vertices are split into triangles.  The file is read
+		// a line or a record at a time, straight into the mesh's lists.
+		// OBJ texture coordinates, normals and materials are ignored, as
+		// are PLY elements and properties other than vertex x, y, z and
+		// face vertex_indices.
+		void LoadObj(const char* filename);
+		void LoadPly(const char* filename);
+
+		size_t GetVertexCount() const;
+
+		size_t GetTriangleCount() const;
+
+		virtual void AppendAllIntersections(const Vector3& vantage, const Vector3& direction, IntersectionList& intersectionList)const;
+
+		virtual int FindClosestHit(const Vector3& vantage, const Vector3& direction, double maxDistanceSquared, RayHit& hit)const;
+
+		virtual void CompleteIntersection(const Vector3& vantage, const Vector3& direction, const RayHit& hit, Intersection& intersection)const;
+
+		virtual bool HasHitWithin(const Vector3& vantage, const Vector3& direction, double maxDistanceSquared)const;
+
+		virtual bool Contains(const Vector3& point) const;
+
+		// Also builds or refits the mesh's hierarchy, as SphereBatch does.
+		virtual BoundingBox GetBoundingBox() const;
+
+		virtual void Prepare() const;
+
+		virtual SolidObject& RotateX(double angleInDegrees);
+		virtual SolidObject& RotateY(double angleInDegrees);
+		virtual SolidObject& RotateZ(double angleInDegrees);
+
+		virtual SolidObject& Translate(double dx, double dy, double dz);
+
+	private:
+		void PrepareHierarchy() const;
+		void CollectTriangleBounds(std::vector<BoundingBox>& boundsList) const;
+		void CheckPrepared() const;
+		void RotateVertices(Scalar Vector3::*a, Scalar Vector3::*b, double angleInDegrees);
+
+		std::vector<Vector3> vertexList;
+
+		// Three vertex indexes per triangle, in the order of
+		// hierarchy.GetPrimitiveOrder() once the hierarchy is built.
+		mutable std::vector<unsigned int> indexList;
+
+		const bool isClosed;
+
+		mutable BoundingVolumeHierarchy hierarchy;
+		mutable bool isHierarchyStale;      // triangles were added
+		mutable bool isBoundsStale;         // vertices were moved
+	};
+
+
+	// A copy of a solid placed in the scene with a transform of its own.
+	// Any number of instances can share one geometry, so a scene with
+	// thousands of copies of a mesh stores the mesh and its hierarchy once,
+	// plus one transform per copy.  Each ray is carried into the geometry's
+	// coordinates and tested there.  The scene's hierarchy over its solids
+	// is then the top level over the instances, and the geometry's own
+	// hierarchy, for a TriangleMesh or SphereBatch, the bottom level.
+	//
+	// The geometry is not added to the scene itself.  Each instance has its
+	// own uniform optics and refractive index, which replace the geometry's;
+	// materials that vary over the geometry's surface, such as a batch's,
+	// are copied into the scene's material table once for all of them.
+	class Instance :public SolidObject
+	{
+	public:
+		// transform takes the geometry's coordinates to the scene's.  The
+		// instance rotates about its center, where transform puts the
+		// geometry's center.
+		explicit Instance(const std::shared_ptr<const SolidObject>& _geometry, const Transform& _transform=Transform());
+
+		const SolidObject& GetGeometry() const;
+
+		const Transform& GetTransform() const;
+
+		void SetTransform(const Transform& _transform);
+
+		virtual void AppendAllIntersections(const Vector3& vantage, const Vector3& direction, IntersectionList& intersectionList)const;
+
+		virtual int FindClosestHit(const Vector3& vantage, const Vector3& direction, double maxDistanceSquared, RayHit& hit)const;
+
+		virtual void CompleteIntersection(const Vector3& vantage, const Vector3& direction, const RayHit& hit, Intersection& intersection)const;
+
+		virtual bool HasHitWithin(const Vector3& vantage, const Vector3& direction, double maxDistanceSquared)const;
+
+		virtual bool Contains(const Vector3& point) const;
+
+		virtual BoundingBox GetBoundingBox() const;
+
+		// Prepares the geometry too, so after changing a geometry that
+		// instances in a scene share, call Scene::RefitAccelerationStructure.
+		virtual void Prepare() const;
+
+		virtual size_t SurfaceMaterial(const Vector3& surfacePoint, const void *context)const;
+
+		virtual SolidObject& RotateX(double angleInDegrees);
+		virtual SolidObject& RotateY(double angleInDegrees);
+		virtual SolidObject& RotateZ(double angleInDegrees);
+
+		virtual SolidObject& Translate(double dx, double dy, double dz);
+
+	protected:
+		// The geometry's surface materials, added once for all its instances.
+		virtual size_t AppendSurfaceMaterials(MaterialList& materialList, SharedMaterialMap& sharedMaterialMap) const;
+
+	private:
+		void RotateAboutCenter(const Transform& rotation);
+
+		// Ratio of a distance squared along a ray in the geometry's
+		// coordinates to the same distance squared in the scene's.
+		double ObjectDistanceRatio(const Vector3& direction, const Vector3& objectDirection) const;
+
+		std::shared_ptr<const SolidObject> geometry;
+		Transform transform;        // geometry to scene
+		Transform inverse;          // scene to geometry
+
+		mutable BoundingBox bounds;
+	};
+
+
+	// A fixed set of worker threads that runs batches of independent tasks.
+	// Each worker owns a queue of task indexes; a worker that runs out of
+	// work steals from the back of another worker's queue, so uneven tasks
+	// (e.g. tiles full of glass next to tiles of empty background)
+	// still keep every core busy.
+	class ThreadPool
+	{
+	public:
+		// A thread count of 0 means one thread per hardware core.
+		explicit ThreadPool(size_t _numThreads=0);
+
+		virtual ~ThreadPool();
+
+		size_t GetThreadCount() const;
+
+		// Calls task(taskIndex, workerIndex) once for every taskIndex
+		// in the range [0, numTasks), and returns after all of them have
+		// finished.  The calling thread takes part as worker 0.
+		// workerIndex is always less than GetThreadCount(), and no two
+		// tasks run at the same time with the same workerIndex, so it
+		// can be used to pick per-thread scratch storage.
+		// If any task throws, the first exception is rethrown here.
+		void ParallelFor(size_t numTasks, const std::function<void(size_t, size_t)>& task);
+
+	private:
+		ThreadPool(const ThreadPool&);
+		ThreadPool& operator=(const ThreadPool&);
+
+		void WorkerLoop(size_t workerIndex);
+		void RunTasks(size_t workerIndex);
+		bool PopTask(size_t workerIndex, size_t& taskIndex);
+
+		struct WorkQueue
+		{
+			std::mutex mutex;
+			std::deque<size_t> taskIndexes;
+		};
+
+		size_t numThreads;
+		std::vector<std::thread> threads;
+		std::vector<WorkQueue*> queues;
+
+		std::mutex mutex;
+		std::condition_variable workAvailable;
+		std::condition_variable workFinished;
+		const std::function<void(size_t, size_t)>* currentTask;
+		size_t generation;
+		size_t numBusyWorkers;
+		bool isShuttingDown;
+		std::exception_ptr firstError;
+	};
+
+
+	// One thread, kept for a whole run of images, that writes each image
+	// while the caller computes the next, as RenderAnimation does.
+	// Images are handed over through a single slot, so Submit only waits
+	// while the previous image has not been picked up yet.
+	class FrameEncoder
+	{
+	public:
+		// Called on the encoder's thread for each image submitted.
+		typedef std::function<void(const std::string& fileName, const std::vector<Color>& averageList, double maxColorValue)> WriteFunction;
+
+		explicit FrameEncoder(const WriteFunction& _write);
+
+		// Writes any image still waiting in the slot, then stops the thread.
+		virtual ~FrameEncoder();
+
+		// Hands averageList over to be written, and gives back in its
+		// place a list an earlier image was written from, so the caller
+		// can reuse its memory.  If writing an earlier image threw,
+		// rethrows that error instead.
+		void Submit(const std::string& fileName, std::vector<Color>& averageList, double maxColorValue);
+
+		// Returns once every submitted image has been written, and
+		// rethrows the first error writing any of them threw.
+		void Finish();
+
+	private:
+		FrameEncoder(const FrameEncoder&);
+		FrameEncoder& operator=(const FrameEncoder&);
+
+		void EncoderLoop();
+
+		WriteFunction write;
+
+		std::mutex mutex;
+		std::condition_variable slotChanged;
+		bool isSlotFull;
+		bool isWriting;
+		bool isShuttingDown;
+		std::string slotFileName;
+		std::vector<Color> slotList;
+		double slotMaxColorValue;
+		std::exception_ptr firstError;
+
+		std::thread thread;
+	};
+
+
+	// Width and height, in supersampled pixels, of the square tiles
+	// that SaveImage hands out to worker threads.
+	const size_t RENDER_TILE_SIZE = 32;
+
+	// Width and height, in supersampled pixels, of the squares a tile is
+	// split into for wavefront rendering.  A wave keeps every surface its
+	// rays hit until the wave is done, so bigger waves fall out of the cache.
+	const size_t WAVEFRONT_TILE_SIZE = 16;
+
+	// Spacing, in final pixels, of the samples a streamed image's
+	// brightness is estimated from when no maximum color value is set.
+	const size_t PREVIEW_SPACING = 2;
+
+	// Spacing, in final pixels, of the rays RenderProgressive's first pass
+	// traces: one for every PROGRESSIVE_START_SPACING^2 pixels.
+	const size_t PROGRESSIVE_START_SPACING = 8;
+
+	// What SaveImage did, counted when IMAGER_STATISTICS is 1;
+	// otherwise everything stays zero.  Each render thread keeps
+	// its own counts, which are added up when the image is done.
+	struct RenderStatistics
+	{
+		// raysAtDepth[MAX_DEPTH] also counts any deeper rays.
+		enum { MAX_DEPTH = MAX_OPTICAL_RECURSION_DEPTH };
+
+		size_t cameraRays;
+		size_t reflectionRays;
+		size_t refractionRays;
+		size_t shadowRays;
+
+		// Rays shaded at each recursion depth; camera rays are depth 0.
+		size_t raysAtDepth[MAX_DEPTH+1];
+
+		size_t intersectionTests;           // solids asked for a ray's closest hit
+		size_t shadowTests;                 // solids asked whether they block a shadow ray
+		size_t shadowCacheHits;             // shadow rays blocked by the light's last occluder
+		size_t shadowsBlocked;
+		size_t containmentTests;            // solids asked whether they contain a point
+		size_t ambiguousPixels;
+		size_t totalInternalReflections;
+
+		RenderStatistics();
+
+		void Add(const RenderStatistics& other);
+
+		// Work done for one pixel, in solids tested.
+		size_t TestCount() const
+		{
+			return intersectionTests+shadowTests+containmentTests;
+		}
+
+		// Writes the counts, one per line, with per-ray averages.
+		void Print(std::ostream& output) const;
+	};
+
+	class Scene
+	{
+	public:
+		Scene(const Color& _backgroundColor=Color());
+
+		virtual ~Scene();
+
+
+		void AddLightSource(const LightSource &lightSource);
+
+		SolidObject& AddSolidObject(SolidObject* solidObject);
+
+		void SaveImage(const char* outPngFileName, size_t pixelWide,size_t pixelHigh,double zoom, size_t antiAliasFactor)const;
+
+		// Writes the scene's solids, lights, background color and ambient
+		// refraction to a binary scene file.  Sphere batches are stored
+		// prepared, with their hierarchies and their spheres already
+		// sorted, and so is the scene's own hierarchy, so loading them
+		// takes no work.  Only Sphere and SphereBatch solids can be
+		// stored, so scenes with a TriangleMesh or an Instance cannot be
+		// saved; render settings are not stored either.
+		void SaveSceneFile(const char* fileName) const;
+
+		// Replaces the scene's solids, lights, background color and ambient
+		// refraction with those in a file SaveSceneFile wrote.  The file is
+		// memory-mapped and sphere batches render straight from it, so
+		// loading takes time in proportion to the number of solids and
+		// materials, not spheres.  The checks cover the file's structure
+		// and the radii, not every value in it, so only load files from
+		// trusted sources.
+		// If the file cannot be loaded, the scene is left empty.
+		void LoadSceneFile(const char* fileName);
+
+		// How far RenderProgressive has got, passed to its callback.
+		struct RenderProgress
+		{
+			size_t pass;                // 0 for the first, coarsest pass
+			size_t sampleSpacing;       // supersampled pixels between the rays traced so far
+			size_t samplesTraced;
+			size_t sampleCount;         // supersampled pixels in the finished image
+			double elapsedSeconds;
+			double maxColorValue;       // what SaveImage would write as 255; exact once complete
+			bool isComplete;
+		};
+
+		// Called after each pass of RenderProgressive with the image so far,
+		// pixelWide x pixelHigh.  Return false to stop rendering.
+		typedef std::function<bool(const ImageBuffer& image, const RenderProgress& progress)> ProgressCallback;
+
+		// Renders SaveImage's image in passes for interactive previews,
+		// calling callback after each.  The first pass traces one ray for
+		// each square of PROGRESSIVE_START_SPACING^2 final pixels and fills
+		// the square from it; each pass after it halves the spacing and
+		// traces only the rays that earlier passes did not, until every
+		// supersampled pixel is traced.  Scaled by maxColorValue, the last
+		// image is exactly SaveImage's.  If timeLimitSeconds is positive,
+		// stops after the first pass that ends later than that.  Returns
+		// true if the image was finished.  Streaming, adaptive anti-aliasing
+		// and the cost heatmap do not apply.
+		bool RenderProgressive(
+			size_t pixelWide,
+			size_t pixelHigh,
+			double zoom,
+			size_t antiAliasFactor,
+			const ProgressCallback& callback,
+			double timeLimitSeconds=0.0) const;
+
+		// Called by RenderAnimation before it traces each frame, with the
+		// frame's number, counting from 0, to move solids for the frame
+		// (SolidObject::Translate, Move, RotateX and so on, or
+		// Instance::SetTransform).  It may add solids and lights too.
+		typedef std::function<void(size_t frame)> FrameUpdate;
+
+		// Renders frameCount frames, each the image SaveImage would make of
+		// the scene as update leaves it, to files named fileNamePrefix
+		// followed by the frame number, padded to four digits, and ".png".
+		// After each update the acceleration structure is refitted, or
+		// rebuilt if solids were added (see RefitAccelerationStructure).
+		// The thread pool, the threads' scratch space, the image buffers and
+		// a FrameEncoder are made once for all the frames, and the encoder
+		// writes each frame's file while the next frame is traced.  Unless
+		// SetMaxColorValue is used, each frame is scaled to its own brightest
+		// pixel, which can make an animation flicker.  Streaming and the cost
+		// heatmap do not apply.  Ray counts and statistics are the last frame's.
+		void RenderAnimation(
+			const char* fileNamePrefix,
+			size_t frameCount,
+			size_t pixelWide,
+			size_t pixelHigh,
+			double zoom,
+			size_t antiAliasFactor,
+			const FrameUpdate& update);
+
+		void SetAmbientRefraction(double refraction);
+
+		void AddDebugPoint(int iPixel,int jPixel);
+
+		// Number of threads SaveImage renders with.
+		// 0 (the default) means one thread per hardware core;
+		// 1 renders serially on the calling thread.
+		// The image is identical for every thread count.
+		void SetThreadCount(size_t _threadCount);
+
+		// The scene's bounding volume hierarchy is built automatically
+		// the first time SaveImage runs after solids are added.
+		// Call RebuildAccelerationStructure to build it ahead of time,
+		// or after moving solids a long way.
+		void RebuildAccelerationStructure();
+
+		// Call after moving solids (SolidObject::Translate, Move, ...)
+		// to update the hierarchy's boxes without rebuilding its shape.
+		// The hierarchy does not notice on its own that a solid has moved.
+		void RefitAccelerationStructure();
+
+		// Number of camera rays traced together as one packet: 4 (2x2 pixels),
+		// 8 (4x2) or 16 (4x4, the default), or 1 to trace them one at a time.
+		// Packets use the widest vector instructions the CPU has
+		// (see PacketKernels::GetSimdLevel).  Reflected, refracted and
+		// shadow rays go their own ways and are always traced one at a time.
+		void SetPacketSize(size_t raysPerPacket);
+
+		// Renders SaveImage's image in horizontal bands of this many pixel
+		// rows and writes each band to the file as soon as it is done, so the
+		// memory needed grows with the image's width but not with its height.
+		// 0 (the default) renders the whole image before writing any of it.
+		void SetStreamingBandHeight(size_t pixelRows);
+
+		// The color component value SaveImage writes as full brightness (255).
+		// 0 (the default) means the largest component in the image.  A streamed
+		// image has to start writing before that is known, so it estimates it
+		// with a quick pass over a sample of one pixel in PREVIEW_SPACING^2;
+		// set a value to make streamed and whole images match exactly.
+		void SetMaxColorValue(double _maxColorValue);
+
+		// Makes SaveImage trace one ray per pixel first, then trace the
+		// full antiAliasFactor x antiAliasFactor grid only for pixels that
+		// differ from a neighbor: a different solid, an ambiguous hit, or a
+		// color component whose contrast |a-b|/(a+b) exceeds contrastThreshold
+		// (0.05 is a reasonable start).  0 (the default) traces the full
+		// grid for every pixel.
+		void SetAdaptiveAntiAliasing(double contrastThreshold);
+
+		// Makes SaveImage trace rays breadth-first, one tile at a time:
+		// all the tile's camera rays, then the shadow rays of the surfaces
+		// they hit, light by light, then all their refracted rays and all
+		// their reflected rays, each sorted by direction, and so on until
+		// no rays are left.  Neighboring pixels' rays are traced together
+		// that way, which suits glassy scenes.  Images are the same either way.
+		void SetWavefrontRendering(bool isEnabled);
+
+		// What SaveImage does when the closest surface a ray hits is a tie:
+		// two or more hits within EPSILON of the same distance, as where
+		// solids touch or overlap.
+		enum AmbiguityPolicy
+		{
+			// Mark the pixel ambiguous and, once the image is traced, give it
+			// the average color of its neighbors that are not (the default).
+			AMBIGUITY_AVERAGE_NEIGHBORS,
+
+			// Take the closest of the tied hits; of hits at exactly the same
+			// distance, the one on the solid added to the scene first.
+			AMBIGUITY_FIRST_SOLID,
+		};
+		void SetAmbiguityPolicy(AmbiguityPolicy policy);
+
+		// Makes SaveImage skip the shadow ray from a surface to a light
+		// that could add no more than 0.001 to any color component of the
+		// pixel even if nothing blocked it.  Lights are found through a
+		// hierarchy of the regions they can reach, so far away and dim
+		// lights cost nothing.  The image changes by at most that much per
+		// light.  Off by default.
+		void SetLightCulling(bool isEnabled);
+
+		// Makes SaveImage trace shadow rays to at most sampleCount lights
+		// per surface, picked at random in proportion to how much light each
+		// could add, and scale what they add so the expected color is unchanged.
+		// Faster for scenes with hundreds of lights, at the cost of noise.
+		// The picks depend only on the surface point, so the image is the
+		// same for every thread count.  0 (the default) tests every light.
+		void SetLightSampleCount(size_t sampleCount);
+
+		// Number of rays the last SaveImage traced from the camera,
+		// not counting the reflected, refracted and shadow rays they spawned.
+		size_t GetCameraRayCount() const;
+
+		// Number of reflected and refracted rays the last SaveImage traced.
+		size_t GetSecondaryRayCount() const;
+
+		// Number of shadow rays (surface point to light source)
+		// the last SaveImage traced.
+		size_t GetShadowRayCount() const;
+
+		// Number of materials in the table the last SaveImage shaded from:
+		// each solid's uniform optics and surface materials, with geometry
+		// that instances share counted once.
+		size_t GetMaterialCount() const;
+
+		// Detailed counts from the last SaveImage; all zero
+		// unless the renderer is built with IMAGER_STATISTICS.
+		const RenderStatistics& GetRenderStatistics() const;
+
+		// Makes SaveImage also write a PNG image showing how many solids
+		// were tested for each pixel, on a logarithmic scale from black
+		// through blue, red and yellow to white at the most expensive
+		// pixel.  Requires IMAGER_STATISTICS.  NULL turns it off again.
+		void SetCostHeatmapFile(const char* fileName);
+
+
+		
+	private:
+		// Scratch state owned by a single render thread.
+		struct ThreadContext;
+
+		void ClearSolidObjectList();
+		
+		// Builds the bounding volume hierarchy if solids were added since it was last built.
+		void PrepareAccelerationStructure() const;
+
+		// Rebuilds materialList from the solids' current optics.
+		void PrepareMaterials() const;
+
+		const Material& SurfaceMaterial(const Intersection& intersection) const
+		{
+			const SolidObject& solid=*intersection.solid;
+			if (intersection.context == NULL)
+			{
+				return materialList[solid.GetMaterialIndex()];
+			}
+			return materialList[solid.GetMaterialIndex(solid.SurfaceMaterial(intersection.point,intersection.context))];
+		}
+
+		void BuildHierarchy() const;
+
+		// Sorts the solids into hierarchySolidList and unboundedSolidList,
+		// preparing each, and gathers the boxes of the bounded ones.
+		void CollectHierarchySolids(std::vector<BoundingBox>& boundsList) const;
+
+		// Uses a hierarchy SaveSceneFile stored, over the solids it was
+		// built from, instead of building one.  owner keeps the arrays valid.
+		void BorrowHierarchy(
+			const BoundingVolumeHierarchy::Node* nodes,
+			size_t nodeCount,
+			const unsigned int* primitiveOrder,
+			size_t primitiveCount,
+			const std::shared_ptr<const void>& owner);
+
+		// Gathers the bounding box of every solid in hierarchySolidList.
+		void CollectSolidBounds(std::vector<BoundingBox>& boundsList) const;
+
+		// Fills in solidPlaceMap from the hierarchy and the solids' boxes.
+		void FindOverlappingSolids(const std::vector<BoundingBox>& boundsList) const;
+
+		void BuildLightHierarchy() const;
+
+		// Returns the number of surfaces hit at the closest distance, which
+		// is never more than 1 with AMBIGUITY_FIRST_SOLID.  intersection is
+		// only filled in if it is 1.
+		int FindClosestIntersectionPoint(ThreadContext& context, const Vector3& vantage,const Vector3& direction, Intersection& intersection) const;
+
+		// Returns true if no solid lies between the two points.
+		// lastOccluder is a per-thread, per-light cache: the solid that
+		// blocked the previous query, tried first because neighboring
+		// pixels are usually shadowed by the same solid.
+		bool HasClearLineOfSight(ThreadContext& context, const Vector3& point1, const Vector3& point2, const SolidObject*& lastOccluder) const;
+
+		// Packet version of FindClosestIntersectionPoint.  Both output
+		// arrays hold RayPacket::MAX_SIZE entries.
+		void FindClosestIntersectionPoints(ThreadContext& context, const RayPacket& packet, Intersection* intersection, int* numClosest) const;
+
+		bool TarceRay(ThreadContext& context, const Vector3& vantage, const Vector3& direction, double refractiveIndex, Color rayIntensity, int recurtionDepth, Color& outColor) const;
+
+		// The second half of TarceRay, once the closest intersection is known.
+		// Secondary rays are traced without recursion, using context.rayStack,
+		// so ShadeRay must not be called again before it returns.
+		// Both return false, leaving outColor alone, if the ray or any
+		// ray it spawned hit more than one surface at the closest distance.
+		bool ShadeRay(ThreadContext& context, int numClosest, const Intersection& intersection, const Vector3& direction, double refractiveIndex, Color rayIntensity, int recurtionDepth, Color& outColor) const;
+
+		struct RayFrame;
+		struct MediumStack;
+
+		// Starts lighting frame.intersection, seen along direction: adds
+		// its matte color to frame.colorSum and works out which secondary
+		// rays it needs.  frame.intersection must already be set.
+		void BeginLighting(ThreadContext& context, RayFrame& frame, const Vector3& direction, double refractiveIndex, const MediumStack& media, Color rayIntensity, int recursionDepth) const;
+
+		// The part of BeginLighting before the shadow rays.  Returns whether
+		// the surface has a matte color, which AddMatteColor must then add
+		// given the light CalculateMatte finds reaching the surface.
+		bool PrepareLighting(RayFrame& frame, const Vector3& direction, double refractiveIndex, const MediumStack& media, Color rayIntensity, int recursionDepth) const;
+
+		void AddMatteColor(RayFrame& frame, const Color& lightSum) const;
+
+		// Gives the next secondary ray the frame's surface needs, starting
+		// at frame.intersection.point, or returns false once there are none
+		// left: first the refracted ray, then the reflected one, whose
+		// intensity depends on how much light the refraction reflects.
+		// Their colors must be added to frame.colorSum in the same order.
+		bool NextSecondaryRay(ThreadContext& context, RayFrame& frame, Vector3& outDirection, double& outRefractiveIndex, MediumStack& outMedia, Color& outRayIntensity) const;
+
+		Color CalculateMatte(ThreadContext& context, const RayFrame& frame) const;
+
+		// A light whose shadow ray SelectLights chose, and how much
+		// of the light it sends counts towards the surface's color.
+		struct LightChoice
+		{
+			size_t light;                       // index into lightSourceList
+			double strength;                    // largest color component it could add
+			double scale;
+		};
+
+		// Lists, in lightSourceList order, the lights whose shadow rays to
+		// frame's surface must be traced: every light in front of the
+		// surface, less those that light culling and light sampling skip.
+		void SelectLights(ThreadContext& context, const RayFrame& frame, std::vector<LightChoice>& choiceList) const;
+
+		// Finds the direction light passing into the surface is bent to,
+		// the refractive index and media on the other side, and the fraction
+		// of the light the surface reflects instead.  Returns false for total
+		// internal reflection, when all of it is reflected.
+		bool CalculateRefraction(
+			ThreadContext& context,
+			const Intersection& intersection,
+			const Vector3& direction,
+			double sourceRefectiveIndex,
+			const MediumStack& sourceMedia,
+			Vector3& outDirection,
+			double& outTargetRefractiveIndex,
+			MediumStack& outTargetMedia,
+			double& outRefrectionFactor)const;
+
+		// Returns the first solid in solidObjectList that contains point,
+		// or NULL if there is none.  guess, if not NULL, is a solid likely
+		// to contain point; once it does, only solids ahead of it in the
+		// list can be the answer, and often none of them can reach it.
+		const SolidObject* PrimaryContainer(ThreadContext& context, const Vector3& point, const SolidObject* guess) const;
+
+		double PolarizedReflection(
+			double n1,                           // source material's index of refraction
+			double n2,                          // target material's index of refraction
+			double cos_a1,                     // incident or outgoing ray angle cosine
+			double cos_a2)const;              // outgoing or incident ray angle cosine
+
+		void ResolveAmbiguousPixel(ImageBuffer& buffer, size_t i, size_t j) const;
+
+		// Convert a floating point color component value, 
+		// based on the maximum component value,
+		// to a byte RGB value in the range 0x00 to 0xff.
+		static unsigned char ConvertPixelValue(
+			double colorComponent,
+			double maxColorValue);
+
+		// Converts a row of pixelWide final pixels to bytes with
+		// ConvertPixelValue: red, green and blue for each pixel.
+		static void ConvertRow(
+			const Color* average,
+			size_t pixelWide,
+			double maxColorValue,
+			unsigned char* rgb);
+
+
+		Color backgroundColor;
+
+		typedef std::vector<SolidObject*> SolidObjectList;
+		typedef std::vector<LightSource> LightSourceList;
+
+		struct PixelCoordinates
+		{
+			size_t i;
+			size_t j;
+
+			PixelCoordinates(size_t _i, size_t _j)
+			{
+				i=_i;
+				j=_j;
+			}
+
+		};
+
+		typedef std::vector<PixelCoordinates> PixelList;
+
+		// ResolveAmbiguousPixel for every pixel in pixelList, in parallel.
+		void ResolveAmbiguousPixels(ThreadPool& pool, ImageBuffer& buffer, const PixelList& pixelList) const;
+
+		// Adds up the threads' ray counts and statistics into the scene's.
+		void CollectCounts(const std::vector<ThreadContext>& contextList) const;
+
+		// Traces the supersampled rows [jBegin,jEnd), which must be inside
+		// the buffer's band, appending ambiguous pixels to ambiguousPixelList.
+		void RenderRows(
+			ThreadPool& pool,
+			std::vector<ThreadContext>& contextList,
+			ImageBuffer& buffer,
+			double largeZoom,
+			size_t jBegin,
+			size_t jEnd,
+			PixelList& ambiguousPixelList) const;
+
+		// Traces the supersampled rows [bandBegin,bandEnd) of SaveImage's
+		// image, and the halo rows around them, resolves their ambiguous
+		// pixels and averages them into final rows in averageList.
+		// renderedEnd and coarseRenderedEnd are the rows of buffer and
+		// coarseBuffer earlier bands have traced, and are moved on.  Returns
+		// the band's largest color component, as AverageRows does.
+		double RenderBand(
+			ThreadPool& pool,
+			std::vector<ThreadContext>& contextList,
+			ImageBuffer& buffer,
+			ImageBuffer& coarseBuffer,
+			double largeZoom,
+			size_t antiAliasFactor,
+			size_t bandBegin,
+			size_t bandEnd,
+			size_t& renderedEnd,
+			size_t& coarseRenderedEnd,
+			PixelList& ambiguousPixelList,
+			std::vector<Color>& averageList) const;
+
+		// Averages each antiAliasFactor x antiAliasFactor square of supersampled
+		// pixels in rows [jBegin,jEnd) into one pixel of averageList, a final
+		// row at a time in parallel.  Returns the largest color component of
+		// the supersampled pixels, as ImageBuffer::MaxColorValue would, found
+		// in the same pass so the buffer is read only once.
+		double AverageRows(
+			ThreadPool& pool,
+			const ImageBuffer& buffer,
+			size_t jBegin,
+			size_t jEnd,
+			size_t antiAliasFactor,
+			std::vector<Color>& averageList) const;
+
+		// Converts the rows of averageList, pixelWide pixels each, to bytes
+		// in parallel, then writes them.
+		void WriteRows(
+			ThreadPool& pool,
+			const std::vector<Color>& averageList,
+			size_t pixelWide,
+			double maxColorValue,
+			PngWriter& writer) const;
+
+		// Writes the whole image in averageList to a PNG file as WriteRows
+		// would, but on the calling thread alone, so RenderAnimation's
+		// FrameEncoder can write one frame while the pool traces the next.
+		void WriteImageFile(
+			const char* fileName,
+			const std::vector<Color>& averageList,
+			size_t pixelWide,
+			double maxColorValue) const;
+
+#if IMAGER_STATISTICS
+		// Adds the cost of each supersampled pixel in rows [jBegin,jEnd)
+		// to the final pixel it belongs to in costList.
+		void AccumulateCost(
+			const ImageBuffer& buffer,
+			size_t jBegin,
+			size_t jEnd,
+			size_t antiAliasFactor,
+			std::vector<unsigned int>& costList) const;
+
+		void SaveCostHeatmap(const std::vector<unsigned int>& costList, size_t pixelWide, size_t pixelHigh) const;
+#endif
+
+		// Traces RenderProgressive's first pass, the supersampled pixels on
+		// the grid of every spacing-th row and column, into gridBuffer, one
+		// pixel per sample, so the first preview need not wait for the
+		// whole supersampled buffer to be allocated.
+		void RenderProgressiveGrid(
+			ThreadPool& pool,
+			std::vector<ThreadContext>& contextList,
+			ImageBuffer& gridBuffer,
+			size_t largePixelWide,
+			size_t largePixelHigh,
+			double largeZoom,
+			size_t spacing,
+			PixelList& ambiguousPixelList) const;
+
+		// Traces the supersampled pixels a later pass of RenderProgressive adds:
+		// those on the grid of every spacing-th row and column but not on
+		// the grid of previousSpacing.
+		void RenderProgressivePass(
+			ThreadPool& pool,
+			std::vector<ThreadContext>& contextList,
+			ImageBuffer& buffer,
+			double largeZoom,
+			size_t spacing,
+			size_t previousSpacing,
+			PixelList& ambiguousPixelList) const;
+
+		// Fills image, one pixel per antiAliasFactor^2 supersampled pixels,
+		// from the samples traced so far on the grid of spacing.  buffer holds
+		// every bufferSpacing-th supersampled pixel of every bufferSpacing-th
+		// row: spacing for RenderProgressiveGrid's buffer, otherwise 1.
+		// Until isResolved, ambiguous samples take the average of their
+		// neighbors on the grid.  Every sample traced so far is read, so
+		// this also returns their largest color component.
+		double UpdateProgressiveImage(
+			ThreadPool& pool,
+			const ImageBuffer& buffer,
+			size_t bufferSpacing,
+			size_t antiAliasFactor,
+			size_t spacing,
+			bool isResolved,
+			ImageBuffer& image) const;
+
+		// Like RenderRows for adaptive anti-aliasing: coarseBuffer holds one
+		// sample per final pixel, and must include the final rows just above
+		// and below the ones rows [jBegin,jEnd) belong to.  Pixels that need
+		// it are traced in full; the rest are filled with their coarse sample.
+		void RenderAdaptiveRows(
+			ThreadPool& pool,
+			std::vector<ThreadContext>& contextList,
+			const ImageBuffer& coarseBuffer,
+			ImageBuffer& buffer,
+			double largeZoom,
+			size_t antiAliasFactor,
+			size_t jBegin,
+			size_t jEnd,
+			PixelList& ambiguousPixelList) const;
+
+		// Whether final pixel (i,j) differs enough from its neighbors
+		// in coarseBuffer to be worth supersampling.
+		bool NeedsRefinement(const ImageBuffer& coarseBuffer, size_t i, size_t j) const;
+
+		// Guesses the largest color component in the image from
+		// one supersampled pixel in every PREVIEW_SPACING x PREVIEW_SPACING
+		// square of final pixels.
+		double EstimateMaxColorValue(
+			ThreadPool& pool,
+			std::vector<ThreadContext>& contextList,
+			size_t largePixelWide,
+			size_t largePixelHigh,
+			double largeZoom,
+			size_t antiAliasFactor) const;
+
+		// Traces every pixel in the rectangle [iBegin,iEnd) x [jBegin,jEnd)
+		// of the supersampled buffer, appending ambiguous pixels to ambiguousPixelList.
+		void RenderTile(
+			ThreadContext& context,
+			ImageBuffer& buffer,
+			double largeZoom,
+			size_t iBegin,
+			size_t iEnd,
+			size_t jBegin,
+			size_t jEnd,
+			PixelList& ambiguousPixelList) const;
+
+		// Traces the rectangle as RenderTile does, with RenderTileWavefront,
+		// RenderTilePackets or RenderTile as the scene's settings call for.
+		void RenderBlock(
+			ThreadContext& context,
+			ImageBuffer& buffer,
+			double largeZoom,
+			size_t iBegin,
+			size_t iEnd,
+			size_t jBegin,
+			size_t jEnd,
+			PixelList& ambiguousPixelList) const;
+
+		// RenderTile for when camera rays are traced in packets.
+		void RenderTilePackets(
+			ThreadContext& context,
+			ImageBuffer& buffer,
+			double largeZoom,
+			size_t iBegin,
+			size_t iEnd,
+			size_t jBegin,
+			size_t jEnd,
+			PixelList& ambiguousPixelList) const;
+
+		// Sets packet to the camera rays through the pixels of the block
+		// starting at (iBlock,jBlock), clipped to iEnd and jEnd, and returns
+		// the pixels' coordinates in iPixel and jPixel.
+		void FillCameraPacket(
+			const ImageBuffer& buffer,
+			double largeZoom,
+			size_t iBlock,
+			size_t iEnd,
+			size_t jBlock,
+			size_t jEnd,
+			RayPacket& packet,
+			size_t* iPixel,
+			size_t* jPixel) const;
+
+		// RenderTile for wavefront rendering (see SetWavefrontRendering).
+		void RenderTileWavefront(
+			ThreadContext& context,
+			ImageBuffer& buffer,
+			double largeZoom,
+			size_t iBegin,
+			size_t iEnd,
+			size_t jBegin,
+			size_t jEnd,
+			PixelList& ambiguousPixelList) const;
+
+		// Wavefront rendering's RenderPixel: records the pixel
+		// and, if its camera ray hit a surface, the surface.
+		void StartWavePixel(
+			ThreadContext& context,
+			ImageBuffer& buffer,
+			size_t i,
+			size_t j,
+			int numClosest,
+			const Intersection& intersection,
+			const Vector3& direction) const;
+
+		// Traces the shadow rays of the wavefront's new surfaces
+		// and queues the secondary rays they need.
+		void LightWavefront(ThreadContext& context) const;
+
+		// Traces a queue of secondary rays, adding the surfaces
+		// they hit to the wavefront's new surfaces.
+		struct WaveRay;
+		void TraceWavefrontQueue(ThreadContext& context, std::vector<WaveRay>& queue) const;
+
+		// Adds a secondary ray's color to the surface it left, and finishes
+		// the surface, and those below it, once all their rays are done.
+		void CompleteWaveRay(ThreadContext& context, size_t surfaceIndex, bool isReflection, Color color) const;
+
+		// Finishes a surface that needs no secondary rays.
+		void FinishWaveSurface(ThreadContext& context, size_t surfaceIndex) const;
+
+		// Traces the camera ray for supersampled pixel (i,j) into pixel.
+		// Returns false, and adds the pixel to ambiguousPixelList,
+		// if the pixel is ambiguous; the caller marks it in its buffer.
+		bool RenderPixel(
+			ThreadContext& context,
+			PixelData& pixel,
+			size_t i,
+			size_t j,
+			int numClosest,
+			const Intersection& intersection,
+			const Vector3& direction,
+			PixelList& ambiguousPixelList) const;
+
+		SolidObjectList solidObjectList;
+
+		LightSourceList lightSourceList;
+
+
+		double ambientRefraction;
+
+		size_t threadCount;
+
+		size_t packetSize;
+
+		size_t streamingBandHeight;
+
+		double maxColorValue;
+
+		double adaptiveThreshold;
+
+		bool isWavefront;
+
+		AmbiguityPolicy ambiguityPolicy;
+
+		bool isLightCulling;
+
+		size_t lightSampleCount;
+
+		// Over the box around each light beyond which it cannot add a
+		// significant amount; the primitive indexes are lightSourceList's.
+		mutable BoundingVolumeHierarchy lightHierarchy;
+		mutable bool isLightHierarchyStale;
+
+		mutable size_t cameraRayCount;
+		mutable size_t secondaryRayCount;
+		mutable size_t shadowRayCount;
+
+		mutable RenderStatistics statistics;
+
+		std::string costHeatmapFileName;
+
+		// Solids with finite bounding boxes live in the hierarchy;
+		// the hierarchy's primitive indexes refer to hierarchySolidList.
+		// Solids with infinite bounds are tested against every ray.
+		mutable BoundingVolumeHierarchy hierarchy;
+		mutable SolidObjectList hierarchySolidList;
+		mutable SolidObjectList unboundedSolidList;
+		mutable bool isHierarchyStale;
+
+		// Keeps a borrowed hierarchy valid; see BorrowHierarchy.
+		mutable std::shared_ptr<const void> hierarchyOwner;
+
+		// The position in solidObjectList of each solid in the two lists
+		// above, for breaking ties with AMBIGUITY_FIRST_SOLID.
+		mutable std::vector<size_t> hierarchySolidOrder;
+		mutable std::vector<size_t> unboundedSolidOrder;
+
+		// Where each solid is in solidObjectList, and whether the box of
+		// any solid ahead of it overlaps its own, for PrimaryContainer.
+		struct SolidPlace
+		{
+			size_t order;
+			bool isOverlapped;
+		};
+		mutable std::unordered_map<const SolidObject*, SolidPlace> solidPlaceMap;
+
+		// Every solid's materials, in solidObjectList order, as
+		// SolidObject::AppendMaterials lays them out.  Geometry that
+		// instances share appears once, with the first instance.
+		mutable MaterialList materialList;
+
+		struct DebugPoint
+		{
+			int     iPixel;
+			int     jPixel;
+
+			DebugPoint(int _iPixel, int _jPixel)
+				: iPixel(_iPixel)
+				, jPixel(_jPixel)
+			{}
+		};
+		typedef std::vector<DebugPoint> DebugPointList;
+		DebugPointList debugPointList;
+
+		// The solids a ray has refracted into and not yet out of, innermost
+		// last.  Only a guess for PrimaryContainer, which checks it, so it
+		// may be wrong (a camera inside a solid, or a deeper nesting than
+		// it keeps) without changing the image.
+		struct MediumStack
+		{
+			enum { MAX_SIZE = 4 };
+
+			const SolidObject* solid[MAX_SIZE];
+			int size;
+
+			MediumStack()
+				: size(0)
+			{}
+
+			const SolidObject* Innermost() const
+			{
+				return (size > 0)?solid[size-1]:NULL;
+			}
+
+			// Drops the outermost solid when full.
+			void Push(const SolidObject* medium)
+			{
+				if (size == MAX_SIZE)
+				{
+					for (int k = 1; k < MAX_SIZE; ++k)
+					{
+						solid[k-1]=solid[k];
+					}
+					--size;
+				}
+				solid[size++]=medium;
+			}
+
+			void Pop()
+			{
+				--size;
+			}
+		};
+
+		// A lit surface waiting for the colors of its secondary rays.
+		struct RayFrame
+		{
+			enum Stage { REFRACTION, REFLECTION, DONE };
+
+			Intersection intersection;
+			Vector3 direction;                  // of the ray that hit the surface
+			double refractiveIndex;             // of the material that ray traveled through
+			MediumStack media;                  // that ray was inside
+			Color rayIntensity;
+			int recursionDepth;
+
+			const Material* material;           // in materialList
+			double refractiveReflectionFactor;
+
+			Color colorSum;                     // the surface's color so far
+			Stage stage;                        // the next secondary ray to trace
+		};
+
+		// A pixel in wavefront rendering's current tile.
+		struct WavePixel
+		{
+			size_t i;
+			size_t j;
+			Color color;
+			bool isAmbiguous;
+#if IMAGER_STATISTICS
+			size_t cost;
+#endif
+		};
+
+		// A surface in wavefront rendering's current tile.  Where ShadeRay
+		// has one frame at a time waiting for a secondary ray, a wavefront
+		// surface waits for all of its secondary rays at once.
+		struct WaveSurface
+		{
+			enum { NO_PARENT = ~(size_t)0 };
+
+			RayFrame frame;
+			size_t pixel;                       // index into Wavefront::pixelList
+			size_t parent;                      // the surface whose secondary ray hit this one
+			bool isReflection;                  // whether that ray was the reflected one
+			bool hasMatte;
+			int pendingCount;                   // secondary rays not yet done
+			bool hasRefraction;
+			bool hasReflection;
+			Color refractionColor;
+			Color reflectionColor;
+		};
+
+		// A secondary ray waiting in a wavefront queue.
+		struct WaveRay
+		{
+			Vector3 direction;
+			double refractiveIndex;
+			MediumStack media;
+			Color rayIntensity;
+			size_t surface;                     // the surface it starts from
+			bool isReflection;
+		};
+
+		// Wavefront rendering's working lists, kept by each
+		// thread so they are allocated once, not once per tile.
+		struct Wavefront
+		{
+			std::vector<WavePixel> pixelList;
+			std::vector<WaveSurface> surfaceList;
+			std::vector<size_t> newSurfaceList;
+			std::vector<char> isClearList;      // shadow ray results, light by light
+			std::vector<double> lightScaleList; // LightChoice::scale, light by light; 0 if not chosen
+			std::vector<WaveRay> refractionQueue;
+			std::vector<WaveRay> reflectionQueue;
+
+			// A queue's rays in the order to trace them: each entry holds
+			// a key for the ray's direction in the upper 32 bits and the
+			// ray's index in the queue in the lower ones.
+			std::vector<unsigned long long> traceOrder;
+		};
+
+		struct ThreadContext
+		{
+			// The debug point matching the pixel being traced, if any.
+			const DebugPoint* activeDebugPoint;
+
+			// The solid that last blocked the shadow ray to each light,
+			// indexed like lightSourceList.
+			std::vector<const SolidObject*> shadowCache;
+
+			// SelectLights' choices for the surface being lit, and
+			// their cumulative strengths when sampling.
+			std::vector<LightChoice> lightChoiceList;
+			std::vector<double> lightStrengthSumList;
+
+			// Rays this thread has traced.
+			size_t cameraRayCount;
+			size_t secondaryRayCount;
+			size_t shadowRayCount;
+
+			RenderStatistics statistics;
+
+			// The surfaces ShadeRay is lighting: each one is waiting for
+			// the color of a secondary ray that hit the one above it.
+			// Surfaces deeper than MAX_OPTICAL_RECURSION_DEPTH are not lit,
+			// so one more frame than that is enough.
+			RayFrame rayStack[MAX_OPTICAL_RECURSION_DEPTH+1];
+
+			Wavefront wavefront;
+
+			ThreadContext()
+				: activeDebugPoint(NULL)
+				, cameraRayCount(0)
+				, secondaryRayCount(0)
+				, shadowRayCount(0)
+			{}
+		};
+
+	};
+
+
+	// Whether a pixel is ambiguous is kept apart from its PixelData,
+	// in ImageBuffer (see ImageBuffer::IsAmbiguous).
+	struct PixelData
+	{
+		Color color;
+
+		// What the pixel's ray hit first (see Intersection);
+		// NULL for the background or an ambiguous hit.
+		const SolidObject* solid;
+		const void* context;
+
+#if IMAGER_STATISTICS
+		// Solids tested to shade this pixel (RenderStatistics::TestCount).
+		unsigned int cost;
+#endif
+
+		PixelData()
+			:color(),
+			solid(NULL),
+			context(NULL)
+		{
+			IMAGER_STATISTIC(cost=0;)
+		}
+
+	};
+	
+	// Width and height of the square tiles an ImageBuffer stores its
+	// pixels in.  Each tile is contiguous and starts on a cache line,
+	// and one 64-bit word holds its pixels' ambiguity bits.
+	const size_t IMAGE_TILE_SIZE = 8;
+	const size_t IMAGE_TILE_PIXELS = IMAGE_TILE_SIZE*IMAGE_TILE_SIZE;
+	const size_t CACHE_LINE_BYTES = 64;
+
 	class ImageBuffer
 	{
 	public:
@@ -552,21 +2739,153 @@ namespace Imager
 			size_t _pixelHigh,
 			const Color &backgroundColor);
 
+		// A buffer that holds only a band of _bandHigh rows of an image
+		// _pixelHigh rows tall, starting with row 0.  Pixel and GetPixelHigh
+		// still number rows as in the whole image; MoveBand slides the band.
+		ImageBuffer(
+			size_t _pixelWide,
+			size_t _pixelHigh,
+			size_t _bandHigh,
+			const Color &backgroundColor);
+
 		virtual ~ImageBuffer();
 
+		// Row j must be inside the band.
 		PixelData& Pixel(size_t i,size_t j) const;
 
+		// Pixel without the bounds check, for render loops whose
+		// pixels are known to be inside the band.
+		PixelData& UncheckedPixel(size_t i, size_t j) const
+		{
+			return array[Index(i,j)];
+		}
+
+		// Whether the pixel's ray hit two or more surfaces equally close,
+		// so its color is to be resolved from its neighbors.  Unchecked,
+		// like UncheckedPixel.
+		bool IsAmbiguous(size_t i, size_t j) const
+		{
+			const size_t k=Index(i,j);
+			return (ambiguousMask[k/IMAGE_TILE_PIXELS].load(std::memory_order_relaxed) & (1ull << (k%IMAGE_TILE_PIXELS))) != 0;
+		}
+
+		// Marks the pixel ambiguous.  Threads may mark pixels of the same tile at once.
+		void SetAmbiguous(size_t i, size_t j) const
+		{
+			const size_t k=Index(i,j);
+			ambiguousMask[k/IMAGE_TILE_PIXELS].fetch_or(1ull << (k%IMAGE_TILE_PIXELS),std::memory_order_relaxed);
+		}
+
 		size_t GetPixelsWide() const;
 
 		size_t GetPixelHigh() const;
 
+		size_t GetBandTop() const;
+
+		size_t GetBandHigh() const;
+
+		// Makes the band start at row newBandTop.  Rows in both the old
+		// and the new band keep their pixels; the others are cleared.
+		void MoveBand(size_t newBandTop);
+
+		// Clears every pixel and moves the band back to row 0, so the
+		// buffer can hold another image of the same size.
+		void Reset();
+
+		// The largest color component in the band.
 		double MaxColorValue() const;
 
 	private:
+		ImageBuffer(const ImageBuffer&);
+		ImageBuffer& operator=(const ImageBuffer&);
+
 		size_t  pixelsWide;     // the width of the image in pixels (columns).
 		size_t  pixelsHigh;     // the height of the image in pixels (rows).
-		size_t  numPixels;      // the total number of pixels.
-		PixelData*  array;      // flattened array [pixelsWide * pixelsHigh].
+		size_t  bandTop;        // the first row held in the array.
+		size_t  bandHigh;       // the number of rows held in the array.
+		size_t  tilesWide;      // tiles in a row of tiles.
+		size_t  firstTileRow;   // the row of tiles, counted from the top of the image, the band starts in.
+		size_t  tileRowsHeld;   // the rows of tiles held in the array.
+		size_t  numTiles;       // the number of tiles held in the array.
+		unsigned char*  storage;            // allocation the array is aligned within.
+		PixelData*  array;                  // tiles [tileRowsHeld][tilesWide], each IMAGE_TILE_SIZE rows of IMAGE_TILE_SIZE pixels.
+		std::atomic<unsigned long long>* ambiguousMask;     // one bit per pixel, one word per tile.
+
+		// Position in array of pixel (i,j), whose row is in a held row of tiles.
+		size_t Index(size_t i, size_t j) const
+		{
+			const size_t tile=(j/IMAGE_TILE_SIZE-firstTileRow)*tilesWide+i/IMAGE_TILE_SIZE;
+			return tile*IMAGE_TILE_PIXELS+(j%IMAGE_TILE_SIZE)*IMAGE_TILE_SIZE+i%IMAGE_TILE_SIZE;
+		}
+
+		void Allocate(size_t _bandHigh);
+	};
+
+
+	// Writes an 8-bit RGB PNG file one row at a time, top row first,
+	// so an image never has to be in memory all at once.  The pixel data
+	// is stored without compression (deflate "stored" blocks), which every
+	// PNG reader accepts and which keeps the writer's memory use fixed.
+	class PngWriter
+	{
+	public:
+		PngWriter(const char* fileName, size_t _pixelsWide, size_t _pixelsHigh);
+
+		virtual ~PngWriter();
+
+		// rgb holds 3*pixelsWide bytes: red, green and blue for each pixel.
+		void WriteRow(const unsigned char* rgb);
+
+		// Writes the end of the file.  Call after the last row.
+		void Finish();
+
+	private:
+		PngWriter(const PngWriter&);
+		PngWriter& operator=(const PngWriter&);
+
+		void AppendImageData(const unsigned char* data, size_t length);
+		void FlushBlock(bool isFinal);
+		void WriteChunk(const char* type, const std::vector<unsigned char>& data);
+
+		std::ofstream output;
+		size_t pixelsWide;
+		size_t pixelsHigh;
+		size_t rowsWritten;
+		bool isFinished;
+
+		// Image data waiting to go out as the next stored block.
+		std::vector<unsigned char> pendingData;
+		bool hasWrittenZlibHeader;
+		unsigned int adlerA;    // running Adler-32 checksum of the image data
+		unsigned int adlerB;
+	};
+
+
+	// A whole file mapped read-only into memory.  Pages are read from disk
+	// the first time they are touched, so opening even a very large file
+	// is quick, and pages nothing reads are never read at all.
+	class MappedFile
+	{
+	public:
+		explicit MappedFile(const char* fileName);
+
+		virtual ~MappedFile();
+
+		// Aligned to at least a memory page.
+		const unsigned char* GetData() const;
+
+		size_t GetSize() const;
+
+	private:
+		MappedFile(const MappedFile&);
+		MappedFile& operator=(const MappedFile&);
+
+		const unsigned char* data;
+		size_t size;
+#if defined(_WIN32)
+		void* fileHandle;
+		void* mappingHandle;
+#endif
 	};
 
 	
@@ -0,0 +1,177 @@
+#include"Imager.h"
+
+namespace Imager
+{
+	namespace
+	{
+		Vector3 InstanceCenter(const std::shared_ptr<const SolidObject>& geometry, const Transform& transform)
+		{
+			if (!geometry)
+			{
+				throw ImageException("Instance has no geometry.");
+			}
+			return transform.ApplyToPoint(geometry->Center());
+		}
+	}
+
+	Instance::Instance(const std::shared_ptr<const SolidObject>& _geometry, const Transform & _transform)
+		: SolidObject(InstanceCenter(_geometry,_transform))
+		, geometry(_geometry)
+		, transform(_transform)
+		, inverse(_transform.Inverse())
+	{
+		// Start out looking like the geometry.
+		SetUniformOptics(geometry->GetUniformOptics());
+		SetRefraction(geometry->GetRefractiveIndex());
+		SetTag("Instance");
+		Prepare();
+	}
+
+	const SolidObject & Instance::GetGeometry() const
+	{
+		return *geometry;
+	}
+
+	const Transform & Instance::GetTransform() const
+	{
+		return transform;
+	}
+
+	void Instance::SetTransform(const Transform & _transform)
+	{
+		// Inverse can throw, so leave the instance alone until it has worked.
+		inverse=_transform.Inverse();
+		transform=_transform;
+
+		const Vector3 shift=transform.ApplyToPoint(geometry->Center())-Center();
+		SolidObject::Translate(shift.x,shift.y,shift.z);
+		Prepare();
+	}
+
+	void Instance::AppendAllIntersections(const Vector3 & vantage, const Vector3 & direction, IntersectionList & intersectionList) const
+	{
+		const size_t first=intersectionList.size();
+		geometry->AppendAllIntersections(inverse.ApplyToPoint(vantage),inverse.ApplyToDirection(direction),intersectionList);
+
+		for (size_t i = first; i < intersectionList.size(); ++i)
+		{
+			Intersection& intersection=intersectionList[i];
+			intersection.point=transform.ApplyToPoint(intersection.point);
+			intersection.surfaceNormal=inverse.ApplyTransposeToDirection(intersection.surfaceNormal).UnitVector();
+			intersection.distanceSquared=(intersection.point-vantage).MagnetitudeSquared();
+			intersection.solid=this;
+		}
+	}
+
+	int Instance::FindClosestHit(const Vector3 & vantage, const Vector3 & direction, double maxDistanceSquared, RayHit & hit) const
+	{
+		const Vector3 objectDirection=inverse.ApplyToDirection(direction);
+		const int numClosest=geometry->FindClosestHit(
+			inverse.ApplyToPoint(vantage),
+			objectDirection,
+			maxDistanceSquared*ObjectDistanceRatio(direction,objectDirection),
+			hit);
+
+		if (numClosest > 0)
+		{
+			// The ray parameter is the same in both coordinates; distances are not.
+			hit.distanceSquared=hit.t*hit.t*direction.MagnetitudeSquared();
+			hit.solid=this;
+		}
+		return numClosest;
+	}
+
+	void Instance::CompleteIntersection(const Vector3 & vantage, const Vector3 & direction, const RayHit & hit, Intersection & intersection) const
+	{
+		RayHit objectHit=hit;
+		objectHit.solid=geometry.get();
+		geometry->CompleteIntersection(inverse.ApplyToPoint(vantage),inverse.ApplyToDirection(direction),objectHit,intersection);
+
+		// Found from the ray in the scene's coordinates, as the
+		// other solids do, rather than by transforming the point back.
+		const SolveVector3 point=SolveVector3(vantage)+static_cast<SolveScalar>(hit.t)*SolveVector3(direction);
+		intersection.point=Vector3(point);
+		intersection.surfaceNormal=inverse.ApplyTransposeToDirection(intersection.surfaceNormal).UnitVector();
+		intersection.distanceSquared=hit.distanceSquared;
+		intersection.solid=this;
+	}
+
+	bool Instance::HasHitWithin(const Vector3 & vantage, const Vector3 & direction, double maxDistanceSquared) const
+	{
+		const Vector3 objectDirection=inverse.ApplyToDirection(direction);
+		return geometry->HasHitWithin(
+			inverse.ApplyToPoint(vantage),
+			objectDirection,
+			maxDistanceSquared*ObjectDistanceRatio(direction,objectDirection));
+	}
+
+	bool Instance::Contains(const Vector3 & point) const
+	{
+		// A transform that scales up would let the geometry's own margin
+		// reach further than CONTAINMENT_MARGIN from the box in the scene.
+		if (!bounds.Expanded(CONTAINMENT_MARGIN).Contains(point))
+		{
+			return false;
+		}
+		return geometry->Contains(inverse.ApplyToPoint(point));
+	}
+
+	BoundingBox Instance::GetBoundingBox() const
+	{
+		return bounds;
+	}
+
+	void Instance::Prepare() const
+	{
+		geometry->Prepare();
+		bounds=transform.ApplyToBox(geometry->GetBoundingBox());
+	}
+
+	size_t Instance::SurfaceMaterial(const Vector3 & surfacePoint, const void * context) const
+	{
+		return geometry->SurfaceMaterial(inverse.ApplyToPoint(surfacePoint),context);
+	}
+
+	size_t Instance::AppendSurfaceMaterials(MaterialList & materialList, SharedMaterialMap & sharedMaterialMap) const
+	{
+		// The instance's uniform optics stand in for the geometry's, so
+		// only the geometry's surface materials are needed, and every
+		// instance of it can use the same copy of them.
+		return geometry->AppendSharedMaterials(materialList,sharedMaterialMap);
+	}
+
+	SolidObject & Instance::RotateX(double angleInDegrees)
+	{
+		RotateAboutCenter(Transform::RotationX(angleInDegrees));
+		return *this;
+	}
+
+	SolidObject & Instance::RotateY(double angleInDegrees)
+	{
+		RotateAboutCenter(Transform::RotationY(angleInDegrees));
+		return *this;
+	}
+
+	SolidObject & Instance::RotateZ(double angleInDegrees)
+	{
+		RotateAboutCenter(Transform::RotationZ(angleInDegrees));
+		return *this;
+	}
+
+	SolidObject & Instance::Translate(double dx, double dy, double dz)
+	{
+		SetTransform(Transform::Translation(dx,dy,dz)*transform);
+		return *this;
+	}
+
+	void Instance::RotateAboutCenter(const Transform & rotation)
+	{
+		const Vector3& center=Center();
+		SetTransform(Transform::Translation(center.x,center.y,center.z)*rotation*Transform::Translation(-center.x,-center.y,-center.z)*transform);
+	}
+
+	double Instance::ObjectDistanceRatio(const Vector3 & direction, const Vector3 & objectDirection) const
+	{
+		return objectDirection.MagnetitudeSquared()/direction.MagnetitudeSquared();
+	}
+}
@@ -0,0 +1,118 @@
+#include"Imager.h"
+
+#if defined(_WIN32)
+#include<windows.h>
+#else
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<unistd.h>
+#endif
+
+namespace Imager
+{
+#if defined(_WIN32)
+	MappedFile::MappedFile(const char * fileName)
+		: data(NULL)
+		, size(0)
+		, fileHandle(INVALID_HANDLE_VALUE)
+		, mappingHandle(NULL)
+	{
+		fileHandle=CreateFileA(fileName,GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,NULL);
+		if (fileHandle == INVALID_HANDLE_VALUE)
+		{
+			throw ImageException("Cannot open file to map.");
+		}
+
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(fileHandle,&fileSize))
+		{
+			CloseHandle(fileHandle);
+			throw ImageException("Cannot get size of file to map.");
+		}
+		size=static_cast<size_t>(fileSize.QuadPart);
+		if (size == 0)
+		{
+			// Windows cannot map an empty file, and there is nothing to read.
+			return;
+		}
+
+		mappingHandle=CreateFileMappingA(fileHandle,NULL,PAGE_READONLY,0,0,NULL);
+		if (mappingHandle != NULL)
+		{
+			data=static_cast<const unsigned char*>(MapViewOfFile(mappingHandle,FILE_MAP_READ,0,0,0));
+		}
+		if (data == NULL)
+		{
+			if (mappingHandle != NULL)
+			{
+				CloseHandle(mappingHandle);
+			}
+			CloseHandle(fileHandle);
+			throw ImageException("Cannot map file into memory.");
+		}
+	}
+
+	MappedFile::~MappedFile()
+	{
+		if (data != NULL)
+		{
+			UnmapViewOfFile(data);
+			CloseHandle(mappingHandle);
+		}
+		CloseHandle(fileHandle);
+	}
+#else
+	MappedFile::MappedFile(const char * fileName)
+		: data(NULL)
+		, size(0)
+	{
+		const int descriptor=open(fileName,O_RDONLY);
+		if (descriptor < 0)
+		{
+			throw ImageException("Cannot open file to map.");
+		}
+
+		struct stat status;
+		if (fstat(descriptor,&status) != 0)
+		{
+			close(descriptor);
+			throw ImageException("Cannot get size of file to map.");
+		}
+		size=static_cast<size_t>(status.st_size);
+		if (size == 0)
+		{
+			// mmap rejects a zero length, and there is nothing to read.
+			close(descriptor);
+			return;
+		}
+
+		// The mapping stays valid after the descriptor is closed.
+		void* address=mmap(NULL,size,PROT_READ,MAP_PRIVATE,descriptor,0);
+		close(descriptor);
+		if (address == MAP_FAILED)
+		{
+			throw ImageException("Cannot map file into memory.");
+		}
+		data=static_cast<const unsigned char*>(address);
+	}
+
+	MappedFile::~MappedFile()
+	{
+		if (data != NULL)
+		{
+			munmap(const_cast<unsigned char*>(data),size);
+		}
+	}
+#endif
+
+	const unsigned char * MappedFile::GetData() const
+	{
+		return data;
+	}
+
+	size_t MappedFile::GetSize() const
+	{
+		return size;
+	}
+}
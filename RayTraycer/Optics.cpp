@@ -13,7 +13,7 @@ namespace Imager
 	{
 		SetMatteColor(_matteColor);
 		SetGlossColor(_glossColor);
-		SetOpacity(opacity);
+		SetOpacity(_opacity);
 	}
 	void Optics::SetMatteColor(const Color & _matteColor)
 	{
@@ -65,7 +65,7 @@ namespace Imager
 		return glossColor;
 	}
 
-	const double Optics::GetOpacity() const
+	double Optics::GetOpacity() const
 	{
 		return opacity;
 	}
@@ -94,5 +94,14 @@ namespace Imager
 	}
 
 
+	Material::Material(const Optics & optics)
+	{
+		matteColor=optics.GetMatteColor();
+		glossColor=optics.GetGlossColor();
+		opacity=optics.GetOpacity();
+		opaqueMatteColor=opacity*matteColor;
+		opaqueGlossColor=opacity*glossColor;
+		transparency=1.0-opacity;
+	}
 
 }
\ No newline at end of file
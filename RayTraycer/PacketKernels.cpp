@@ -0,0 +1,240 @@
+#include"PacketKernels.h"
+#include<cmath>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define IMAGER_X86 1
+#if defined(_MSC_VER)
+#include<intrin.h>
+#else
+#include<cpuid.h>
+#endif
+#include<emmintrin.h>
+#endif
+
+namespace
+{
+	struct ScalarOps
+	{
+		typedef double Reg;
+		typedef bool Mask;
+		enum { WIDTH = 1 };
+
+		static Reg Load(const double* p) { return *p; }
+		static void Store(double* p, Reg a) { *p = a; }
+		static Reg Set1(double a) { return a; }
+		static Reg Add(Reg a, Reg b) { return a + b; }
+		static Reg Sub(Reg a, Reg b) { return a - b; }
+		static Reg Mul(Reg a, Reg b) { return a * b; }
+		static Reg Div(Reg a, Reg b) { return a / b; }
+		static Reg Sqrt(Reg a) { return sqrt(a); }
+		static Reg Neg(Reg a) { return -a; }
+		static Reg Abs(Reg a) { return fabs(a); }
+		static Mask CmpLt(Reg a, Reg b) { return a < b; }
+		static Mask CmpGt(Reg a, Reg b) { return a > b; }
+		static Mask CmpGe(Reg a, Reg b) { return a >= b; }
+		static Mask MaskAnd(Mask a, Mask b) { return a && b; }
+		static Mask MaskOr(Mask a, Mask b) { return a || b; }
+		static Mask MaskAndNot(Mask a, Mask b) { return a && !b; }
+		static Reg Select(Mask m, Reg a, Reg b) { return m ? a : b; }
+		static bool Any(Mask m) { return m; }
+	};
+
+#if IMAGER_X86
+	// SSE2 is part of every x64 CPU, so it needs no special compiler options.
+	struct Sse2Ops
+	{
+		typedef __m128d Reg;
+		typedef __m128d Mask;
+		enum { WIDTH = 2 };
+
+		static Reg Load(const double* p) { return _mm_loadu_pd(p); }
+		static void Store(double* p, Reg a) { _mm_storeu_pd(p, a); }
+		static Reg Set1(double a) { return _mm_set1_pd(a); }
+		static Reg Add(Reg a, Reg b) { return _mm_add_pd(a, b); }
+		static Reg Sub(Reg a, Reg b) { return _mm_sub_pd(a, b); }
+		static Reg Mul(Reg a, Reg b) { return _mm_mul_pd(a, b); }
+		static Reg Div(Reg a, Reg b) { return _mm_div_pd(a, b); }
+		static Reg Sqrt(Reg a) { return _mm_sqrt_pd(a); }
+		static Reg Neg(Reg a) { return _mm_xor_pd(a, _mm_set1_pd(-0.0)); }
+		static Reg Abs(Reg a) { return _mm_andnot_pd(_mm_set1_pd(-0.0), a); }
+		static Mask CmpLt(Reg a, Reg b) { return _mm_cmplt_pd(a, b); }
+		static Mask CmpGt(Reg a, Reg b) { return _mm_cmpgt_pd(a, b); }
+		static Mask CmpGe(Reg a, Reg b) { return _mm_cmpge_pd(a, b); }
+		static Mask MaskAnd(Mask a, Mask b) { return _mm_and_pd(a, b); }
+		static Mask MaskOr(Mask a, Mask b) { return _mm_or_pd(a, b); }
+		static Mask MaskAndNot(Mask a, Mask b) { return _mm_andnot_pd(b, a); }
+		static Reg Select(Mask m, Reg a, Reg b) { return _mm_or_pd(_mm_and_pd(m, a), _mm_andnot_pd(m, b)); }
+		static bool Any(Mask m) { return _mm_movemask_pd(m) != 0; }
+	};
+#endif
+}
+
+#include"SphereKernel.inl"
+
+namespace Imager
+{
+	namespace PacketKernels
+	{
+		void IntersectSpherePacket_Scalar(const SpherePacketInput& input, const double* maxDistanceSquared, const SpherePacketOutput& output)
+		{
+			IntersectSpherePacketTemplate<ScalarOps>(input, maxDistanceSquared, output);
+		}
+
+		void IntersectSpherePacket_Sse2(const SpherePacketInput& input, const double* maxDistanceSquared, const SpherePacketOutput& output)
+		{
+#if IMAGER_X86
+			IntersectSpherePacketTemplate<Sse2Ops>(input, maxDistanceSquared, output);
+#else
+			IntersectSpherePacketTemplate<ScalarOps>(input, maxDistanceSquared, output);
+#endif
+		}
+
+		void IntersectSphereBatch_Scalar(const SphereBatchInput& input, double maxDistanceSquared, const SpherePacketOutput& output)
+		{
+			IntersectSphereBatchTemplate<ScalarOps>(input, maxDistanceSquared, output);
+		}
+
+		void IntersectSphereBatch_Sse2(const SphereBatchInput& input, double maxDistanceSquared, const SpherePacketOutput& output)
+		{
+#if IMAGER_X86
+			IntersectSphereBatchTemplate<Sse2Ops>(input, maxDistanceSquared, output);
+#else
+			IntersectSphereBatchTemplate<ScalarOps>(input, maxDistanceSquared, output);
+#endif
+		}
+
+		namespace
+		{
+#if IMAGER_X86
+			void CpuId(int leaf, int subleaf, unsigned int reg[4])
+			{
+#if defined(_MSC_VER)
+				int info[4];
+				__cpuidex(info, leaf, subleaf);
+				for (int i = 0; i < 4; ++i)
+				{
+					reg[i] = static_cast<unsigned int>(info[i]);
+				}
+#else
+				if (!__get_cpuid_count(leaf, subleaf, &reg[0], &reg[1], &reg[2], &reg[3]))
+				{
+					reg[0] = reg[1] = reg[2] = reg[3] = 0;
+				}
+#endif
+			}
+
+			// Which register states the operating system saves on a context switch.
+			unsigned long long ExtendedControlRegister()
+			{
+#if defined(_MSC_VER)
+				return _xgetbv(0);
+#else
+				unsigned int eax, edx;
+				__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+				return (static_cast<unsigned long long>(edx) << 32) | eax;
+#endif
+			}
+#endif
+
+			SimdLevel DetectOnce()
+			{
+#if IMAGER_X86
+				unsigned int leaf0[4];
+				CpuId(0, 0, leaf0);
+				const unsigned int maxLeaf = leaf0[0];
+
+				unsigned int leaf1[4];
+				CpuId(1, 0, leaf1);
+				const bool hasSse2 = (leaf1[3] & (1u << 26)) != 0;
+				if (!hasSse2)
+				{
+					return SIMD_SCALAR;
+				}
+
+				// AVX registers are only usable if the OS saves them (OSXSAVE + XCR0).
+				const bool hasOsxsave = (leaf1[2] & (1u << 27)) != 0;
+				const bool hasAvx = (leaf1[2] & (1u << 28)) != 0;
+				if (!hasOsxsave || !hasAvx || (maxLeaf < 7))
+				{
+					return SIMD_SSE2;
+				}
+
+				const unsigned long long xcr0 = ExtendedControlRegister();
+				const bool osSavesYmm = (xcr0 & 0x6) == 0x6;
+				const bool osSavesZmm = (xcr0 & 0xe6) == 0xe6;
+
+				unsigned int leaf7[4];
+				CpuId(7, 0, leaf7);
+				const bool hasAvx2 = (leaf7[1] & (1u << 5)) != 0;
+				const bool hasAvx512f = (leaf7[1] & (1u << 16)) != 0;
+
+				if (hasAvx512f && osSavesZmm)
+				{
+					return SIMD_AVX512;
+				}
+				if (hasAvx2 && osSavesYmm)
+				{
+					return SIMD_AVX2;
+				}
+				return SIMD_SSE2;
+#else
+				return SIMD_SCALAR;
+#endif
+			}
+
+			SpherePacketKernel SphereKernelFor(SimdLevel level)
+			{
+				switch (level)
+				{
+				case SIMD_AVX512:   return IntersectSpherePacket_Avx512;
+				case SIMD_AVX2:     return IntersectSpherePacket_Avx2;
+				case SIMD_SSE2:     return IntersectSpherePacket_Sse2;
+				default:            return IntersectSpherePacket_Scalar;
+				}
+			}
+
+			SphereBatchKernel SphereBatchKernelFor(SimdLevel level)
+			{
+				switch (level)
+				{
+				case SIMD_AVX512:   return IntersectSphereBatch_Avx512;
+				case SIMD_AVX2:     return IntersectSphereBatch_Avx2;
+				case SIMD_SSE2:     return IntersectSphereBatch_Sse2;
+				default:            return IntersectSphereBatch_Scalar;
+				}
+			}
+
+			const SimdLevel detectedLevel = DetectOnce();
+			SimdLevel selectedLevel = detectedLevel;
+			SpherePacketKernel sphereKernel = SphereKernelFor(detectedLevel);
+			SphereBatchKernel sphereBatchKernel = SphereBatchKernelFor(detectedLevel);
+		}
+
+		SimdLevel DetectSimdLevel()
+		{
+			return detectedLevel;
+		}
+
+		SimdLevel GetSimdLevel()
+		{
+			return selectedLevel;
+		}
+
+		void SetSimdLevel(SimdLevel level)
+		{
+			selectedLevel = (level < detectedLevel) ? level : detectedLevel;
+			sphereKernel = SphereKernelFor(selectedLevel);
+			sphereBatchKernel = SphereBatchKernelFor(selectedLevel);
+		}
+
+		void IntersectSpherePacket(const SpherePacketInput& input, const double* maxDistanceSquared, const SpherePacketOutput& output)
+		{
+			sphereKernel(input, maxDistanceSquared, output);
+		}
+
+		void IntersectSphereBatch(const SphereBatchInput& input, double maxDistanceSquared, const SpherePacketOutput& output)
+		{
+			sphereBatchKernel(input, maxDistanceSquared, output);
+		}
+	}
+}
@@ -0,0 +1,122 @@
+#pragma once
+#include<cstddef>
+
+// Vectorized kernels for tracing packets of rays.
+//
+// Each instruction set has its own translation unit, compiled with the
+// compiler options that enable it, and the best one the CPU supports is
+// picked at run time.  Because those translation units are compiled for
+// CPUs that may not be present, they must not include Imager.h or any
+// other header with inline functions: the linker could pick their copy
+// of such a function for the whole program.  That is why this header
+// uses nothing but plain arrays of doubles.
+
+namespace Imager
+{
+	enum SimdLevel
+	{
+		SIMD_SCALAR,        // plain C++, any CPU
+		SIMD_SSE2,          // 2 doubles per register
+		SIMD_AVX2,          // 4 doubles per register
+		SIMD_AVX512,        // 8 doubles per register
+	};
+
+	namespace PacketKernels
+	{
+		// Ray directions in a packet are padded and aligned so every
+		// kernel can read whole registers, up to the widest (AVX-512).
+		const size_t PACKET_ALIGNMENT = 64;
+		const size_t MAX_PACKET_SIZE = 16;
+
+		// Doubles in the widest register any kernel uses (AVX-512).
+		// Arrays a kernel walks with a count must be padded to a multiple of this.
+		const size_t MAX_REGISTER_WIDTH = 8;
+
+		// One sphere against a packet of rays that share a vantage point.
+		struct SpherePacketInput
+		{
+			const double* dirX;     // ray direction components [MAX_PACKET_SIZE]
+			const double* dirY;
+			const double* dirZ;
+			size_t count;           // number of rays in use; the rest is padding
+
+			double dispX;           // vantage - sphere center
+			double dispY;
+			double dispZ;
+			double c;               // |vantage - center|^2 - radius^2
+
+			double epsilon;         // hits at u <= epsilon are ignored
+		};
+
+		// One ray against a batch of spheres stored as parallel arrays.
+		struct SphereBatchInput
+		{
+			const double* centerX;  // sphere centers and radii, padded to a
+			const double* centerY;  // multiple of MAX_REGISTER_WIDTH
+			const double* centerZ;
+			const double* radius;
+			size_t count;           // number of spheres in use; the rest is padding
+
+			double vantageX;
+			double vantageY;
+			double vantageZ;
+			double dirX;
+			double dirY;
+			double dirZ;
+
+			double epsilon;         // hits at u <= epsilon are ignored
+		};
+
+		// Per-lane results of a sphere kernel: one lane per ray for a packet,
+		// one per sphere for a batch.  numClosest[k] is 0, 1 or 2 (a ray
+		// grazing the sphere); distanceSquared[k] and t[k] are only
+		// meaningful when it is not 0.
+		struct SpherePacketOutput
+		{
+			double* distanceSquared;
+			double* t;
+			double* numClosest;
+		};
+
+		// For each ray k, finds the sphere's closest intersection with
+		// distanceSquared less than maxDistanceSquared[k], using exactly
+		// the same arithmetic as Sphere::FindClosestHit, so every
+		// instruction set produces the same bits as the scalar code.
+		typedef void (*SpherePacketKernel)(
+			const SpherePacketInput& input,
+			const double* maxDistanceSquared,
+			const SpherePacketOutput& output);
+
+		void IntersectSpherePacket_Scalar(const SpherePacketInput& input, const double* maxDistanceSquared, const SpherePacketOutput& output);
+		void IntersectSpherePacket_Sse2(const SpherePacketInput& input, const double* maxDistanceSquared, const SpherePacketOutput& output);
+		void IntersectSpherePacket_Avx2(const SpherePacketInput& input, const double* maxDistanceSquared, const SpherePacketOutput& output);
+		void IntersectSpherePacket_Avx512(const SpherePacketInput& input, const double* maxDistanceSquared, const SpherePacketOutput& output);
+
+		// For each sphere k, finds the ray's closest intersection with it
+		// that has distanceSquared less than maxDistanceSquared, with the
+		// same arithmetic as Sphere::FindClosestHit on that sphere alone.
+		typedef void (*SphereBatchKernel)(
+			const SphereBatchInput& input,
+			double maxDistanceSquared,
+			const SpherePacketOutput& output);
+
+		void IntersectSphereBatch_Scalar(const SphereBatchInput& input, double maxDistanceSquared, const SpherePacketOutput& output);
+		void IntersectSphereBatch_Sse2(const SphereBatchInput& input, double maxDistanceSquared, const SpherePacketOutput& output);
+		void IntersectSphereBatch_Avx2(const SphereBatchInput& input, double maxDistanceSquared, const SpherePacketOutput& output);
+		void IntersectSphereBatch_Avx512(const SphereBatchInput& input, double maxDistanceSquared, const SpherePacketOutput& output);
+
+		// The most capable instruction set both this CPU and this build support.
+		SimdLevel DetectSimdLevel();
+
+		// The instruction set the kernels below dispatch to.  Starts out
+		// as DetectSimdLevel(); SetSimdLevel can lower it (to compare
+		// against the scalar code, say) but never raise it past that.
+		// Do not change it while a render is in progress.
+		SimdLevel GetSimdLevel();
+		void SetSimdLevel(SimdLevel level);
+
+		void IntersectSpherePacket(const SpherePacketInput& input, const double* maxDistanceSquared, const SpherePacketOutput& output);
+
+		void IntersectSphereBatch(const SphereBatchInput& input, double maxDistanceSquared, const SpherePacketOutput& output);
+	}
+}
@@ -0,0 +1,82 @@
+// AVX2 versions of the packet kernels.
+// Compile this file with AVX2 enabled (-mavx2 on GCC and Clang;
+// Visual C++ needs no option).  Only call into it when
+// PacketKernels::DetectSimdLevel() reports AVX2 or better.
+// See PacketKernels.h for why nothing here may include Imager.h.
+
+#include"PacketKernels.h"
+
+#if (defined(_M_X64) || defined(__x86_64__)) && (defined(_MSC_VER) || defined(__AVX2__))
+#define IMAGER_HAS_AVX2 1
+#include<immintrin.h>
+#endif
+
+#if IMAGER_HAS_AVX2
+
+namespace
+{
+	struct Avx2Ops
+	{
+		typedef __m256d Reg;
+		typedef __m256d Mask;
+		enum { WIDTH = 4 };
+
+		static Reg Load(const double* p) { return _mm256_loadu_pd(p); }
+		static void Store(double* p, Reg a) { _mm256_storeu_pd(p, a); }
+		static Reg Set1(double a) { return _mm256_set1_pd(a); }
+		static Reg Add(Reg a, Reg b) { return _mm256_add_pd(a, b); }
+		static Reg Sub(Reg a, Reg b) { return _mm256_sub_pd(a, b); }
+		static Reg Mul(Reg a, Reg b) { return _mm256_mul_pd(a, b); }
+		static Reg Div(Reg a, Reg b) { return _mm256_div_pd(a, b); }
+		static Reg Sqrt(Reg a) { return _mm256_sqrt_pd(a); }
+		static Reg Neg(Reg a) { return _mm256_xor_pd(a, _mm256_set1_pd(-0.0)); }
+		static Reg Abs(Reg a) { return _mm256_andnot_pd(_mm256_set1_pd(-0.0), a); }
+		static Mask CmpLt(Reg a, Reg b) { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+		static Mask CmpGt(Reg a, Reg b) { return _mm256_cmp_pd(a, b, _CMP_GT_OQ); }
+		static Mask CmpGe(Reg a, Reg b) { return _mm256_cmp_pd(a, b, _CMP_GE_OQ); }
+		static Mask MaskAnd(Mask a, Mask b) { return _mm256_and_pd(a, b); }
+		static Mask MaskOr(Mask a, Mask b) { return _mm256_or_pd(a, b); }
+		static Mask MaskAndNot(Mask a, Mask b) { return _mm256_andnot_pd(b, a); }
+		static Reg Select(Mask m, Reg a, Reg b) { return _mm256_blendv_pd(b, a, m); }
+		static bool Any(Mask m) { return _mm256_movemask_pd(m) != 0; }
+	};
+}
+
+#include"SphereKernel.inl"
+
+namespace Imager
+{
+	namespace PacketKernels
+	{
+		void IntersectSpherePacket_Avx2(const SpherePacketInput& input, const double* maxDistanceSquared, const SpherePacketOutput& output)
+		{
+			IntersectSpherePacketTemplate<Avx2Ops>(input, maxDistanceSquared, output);
+		}
+
+		void IntersectSphereBatch_Avx2(const SphereBatchInput& input, double maxDistanceSquared, const SpherePacketOutput& output)
+		{
+			IntersectSphereBatchTemplate<Avx2Ops>(input, maxDistanceSquared, output);
+		}
+	}
+}
+
+#else
+
+namespace Imager
+{
+	namespace PacketKernels
+	{
+		// Built without AVX2 code generation; fall back to SSE2.
+		void IntersectSpherePacket_Avx2(const SpherePacketInput& input, const double* maxDistanceSquared, const SpherePacketOutput& output)
+		{
+			IntersectSpherePacket_Sse2(input, maxDistanceSquared, output);
+		}
+
+		void IntersectSphereBatch_Avx2(const SphereBatchInput& input, double maxDistanceSquared, const SpherePacketOutput& output)
+		{
+			IntersectSphereBatch_Sse2(input, maxDistanceSquared, output);
+		}
+	}
+}
+
+#endif
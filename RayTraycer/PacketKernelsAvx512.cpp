@@ -0,0 +1,95 @@
+// AVX-512 versions of the packet kernels.
+// Compile this file with AVX-512F enabled (-mavx512f on GCC and Clang;
+// Visual C++ needs no option).  Only call into it when
+// PacketKernels::DetectSimdLevel() reports AVX-512.
+// See PacketKernels.h for why nothing here may include Imager.h.
+
+#include"PacketKernels.h"
+
+#if (defined(_M_X64) || defined(__x86_64__)) && (defined(_MSC_VER) || defined(__AVX512F__))
+#define IMAGER_HAS_AVX512 1
+#include<immintrin.h>
+#endif
+
+#if IMAGER_HAS_AVX512
+
+#if defined(__GNUC__) && !defined(__clang__)
+// AVX-512 brings FMA with it, and GCC would otherwise fuse our multiplies
+// and adds, which rounds differently from the scalar code.
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+namespace
+{
+	struct Avx512Ops
+	{
+		typedef __m512d Reg;
+		typedef __mmask8 Mask;
+		enum { WIDTH = 8 };
+
+		static Reg Load(const double* p) { return _mm512_loadu_pd(p); }
+		static void Store(double* p, Reg a) { _mm512_storeu_pd(p, a); }
+		static Reg Set1(double a) { return _mm512_set1_pd(a); }
+		static Reg Add(Reg a, Reg b) { return _mm512_add_pd(a, b); }
+		static Reg Sub(Reg a, Reg b) { return _mm512_sub_pd(a, b); }
+		static Reg Mul(Reg a, Reg b) { return _mm512_mul_pd(a, b); }
+		static Reg Div(Reg a, Reg b) { return _mm512_div_pd(a, b); }
+		static Reg Sqrt(Reg a) { return _mm512_sqrt_pd(a); }
+		static Reg Abs(Reg a) { return _mm512_abs_pd(a); }
+
+		static Reg Neg(Reg a)
+		{
+			// Floating point xor needs AVX-512DQ; flip the sign bit as an integer instead.
+			const __m512i signBit = _mm512_set1_epi64(static_cast<long long>(0x8000000000000000ULL));
+			return _mm512_castsi512_pd(_mm512_xor_si512(_mm512_castpd_si512(a), signBit));
+		}
+
+		static Mask CmpLt(Reg a, Reg b) { return _mm512_cmp_pd_mask(a, b, _CMP_LT_OQ); }
+		static Mask CmpGt(Reg a, Reg b) { return _mm512_cmp_pd_mask(a, b, _CMP_GT_OQ); }
+		static Mask CmpGe(Reg a, Reg b) { return _mm512_cmp_pd_mask(a, b, _CMP_GE_OQ); }
+		static Mask MaskAnd(Mask a, Mask b) { return static_cast<Mask>(a & b); }
+		static Mask MaskOr(Mask a, Mask b) { return static_cast<Mask>(a | b); }
+		static Mask MaskAndNot(Mask a, Mask b) { return static_cast<Mask>(a & ~b); }
+		static Reg Select(Mask m, Reg a, Reg b) { return _mm512_mask_blend_pd(m, b, a); }
+		static bool Any(Mask m) { return m != 0; }
+	};
+}
+
+#include"SphereKernel.inl"
+
+namespace Imager
+{
+	namespace PacketKernels
+	{
+		void IntersectSpherePacket_Avx512(const SpherePacketInput& input, const double* maxDistanceSquared, const SpherePacketOutput& output)
+		{
+			IntersectSpherePacketTemplate<Avx512Ops>(input, maxDistanceSquared, output);
+		}
+
+		void IntersectSphereBatch_Avx512(const SphereBatchInput& input, double maxDistanceSquared, const SpherePacketOutput& output)
+		{
+			IntersectSphereBatchTemplate<Avx512Ops>(input, maxDistanceSquared, output);
+		}
+	}
+}
+
+#else
+
+namespace Imager
+{
+	namespace PacketKernels
+	{
+		// Built without AVX-512 code generation; fall back to AVX2.
+		void IntersectSpherePacket_Avx512(const SpherePacketInput& input, const double* maxDistanceSquared, const SpherePacketOutput& output)
+		{
+			IntersectSpherePacket_Avx2(input, maxDistanceSquared, output);
+		}
+
+		void IntersectSphereBatch_Avx512(const SphereBatchInput& input, double maxDistanceSquared, const SpherePacketOutput& output)
+		{
+			IntersectSphereBatch_Avx2(input, maxDistanceSquared, output);
+		}
+	}
+}
+
+#endif
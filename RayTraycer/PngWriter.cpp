@@ -0,0 +1,211 @@
+#include"Imager.h"
+
+namespace Imager
+{
+	namespace
+	{
+		// A stored deflate block holds at most this many bytes.
+		const size_t MAX_STORED_BLOCK = 65535;
+
+		const unsigned int ADLER_MODULUS = 65521;
+
+		// The most bytes Adler-32's sums can take in before they
+		// must be reduced to avoid overflowing 32 bits.
+		const size_t ADLER_MAX_RUN = 5552;
+
+		unsigned int Crc32(const unsigned char* data, size_t length, unsigned int crc)
+		{
+			static const struct CrcTable
+			{
+				unsigned int entry[256];
+
+				CrcTable()
+				{
+					for (unsigned int n = 0; n < 256; ++n)
+					{
+						unsigned int c=n;
+						for (int k = 0; k < 8; ++k)
+						{
+							c=(c & 1) ? (0xedb88320u ^ (c >> 1)) : (c >> 1);
+						}
+						entry[n]=c;
+					}
+				}
+			} table;
+
+			for (size_t i = 0; i < length; ++i)
+			{
+				crc=table.entry[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+			}
+			return crc;
+		}
+
+		void AppendBigEndian(std::vector<unsigned char>& data, unsigned int value)
+		{
+			data.push_back(static_cast<unsigned char>(value >> 24));
+			data.push_back(static_cast<unsigned char>(value >> 16));
+			data.push_back(static_cast<unsigned char>(value >> 8));
+			data.push_back(static_cast<unsigned char>(value));
+		}
+	}
+
+	PngWriter::PngWriter(const char * fileName, size_t _pixelsWide, size_t _pixelsHigh)
+		:output(fileName,std::ios::out | std::ios::binary | std::ios::trunc)
+	{
+		pixelsWide=_pixelsWide;
+		pixelsHigh=_pixelsHigh;
+		rowsWritten=0;
+		isFinished=false;
+		hasWrittenZlibHeader=false;
+		adlerA=1;
+		adlerB=0;
+
+		if ((pixelsWide == 0) || (pixelsHigh == 0) || (pixelsWide > 0x7fffffff) || (pixelsHigh > 0x7fffffff))
+		{
+			throw ImageException("Invalid PNG image size.");
+		}
+		if (!output)
+		{
+			throw ImageException("Cannot open PNG output file.");
+		}
+
+		static const unsigned char signature[8]={0x89,'P','N','G','\r','\n',0x1a,'\n'};
+		output.write(reinterpret_cast<const char*>(signature),sizeof(signature));
+
+		std::vector<unsigned char> header;
+		AppendBigEndian(header,static_cast<unsigned int>(pixelsWide));
+		AppendBigEndian(header,static_cast<unsigned int>(pixelsHigh));
+		header.push_back(8);    // bits per channel
+		header.push_back(2);    // color type: RGB
+		header.push_back(0);    // compression method: deflate
+		header.push_back(0);    // filter method: adaptive
+		header.push_back(0);    // no interlacing
+		WriteChunk("IHDR",header);
+
+		pendingData.reserve(MAX_STORED_BLOCK);
+	}
+
+	PngWriter::~PngWriter()
+	{
+	}
+
+	void PngWriter::WriteRow(const unsigned char * rgb)
+	{
+		if (isFinished || (rowsWritten == pixelsHigh))
+		{
+			throw ImageException("Too many rows written to PNG file.");
+		}
+
+		// Each row starts with its filter type; 0 means no filter.
+		const unsigned char filterType=0;
+		AppendImageData(&filterType,1);
+		AppendImageData(rgb,3*pixelsWide);
+		++rowsWritten;
+	}
+
+	void PngWriter::Finish()
+	{
+		if (rowsWritten != pixelsHigh)
+		{
+			throw ImageException("PNG file finished before all rows were written.");
+		}
+		if (!isFinished)
+		{
+			FlushBlock(true);
+			WriteChunk("IEND",std::vector<unsigned char>());
+			output.flush();
+			isFinished=true;
+			if (!output)
+			{
+				throw ImageException("Error writing PNG output file.");
+			}
+		}
+	}
+
+	void PngWriter::AppendImageData(const unsigned char * data, size_t length)
+	{
+		for (size_t first = 0; first < length; first += ADLER_MAX_RUN)
+		{
+			const size_t last=(first+ADLER_MAX_RUN < length)?(first+ADLER_MAX_RUN):length;
+			for (size_t i = first; i < last; ++i)
+			{
+				adlerA+=data[i];
+				adlerB+=adlerA;
+			}
+			adlerA%=ADLER_MODULUS;
+			adlerB%=ADLER_MODULUS;
+		}
+
+		while (length > 0)
+		{
+			if (pendingData.size() == MAX_STORED_BLOCK)
+			{
+				// We cannot tell yet whether this is the last block;
+				// Finish always writes one more, possibly empty, final block.
+				FlushBlock(false);
+			}
+			const size_t room=MAX_STORED_BLOCK-pendingData.size();
+			const size_t count=(length < room)?length:room;
+			pendingData.insert(pendingData.end(),data,data+count);
+			data+=count;
+			length-=count;
+		}
+	}
+
+	void PngWriter::FlushBlock(bool isFinal)
+	{
+		// One IDAT chunk per stored block: the zlib header before the
+		// first block, then a 5-byte block header and the raw bytes,
+		// and the Adler-32 checksum after the final block.
+		std::vector<unsigned char> chunk;
+		chunk.reserve(pendingData.size()+11);
+		if (!hasWrittenZlibHeader)
+		{
+			chunk.push_back(0x78);  // deflate, 32K window
+			chunk.push_back(0x01);  // no preset dictionary, fastest compression
+			hasWrittenZlibHeader=true;
+		}
+
+		const unsigned int length=static_cast<unsigned int>(pendingData.size());
+		chunk.push_back(isFinal ? 1 : 0);
+		chunk.push_back(static_cast<unsigned char>(length));
+		chunk.push_back(static_cast<unsigned char>(length >> 8));
+		chunk.push_back(static_cast<unsigned char>(~length));
+		chunk.push_back(static_cast<unsigned char>(~length >> 8));
+		chunk.insert(chunk.end(),pendingData.begin(),pendingData.end());
+		pendingData.clear();
+
+		if (isFinal)
+		{
+			AppendBigEndian(chunk,(adlerB << 16) | adlerA);
+		}
+		WriteChunk("IDAT",chunk);
+	}
+
+	void PngWriter::WriteChunk(const char * type, const std::vector<unsigned char>& data)
+	{
+		std::vector<unsigned char> header;
+		AppendBigEndian(header,static_cast<unsigned int>(data.size()));
+		header.insert(header.end(),type,type+4);
+		output.write(reinterpret_cast<const char*>(&header[0]),header.size());
+		if (!data.empty())
+		{
+			output.write(reinterpret_cast<const char*>(&data[0]),data.size());
+		}
+
+		// The CRC covers the chunk type and data, not the length.
+		unsigned int crc=Crc32(reinterpret_cast<const unsigned char*>(type),4,0xffffffffu);
+		if (!data.empty())
+		{
+			crc=Crc32(&data[0],data.size(),crc);
+		}
+		std::vector<unsigned char> trailer;
+		AppendBigEndian(trailer,crc ^ 0xffffffffu);
+		output.write(reinterpret_cast<const char*>(&trailer[0]),trailer.size());
+
+		if (!output)
+		{
+			throw ImageException("Error writing PNG output file.");
+		}
+	}
+}
@@ -0,0 +1,68 @@
+#include"Imager.h"
+
+namespace Imager
+{
+	RenderStatistics::RenderStatistics()
+	{
+		cameraRays=0;
+		reflectionRays=0;
+		refractionRays=0;
+		shadowRays=0;
+		for (int depth = 0; depth <= MAX_DEPTH; ++depth)
+		{
+			raysAtDepth[depth]=0;
+		}
+		intersectionTests=0;
+		shadowTests=0;
+		shadowCacheHits=0;
+		shadowsBlocked=0;
+		containmentTests=0;
+		ambiguousPixels=0;
+		totalInternalReflections=0;
+	}
+
+	void RenderStatistics::Add(const RenderStatistics & other)
+	{
+		cameraRays+=other.cameraRays;
+		reflectionRays+=other.reflectionRays;
+		refractionRays+=other.refractionRays;
+		shadowRays+=other.shadowRays;
+		for (int depth = 0; depth <= MAX_DEPTH; ++depth)
+		{
+			raysAtDepth[depth]+=other.raysAtDepth[depth];
+		}
+		intersectionTests+=other.intersectionTests;
+		shadowTests+=other.shadowTests;
+		shadowCacheHits+=other.shadowCacheHits;
+		shadowsBlocked+=other.shadowsBlocked;
+		containmentTests+=other.containmentTests;
+		ambiguousPixels+=other.ambiguousPixels;
+		totalInternalReflections+=other.totalInternalReflections;
+	}
+
+	void RenderStatistics::Print(std::ostream & output) const
+	{
+		const size_t rays=cameraRays+reflectionRays+refractionRays;
+		const double perRay=(rays > 0)?(1.0/rays):0.0;
+		const double perShadowRay=(shadowRays > 0)?(1.0/shadowRays):0.0;
+
+		output << "camera rays                 " << cameraRays << "\n";
+		output << "reflection rays             " << reflectionRays << "\n";
+		output << "refraction rays             " << refractionRays << "\n";
+		output << "shadow rays                 " << shadowRays << "\n";
+		for (int depth = 0; depth <= MAX_DEPTH; ++depth)
+		{
+			if (raysAtDepth[depth] > 0)
+			{
+				output << "  rays at depth " << depth << ((depth < 10)?"            ":"           ") << raysAtDepth[depth] << "\n";
+			}
+		}
+		output << "intersection tests          " << intersectionTests << " (" << perRay*intersectionTests << " per ray)\n";
+		output << "shadow tests                " << shadowTests << " (" << perShadowRay*shadowTests << " per shadow ray)\n";
+		output << "shadow cache hits           " << shadowCacheHits << "\n";
+		output << "shadows blocked             " << shadowsBlocked << "\n";
+		output << "containment tests           " << containmentTests << "\n";
+		output << "ambiguous pixels            " << ambiguousPixels << "\n";
+		output << "total internal reflections  " << totalInternalReflections << "\n";
+	}
+}
@@ -1,5 +1,10 @@
 #include"Imager.h"
+#include"Algebra.h"
 #include<cmath>
+#include<cstdio>
+#include<cstring>
+#include<algorithm>
+#include<chrono>
 
 namespace Imager
 {
@@ -7,7 +12,20 @@ namespace Imager
 	{
 		backgroundColor=_backgroundColor;
 		ambientRefraction=REFRACTION_VACUUM;
-		activeDebugPoint=NULL;
+		threadCount=0;
+		packetSize=RayPacket::MAX_SIZE;
+		streamingBandHeight=0;
+		maxColorValue=0.0;
+		adaptiveThreshold=0.0;
+		isWavefront=false;
+		ambiguityPolicy=AMBIGUITY_AVERAGE_NEIGHBORS;
+		isLightCulling=false;
+		lightSampleCount=0;
+		isLightHierarchyStale=true;
+		cameraRayCount=0;
+		secondaryRayCount=0;
+		shadowRayCount=0;
+		isHierarchyStale=true;
 	}
 
 	Scene::~Scene()
@@ -25,231 +43,2513 @@ namespace Imager
 			(color.blue >= MIN_OPTICAL_INTENSITY);
 	}
 
+	inline double LargestComponent(const Color& color)
+	{
+		return std::max(color.red,std::max(color.green,color.blue));
+	}
+
+	// Adds the light a source with a clear line of sight
+	// to the intersection's point shines on it, times scale
+	// (see Scene::LightChoice).
+	inline void AddDiffuseLight(const Intersection& intersection, const LightSource& source, double scale, Color& colorSum)
+	{
+		Vector3 direction=source.location-intersection.point;
+
+		const double incidence = DotProduct(
+			intersection.surfaceNormal,direction);
+
+		if (incidence > 0.0) {
+			const double intensity=scale*(incidence/direction.MagnetitudeSquared());
+			colorSum+=intensity*source.color;
+		}
+	}
+
+	// Raises max to the color's largest component, after checking,
+	// as ImageBuffer::MaxColorValue does, that none is negative.
+	inline void AccumulateMaxColorValue(const Color& color, double& max)
+	{
+		color.Validate();
+		if (color.red > max) max=color.red;
+		if (color.green > max) max=color.green;
+		if (color.blue > max) max=color.blue;
+	}
+
+	// The largest of the maxima found by several threads, or 1
+	// if everything is black, as ImageBuffer::MaxColorValue returns.
+	inline double CombineMaxColorValues(const std::vector<double>& maxList)
+	{
+		double max=0.0;
+		for (size_t k = 0; k < maxList.size(); ++k)
+		{
+			if (maxList[k] > max)
+			{
+				max=maxList[k];
+			}
+		}
+		return (max > 0.0)?max:1.0;
+	}
+
+	// The color RenderProgressive shows for the sample at (i,j) of the
+	// grid of spacing.  Until ambiguous samples are resolved, an ambiguous
+	// one takes the average of its neighbors on the grid that are not,
+	// as ResolveAmbiguousPixel does for the finished image.
+	inline Color ProgressiveSampleColor(const ImageBuffer& buffer, size_t i, size_t j, size_t spacing, bool isResolved)
+	{
+		if (isResolved || !buffer.IsAmbiguous(i,j))
+		{
+			return buffer.UncheckedPixel(i,j).color;
+		}
+
+		Color sum(0.0,0.0,0.0);
+		int numFound=0;
+		const size_t iFirst=(i >= spacing)?(i-spacing):i;
+		const size_t jFirst=(j >= spacing)?(j-spacing):j;
+		const size_t iLast=(i+spacing < buffer.GetPixelsWide())?(i+spacing):i;
+		const size_t jLast=(j+spacing < buffer.GetPixelHigh())?(j+spacing):j;
+		for (size_t si = iFirst; si <= iLast; si += spacing)
+		{
+			for (size_t sj = jFirst; sj <= jLast; sj += spacing)
+			{
+				if (!buffer.IsAmbiguous(si,sj))
+				{
+					sum+=buffer.UncheckedPixel(si,sj).color;
+					++numFound;
+				}
+			}
+		}
+		if (numFound > 0)
+		{
+			sum/=numFound;
+		}
+		return sum;
+	}
+
+	// Light sampling's random numbers come from a generator seeded with
+	// the surface point, so the picks do not depend on which thread
+	// lights the surface, or on what it lit before.
+	inline unsigned long long LightSampleSeed(const Vector3& point)
+	{
+		const double coordinate[3]={point.x, point.y, point.z};
+		unsigned long long seed=0;
+		for (int c = 0; c < 3; ++c)
+		{
+			unsigned long long bits;
+			memcpy(&bits,&coordinate[c],sizeof(bits));
+			seed=(seed ^ bits)*0x100000001b3ull;
+		}
+		return seed;
+	}
+
+	// Returns a number in [0,1) and advances state (splitmix64).
+	inline double NextLightSample(unsigned long long& state)
+	{
+		unsigned long long z=(state+=0x9e3779b97f4a7c15ull);
+		z=(z ^ (z >> 30))*0xbf58476d1ce4e5b9ull;
+		z=(z ^ (z >> 27))*0x94d049bb133111ebull;
+		z=z ^ (z >> 31);
+		return (z >> 11)*(1.0/9007199254740992.0);
+	}
+
 	void Scene::AddLightSource(const LightSource & lightSource)
 	{
-		lightSourceList.push_back(lightSource);
+		lightSourceList.push_back(lightSource);
+		isLightHierarchyStale=true;
+	}
+
+
+	SolidObject & Scene::AddSolidObject(SolidObject * solidObject)
+	{
+		solidObjectList.push_back(solidObject);
+		isHierarchyStale=true;
+		return *solidObject;
+	}
+
+
+	void Scene::SaveImage(const char * outPngFileName, size_t pixelWide, size_t pixelHigh, double zoom, size_t antiAliasFactor) const
+	{
+		if ((pixelWide == 0) || (pixelHigh == 0) || (antiAliasFactor == 0))
+		{
+			throw ImageException("Image size and anti-alias factor must be positive.");
+		}
+
+		const size_t largePixelWide=antiAliasFactor*pixelWide;
+		const size_t largePixelHigh=antiAliasFactor*pixelHigh;
+		const size_t smallerDim= ((pixelWide<pixelHigh)?pixelWide:pixelHigh);
+
+		const double largeZoom=antiAliasFactor*zoom*smallerDim;
+
+		PrepareAccelerationStructure();
+		PrepareMaterials();
+
+		ThreadPool pool(threadCount);
+		std::vector<ThreadContext> contextList(pool.GetThreadCount());
+		for (size_t w = 0; w < contextList.size(); ++w)
+		{
+			contextList[w].shadowCache.assign(lightSourceList.size(),NULL);
+		}
+
+		// Each band is a whole number of final rows.  The buffer also holds
+		// one supersampled row above and below the band, so ambiguous pixels
+		// on its edges are resolved from the same neighbors as they would
+		// be with the whole image in memory.
+		const bool isStreaming=(streamingBandHeight > 0) && (streamingBandHeight < pixelHigh);
+		const size_t largeBandHigh=antiAliasFactor*(isStreaming?streamingBandHeight:pixelHigh);
+		ImageBuffer buffer(largePixelWide,largePixelHigh,largeBandHigh+2,backgroundColor);
+
+		// Adaptive anti-aliasing decides which pixels to supersample from
+		// one sample per final pixel.  Deciding for a band's rows takes the
+		// coarse samples of the row above the band and of two rows below it,
+		// because the band's lower halo row belongs to the next final row.
+		const bool isAdaptive=(adaptiveThreshold > 0.0) && (antiAliasFactor > 1);
+		const size_t coarseBandHigh=isAdaptive?(largeBandHigh/antiAliasFactor+3):0;
+		ImageBuffer coarseBuffer(pixelWide,pixelHigh,coarseBandHigh,backgroundColor);
+		size_t coarseRenderedEnd=0;
+
+		double imageMaxColorValue=maxColorValue;
+		if ((imageMaxColorValue <= 0.0) && isStreaming)
+		{
+			imageMaxColorValue=EstimateMaxColorValue(pool,contextList,largePixelWide,largePixelHigh,largeZoom,antiAliasFactor);
+		}
+
+		PngWriter writer(outPngFileName,pixelWide,pixelHigh);
+
+#if IMAGER_STATISTICS
+		std::vector<unsigned int> costList;
+		if (!costHeatmapFileName.empty())
+		{
+			costList.assign(pixelWide*pixelHigh,0);
+		}
+#endif
+
+		PixelList ambiguousPixelList;
+		std::vector<Color> averageList;
+		size_t renderedEnd=0;
+		for (size_t bandBegin = 0; bandBegin < largePixelHigh; bandBegin += largeBandHigh)
+		{
+			const size_t bandEnd=(bandBegin+largeBandHigh<largePixelHigh)?(bandBegin+largeBandHigh):largePixelHigh;
+
+			// Without streaming, the band is the whole image,
+			// so its brightest pixel is the image's.
+			const double bandMaxColorValue=RenderBand(
+				pool,
+				contextList,
+				buffer,
+				coarseBuffer,
+				largeZoom,
+				antiAliasFactor,
+				bandBegin,
+				bandEnd,
+				renderedEnd,
+				coarseRenderedEnd,
+				ambiguousPixelList,
+				averageList);
+			WriteRows(pool,averageList,pixelWide,(imageMaxColorValue > 0.0)?imageMaxColorValue:bandMaxColorValue,writer);
+#if IMAGER_STATISTICS
+			if (!costList.empty())
+			{
+				AccumulateCost(buffer,bandBegin,bandEnd,antiAliasFactor,costList);
+			}
+#endif
+		}
+
+		writer.Finish();
+
+		CollectCounts(contextList);
+
+#if IMAGER_STATISTICS
+		if (!costList.empty())
+		{
+			SaveCostHeatmap(costList,pixelWide,pixelHigh);
+		}
+#endif
+	}
+
+	void Scene::RenderAnimation(
+		const char * fileNamePrefix,
+		size_t frameCount,
+		size_t pixelWide,
+		size_t pixelHigh,
+		double zoom,
+		size_t antiAliasFactor,
+		const FrameUpdate & update)
+	{
+		if ((pixelWide == 0) || (pixelHigh == 0) || (antiAliasFactor == 0))
+		{
+			throw ImageException("Image size and anti-alias factor must be positive.");
+		}
+
+		const size_t largePixelWide=antiAliasFactor*pixelWide;
+		const size_t largePixelHigh=antiAliasFactor*pixelHigh;
+		const size_t smallerDim= ((pixelWide<pixelHigh)?pixelWide:pixelHigh);
+
+		const double largeZoom=antiAliasFactor*zoom*smallerDim;
+
+		// Everything a frame needs but the scene itself is made once.
+		// Each frame is one band the size of the whole image.
+		ThreadPool pool(threadCount);
+		std::vector<ThreadContext> contextList(pool.GetThreadCount());
+		ImageBuffer buffer(largePixelWide,largePixelHigh,backgroundColor);
+		const bool isAdaptive=(adaptiveThreshold > 0.0) && (antiAliasFactor > 1);
+		ImageBuffer coarseBuffer(pixelWide,pixelHigh,isAdaptive?pixelHigh:0,backgroundColor);
+		std::vector<Color> averageList;
+
+		// One thread writes each frame while the pool traces the next.
+		FrameEncoder encoder([this,pixelWide](const std::string& fileName, const std::vector<Color>& frameList, double frameMaxColorValue)
+		{
+			WriteImageFile(fileName.c_str(),frameList,pixelWide,frameMaxColorValue);
+		});
+
+		for (size_t frame = 0; frame < frameCount; ++frame)
+		{
+			update(frame);
+			RefitAccelerationStructure();
+			PrepareAccelerationStructure();
+			PrepareMaterials();
+
+			// Lights may have been added, and counts are per frame.
+			for (size_t w = 0; w < contextList.size(); ++w)
+			{
+				ThreadContext& context=contextList[w];
+				context.shadowCache.assign(lightSourceList.size(),NULL);
+				context.cameraRayCount=0;
+				context.secondaryRayCount=0;
+				context.shadowRayCount=0;
+				context.statistics=RenderStatistics();
+			}
+
+			buffer.Reset();
+			coarseBuffer.Reset();
+			size_t renderedEnd=0;
+			size_t coarseRenderedEnd=0;
+			PixelList ambiguousPixelList;
+			const double frameMaxColorValue=RenderBand(
+				pool,
+				contextList,
+				buffer,
+				coarseBuffer,
+				largeZoom,
+				antiAliasFactor,
+				0,
+				largePixelHigh,
+				renderedEnd,
+				coarseRenderedEnd,
+				ambiguousPixelList,
+				averageList);
+			CollectCounts(contextList);
+
+			char frameNumber[32];
+			snprintf(frameNumber,sizeof(frameNumber),"%04lu",static_cast<unsigned long>(frame));
+			const std::string fileName=std::string(fileNamePrefix)+frameNumber+".png";
+			const double imageMaxColorValue=(maxColorValue > 0.0)?maxColorValue:frameMaxColorValue;
+
+			// Gives back an earlier frame's list for the next frame.
+			encoder.Submit(fileName,averageList,imageMaxColorValue);
+		}
+		encoder.Finish();
+	}
+
+	bool Scene::RenderProgressive(
+		size_t pixelWide,
+		size_t pixelHigh,
+		double zoom,
+		size_t antiAliasFactor,
+		const ProgressCallback & callback,
+		double timeLimitSeconds) const
+	{
+		if ((pixelWide == 0) || (pixelHigh == 0) || (antiAliasFactor == 0))
+		{
+			throw ImageException("Image size and anti-alias factor must be positive.");
+		}
+
+		const std::chrono::steady_clock::time_point start=std::chrono::steady_clock::now();
+
+		// The same supersampled pixels and rays as SaveImage.
+		const size_t largePixelWide=antiAliasFactor*pixelWide;
+		const size_t largePixelHigh=antiAliasFactor*pixelHigh;
+		const size_t smallerDim= ((pixelWide<pixelHigh)?pixelWide:pixelHigh);
+
+		const double largeZoom=antiAliasFactor*zoom*smallerDim;
+
+		PrepareAccelerationStructure();
+		PrepareMaterials();
+
+		ThreadPool pool(threadCount);
+		std::vector<ThreadContext> contextList(pool.GetThreadCount());
+		for (size_t w = 0; w < contextList.size(); ++w)
+		{
+			contextList[w].shadowCache.assign(lightSourceList.size(),NULL);
+		}
+
+		ImageBuffer image(pixelWide,pixelHigh,backgroundColor);
+
+		RenderProgress progress;
+		progress.pass=0;
+		progress.sampleCount=largePixelWide*largePixelHigh;
+		progress.isComplete=false;
+
+		// Reports a finished pass; false means stop.
+		auto report=[&](const ImageBuffer& samples, size_t bufferSpacing, size_t spacing)
+		{
+			// Samples not traced yet are black, so the brightest traced
+			// sample is also the brightest pixel in the buffer.
+			const double sampleMaxColorValue=UpdateProgressiveImage(pool,samples,bufferSpacing,antiAliasFactor,spacing,progress.isComplete,image);
+			CollectCounts(contextList);
+
+			progress.sampleSpacing=spacing;
+			progress.samplesTraced=((largePixelWide+spacing-1)/spacing)*((largePixelHigh+spacing-1)/spacing);
+			progress.maxColorValue=(maxColorValue > 0.0)?maxColorValue:sampleMaxColorValue;
+			progress.elapsedSeconds=std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+
+			if (!callback(image,progress))
+			{
+				return false;
+			}
+			return (timeLimitSeconds <= 0.0) ||
+				(std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count() < timeLimitSeconds);
+		};
+
+		// The first pass needs only its own samples, and the supersampled
+		// buffer takes a while to allocate, so it waits for the first preview.
+		PixelList ambiguousPixelList;
+		size_t spacing=PROGRESSIVE_START_SPACING*antiAliasFactor;
+		ImageBuffer gridBuffer((largePixelWide+spacing-1)/spacing,(largePixelHigh+spacing-1)/spacing,backgroundColor);
+		RenderProgressiveGrid(pool,contextList,gridBuffer,largePixelWide,largePixelHigh,largeZoom,spacing,ambiguousPixelList);
+		if (!report(gridBuffer,spacing,spacing))
+		{
+			return false;
+		}
+
+		// Every supersampled pixel is traced exactly once, by the first
+		// pass whose grid it is on, so nothing in the buffer is redone.
+		ImageBuffer buffer(largePixelWide,largePixelHigh,backgroundColor);
+		for (size_t j = 0; j < gridBuffer.GetPixelHigh(); ++j)
+		{
+			for (size_t i = 0; i < gridBuffer.GetPixelsWide(); ++i)
+			{
+				buffer.UncheckedPixel(i*spacing,j*spacing)=gridBuffer.UncheckedPixel(i,j);
+				if (gridBuffer.IsAmbiguous(i,j))
+				{
+					buffer.SetAmbiguous(i*spacing,j*spacing);
+				}
+			}
+		}
+
+		while (!progress.isComplete)
+		{
+			// Halving an odd spacing would leave samples off every grid.
+			const size_t previousSpacing=spacing;
+			spacing=((spacing%2) == 0)?(spacing/2):1;
+			++progress.pass;
+
+			RenderProgressivePass(pool,contextList,buffer,largeZoom,spacing,previousSpacing,ambiguousPixelList);
+
+			progress.isComplete=(spacing == 1);
+			if (progress.isComplete)
+			{
+				ResolveAmbiguousPixels(pool,buffer,ambiguousPixelList);
+			}
+			if (!report(buffer,1,spacing) && !progress.isComplete)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void Scene::RenderProgressiveGrid(
+		ThreadPool & pool,
+		std::vector<ThreadContext>& contextList,
+		ImageBuffer & gridBuffer,
+		size_t largePixelWide,
+		size_t largePixelHigh,
+		double largeZoom,
+		size_t spacing,
+		PixelList & ambiguousPixelList) const
+	{
+		const size_t gridWide=gridBuffer.GetPixelsWide();
+		const size_t numRows=gridBuffer.GetPixelHigh();
+		std::vector<PixelList> rowAmbiguousPixelList(numRows);
+
+		// The samples are too far apart to fill packets or waves.
+		pool.ParallelFor(numRows, [&](size_t row, size_t workerIndex)
+		{
+			ThreadContext& context=contextList[workerIndex];
+			const Vector3 camera(0.0,0.0,0.0);
+			const size_t j=row*spacing;
+			for (size_t column = 0; column < gridWide; ++column)
+			{
+				// Same rays as RenderTile.
+				const size_t i=column*spacing;
+				const Vector3 direction(
+					(i-largePixelWide/2.0)/largeZoom,
+					(largePixelHigh/2.0-j)/largeZoom,
+					-1.0);
+
+				IMAGER_STATISTIC(const size_t testCount=context.statistics.TestCount();)
+
+				Intersection intersection;
+				const int numClosest=FindClosestIntersectionPoint(context,camera,direction,intersection);
+				if (!RenderPixel(context,gridBuffer.UncheckedPixel(column,row),i,j,numClosest,intersection,direction,rowAmbiguousPixelList[row]))
+				{
+					gridBuffer.SetAmbiguous(column,row);
+				}
+
+				IMAGER_STATISTIC(gridBuffer.UncheckedPixel(column,row).cost=static_cast<unsigned int>(context.statistics.TestCount()-testCount);)
+			}
+		});
+
+		for (size_t r = 0; r < numRows; ++r)
+		{
+			ambiguousPixelList.insert(
+				ambiguousPixelList.end(),
+				rowAmbiguousPixelList[r].begin(),
+				rowAmbiguousPixelList[r].end());
+		}
+	}
+
+	void Scene::RenderProgressivePass(
+		ThreadPool & pool,
+		std::vector<ThreadContext>& contextList,
+		ImageBuffer & buffer,
+		double largeZoom,
+		size_t spacing,
+		size_t previousSpacing,
+		PixelList & ambiguousPixelList) const
+	{
+		const size_t largePixelWide=buffer.GetPixelsWide();
+		const size_t largePixelHigh=buffer.GetPixelHigh();
+
+		if (spacing > 1)
+		{
+			// The samples are too far apart to fill packets or waves.
+			const size_t numRows=(largePixelHigh+spacing-1)/spacing;
+			std::vector<PixelList> rowAmbiguousPixelList(numRows);
+
+			pool.ParallelFor(numRows, [&](size_t row, size_t workerIndex)
+			{
+				const size_t j=row*spacing;
+				const bool isTracedRow=((j%previousSpacing) == 0);
+				for (size_t i = 0; i < largePixelWide; i += spacing)
+				{
+					if (!isTracedRow || ((i%previousSpacing) != 0))
+					{
+						RenderTile(contextList[workerIndex],buffer,largeZoom,i,i+1,j,j+1,rowAmbiguousPixelList[row]);
+					}
+				}
+			});
+
+			for (size_t r = 0; r < numRows; ++r)
+			{
+				ambiguousPixelList.insert(
+					ambiguousPixelList.end(),
+					rowAmbiguousPixelList[r].begin(),
+					rowAmbiguousPixelList[r].end());
+			}
+			return;
+		}
+
+		// The last pass traces everything else: the runs between the
+		// previous grid's samples on its rows, and all the rows between
+		// its rows, a band of them and a tile's width at a time.
+		const size_t bandHigh=previousSpacing;
+		const size_t tilesWide=(largePixelWide+RENDER_TILE_SIZE-1)/RENDER_TILE_SIZE;
+		const size_t numBands=(largePixelHigh+bandHigh-1)/bandHigh;
+		const size_t numTasks=tilesWide*numBands;
+
+		std::vector<PixelList> taskAmbiguousPixelList(numTasks);
+
+		pool.ParallelFor(numTasks, [&](size_t taskIndex, size_t workerIndex)
+		{
+			ThreadContext& context=contextList[workerIndex];
+			const size_t iBegin=(taskIndex%tilesWide)*RENDER_TILE_SIZE;
+			const size_t iEnd=(iBegin+RENDER_TILE_SIZE<largePixelWide)?(iBegin+RENDER_TILE_SIZE):largePixelWide;
+			const size_t jBand=(taskIndex/tilesWide)*bandHigh;
+			const size_t jBandEnd=(jBand+bandHigh<largePixelHigh)?(jBand+bandHigh):largePixelHigh;
+
+			size_t i=iBegin;
+			while (i < iEnd)
+			{
+				if ((i%bandHigh) == 0)
+				{
+					++i;
+					continue;
+				}
+				const size_t runEnd=((i/bandHigh+1)*bandHigh<iEnd)?((i/bandHigh+1)*bandHigh):iEnd;
+				RenderBlock(context,buffer,largeZoom,i,runEnd,jBand,jBand+1,taskAmbiguousPixelList[taskIndex]);
+				i=runEnd;
+			}
+
+			if (jBand+1 < jBandEnd)
+			{
+				RenderBlock(context,buffer,largeZoom,iBegin,iEnd,jBand+1,jBandEnd,taskAmbiguousPixelList[taskIndex]);
+			}
+		});
+
+		for (size_t t = 0; t < numTasks; ++t)
+		{
+			ambiguousPixelList.insert(
+				ambiguousPixelList.end(),
+				taskAmbiguousPixelList[t].begin(),
+				taskAmbiguousPixelList[t].end());
+		}
+	}
+
+	double Scene::UpdateProgressiveImage(
+		ThreadPool & pool,
+		const ImageBuffer & buffer,
+		size_t bufferSpacing,
+		size_t antiAliasFactor,
+		size_t spacing,
+		bool isResolved,
+		ImageBuffer & image) const
+	{
+		const size_t pixelWide=image.GetPixelsWide();
+		const size_t gridSpacing=spacing/bufferSpacing;
+		std::vector<double> rowMax(image.GetPixelHigh(),0.0);
+
+		pool.ParallelFor(image.GetPixelHigh(), [&](size_t j, size_t)
+		{
+			double& max=rowMax[j];
+			for (size_t i = 0; i < pixelWide; ++i)
+			{
+				// The traced sample nearest the pixel's first supersampled
+				// pixel, up and to the left; the pixel's first sample itself
+				// once the grid is at least as fine as the pixels.
+				const size_t iSample=(antiAliasFactor*i/spacing)*gridSpacing;
+				const size_t jSample=(antiAliasFactor*j/spacing)*gridSpacing;
+
+				PixelData& pixel=image.UncheckedPixel(i,j);
+				pixel=buffer.UncheckedPixel(iSample,jSample);
+
+				// Same order of sums as AverageRows, so the last image matches it.
+				const size_t step=(spacing < antiAliasFactor)?spacing:antiAliasFactor;
+				Color sum(0.0,0.0,0.0);
+				size_t count=0;
+				for (size_t di = 0; di < antiAliasFactor; di += step)
+				{
+					for (size_t dj = 0; dj < antiAliasFactor; dj += step)
+					{
+						const size_t iGrid=iSample+di/bufferSpacing;
+						const size_t jGrid=jSample+dj/bufferSpacing;
+						AccumulateMaxColorValue(buffer.UncheckedPixel(iGrid,jGrid).color,max);
+						sum+=ProgressiveSampleColor(buffer,iGrid,jGrid,gridSpacing,isResolved);
+						++count;
+					}
+				}
+				sum/=static_cast<double>(count);
+				pixel.color=sum;
+			}
+		});
+
+		return CombineMaxColorValues(rowMax);
+	}
+
+	void Scene::ResolveAmbiguousPixels(ThreadPool & pool, ImageBuffer & buffer, const PixelList & pixelList) const
+	{
+		const size_t pixelsPerTask=256;
+		const size_t numResolveTasks=(pixelList.size()+pixelsPerTask-1)/pixelsPerTask;
+		pool.ParallelFor(numResolveTasks, [&](size_t taskIndex, size_t)
+		{
+			const size_t first=taskIndex*pixelsPerTask;
+			const size_t last=(first+pixelsPerTask < pixelList.size())?(first+pixelsPerTask):pixelList.size();
+			for (size_t p = first; p < last; ++p)
+			{
+				ResolveAmbiguousPixel(buffer,pixelList[p].i,pixelList[p].j);
+			}
+		});
+	}
+
+	void Scene::CollectCounts(const std::vector<ThreadContext>& contextList) const
+	{
+		cameraRayCount=0;
+		secondaryRayCount=0;
+		shadowRayCount=0;
+		for (size_t w = 0; w < contextList.size(); ++w)
+		{
+			cameraRayCount+=contextList[w].cameraRayCount;
+			secondaryRayCount+=contextList[w].secondaryRayCount;
+			shadowRayCount+=contextList[w].shadowRayCount;
+		}
+
+		statistics=RenderStatistics();
+		for (size_t w = 0; w < contextList.size(); ++w)
+		{
+			statistics.Add(contextList[w].statistics);
+		}
+	}
+
+	void Scene::RenderRows(
+		ThreadPool & pool,
+		std::vector<ThreadContext>& contextList,
+		ImageBuffer & buffer,
+		double largeZoom,
+		size_t jBegin,
+		size_t jEnd,
+		PixelList & ambiguousPixelList) const
+	{
+		// Split the rows into tiles and let the thread
+		// pool spread them across the available cores.
+		const size_t largePixelWide=buffer.GetPixelsWide();
+		const size_t tilesWide=(largePixelWide+RENDER_TILE_SIZE-1)/RENDER_TILE_SIZE;
+		const size_t tilesHigh=(jEnd-jBegin+RENDER_TILE_SIZE-1)/RENDER_TILE_SIZE;
+		const size_t numTiles=tilesWide*tilesHigh;
+
+		std::vector<PixelList> tileAmbiguousPixelList(numTiles);
+
+		pool.ParallelFor(numTiles, [&](size_t tileIndex, size_t workerIndex)
+		{
+			const size_t iBegin=(tileIndex%tilesWide)*RENDER_TILE_SIZE;
+			const size_t jTileBegin=jBegin+(tileIndex/tilesWide)*RENDER_TILE_SIZE;
+			const size_t iEnd=(iBegin+RENDER_TILE_SIZE<largePixelWide)?(iBegin+RENDER_TILE_SIZE):largePixelWide;
+			const size_t jTileEnd=(jTileBegin+RENDER_TILE_SIZE<jEnd)?(jTileBegin+RENDER_TILE_SIZE):jEnd;
+
+			RenderBlock(
+				contextList[workerIndex],
+				buffer,
+				largeZoom,
+				iBegin,
+				iEnd,
+				jTileBegin,
+				jTileEnd,
+				tileAmbiguousPixelList[tileIndex]);
+		});
+
+		for (size_t t = 0; t < numTiles; ++t)
+		{
+			ambiguousPixelList.insert(
+				ambiguousPixelList.end(),
+				tileAmbiguousPixelList[t].begin(),
+				tileAmbiguousPixelList[t].end());
+		}
+	}
+
+	void Scene::RenderAdaptiveRows(
+		ThreadPool & pool,
+		std::vector<ThreadContext>& contextList,
+		const ImageBuffer & coarseBuffer,
+		ImageBuffer & buffer,
+		double largeZoom,
+		size_t antiAliasFactor,
+		size_t jBegin,
+		size_t jEnd,
+		PixelList & ambiguousPixelList) const
+	{
+		const size_t pixelWide=coarseBuffer.GetPixelsWide();
+		const size_t rowBegin=jBegin/antiAliasFactor;
+		const size_t rowEnd=(jEnd+antiAliasFactor-1)/antiAliasFactor;
+		const size_t numRows=(rowEnd > rowBegin)?(rowEnd-rowBegin):0;
+
+		std::vector<PixelList> rowAmbiguousPixelList(numRows);
+
+		pool.ParallelFor(numRows, [&](size_t row, size_t workerIndex)
+		{
+			// Only the part of the final row inside [jBegin,jEnd) is rendered.
+			const size_t pixelRow=rowBegin+row;
+			const size_t jRowBegin=(antiAliasFactor*pixelRow > jBegin)?(antiAliasFactor*pixelRow):jBegin;
+			const size_t jRowEnd=(antiAliasFactor*(pixelRow+1) < jEnd)?(antiAliasFactor*(pixelRow+1)):jEnd;
+
+			size_t i=0;
+			while (i < pixelWide)
+			{
+				if (!NeedsRefinement(coarseBuffer,i,pixelRow))
+				{
+					// Never ambiguous, or it would need refinement.
+					const PixelData& sample=coarseBuffer.UncheckedPixel(i,pixelRow);
+					for (size_t j = jRowBegin; j < jRowEnd; ++j)
+					{
+						for (size_t di = 0; di < antiAliasFactor; ++di)
+						{
+							buffer.UncheckedPixel(antiAliasFactor*i+di,j)=sample;
+							// The coarse ray was traced once, so count it once.
+							IMAGER_STATISTIC(if ((di > 0) || (j > antiAliasFactor*pixelRow)) buffer.UncheckedPixel(antiAliasFactor*i+di,j).cost=0;)
+						}
+					}
+					++i;
+					continue;
+				}
+
+				// Trace runs of neighboring refined pixels together,
+				// so packets are filled as they are with uniform sampling.
+				size_t iEnd=i+1;
+				while ((iEnd < pixelWide) && NeedsRefinement(coarseBuffer,iEnd,pixelRow))
+				{
+					++iEnd;
+				}
+
+				RenderBlock(
+					contextList[workerIndex],
+					buffer,
+					largeZoom,
+					antiAliasFactor*i,
+					antiAliasFactor*iEnd,
+					jRowBegin,
+					jRowEnd,
+					rowAmbiguousPixelList[row]);
+
+#if IMAGER_STATISTICS
+				// Refined pixels also paid for their coarse ray.
+				if (jRowBegin == antiAliasFactor*pixelRow)
+				{
+					for (size_t r = i; r < iEnd; ++r)
+					{
+						buffer.UncheckedPixel(antiAliasFactor*r,jRowBegin).cost+=coarseBuffer.UncheckedPixel(r,pixelRow).cost;
+					}
+				}
+#endif
+				i=iEnd;
+			}
+		});
+
+		for (size_t r = 0; r < numRows; ++r)
+		{
+			ambiguousPixelList.insert(
+				ambiguousPixelList.end(),
+				rowAmbiguousPixelList[r].begin(),
+				rowAmbiguousPixelList[r].end());
+		}
+	}
+
+	bool Scene::NeedsRefinement(const ImageBuffer & coarseBuffer, size_t i, size_t j) const
+	{
+		const PixelData& pixel=coarseBuffer.UncheckedPixel(i,j);
+		if (coarseBuffer.IsAmbiguous(i,j))
+		{
+			return true;
+		}
+
+		const size_t iLast=coarseBuffer.GetPixelsWide()-1;
+		const size_t jLast=coarseBuffer.GetPixelHigh()-1;
+		const size_t iNeighbor[4]={(i > 0)?(i-1):i, (i < iLast)?(i+1):i, i, i};
+		const size_t jNeighbor[4]={j, j, (j > 0)?(j-1):j, (j < jLast)?(j+1):j};
+
+		for (int n = 0; n < 4; ++n)
+		{
+			const PixelData& neighbor=coarseBuffer.UncheckedPixel(iNeighbor[n],jNeighbor[n]);
+			if (coarseBuffer.IsAmbiguous(iNeighbor[n],jNeighbor[n]) || (neighbor.solid != pixel.solid) || (neighbor.context != pixel.context))
+			{
+				return true;
+			}
+
+			// Contrast |a-b|/(a+b), compared without dividing.
+			const double a[3]={pixel.color.red, pixel.color.green, pixel.color.blue};
+			const double b[3]={neighbor.color.red, neighbor.color.green, neighbor.color.blue};
+			for (int c = 0; c < 3; ++c)
+			{
+				if (fabs(a[c]-b[c]) > adaptiveThreshold*(a[c]+b[c]))
+				{
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
+	double Scene::AverageRows(
+		ThreadPool & pool,
+		const ImageBuffer & buffer,
+		size_t jBegin,
+		size_t jEnd,
+		size_t antiAliasFactor,
+		std::vector<Color>& averageList) const
+	{
+		const size_t pixelWide=buffer.GetPixelsWide()/antiAliasFactor;
+		const size_t numRows=(jEnd-jBegin)/antiAliasFactor;
+		const double patchSize=static_cast<double>(antiAliasFactor*antiAliasFactor);
+
+		averageList.resize(numRows*pixelWide);
+		std::vector<double> rowMax(numRows,0.0);
+
+		pool.ParallelFor(numRows, [&](size_t row, size_t)
+		{
+			const size_t j=jBegin+row*antiAliasFactor;
+			Color* average=&averageList[row*pixelWide];
+			double& max=rowMax[row];
+			for (size_t i = 0; i < pixelWide; ++i)
+			{
+				Color sum(0.0,0.0,0.0);
+				for (size_t di = 0; di < antiAliasFactor; ++di)
+				{
+					for (size_t dj = 0; dj < antiAliasFactor; ++dj)
+					{
+						const Color& color=buffer.UncheckedPixel(antiAliasFactor*i+di,j+dj).color;
+						AccumulateMaxColorValue(color,max);
+						sum+=color;
+					}
+				}
+				sum/=patchSize;
+				average[i]=sum;
+			}
+		});
+
+		return CombineMaxColorValues(rowMax);
+	}
+
+	double Scene::RenderBand(
+		ThreadPool & pool,
+		std::vector<ThreadContext>& contextList,
+		ImageBuffer & buffer,
+		ImageBuffer & coarseBuffer,
+		double largeZoom,
+		size_t antiAliasFactor,
+		size_t bandBegin,
+		size_t bandEnd,
+		size_t & renderedEnd,
+		size_t & coarseRenderedEnd,
+		PixelList & ambiguousPixelList,
+		std::vector<Color>& averageList) const
+	{
+		const size_t largePixelHigh=buffer.GetPixelHigh();
+		const size_t pixelHigh=coarseBuffer.GetPixelHigh();
+		const bool isAdaptive=(adaptiveThreshold > 0.0) && (antiAliasFactor > 1);
+		const size_t haloBegin=(bandBegin > 0)?(bandBegin-1):0;
+		const size_t haloEnd=(bandEnd < largePixelHigh)?(bandEnd+1):bandEnd;
+
+		// The halo rows were rendered with the previous band; keep them.
+		buffer.MoveBand(haloBegin);
+		if (isAdaptive)
+		{
+			const size_t rowBegin=bandBegin/antiAliasFactor;
+			const size_t rowEnd=bandEnd/antiAliasFactor;
+			const size_t coarseBegin=(rowBegin > 0)?(rowBegin-1):0;
+			const size_t coarseEnd=(rowEnd+2 < pixelHigh)?(rowEnd+2):pixelHigh;
+
+			// Coarse rays go through the corner of each final pixel,
+			// like the first ray of its supersampling grid.  Their
+			// ambiguous pixels are refined rather than resolved.
+			PixelList coarseAmbiguousPixelList;
+			coarseBuffer.MoveBand(coarseBegin);
+			RenderRows(pool,contextList,coarseBuffer,largeZoom/antiAliasFactor,coarseRenderedEnd,coarseEnd,coarseAmbiguousPixelList);
+			coarseRenderedEnd=coarseEnd;
+
+			RenderAdaptiveRows(pool,contextList,coarseBuffer,buffer,largeZoom,antiAliasFactor,renderedEnd,haloEnd,ambiguousPixelList);
+		}
+		else
+		{
+			RenderRows(pool,contextList,buffer,largeZoom,renderedEnd,haloEnd,ambiguousPixelList);
+		}
+		renderedEnd=haloEnd;
+
+		// Resolving only reads pixels that are not ambiguous, so the
+		// result does not depend on the order pixels are resolved in,
+		// and the pixels can be shared out among the threads.
+		// Ambiguous pixels in the lower halo wait for the next band.
+		PixelList resolvePixelList;
+		PixelList laterPixelList;
+		PixelList::const_iterator iter=ambiguousPixelList.begin();
+		PixelList::const_iterator end=ambiguousPixelList.end();
+		for (; iter != end; ++iter)
+		{
+			if (iter->j < bandEnd)
+			{
+				resolvePixelList.push_back(*iter);
+			}
+			else
+			{
+				laterPixelList.push_back(*iter);
+			}
+		}
+		ambiguousPixelList.swap(laterPixelList);
+
+		ResolveAmbiguousPixels(pool,buffer,resolvePixelList);
+
+		return AverageRows(pool,buffer,bandBegin,bandEnd,antiAliasFactor,averageList);
+	}
+	void Scene::WriteRows(
+		ThreadPool & pool,
+		const std::vector<Color>& averageList,
+		size_t pixelWide,
+		double maxColorValue,
+		PngWriter & writer) const
+	{
+		const size_t numRows=averageList.size()/pixelWide;
+		std::vector<unsigned char> rgbList(3*averageList.size());
+
+		pool.ParallelFor(numRows, [&](size_t row, size_t)
+		{
+			ConvertRow(&averageList[row*pixelWide],pixelWide,maxColorValue,&rgbList[3*row*pixelWide]);
+		});
+
+		// The file itself is written in order.
+		for (size_t row = 0; row < numRows; ++row)
+		{
+			writer.WriteRow(&rgbList[3*row*pixelWide]);
+		}
+	}
+	void Scene::WriteImageFile(
+		const char * fileName,
+		const std::vector<Color>& averageList,
+		size_t pixelWide,
+		double maxColorValue) const
+	{
+		const size_t numRows=averageList.size()/pixelWide;
+		PngWriter writer(fileName,pixelWide,numRows);
+		std::vector<unsigned char> rgbRow(3*pixelWide);
+		for (size_t row = 0; row < numRows; ++row)
+		{
+			ConvertRow(&averageList[row*pixelWide],pixelWide,maxColorValue,&rgbRow[0]);
+			writer.WriteRow(&rgbRow[0]);
+		}
+		writer.Finish();
+	}
+
+#if IMAGER_STATISTICS
+	void Scene::AccumulateCost(
+		const ImageBuffer & buffer,
+		size_t jBegin,
+		size_t jEnd,
+		size_t antiAliasFactor,
+		std::vector<unsigned int>& costList) const
+	{
+		const size_t largePixelWide=buffer.GetPixelsWide();
+		const size_t pixelWide=largePixelWide/antiAliasFactor;
+		for (size_t j = jBegin; j < jEnd; ++j)
+		{
+			unsigned int* costRow=&costList[(j/antiAliasFactor)*pixelWide];
+			for (size_t i = 0; i < largePixelWide; ++i)
+			{
+				costRow[i/antiAliasFactor]+=buffer.UncheckedPixel(i,j).cost;
+			}
+		}
+	}
+
+	void Scene::SaveCostHeatmap(const std::vector<unsigned int>& costList, size_t pixelWide, size_t pixelHigh) const
+	{
+		unsigned int maxCost=0;
+		for (size_t k = 0; k < costList.size(); ++k)
+		{
+			if (costList[k] > maxCost)
+			{
+				maxCost=costList[k];
+			}
+		}
+		const double logMax=log(1.0+maxCost);
+
+		// Stops of the color ramp, from cheapest to most expensive.
+		const double ramp[5][3]=
+		{
+			{  0.0,   0.0,   0.0},
+			{  0.0,   0.0, 255.0},
+			{255.0,   0.0,   0.0},
+			{255.0, 255.0,   0.0},
+			{255.0, 255.0, 255.0},
+		};
+
+		PngWriter writer(costHeatmapFileName.c_str(),pixelWide,pixelHigh);
+		std::vector<unsigned char> rgbRow(3*pixelWide);
+		for (size_t j = 0; j < pixelHigh; ++j)
+		{
+			for (size_t i = 0; i < pixelWide; ++i)
+			{
+				const double level=(logMax > 0.0)?(4.0*log(1.0+costList[j*pixelWide+i])/logMax):0.0;
+				const int stop=(level < 4.0)?static_cast<int>(level):3;
+				const double fraction=level-stop;
+				for (int c = 0; c < 3; ++c)
+				{
+					const double value=ramp[stop][c]+fraction*(ramp[stop+1][c]-ramp[stop][c]);
+					rgbRow[3*i+c]=static_cast<unsigned char>(value+0.5);
+				}
+			}
+			writer.WriteRow(&rgbRow[0]);
+		}
+		writer.Finish();
+	}
+#endif
+
+	double Scene::EstimateMaxColorValue(
+		ThreadPool & pool,
+		std::vector<ThreadContext>& contextList,
+		size_t largePixelWide,
+		size_t largePixelHigh,
+		double largeZoom,
+		size_t antiAliasFactor) const
+	{
+		const size_t spacing=PREVIEW_SPACING*antiAliasFactor;
+		const size_t numRows=(largePixelHigh+spacing-1)/spacing;
+		std::vector<double> workerMax(pool.GetThreadCount(),0.0);
+
+		pool.ParallelFor(numRows, [&](size_t row, size_t workerIndex)
+		{
+			ThreadContext& context=contextList[workerIndex];
+			context.activeDebugPoint=NULL;
+
+			const Vector3 camera(0.0,0.0,0.0);
+			const size_t j=row*spacing;
+			for (size_t i = 0; i < largePixelWide; i += spacing)
+			{
+				// Same rays as RenderTile.
+				const Vector3 direction(
+					(i-largePixelWide/2.0)/largeZoom,
+					(largePixelHigh/2.0-j)/largeZoom,
+					-1.0);
+				++context.cameraRayCount;
+				IMAGER_STATISTIC(++context.statistics.cameraRays;)
+				// Resolved pixels are averages of their neighbors,
+				// so ambiguous ones cannot be the brightest anyway.
+				Color color;
+				if (TarceRay(context,camera,direction,ambientRefraction,Color(1.0,1.0,1.0),0,color))
+				{
+					double& max=workerMax[workerIndex];
+					if (color.red > max) max=color.red;
+					if (color.green > max) max=color.green;
+					if (color.blue > max) max=color.blue;
+				}
+			}
+		});
+
+		double max=0.0;
+		for (size_t w = 0; w < workerMax.size(); ++w)
+		{
+			if (workerMax[w] > max)
+			{
+				max=workerMax[w];
+			}
+		}
+
+		// As in ImageBuffer::MaxColorValue, an all-black image needs no scaling.
+		return (max > 0.0)?max:1.0;
+	}
+
+	void Scene::RenderTile(
+		ThreadContext & context,
+		ImageBuffer & buffer,
+		double largeZoom,
+		size_t iBegin,
+		size_t iEnd,
+		size_t jBegin,
+		size_t jEnd,
+		PixelList & ambiguousPixelList) const
+	{
+		const size_t largePixelWide=buffer.GetPixelsWide();
+		const size_t largePixelHigh=buffer.GetPixelHigh();
+
+		Vector3 camera(0.0,0.0,0.0);
+
+		Vector3 direction(0.0,0.0,-1.0);
+
+		// Row by row, the order ImageBuffer stores the pixels of a tile in.
+		for (size_t j = jBegin; j < jEnd; j++)
+		{
+			direction.y=(largePixelHigh/2.0-j)/largeZoom;
+
+			for (size_t i = iBegin; i < iEnd; i++)
+			{
+				direction.x=(i-largePixelWide/2.0)/largeZoom;
+
+				IMAGER_STATISTIC(const size_t testCount=context.statistics.TestCount();)
+
+				Intersection intersection;
+				const int numClosest=FindClosestIntersectionPoint(context,camera,direction,intersection);
+				if (!RenderPixel(context,buffer.UncheckedPixel(i,j),i,j,numClosest,intersection,direction,ambiguousPixelList))
+				{
+					buffer.SetAmbiguous(i,j);
+				}
+
+				IMAGER_STATISTIC(buffer.UncheckedPixel(i,j).cost=static_cast<unsigned int>(context.statistics.TestCount()-testCount);)
+			}
+		}
+	}
+
+	void Scene::RenderBlock(
+		ThreadContext & context,
+		ImageBuffer & buffer,
+		double largeZoom,
+		size_t iBegin,
+		size_t iEnd,
+		size_t jBegin,
+		size_t jEnd,
+		PixelList & ambiguousPixelList) const
+	{
+		if (isWavefront)
+		{
+			RenderTileWavefront(context,buffer,largeZoom,iBegin,iEnd,jBegin,jEnd,ambiguousPixelList);
+		}
+		else if (packetSize > 1)
+		{
+			RenderTilePackets(context,buffer,largeZoom,iBegin,iEnd,jBegin,jEnd,ambiguousPixelList);
+		}
+		else
+		{
+			RenderTile(context,buffer,largeZoom,iBegin,iEnd,jBegin,jEnd,ambiguousPixelList);
+		}
+	}
+
+	void Scene::RenderTilePackets(
+		ThreadContext & context,
+		ImageBuffer & buffer,
+		double largeZoom,
+		size_t iBegin,
+		size_t iEnd,
+		size_t jBegin,
+		size_t jEnd,
+		PixelList & ambiguousPixelList) const
+	{
+		// Packets cover small, nearly square blocks of pixels,
+		// whose rays tend to hit the same solids.
+		const size_t blockWide=(packetSize >= 8)?4:2;
+		const size_t blockHigh=packetSize/blockWide;
+
+		RayPacket packet;
+		size_t iPixel[RayPacket::MAX_SIZE];
+		size_t jPixel[RayPacket::MAX_SIZE];
+		Intersection intersection[RayPacket::MAX_SIZE];
+		int numClosest[RayPacket::MAX_SIZE];
+
+		for (size_t jBlock = jBegin; jBlock < jEnd; jBlock += blockHigh)
+		{
+			for (size_t iBlock = iBegin; iBlock < iEnd; iBlock += blockWide)
+			{
+				FillCameraPacket(buffer,largeZoom,iBlock,iEnd,jBlock,jEnd,packet,iPixel,jPixel);
+
+				IMAGER_STATISTIC(size_t testCount=context.statistics.TestCount();)
+				FindClosestIntersectionPoints(context,packet,intersection,numClosest);
+
+#if IMAGER_STATISTICS
+				// The packet's tests are shared out evenly among its rays.
+				const size_t packetCost=(context.statistics.TestCount()-testCount)/packet.count;
+#endif
+
+				for (size_t k = 0; k < packet.count; ++k)
+				{
+					IMAGER_STATISTIC(testCount=context.statistics.TestCount();)
+					const bool isShaded=RenderPixel(
+						context,
+						buffer.UncheckedPixel(iPixel[k],jPixel[k]),
+						iPixel[k],
+						jPixel[k],
+						numClosest[k],
+						intersection[k],
+						packet.Direction(k),
+						ambiguousPixelList);
+					if (!isShaded)
+					{
+						buffer.SetAmbiguous(iPixel[k],jPixel[k]);
+					}
+					IMAGER_STATISTIC(buffer.UncheckedPixel(iPixel[k],jPixel[k]).cost=static_cast<unsigned int>(packetCost+context.statistics.TestCount()-testCount);)
+				}
+			}
+		}
+	}
+
+	void Scene::FillCameraPacket(
+		const ImageBuffer & buffer,
+		double largeZoom,
+		size_t iBlock,
+		size_t iEnd,
+		size_t jBlock,
+		size_t jEnd,
+		RayPacket & packet,
+		size_t * iPixel,
+		size_t * jPixel) const
+	{
+		const size_t largePixelWide=buffer.GetPixelsWide();
+		const size_t largePixelHigh=buffer.GetPixelHigh();
+		const size_t blockWide=(packetSize >= 8)?4:2;
+		const size_t blockHigh=packetSize/blockWide;
+
+		packet.vantage=Vector3(0.0,0.0,0.0);
+		packet.count=0;
+		for (size_t j = jBlock; (j < jBlock+blockHigh) && (j < jEnd); ++j)
+		{
+			for (size_t i = iBlock; (i < iBlock+blockWide) && (i < iEnd); ++i)
+			{
+				// Same arithmetic as RenderTile, so both give the same rays.
+				const size_t k=packet.count++;
+				packet.dirX[k]=(i-largePixelWide/2.0)/largeZoom;
+				packet.dirY[k]=(largePixelHigh/2.0-j)/largeZoom;
+				packet.dirZ[k]=-1.0;
+				iPixel[k]=i;
+				jPixel[k]=j;
+			}
+		}
+
+		// Fill unused lanes with a real ray, so kernels
+		// that process whole registers see valid numbers.
+		for (size_t k = packet.count; k < RayPacket::MAX_SIZE; ++k)
+		{
+			packet.dirX[k]=packet.dirX[0];
+			packet.dirY[k]=packet.dirY[0];
+			packet.dirZ[k]=packet.dirZ[0];
+		}
+	}
+
+	void Scene::RenderTileWavefront(
+		ThreadContext & context,
+		ImageBuffer & buffer,
+		double largeZoom,
+		size_t iBegin,
+		size_t iEnd,
+		size_t jBegin,
+		size_t jEnd,
+		PixelList & ambiguousPixelList) const
+	{
+		if ((iEnd-iBegin > WAVEFRONT_TILE_SIZE) || (jEnd-jBegin > WAVEFRONT_TILE_SIZE))
+		{
+			for (size_t j = jBegin; j < jEnd; j += WAVEFRONT_TILE_SIZE)
+			{
+				const size_t jWaveEnd=(j+WAVEFRONT_TILE_SIZE < jEnd)?(j+WAVEFRONT_TILE_SIZE):jEnd;
+				for (size_t i = iBegin; i < iEnd; i += WAVEFRONT_TILE_SIZE)
+				{
+					const size_t iWaveEnd=(i+WAVEFRONT_TILE_SIZE < iEnd)?(i+WAVEFRONT_TILE_SIZE):iEnd;
+					RenderTileWavefront(context,buffer,largeZoom,i,iWaveEnd,j,jWaveEnd,ambiguousPixelList);
+				}
+			}
+			return;
+		}
+
+		Wavefront& wave=context.wavefront;
+		wave.pixelList.clear();
+		wave.surfaceList.clear();
+		wave.newSurfaceList.clear();
+
+		// All camera rays first, in packets if packets are on.
+		if (packetSize > 1)
+		{
+			const size_t blockWide=(packetSize >= 8)?4:2;
+			const size_t blockHigh=packetSize/blockWide;
+
+			RayPacket packet;
+			size_t iPixel[RayPacket::MAX_SIZE];
+			size_t jPixel[RayPacket::MAX_SIZE];
+			Intersection intersection[RayPacket::MAX_SIZE];
+			int numClosest[RayPacket::MAX_SIZE];
+
+			for (size_t jBlock = jBegin; jBlock < jEnd; jBlock += blockHigh)
+			{
+				for (size_t iBlock = iBegin; iBlock < iEnd; iBlock += blockWide)
+				{
+					FillCameraPacket(buffer,largeZoom,iBlock,iEnd,jBlock,jEnd,packet,iPixel,jPixel);
+
+					IMAGER_STATISTIC(const size_t testCount=context.statistics.TestCount();)
+					FindClosestIntersectionPoints(context,packet,intersection,numClosest);
+					IMAGER_STATISTIC(const size_t packetCost=(context.statistics.TestCount()-testCount)/packet.count;)
+
+					for (size_t k = 0; k < packet.count; ++k)
+					{
+						StartWavePixel(context,buffer,iPixel[k],jPixel[k],numClosest[k],intersection[k],packet.Direction(k));
+						IMAGER_STATISTIC(wave.pixelList.back().cost=packetCost;)
+					}
+				}
+			}
+		}
+		else
+		{
+			const size_t largePixelWide=buffer.GetPixelsWide();
+			const size_t largePixelHigh=buffer.GetPixelHigh();
+			const Vector3 camera(0.0,0.0,0.0);
+
+			for (size_t j = jBegin; j < jEnd; j++)
+			{
+				for (size_t i = iBegin; i < iEnd; i++)
+				{
+					const Vector3 direction(
+						(i-largePixelWide/2.0)/largeZoom,
+						(largePixelHigh/2.0-j)/largeZoom,
+						-1.0);
+
+					IMAGER_STATISTIC(const size_t testCount=context.statistics.TestCount();)
+					Intersection intersection;
+					const int numClosest=FindClosestIntersectionPoint(context,camera,direction,intersection);
+					StartWavePixel(context,buffer,i,j,numClosest,intersection,direction);
+					IMAGER_STATISTIC(wave.pixelList.back().cost=context.statistics.TestCount()-testCount;)
+				}
+			}
+		}
+
+		// Then one bounce at a time.
+		while (!wave.newSurfaceList.empty())
+		{
+			LightWavefront(context);
+			wave.newSurfaceList.clear();
+
+			TraceWavefrontQueue(context,wave.refractionQueue);
+			TraceWavefrontQueue(context,wave.reflectionQueue);
+		}
+
+		for (size_t p = 0; p < wave.pixelList.size(); ++p)
+		{
+			const WavePixel& wavePixel=wave.pixelList[p];
+			PixelData& pixel=buffer.UncheckedPixel(wavePixel.i,wavePixel.j);
+			if (wavePixel.isAmbiguous)
+			{
+				buffer.SetAmbiguous(wavePixel.i,wavePixel.j);
+				ambiguousPixelList.push_back(PixelCoordinates(wavePixel.i,wavePixel.j));
+				IMAGER_STATISTIC(++context.statistics.ambiguousPixels;)
+			}
+			else
+			{
+				pixel.color=wavePixel.color;
+			}
+			IMAGER_STATISTIC(pixel.cost=static_cast<unsigned int>(wavePixel.cost);)
+		}
+	}
+
+	void Scene::StartWavePixel(
+		ThreadContext & context,
+		ImageBuffer & buffer,
+		size_t i,
+		size_t j,
+		int numClosest,
+		const Intersection & intersection,
+		const Vector3 & direction) const
+	{
+		Wavefront& wave=context.wavefront;
+		const Color fullIntensity(1.0,1.0,1.0);
+
+		++context.cameraRayCount;
+		IMAGER_STATISTIC(++context.statistics.cameraRays;)
+		IMAGER_STATISTIC(++context.statistics.raysAtDepth[0];)
+
+		WavePixel wavePixel;
+		wavePixel.i=i;
+		wavePixel.j=j;
+		wavePixel.isAmbiguous=false;
+		IMAGER_STATISTIC(wavePixel.cost=0;)
+
+		switch (numClosest)
+		{
+		case 0:
+			wavePixel.color=fullIntensity*backgroundColor;
+			break;
+
+		case 1:
+			{
+				PixelData& pixel=buffer.UncheckedPixel(i,j);
+				pixel.solid=intersection.solid;
+				pixel.context=intersection.context;
+
+				wave.newSurfaceList.push_back(wave.surfaceList.size());
+				wave.surfaceList.resize(wave.surfaceList.size()+1);
+				WaveSurface& surface=wave.surfaceList.back();
+				surface.frame.intersection=intersection;
+				surface.pixel=wave.pixelList.size();
+				surface.parent=WaveSurface::NO_PARENT;
+				surface.isReflection=false;
+				surface.hasMatte=PrepareLighting(surface.frame,direction,ambientRefraction,MediumStack(),fullIntensity,1);
+			}
+			break;
+
+		default:
+			wavePixel.isAmbiguous=true;
+			break;
+		}
+
+		wave.pixelList.push_back(wavePixel);
+	}
+
+	void Scene::LightWavefront(ThreadContext & context) const
+	{
+		Wavefront& wave=context.wavefront;
+		const size_t numSurfaces=wave.newSurfaceList.size();
+		const size_t numLights=lightSourceList.size();
+
+		// The lights each surface needs shadow rays to.
+		wave.lightScaleList.assign(numLights*numSurfaces,0.0);
+		for (size_t s = 0; s < numSurfaces; ++s)
+		{
+			const WaveSurface& surface=wave.surfaceList[wave.newSurfaceList[s]];
+			if (surface.hasMatte && !wave.pixelList[surface.pixel].isAmbiguous)
+			{
+				SelectLights(context,surface.frame,context.lightChoiceList);
+				for (size_t c = 0; c < context.lightChoiceList.size(); ++c)
+				{
+					const LightChoice& choice=context.lightChoiceList[c];
+					wave.lightScaleList[choice.light*numSurfaces+s]=choice.scale;
+				}
+			}
+		}
+
+		// Going light by light lets each light's shadow cache
+		// try the same occluder on many neighboring points.
+		wave.isClearList.assign(numLights*numSurfaces,0);
+		for (size_t k = 0; k < numLights; ++k)
+		{
+			const LightSource& source=lightSourceList[k];
+			for (size_t s = 0; s < numSurfaces; ++s)
+			{
+				const WaveSurface& surface=wave.surfaceList[wave.newSurfaceList[s]];
+				if (wave.lightScaleList[k*numSurfaces+s] > 0.0)
+				{
+					IMAGER_STATISTIC(const size_t testCount=context.statistics.TestCount();)
+					++context.shadowRayCount;
+					wave.isClearList[k*numSurfaces+s]=HasClearLineOfSight(context,surface.frame.intersection.point,source.location,context.shadowCache[k]);
+					IMAGER_STATISTIC(wave.pixelList[surface.pixel].cost+=context.statistics.TestCount()-testCount;)
+				}
+			}
+		}
+
+		for (size_t s = 0; s < numSurfaces; ++s)
+		{
+			const size_t surfaceIndex=wave.newSurfaceList[s];
+			WaveSurface& surface=wave.surfaceList[surfaceIndex];
+			surface.pendingCount=0;
+			surface.hasRefraction=false;
+			surface.hasReflection=false;
+			if (wave.pixelList[surface.pixel].isAmbiguous)
+			{
+				// Its color will not be used.
+				FinishWaveSurface(context,surfaceIndex);
+				continue;
+			}
+
+			if (surface.hasMatte)
+			{
+				// Added up in the same order as CalculateMatte.
+				Color lightSum(0.0,0.0,0.0);
+				for (size_t k = 0; k < numLights; ++k)
+				{
+					if (wave.isClearList[k*numSurfaces+s])
+					{
+						AddDiffuseLight(surface.frame.intersection,lightSourceList[k],wave.lightScaleList[k*numSurfaces+s],lightSum);
+					}
+				}
+				AddMatteColor(surface.frame,lightSum);
+			}
+
+			IMAGER_STATISTIC(const size_t testCount=context.statistics.TestCount();)
+			WaveRay ray;
+			ray.surface=surfaceIndex;
+			while (NextSecondaryRay(context,surface.frame,ray.direction,ray.refractiveIndex,ray.media,ray.rayIntensity))
+			{
+				// The refracted ray comes first, leaving the frame
+				// ready for the reflected one.
+				ray.isReflection=(surface.frame.stage == RayFrame::DONE);
+
+				++surface.pendingCount;
+				if (ray.isReflection)
+				{
+					surface.hasReflection=true;
+					wave.reflectionQueue.push_back(ray);
+				}
+				else
+				{
+					surface.hasRefraction=true;
+					wave.refractionQueue.push_back(ray);
+				}
+			}
+			IMAGER_STATISTIC(wave.pixelList[surface.pixel].cost+=context.statistics.TestCount()-testCount;)
+
+			if (surface.pendingCount == 0)
+			{
+				FinishWaveSurface(context,surfaceIndex);
+			}
+		}
+	}
+
+	void Scene::TraceWavefrontQueue(ThreadContext & context, std::vector<WaveRay>& queue) const
+	{
+		Wavefront& wave=context.wavefront;
+
+		// Trace rays in order of a coarse grid on the unit sphere of
+		// directions, and rays in the same cell in pixel order, which
+		// keeps their starting points close.
+		wave.traceOrder.resize(queue.size());
+		for (size_t r = 0; r < queue.size(); ++r)
+		{
+			const Vector3 unit=queue[r].direction.UnitVector();
+			const double component[3]={unit.x, unit.y, unit.z};
+			unsigned long long key=0;
+			for (int c = 0; c < 3; ++c)
+			{
+				const int cell=static_cast<int>((component[c]+1.0)*8.0);
+				key=(key << 4) | ((cell < 15)?cell:15);
+			}
+			wave.traceOrder[r]=(key << 32) | r;
+		}
+		std::sort(wave.traceOrder.begin(),wave.traceOrder.end());
+
+		for (size_t t = 0; t < queue.size(); ++t)
+		{
+			const WaveRay& ray=queue[static_cast<size_t>(wave.traceOrder[t] & 0xffffffffu)];
+
+			// The surface list grows below, so copy what is needed.
+			const WaveSurface& source=wave.surfaceList[ray.surface];
+			const Vector3 vantage=source.frame.intersection.point;
+			const int recursionDepth=source.frame.recursionDepth;
+			const size_t pixelIndex=source.pixel;
+
+			if (wave.pixelList[pixelIndex].isAmbiguous)
+			{
+				CompleteWaveRay(context,ray.surface,ray.isReflection,Color(0.0,0.0,0.0));
+				continue;
+			}
+
+			IMAGER_STATISTIC(++context.statistics.raysAtDepth[(recursionDepth < RenderStatistics::MAX_DEPTH)?recursionDepth:RenderStatistics::MAX_DEPTH];)
+			IMAGER_STATISTIC(const size_t testCount=context.statistics.TestCount();)
+
+			// Whatever the ray hits becomes the next surface.
+			wave.surfaceList.resize(wave.surfaceList.size()+1);
+			WaveSurface& surface=wave.surfaceList.back();
+			const int numClosest=FindClosestIntersectionPoint(context,vantage,ray.direction,surface.frame.intersection);
+			IMAGER_STATISTIC(wave.pixelList[pixelIndex].cost+=context.statistics.TestCount()-testCount;)
+
+			switch (numClosest)
+			{
+			case 0:
+				wave.surfaceList.pop_back();
+				CompleteWaveRay(context,ray.surface,ray.isReflection,ray.rayIntensity*backgroundColor);
+				break;
+
+			case 1:
+				surface.pixel=pixelIndex;
+				surface.parent=ray.surface;
+				surface.isReflection=ray.isReflection;
+				surface.hasMatte=PrepareLighting(surface.frame,ray.direction,ray.refractiveIndex,ray.media,ray.rayIntensity,1+recursionDepth);
+				wave.newSurfaceList.push_back(wave.surfaceList.size()-1);
+				break;
+
+			default:
+				wave.surfaceList.pop_back();
+				wave.pixelList[pixelIndex].isAmbiguous=true;
+				CompleteWaveRay(context,ray.surface,ray.isReflection,Color(0.0,0.0,0.0));
+				break;
+			}
+		}
+		queue.clear();
+	}
+
+	void Scene::CompleteWaveRay(ThreadContext & context, size_t surfaceIndex, bool isReflection, Color color) const
+	{
+		Wavefront& wave=context.wavefront;
+		for (;;)
+		{
+			WaveSurface& surface=wave.surfaceList[surfaceIndex];
+			if (isReflection)
+			{
+				surface.reflectionColor=color;
+			}
+			else
+			{
+				surface.refractionColor=color;
+			}
+			if (--surface.pendingCount > 0)
+			{
+				return;
+			}
+
+			// Added up in the same order as ShadeRay.
+			Color& colorSum=surface.frame.colorSum;
+			if (surface.hasRefraction)
+			{
+				colorSum+=surface.refractionColor;
+			}
+			if (surface.hasReflection)
+			{
+				colorSum+=surface.reflectionColor;
+			}
+
+			if (surface.parent == WaveSurface::NO_PARENT)
+			{
+				wave.pixelList[surface.pixel].color=colorSum;
+				return;
+			}
+			color=colorSum;
+			isReflection=surface.isReflection;
+			surfaceIndex=surface.parent;
+		}
+	}
+
+	void Scene::FinishWaveSurface(ThreadContext & context, size_t surfaceIndex) const
+	{
+		Wavefront& wave=context.wavefront;
+		const WaveSurface& surface=wave.surfaceList[surfaceIndex];
+		if (surface.parent == WaveSurface::NO_PARENT)
+		{
+			wave.pixelList[surface.pixel].color=surface.frame.colorSum;
+		}
+		else
+		{
+			CompleteWaveRay(context,surface.parent,surface.isReflection,surface.frame.colorSum);
+		}
+	}
+
+	bool Scene::RenderPixel(
+		ThreadContext & context,
+		PixelData & pixel,
+		size_t i,
+		size_t j,
+		int numClosest,
+		const Intersection & intersection,
+		const Vector3 & direction,
+		PixelList & ambiguousPixelList) const
+	{
+		const Color fullIntensity(1.0,1.0,1.0);
+
+		context.activeDebugPoint=NULL;
+		DebugPointList::const_iterator debugIter=debugPointList.begin();
+		DebugPointList::const_iterator debugEnd=debugPointList.end();
+		for (; debugIter != debugEnd; ++debugIter)
+		{
+			if ((debugIter->iPixel == (int)i) && (debugIter->jPixel == (int)j))
+			{
+				context.activeDebugPoint=&*debugIter;
+				break;
+			}
+		}
+
+		++context.cameraRayCount;
+		IMAGER_STATISTIC(++context.statistics.cameraRays;)
+
+		if (numClosest == 1)
+		{
+			pixel.solid=intersection.solid;
+			pixel.context=intersection.context;
+		}
+		const bool isShaded=ShadeRay(
+			context,
+			numClosest,
+			intersection,
+			direction,
+			ambientRefraction,
+			fullIntensity,
+			0,
+			pixel.color
+		);
+		if (!isShaded)
+		{
+			ambiguousPixelList.push_back(PixelCoordinates(i,j));
+			IMAGER_STATISTIC(++context.statistics.ambiguousPixels;)
+		}
+		return isShaded;
+	}
+
+	void Scene::SetAmbientRefraction(double refraction)
+	{
+		ValidateRefraction(refraction);
+		ambientRefraction=refraction;
+	}
+
+	void Scene::AddDebugPoint(int iPixel, int jPixel)
+	{
+		debugPointList.push_back(DebugPoint(iPixel,jPixel));
+	}
+
+	void Scene::SetThreadCount(size_t _threadCount)
+	{
+		threadCount=_threadCount;
+	}
+
+	void Scene::SetStreamingBandHeight(size_t pixelRows)
+	{
+		streamingBandHeight=pixelRows;
+	}
+
+	void Scene::SetMaxColorValue(double _maxColorValue)
+	{
+		if (!(_maxColorValue >= 0.0))
+		{
+			throw ImageException("Maximum color value must not be negative.");
+		}
+		maxColorValue=_maxColorValue;
+	}
+
+	void Scene::SetAdaptiveAntiAliasing(double contrastThreshold)
+	{
+		if (!(contrastThreshold >= 0.0))
+		{
+			throw ImageException("Anti-aliasing contrast threshold must not be negative.");
+		}
+		adaptiveThreshold=contrastThreshold;
+	}
+
+	void Scene::SetWavefrontRendering(bool isEnabled)
+	{
+		isWavefront=isEnabled;
+	}
+
+	void Scene::SetAmbiguityPolicy(AmbiguityPolicy policy)
+	{
+		ambiguityPolicy=policy;
+	}
+
+	void Scene::SetLightCulling(bool isEnabled)
+	{
+		isLightCulling=isEnabled;
+	}
+
+	void Scene::SetLightSampleCount(size_t sampleCount)
+	{
+		lightSampleCount=sampleCount;
+	}
+
+	size_t Scene::GetCameraRayCount() const
+	{
+		return cameraRayCount;
+	}
+
+	size_t Scene::GetSecondaryRayCount() const
+	{
+		return secondaryRayCount;
+	}
+
+	size_t Scene::GetShadowRayCount() const
+	{
+		return shadowRayCount;
+	}
+
+	size_t Scene::GetMaterialCount() const
+	{
+		return materialList.size();
+	}
+
+	const RenderStatistics & Scene::GetRenderStatistics() const
+	{
+		return statistics;
+	}
+
+	void Scene::SetCostHeatmapFile(const char * fileName)
+	{
+		if (fileName == NULL)
+		{
+			costHeatmapFileName.clear();
+			return;
+		}
+#if IMAGER_STATISTICS
+		costHeatmapFileName=fileName;
+#else
+		throw ImageException("Cost heatmaps require building with IMAGER_STATISTICS.");
+#endif
+	}
+
+	void Scene::SetPacketSize(size_t raysPerPacket)
+	{
+		if ((raysPerPacket != 1) && (raysPerPacket != 4) && (raysPerPacket != 8) && (raysPerPacket != 16))
+		{
+			throw ImageException("Packet size must be 1, 4, 8 or 16.");
+		}
+		packetSize=raysPerPacket;
+	}
+
+	void Scene::RebuildAccelerationStructure()
+	{
+		BuildHierarchy();
+	}
+
+	void Scene::BuildHierarchy() const
+	{
+		std::vector<BoundingBox> boundsList;
+		CollectHierarchySolids(boundsList);
+
+		hierarchy.Build(boundsList);
+		hierarchyOwner.reset();
+		FindOverlappingSolids(boundsList);
+		isHierarchyStale=false;
+	}
+
+	void Scene::BorrowHierarchy(const BoundingVolumeHierarchy::Node * nodes, size_t nodeCount, const unsigned int * primitiveOrder, size_t primitiveCount, const std::shared_ptr<const void>& owner)
+	{
+		std::vector<BoundingBox> boundsList;
+		CollectHierarchySolids(boundsList);
+		if (primitiveCount != boundsList.size())
+		{
+			throw ImageException("Hierarchy does not match the scene's solids.");
+		}
+
+		// Checks the hierarchy before anything else changes.
+		hierarchy.Borrow(nodes,nodeCount,primitiveOrder,primitiveCount);
+		hierarchyOwner=owner;
+		FindOverlappingSolids(boundsList);
+		isHierarchyStale=false;
+	}
+
+	void Scene::CollectHierarchySolids(std::vector<BoundingBox>& boundsList) const
+	{
+		hierarchySolidList.clear();
+		unboundedSolidList.clear();
+		hierarchySolidOrder.clear();
+		unboundedSolidOrder.clear();
+
+		boundsList.clear();
+		for (size_t k = 0; k < solidObjectList.size(); ++k)
+		{
+			solidObjectList[k]->Prepare();
+			const BoundingBox bounds=solidObjectList[k]->GetBoundingBox();
+			if (bounds.IsFinite())
+			{
+				hierarchySolidList.push_back(solidObjectList[k]);
+				hierarchySolidOrder.push_back(k);
+				boundsList.push_back(bounds);
+			}
+			else
+			{
+				unboundedSolidList.push_back(solidObjectList[k]);
+				unboundedSolidOrder.push_back(k);
+			}
+		}
+	}
+
+	void Scene::RefitAccelerationStructure()
+	{
+		if (isHierarchyStale)
+		{
+			// Solids were added since the last build; refitting is not enough.
+			BuildHierarchy();
+			return;
+		}
+
+		std::vector<BoundingBox> boundsList;
+		CollectSolidBounds(boundsList);
+
+		SolidObjectList::const_iterator iter=unboundedSolidList.begin();
+		SolidObjectList::const_iterator end=unboundedSolidList.end();
+		for (; iter != end; ++iter)
+		{
+			(*iter)->Prepare();
+			if ((*iter)->GetBoundingBox().IsFinite())
+			{
+				// A solid became bounded; it has to move into the tree.
+				BuildHierarchy();
+				return;
+			}
+		}
+
+		for (size_t k = 0; k < boundsList.size(); ++k)
+		{
+			if (!boundsList[k].IsFinite())
+			{
+				BuildHierarchy();
+				return;
+			}
+		}
+
+		hierarchy.Refit(boundsList);
+		FindOverlappingSolids(boundsList);
+	}
+
+	void Scene::PrepareAccelerationStructure() const
+	{
+		if (isHierarchyStale)
+		{
+			// The hierarchy is a cache of the solid list, so building it
+			// does not change the scene as far as callers can tell.
+			BuildHierarchy();
+		}
+		if (isLightCulling && isLightHierarchyStale)
+		{
+			BuildLightHierarchy();
+		}
 	}
 
+	void Scene::PrepareMaterials() const
+	{
+		// Cheap next to a render, so it is redone every time rather
+		// than tracking changes to every solid's optics.
+		materialList.clear();
+		SharedMaterialMap sharedMaterialMap;
+		for (size_t k = 0; k < solidObjectList.size(); ++k)
+		{
+			solidObjectList[k]->AppendMaterials(materialList,sharedMaterialMap);
+		}
+	}
 
-	SolidObject & Scene::AddSolidObject(SolidObject * solidObject)
+	void Scene::BuildLightHierarchy() const
 	{
-		solidObjectList.push_back(solidObject);
-		return *solidObject;
+		// A light adds at most component*weight*cos(angle)/distance to a
+		// surface's color, where weight, the fraction of the surface's
+		// light that reaches the camera, is usually no more than 1.
+		std::vector<BoundingBox> boundsList(lightSourceList.size());
+		for (size_t k = 0; k < lightSourceList.size(); ++k)
+		{
+			const LightSource& source=lightSourceList[k];
+			const double reach=LargestComponent(source.color)/MIN_OPTICAL_INTENSITY;
+			boundsList[k]=BoundingBox(source.location,source.location).Expanded(reach);
+		}
+		lightHierarchy.Build(boundsList);
+		isLightHierarchyStale=false;
 	}
 
+	void Scene::CollectSolidBounds(std::vector<BoundingBox>& boundsList) const
+	{
+		boundsList.resize(hierarchySolidList.size());
+		for (size_t k = 0; k < hierarchySolidList.size(); ++k)
+		{
+			hierarchySolidList[k]->Prepare();
+			boundsList[k]=hierarchySolidList[k]->GetBoundingBox();
+		}
+	}
 
-	void Scene::SaveImage(const char * outPngFileName, size_t pixelWide, size_t pixelHigh, double zoom, size_t antiAliasFactor) const
+	void Scene::FindOverlappingSolids(const std::vector<BoundingBox>& boundsList) const
 	{
-		const size_t largePixelWide=antiAliasFactor*pixelWide;
-		const size_t largePixelHigh=antiAliasFactor*pixelHigh;
-		const size_t smallerDim= ((pixelWide<pixelHigh)?pixelWide:pixelHigh);
+		solidPlaceMap.clear();
 
-		const double largeZoom=antiAliasFactor*zoom*smallerDim;
+		// An unbounded solid may overlap every solid after it.
+		const size_t firstUnboundedOrder=unboundedSolidOrder.empty()?solidObjectList.size():unboundedSolidOrder[0];
+		for (size_t k = 0; k < unboundedSolidList.size(); ++k)
+		{
+			SolidPlace place;
+			place.order=unboundedSolidOrder[k];
+			place.isOverlapped=(place.order > 0);
+			solidPlaceMap[unboundedSolidList[k]]=place;
+		}
 
-		ImageBuffer buffer(largePixelWide,largePixelHigh,backgroundColor);
+		for (size_t k = 0; k < hierarchySolidList.size(); ++k)
+		{
+			SolidPlace place;
+			place.order=hierarchySolidOrder[k];
+			place.isOverlapped=(place.order > firstUnboundedOrder);
+			if (!place.isOverlapped)
+			{
+				// Either solid may contain points up to the margin outside its box.
+				auto visitor=[&](unsigned int index)
+				{
+					if (hierarchySolidOrder[index] < place.order)
+					{
+						place.isOverlapped=true;
+						return true;
+					}
+					return false;
+				};
+				hierarchy.TraverseOverlapping(boundsList[k].Expanded(2.0*CONTAINMENT_MARGIN),visitor);
+			}
+			solidPlaceMap[hierarchySolidList[k]]=place;
+		}
+	}
 
+	void Scene::ClearSolidObjectList()
+	{
+		SolidObjectList::iterator iter=solidObjectList.begin();
+		SolidObjectList::iterator end=solidObjectList.end();
+		for (; iter != end; ++iter)
+		{
+			delete *iter;
+			*iter=NULL;
+		}
+		solidObjectList.clear();
+		hierarchySolidList.clear();
+		unboundedSolidList.clear();
+		hierarchySolidOrder.clear();
+		unboundedSolidOrder.clear();
+		solidPlaceMap.clear();
+		hierarchy.Clear();
+		hierarchyOwner.reset();
+		isHierarchyStale=true;
+	}
 
-		Vector3 camera(0.0,0.0,0.0);
+	int Scene::FindClosestIntersectionPoint(ThreadContext & context, const Vector3 & vantage, const Vector3 & direction, Intersection & intersection) const
+	{
+		// Applies the same tie rule as PickClosestIntersection, one solid
+		// at a time, so no list of candidates has to be built.
+		RayHit closest;
+		size_t closestOrder=0;
+		int tieCount=0;
+		const double directionMagnitudeSquared=direction.MagnetitudeSquared();
+		const bool isTieBroken=(ambiguityPolicy == AMBIGUITY_FIRST_SOLID);
+
+		auto visitSolid=[&](const SolidObject* solid, size_t order)
+		{
+			// Hits further than the closest one plus the tie tolerance
+			// can neither win nor tie, so the solid need not report them.
+			const double maxDistanceSquared=(tieCount > 0) ?
+				(closest.distanceSquared+2.0*EPSILON) :
+				HUGE_VAL;
+
+			IMAGER_STATISTIC(++context.statistics.intersectionTests;)
+			RayHit hit;
+			const int numClosest=solid->FindClosestHit(vantage,direction,maxDistanceSquared,hit);
+			if (numClosest > 0)
+			{
+				if (tieCount == 0)
+				{
+					closest=hit;
+					closestOrder=order;
+					tieCount=isTieBroken?1:numClosest;
+				}
+				else
+				{
+					const double diff=hit.distanceSquared-closest.distanceSquared;
+					if (isTieBroken)
+					{
+						if ((diff < 0.0) || ((diff == 0.0) && (order < closestOrder)))
+						{
+							closest=hit;
+							closestOrder=order;
+						}
+					}
+					else if (fabs(diff) < EPSILON)
+					{
+						tieCount+=numClosest;
+					}
+					else if (diff < 0.0)
+					{
+						closest=hit;
+						tieCount=numClosest;
+					}
+				}
+			}
+		};
 
-		Vector3 direction(0.0,0.0,-1.0);
+		for (size_t k = 0; k < unboundedSolidList.size(); ++k)
+		{
+			visitSolid(unboundedSolidList[k],unboundedSolidOrder[k]);
+		}
 
-		const Color fullIntensity(1.0,1.0,1.0);
+		// Nothing further than the closest hit so far, plus the tie tolerance, can matter.
+		auto reach=[&]()
+		{
+			return (tieCount > 0) ?
+				sqrt((closest.distanceSquared+2.0*EPSILON)/directionMagnitudeSquared) :
+				HUGE_VAL;
+		};
+
+		auto visitor=[&](unsigned int solidIndex, double& tMax)
+		{
+			visitSolid(hierarchySolidList[solidIndex],hierarchySolidOrder[solidIndex]);
+			tMax=reach();
+			return false;
+		};
+		hierarchy.Traverse(vantage,direction,reach(),visitor);
 
-		PixelList ambigiousPixelList;
+		if (tieCount == 1)
+		{
+			// Only now is it worth finding the point and surface normal.
+			closest.solid->CompleteIntersection(vantage,direction,closest,intersection);
+		}
+		return tieCount;
+	}
 
-		for (size_t i = 0; i < largePixelWide; i++)
+	void Scene::FindClosestIntersectionPoints(ThreadContext & context, const RayPacket & packet, Intersection * intersection, int * numClosest) const
+	{
+		// The same search as FindClosestIntersectionPoint, run for every
+		// ray in the packet at once: each solid is asked about all rays
+		// in one call, which lets Sphere use its vector kernel.
+		RayHit closest[RayPacket::MAX_SIZE];
+		size_t closestOrder[RayPacket::MAX_SIZE];
+		int tieCount[RayPacket::MAX_SIZE];
+		const bool isTieBroken=(ambiguityPolicy == AMBIGUITY_FIRST_SOLID);
+		alignas(64) double maxDistanceSquared[RayPacket::MAX_SIZE];
+		double tMax[RayPacket::MAX_SIZE];
+		double directionMagnitudeSquared[RayPacket::MAX_SIZE];
+		for (size_t k = 0; k < RayPacket::MAX_SIZE; ++k)
 		{
-			direction.x=(i-largePixelWide/2.0)/largeZoom;
+			tieCount[k]=0;
+			maxDistanceSquared[k]=HUGE_VAL;
+			tMax[k]=HUGE_VAL;
+			directionMagnitudeSquared[k]=packet.Direction(k).MagnetitudeSquared();
+		}
 
-			for (size_t j = 0; j < largePixelHigh; j++)
-			{
-				direction.y=(largePixelHigh/2.0-j)/largeZoom;
+		RayHit hit[RayPacket::MAX_SIZE];
+		int numHits[RayPacket::MAX_SIZE];
 
-				PixelData& pixel = buffer.Pixel(i, j);
-				try
-				{
-					pixel.color = TarceRay(
-						camera,
-						direction,
-						ambientRefraction,
-						fullIntensity,
-						0
-					);
-				}
-				catch (AmbiguousIntersectionException)
+		auto visitSolid=[&](const SolidObject* solid, size_t order)
+		{
+			IMAGER_STATISTIC(context.statistics.intersectionTests+=packet.count;)
+			solid->FindClosestHits(packet,maxDistanceSquared,hit,numHits);
+			for (size_t k = 0; k < packet.count; ++k)
+			{
+				if (numHits[k] > 0)
 				{
-					pixel.isAmbiguous=true;
-					ambigiousPixelList.push_back(PixelCoordinates(i,j));
+					if (tieCount[k] == 0)
+					{
+						closest[k]=hit[k];
+						closestOrder[k]=order;
+						tieCount[k]=isTieBroken?1:numHits[k];
+					}
+					else
+					{
+						const double diff=hit[k].distanceSquared-closest[k].distanceSquared;
+						if (isTieBroken)
+						{
+							if ((diff < 0.0) || ((diff == 0.0) && (order < closestOrder[k])))
+							{
+								closest[k]=hit[k];
+								closestOrder[k]=order;
+							}
+						}
+						else if (fabs(diff) < EPSILON)
+						{
+							tieCount[k]+=numHits[k];
+						}
+						else if (diff < 0.0)
+						{
+							closest[k]=hit[k];
+							tieCount[k]=numHits[k];
+						}
+					}
+
+					maxDistanceSquared[k]=closest[k].distanceSquared+2.0*EPSILON;
+					tMax[k]=sqrt(maxDistanceSquared[k]/directionMagnitudeSquared[k]);
 				}
-				
 			}
+		};
+
+		for (size_t u = 0; u < unboundedSolidList.size(); ++u)
+		{
+			visitSolid(unboundedSolidList[u],unboundedSolidOrder[u]);
 		}
 
-		PixelList::const_iterator iter=ambigiousPixelList.begin();
-		PixelList::const_iterator end = ambigiousPixelList.end();
+		auto visitor=[&](unsigned int solidIndex)
+		{
+			visitSolid(hierarchySolidList[solidIndex],hierarchySolidOrder[solidIndex]);
+		};
+		hierarchy.TraversePacket(packet,tMax,visitor);
 
-		for (;iter!=end; ++iter)
+		for (size_t k = 0; k < packet.count; ++k)
 		{
-			const PixelCoordinates& p=*iter;
-			ResolveAmbiguousPixel(buffer,p.i,p.j);
+			numClosest[k]=tieCount[k];
+			if (tieCount[k] == 1)
+			{
+				closest[k].solid->CompleteIntersection(packet.vantage,packet.Direction(k),closest[k],intersection[k]);
+			}
 		}
 	}
-	void Scene::SetAmbientRefraction(double refraction)
-	{}
-	void Scene::AddDebugPoint(int iPixel, int jPixel)
-	{}
-
-	void Scene::ClearSolidObjectList()
-	{}
 
-	int Scene::FindClosestIntersectionPoint(const Vector3 & vantage, const Vector3 & direction, Intersection & intersection) const
+	bool Scene::HasClearLineOfSight(ThreadContext & context, const Vector3 & point1, const Vector3 & point2, const SolidObject *& lastOccluder) const
 	{
-		return 0;
-	}
+		const Vector3 dir=point2-point1;
+		const double gapDistanceSquared=dir.MagnetitudeSquared();
 
-	bool Scene::HasClearLineOfSight(const Vector3 & point1, const Vector3 & point2) const
-	{
-		return false;
+		IMAGER_STATISTIC(++context.statistics.shadowRays;)
+		if (lastOccluder != NULL)
+		{
+			IMAGER_STATISTIC(++context.statistics.shadowTests;)
+			if (lastOccluder->HasHitWithin(point1,dir,gapDistanceSquared))
+			{
+				IMAGER_STATISTIC(++context.statistics.shadowCacheHits;)
+				IMAGER_STATISTIC(++context.statistics.shadowsBlocked;)
+				return false;
+			}
+		}
+
+		auto isBlocking=[&](const SolidObject* solid)
+		{
+			if (solid == lastOccluder)
+			{
+				return false;
+			}
+			IMAGER_STATISTIC(++context.statistics.shadowTests;)
+			if (solid->HasHitWithin(point1,dir,gapDistanceSquared))
+			{
+				IMAGER_STATISTIC(++context.statistics.shadowsBlocked;)
+				lastOccluder=solid;
+				return true;
+			}
+			return false;
+		};
+
+		SolidObjectList::const_iterator iter=unboundedSolidList.begin();
+		SolidObjectList::const_iterator end=unboundedSolidList.end();
+		for (; iter != end; ++iter)
+		{
+			if (isBlocking(*iter))
+			{
+				return false;
+			}
+		}
+
+		// Since dir spans the gap exactly, the segment is the
+		// part of the ray with parameter between 0 and 1.
+		bool isBlocked=false;
+		auto visitor=[&](unsigned int solidIndex, double&)
+		{
+			isBlocked=isBlocking(hierarchySolidList[solidIndex]);
+			return isBlocked;
+		};
+		hierarchy.Traverse(point1,dir,1.0,visitor);
+
+		return !isBlocked;
 	}
 
-	Color Imager::Scene::TarceRay(const Vector3 & vantage, const Vector3 & direction, double refractiveIndex, Color rayIntensity, int recurtionDepth) const
+	bool Imager::Scene::TarceRay(ThreadContext & context, const Vector3 & vantage, const Vector3 & direction, double refractiveIndex, Color rayIntensity, int recurtionDepth, Color & outColor) const
 	{
 		Intersection intersection;
 		const int numClosest = FindClosestIntersectionPoint(
+			context,
 			vantage,
 			direction,
 			intersection
 		);
 
+		return ShadeRay(context,numClosest,intersection,direction,refractiveIndex,rayIntensity,recurtionDepth,outColor);
+	}
+
+	bool Scene::ShadeRay(ThreadContext & context, int numClosest, const Intersection & intersection, const Vector3 & direction, double refractiveIndex, Color rayIntensity, int recurtionDepth, Color & outColor) const
+	{
+		IMAGER_STATISTIC(++context.statistics.raysAtDepth[(recurtionDepth < RenderStatistics::MAX_DEPTH)?recurtionDepth:RenderStatistics::MAX_DEPTH];)
+
 		switch (numClosest)
 		{
 		case 0:
 			// The ray of light did not hit anything.
 			// Therefore we see the background color attenuated
 			// by the incoming ray intensity.
-			return rayIntensity*backgroundColor;
+			outColor=rayIntensity*backgroundColor;
+			return true;
 
 			// The ray of light struck exactly one closest surface.
 			// Determine the lighting using that single intersection.
 		case 1:
-			return CalculateLighting(
-				intersection,
-				direction,
-				refractiveIndex,
-				rayIntensity,
-				1+recurtionDepth
-			);
-
-		default:
-			// There is an ambiguity: more than one intersection
-			// has the same minimum distance.  Caller must catch
-			// this exception and have a backup plan for handling
-			// this ray of light.
-			throw AmbiguousIntersectionException();
 			break;
+
+		default:
+			// There is an ambiguity: more than one intersection
+			// has the same minimum distance.  The caller needs
+			// a backup plan for handling this ray of light.
+			return false;
+		}
+
+		// Each secondary ray that hits something gets a frame above the
+		// surface it left, and its color is added to that surface's once
+		// the frame is done.  The sums come out exactly as they would if
+		// every ray were traced by a recursive call.
+		RayFrame* const rayStack=context.rayStack;
+		size_t top=0;
+		rayStack[0].intersection=intersection;
+		BeginLighting(context,rayStack[0],direction,refractiveIndex,MediumStack(),rayIntensity,1+recurtionDepth);
+
+		for (;;)
+		{
+			RayFrame& frame=rayStack[top];
+
+			Vector3 secondaryDirection;
+			double secondaryRefractiveIndex;
+			MediumStack secondaryMedia;
+			Color secondaryRayIntensity;
+			if (!NextSecondaryRay(context,frame,secondaryDirection,secondaryRefractiveIndex,secondaryMedia,secondaryRayIntensity))
+			{
+				if (top == 0)
+				{
+					outColor=frame.colorSum;
+					return true;
+				}
+				--top;
+				rayStack[top].colorSum+=frame.colorSum;
+				continue;
+			}
+
+			IMAGER_STATISTIC(++context.statistics.raysAtDepth[(frame.recursionDepth < RenderStatistics::MAX_DEPTH)?frame.recursionDepth:RenderStatistics::MAX_DEPTH];)
+
+			RayFrame& next=rayStack[top+1];
+			switch (FindClosestIntersectionPoint(context,frame.intersection.point,secondaryDirection,next.intersection))
+			{
+			case 0:
+				frame.colorSum+=secondaryRayIntensity*backgroundColor;
+				break;
+
+			case 1:
+				BeginLighting(context,next,secondaryDirection,secondaryRefractiveIndex,secondaryMedia,secondaryRayIntensity,1+frame.recursionDepth);
+				++top;
+				break;
+
+			default:
+				return false;
+			}
 		}
-		
 	}
-	Color Scene::CalculateLighting(const Intersection & intersection, const Vector3 & direction, double refractiveIndex, Color rayIntensity, int recursionDepth) const
+
+	void Scene::BeginLighting(ThreadContext & context, RayFrame & frame, const Vector3 & direction, double refractiveIndex, const MediumStack & media, Color rayIntensity, int recursionDepth) const
 	{
-		Color colorSum(0.0,0.0,0.0);
+		if (PrepareLighting(frame,direction,refractiveIndex,media,rayIntensity,recursionDepth))
+		{
+			AddMatteColor(frame,CalculateMatte(context,frame));
+		}
+	}
+
+	bool Scene::PrepareLighting(RayFrame & frame, const Vector3 & direction, double refractiveIndex, const MediumStack & media, Color rayIntensity, int recursionDepth) const
+	{
+		frame.direction=direction;
+		frame.refractiveIndex=refractiveIndex;
+		frame.media=media;
+		frame.rayIntensity=rayIntensity;
+		frame.recursionDepth=recursionDepth;
+		frame.refractiveReflectionFactor=0.0;
+		frame.colorSum=Color(0.0,0.0,0.0);
+		frame.stage=RayFrame::DONE;
+
 		if (recursionDepth <= MAX_OPTICAL_RECURSION_DEPTH) {
 			if (IsSignificant(rayIntensity))
 			{
-				if (intersection.solid == NULL) {
+				if (frame.intersection.solid == NULL) {
 					throw ImageException("Undefined solid at intersection.");
 				}
-				const SolidObject& solid=*intersection.solid;
-
-				const Optics optics = solid.SurfaceOptics(
-					intersection.point,
-					intersection.context
-				);
-
-				const double opacity=optics.GetOpacity();
-				const double transparency=1.0-opacity;
-				if (opacity > 0.0) {
-					const Color matteColor=opacity*optics.GetMatteColor()*rayIntensity*CalculateMatte(intersection);
-					colorSum+=matteColor;
-
-					double refractiveReflectionFactor=0.0;
-					if (transparency > 0.0) {
-						colorSum += CalculateRefraction(
-							intersection,
-							direction,
-							refractiveIndex,
-							transparency*rayIntensity,
-							recursionDepth,
-							refractiveReflectionFactor
-						);
-					}
+				frame.material=&SurfaceMaterial(frame.intersection);
+				if (frame.material->opacity > 0.0) {
+					frame.stage=(frame.material->transparency > 0.0)?RayFrame::REFRACTION:RayFrame::REFLECTION;
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+
+	void Scene::AddMatteColor(RayFrame & frame, const Color & lightSum) const
+	{
+		const Color matteColor=frame.material->opaqueMatteColor*frame.rayIntensity*lightSum;
+		frame.colorSum+=matteColor;
+	}
 
-					Color reflectionColor(1.0,1.0,1.0);
-					reflectionColor *=transparency*refractiveReflectionFactor;
+	bool Scene::NextSecondaryRay(ThreadContext & context, RayFrame & frame, Vector3 & outDirection, double & outRefractiveIndex, MediumStack & outMedia, Color & outRayIntensity) const
+	{
+		if (frame.stage == RayFrame::REFRACTION)
+		{
+			frame.stage=RayFrame::REFLECTION;
+			if (CalculateRefraction(
+				context,
+				frame.intersection,
+				frame.direction,
+				frame.refractiveIndex,
+				frame.media,
+				outDirection,
+				outRefractiveIndex,
+				outMedia,
+				frame.refractiveReflectionFactor))
+			{
+				outRayIntensity=(1.0-frame.refractiveReflectionFactor)*(frame.material->transparency*frame.rayIntensity);
 
-					reflectionColor+=opacity*optics.GetGlossColor();
+				++context.secondaryRayCount;
+				IMAGER_STATISTIC(++context.statistics.refractionRays;)
+				return true;
+			}
+		}
 
-					reflectionColor*=rayIntensity;
+		if (frame.stage == RayFrame::REFLECTION)
+		{
+			frame.stage=RayFrame::DONE;
 
-					if (IsSignificant(reflectionColor)) {
-						const Color matteColor = CalculateReflection(
-							intersection,direction,refractiveIndex,reflectionColor,recursionDepth);
-						colorSum+=matteColor;
-					}
-				}
+			Color reflectionColor(1.0,1.0,1.0);
+			reflectionColor *=frame.material->transparency*frame.refractiveReflectionFactor;
+
+			reflectionColor+=frame.material->opaqueGlossColor;
+
+			reflectionColor*=frame.rayIntensity;
+
+			if (IsSignificant(reflectionColor)) {
+				const Vector3& normal =frame.intersection.surfaceNormal;
+				const double perp=2.0*DotProduct(frame.direction,normal);
+				outDirection=frame.direction-(perp*normal);
+				outRefractiveIndex=frame.refractiveIndex;
+				outMedia=frame.media;
+				outRayIntensity=reflectionColor;
+
+				++context.secondaryRayCount;
+				IMAGER_STATISTIC(++context.statistics.reflectionRays;)
+				return true;
 			}
 		}
-		return colorSum;
+
+		return false;
 	}
-	Color Scene::CalculateMatte(const Intersection & intersection) const
+
+	Color Scene::CalculateMatte(ThreadContext & context, const RayFrame & frame) const
 	{
+		const Intersection& intersection=frame.intersection;
 		Color colorSum(0.0,0.0,0.0);
 
-		LightSourceList::const_iterator iter=lightSourceList.begin();
-		LightSourceList::const_iterator end = lightSourceList.end();
-
-		for (;iter!=end; ++iter)
+		std::vector<LightChoice>& choiceList=context.lightChoiceList;
+		SelectLights(context,frame,choiceList);
+		for (size_t c = 0; c < choiceList.size(); ++c)
 		{
-			const LightSource& source=*iter;
+			const size_t k=choiceList[c].light;
+			const LightSource& source=lightSourceList[k];
 
-			if (HasClearLineOfSight(intersection.point,source.location))
+			++context.shadowRayCount;
+			if (HasClearLineOfSight(context,intersection.point,source.location,context.shadowCache[k]))
 			{
-				Vector3 direction=source.location-intersection.point;
-
-				const double incidence = DotProduct(
-					intersection.surfaceNormal,direction);
-
-				if (incidence > 0.0) {
-					const double intensity=incidence/direction.MagnetitudeSquared();
-					colorSum+=intensity*source.color;
-				}
+				AddDiffuseLight(intersection,source,choiceList[c].scale,colorSum);
 			}
 		}
 
 		return colorSum;
 	}
-	Color Scene::CalculateReflection(const Intersection & intersection, const Vector3 & incidentDir, double refectiveIndex, Color rayIntensity, int recurtionDepth) const
+
+	void Scene::SelectLights(ThreadContext & context, const RayFrame & frame, std::vector<LightChoice>& choiceList) const
 	{
-		const Vector3& normal =intersection.surfaceNormal;
-		const double perp=2.0*DotProduct(incidentDir,normal);
-		const Vector3 reflectDir=incidentDir-(perp*normal);
+		const Intersection& intersection=frame.intersection;
+		const Color weight=frame.material->opaqueMatteColor*frame.rayIntensity;
+		choiceList.clear();
 
-		return TarceRay(
-			intersection.point,
-			reflectDir,
-			refectiveIndex,
-			rayIntensity,
-			recurtionDepth
-			);
-	}
+		auto consider=[&](size_t k)
+		{
+			const LightSource& source=lightSourceList[k];
+			const Vector3 direction=source.location-intersection.point;
+			const double incidence=DotProduct(intersection.surfaceNormal,direction);
+			if (incidence <= 0.0)
+			{
+				// Behind the surface, so it adds nothing whether or not it is blocked.
+				return;
+			}
+
+			const Color reaching=(incidence/direction.MagnetitudeSquared())*(weight*source.color);
+			if (isLightCulling && !IsSignificant(reaching))
+			{
+				return;
+			}
+
+			LightChoice choice;
+			choice.light=k;
+			choice.strength=LargestComponent(reaching);
+			choice.scale=1.0;
+			choiceList.push_back(choice);
+		};
+
+		if (isLightCulling && (LargestComponent(weight) <= 1.0))
+		{
+			// Only lights whose boxes hold the point can be significant.
+			auto visitor=[&](unsigned int k)
+			{
+				consider(k);
+				return false;
+			};
+			lightHierarchy.TraverseOverlapping(BoundingBox(intersection.point,intersection.point),visitor);
+			std::sort(choiceList.begin(),choiceList.end(),
+				[](const LightChoice& a, const LightChoice& b) { return a.light < b.light; });
+		}
+		else
+		{
+			for (size_t k = 0; k < lightSourceList.size(); ++k)
+			{
+				consider(k);
+			}
+		}
+
+		if ((lightSampleCount == 0) || (choiceList.size() <= lightSampleCount))
+		{
+			return;
+		}
+
+		// Draw lightSampleCount lights, with replacement, each with
+		// probability strength/totalStrength, and give each draw of a
+		// light the scale that makes the sum's expected value exact.
+		std::vector<double>& strengthSumList=context.lightStrengthSumList;
+		strengthSumList.resize(choiceList.size());
+		double totalStrength=0.0;
+		for (size_t c = 0; c < choiceList.size(); ++c)
+		{
+			totalStrength+=choiceList[c].strength;
+			strengthSumList[c]=totalStrength;
+			choiceList[c].scale=0.0;
+		}
 
+		unsigned long long state=LightSampleSeed(intersection.point);
+		for (size_t n = 0; n < lightSampleCount; ++n)
+		{
+			const double target=NextLightSample(state)*totalStrength;
+			size_t c=std::upper_bound(strengthSumList.begin(),strengthSumList.end(),target)-strengthSumList.begin();
+			if (c == choiceList.size())
+			{
+				--c;
+			}
+			choiceList[c].scale+=totalStrength/(lightSampleCount*choiceList[c].strength);
+		}
 
-	Color Scene::CalculateRefraction(
+		// Keep only the lights drawn at least once.
+		size_t numChosen=0;
+		for (size_t c = 0; c < choiceList.size(); ++c)
+		{
+			if (choiceList[c].scale > 0.0)
+			{
+				choiceList[numChosen++]=choiceList[c];
+			}
+		}
+		choiceList.resize(numChosen);
+	}
+	bool Scene::CalculateRefraction(
+		ThreadContext & context,
 		const Intersection & intersection,
 		const Vector3 & direction,
 		double sourceRefectiveIndex,
-		Color rayIntensity,
-		int recurtionDepth,
+		const MediumStack & sourceMedia,
+		Vector3 & outDirection,
+		double & outTargetRefractiveIndex,
+		MediumStack & outTargetMedia,
 		 double & outRefrectionFactor) const
 	{
 		const Vector3 dirUnit=direction.UnitVector();
@@ -280,17 +2580,43 @@ namespace Imager
 		const double SMALL_SHIFT=0.001;
 		const Vector3 testPoint=intersection.point+SMALL_SHIFT*dirUnit;
 
-		const SolidObject* container=PrimaryContainer(testPoint);
+		// Guess the solid on the other side from the media the ray is in:
+		// a ray leaving the innermost one returns to the one around it,
+		// and any other ray is going into the solid it hit.
+		MediumStack targetMedia=sourceMedia;
+		if (targetMedia.Innermost() == intersection.solid)
+		{
+			targetMedia.Pop();
+		}
+		else
+		{
+			targetMedia.Push(intersection.solid);
+		}
+		const SolidObject* guess=targetMedia.Innermost();
+
+		const SolidObject* container=PrimaryContainer(context,testPoint,guess);
+		if (container != guess)
+		{
+			targetMedia=MediumStack();
+			if (container != NULL)
+			{
+				targetMedia.Push(container);
+			}
+		}
+		outTargetMedia=targetMedia;
 
 		const double targetRefractiveIndex=(container!=NULL)?container->GetRefractiveIndex():ambientRefraction;
+		outTargetRefractiveIndex=targetRefractiveIndex;
 
 		const double ratio=sourceRefectiveIndex/targetRefractiveIndex;
 
 		const double sin_a2=ratio*sin_a1;
 
 		if (sin_a2 <= -1.0 || sin_a2 >= 1.0) {
+			// Total internal reflection.
+			IMAGER_STATISTIC(++context.statistics.totalInternalReflections;)
 			outRefrectionFactor=1.0;
-			return Color(0.0,0.0,0.0);
+			return false;
 		}
 
 		double k[2];
@@ -301,14 +2627,13 @@ namespace Imager
 			k);
 
 		double maxAlignment=-0.001;
-		Vector3 refractionDir;
 		for (int i = 0; i < numSolutions; i++)
 		{
 			Vector3 refractionAttempt=dirUnit+(k[i]*intersection.surfaceNormal);
 			double alignment=DotProduct(dirUnit,refractionAttempt);
 			if (alignment > maxAlignment) {
 				maxAlignment=alignment;
-				refractionDir=refractionAttempt;
+				outDirection=refractionAttempt;
 			}
 		}
 
@@ -318,7 +2643,7 @@ namespace Imager
 
 		double cos_a2=sqrt(1.0-sin_a2*sin_a2);
 		if (cos_a1 < 0.0) {
-			cos_a2-=cos_a2;
+			cos_a2=-cos_a2;
 		}
 
 
@@ -338,33 +2663,131 @@ namespace Imager
 			cos_a1);
 
 		outRefrectionFactor = (Rs + Rp) / 2.0;
-
-		const Color nextRayIntensity=(1.0-outRefrectionFactor)*rayIntensity;
-
-		return TarceRay(
-		intersection.point,
-			refractionDir,
-			targetRefractiveIndex,
-			nextRayIntensity,
-			recurtionDepth
-		)
-
-
-
-		
+		return true;
 	}
-	const SolidObject * Scene::PrimaryContainer(const Vector3 & point) const
+	const SolidObject * Scene::PrimaryContainer(ThreadContext & context, const Vector3 & point, const SolidObject * guess) const
 	{
-		return nullptr;
+		const SolidObject* container=NULL;
+		size_t containerOrder=solidObjectList.size();
+		if (guess != NULL)
+		{
+			IMAGER_STATISTIC(++context.statistics.containmentTests;)
+			if (guess->Contains(point))
+			{
+				const SolidPlace& place=solidPlaceMap.find(guess)->second;
+				if (!place.isOverlapped)
+				{
+					return guess;
+				}
+				container=guess;
+				containerOrder=place.order;
+			}
+		}
+
+		// Otherwise the answer is the first solid, ahead of any found so
+		// far, that contains the point: the first unbounded one that does...
+		for (size_t k = 0; (k < unboundedSolidList.size()) && (unboundedSolidOrder[k] < containerOrder); ++k)
+		{
+			IMAGER_STATISTIC(++context.statistics.containmentTests;)
+			if (unboundedSolidList[k]->Contains(point))
+			{
+				container=unboundedSolidList[k];
+				containerOrder=unboundedSolidOrder[k];
+				break;
+			}
+		}
+
+		// ...or one ahead of that among the solids whose boxes reach the point.
+		auto visitor=[&](unsigned int index)
+		{
+			if (hierarchySolidOrder[index] < containerOrder)
+			{
+				IMAGER_STATISTIC(++context.statistics.containmentTests;)
+				if (hierarchySolidList[index]->Contains(point))
+				{
+					container=hierarchySolidList[index];
+					containerOrder=hierarchySolidOrder[index];
+				}
+			}
+			return false;
+		};
+		hierarchy.TraverseOverlapping(BoundingBox(point,point).Expanded(CONTAINMENT_MARGIN),visitor);
+		return container;
 	}
 	double Scene::PolarizedReflection(double n1, double n2, double cos_a1, double cos_a2) const
 	{
-		return 0.0;
+		const double left=n1*cos_a1;
+		const double right=n2*cos_a2;
+		const double numer=left-right;
+		double denom=left+right;
+		denom*=denom;
+		if (denom < EPSILON)
+		{
+			// Assume complete reflection.
+			return 1.0;
+		}
+		const double reflection=(numer*numer)/denom;
+		if (reflection > 1.0)
+		{
+			// Clamp to actual upper limit.
+			return 1.0;
+		}
+		return reflection;
 	}
 	void Scene::ResolveAmbiguousPixel(ImageBuffer & buffer, size_t i, size_t j) const
-	{}
+	{
+		// SaveImage could not decide which of several equally close
+		// surfaces this pixel shows.  Use the average color of the
+		// surrounding pixels that were not ambiguous.
+		Color sum(0.0,0.0,0.0);
+		int numFound=0;
+
+		const size_t iFirst=(i > 0)?(i-1):0;
+		const size_t jFirst=(j > 0)?(j-1):0;
+		const size_t iLast=(i+1 < buffer.GetPixelsWide())?(i+1):i;
+		const size_t jLast=(j+1 < buffer.GetPixelHigh())?(j+1):j;
+
+		for (size_t si = iFirst; si <= iLast; ++si)
+		{
+			for (size_t sj = jFirst; sj <= jLast; ++sj)
+			{
+				if (!buffer.IsAmbiguous(si,sj))
+				{
+					sum+=buffer.UncheckedPixel(si,sj).color;
+					++numFound;
+				}
+			}
+		}
+
+		if (numFound > 0)
+		{
+			sum/=numFound;
+		}
+
+		buffer.UncheckedPixel(i,j).color=sum;
+	}
 	unsigned char Scene::ConvertPixelValue(double colorComponent, double maxColorValue)
 	{
-		return 0;
+		int pixelValue=static_cast<int>(255.0*colorComponent/maxColorValue);
+
+		// Clamp to the allowed range of values 0..255.
+		if (pixelValue < 0)
+		{
+			pixelValue=0;
+		}
+		else if (pixelValue > 255)
+		{
+			pixelValue=255;
+		}
+		return static_cast<unsigned char>(pixelValue);
+	}
+	void Scene::ConvertRow(const Color * average, size_t pixelWide, double maxColorValue, unsigned char * rgb)
+	{
+		for (size_t i = 0; i < pixelWide; ++i)
+		{
+			rgb[3*i]=ConvertPixelValue(average[i].red,maxColorValue);
+			rgb[3*i+1]=ConvertPixelValue(average[i].green,maxColorValue);
+			rgb[3*i+2]=ConvertPixelValue(average[i].blue,maxColorValue);
+		}
 	}
 }
\ No newline at end of file
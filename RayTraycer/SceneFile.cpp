@@ -0,0 +1,491 @@
+#include"Imager.h"
+#include<cstdint>
+#include<cmath>
+#include<cstring>
+#include<typeinfo>
+
+namespace Imager
+{
+	namespace
+	{
+		// A scene file is a FileHeader followed by blocks the header and
+		// the solid records point at by their offset from the start of
+		// the file.  Every block starts on a cache line, so the arrays of
+		// a sphere batch can be read in place once the file is mapped.
+		// Numbers are stored in the writing machine's own format.
+		const char SCENE_FILE_MAGIC[8]={'I','M','G','S','C','E','N','E'};
+
+		// Change whenever a record or BoundingVolumeHierarchy::Node changes.
+		const uint32_t SCENE_FILE_VERSION=2;
+
+		// Reads back differently on a machine with the other byte order.
+		const uint32_t BYTE_ORDER_MARK=0x01020304u;
+
+		const size_t SCENE_FILE_ALIGNMENT=CACHE_LINE_BYTES;
+
+		enum SolidType
+		{
+			SOLID_SPHERE = 1,
+			SOLID_SPHERE_BATCH = 2
+		};
+
+		struct OpticsRecord
+		{
+			double matteColor[3];
+			double glossColor[3];
+			double opacity;
+		};
+
+		// Tags are stored together in one block of text.
+		struct TagRecord
+		{
+			uint64_t offset;
+			uint64_t bytes;
+		};
+
+		struct FileHeader
+		{
+			char magic[8];
+			uint32_t version;
+			uint32_t byteOrderMark;
+			uint32_t nodeBytes;                 // sizeof(BoundingVolumeHierarchy::Node)
+			uint32_t reserved;
+			uint64_t fileBytes;
+			double backgroundColor[3];
+			double ambientRefraction;
+			uint64_t lightCount;
+			uint64_t lightOffset;
+			uint64_t solidCount;
+			uint64_t solidOffset;
+			uint64_t textOffset;
+			uint64_t textBytes;
+
+			// The scene's hierarchy over its bounded solids, in the order
+			// they appear among the solid records.
+			uint64_t hierarchyNodeCount;
+			uint64_t hierarchyNodeOffset;
+			uint64_t hierarchyPrimitiveCount;
+			uint64_t hierarchyPrimitiveOrderOffset;
+		};
+
+		struct LightRecord
+		{
+			double location[3];
+			double color[3];
+			TagRecord tag;
+		};
+
+		struct SolidRecord
+		{
+			uint32_t type;                      // a SolidType
+			uint32_t reserved;
+			TagRecord tag;
+			double center[3];
+			OpticsRecord uniformOptics;
+			double refractiveIndex;
+
+			// SOLID_SPHERE only.
+			double radius;
+
+			// SOLID_SPHERE_BATCH only, laid out as SphereBatch::GetSphereArrays
+			// returns them.  The primitive order has sphereCount entries.
+			uint64_t sphereCount;
+			uint64_t paddedCount;
+			uint64_t materialCount;
+			uint64_t nodeCount;
+			uint64_t centerXOffset;
+			uint64_t centerYOffset;
+			uint64_t centerZOffset;
+			uint64_t radiusOffset;
+			uint64_t materialIndexOffset;
+			uint64_t materialOffset;            // materialCount OpticsRecords
+			uint64_t nodeOffset;
+			uint64_t primitiveOrderOffset;
+		};
+
+		void StoreVector(const Vector3& vector, double* record)
+		{
+			record[0]=vector.x;
+			record[1]=vector.y;
+			record[2]=vector.z;
+		}
+
+		void StoreColor(const Color& color, double* record)
+		{
+			record[0]=color.red;
+			record[1]=color.green;
+			record[2]=color.blue;
+		}
+
+		OpticsRecord StoreOptics(const Optics& optics)
+		{
+			OpticsRecord record;
+			StoreColor(optics.GetMatteColor(),record.matteColor);
+			StoreColor(optics.GetGlossColor(),record.glossColor);
+			record.opacity=optics.GetOpacity();
+			return record;
+		}
+
+		Vector3 LoadVector(const double* record)
+		{
+			return Vector3(record[0],record[1],record[2]);
+		}
+
+		Color LoadColor(const double* record)
+		{
+			return Color(record[0],record[1],record[2]);
+		}
+
+		// Validates the colors and opacity, as Optics always does.
+		Optics LoadOptics(const OpticsRecord& record)
+		{
+			return Optics(LoadColor(record.matteColor),LoadColor(record.glossColor),record.opacity);
+		}
+
+		// Also false for NaN.
+		bool IsValidRadius(double radius)
+		{
+			return (radius > 0.0) && std::isfinite(radius);
+		}
+
+		// Build never makes more than 2n-1 nodes, and makes none for no primitives.
+		bool IsValidNodeCount(uint64_t nodeCount, uint64_t primitiveCount)
+		{
+			if (primitiveCount == 0)
+			{
+				return nodeCount == 0;
+			}
+			return (nodeCount > 0) && (nodeCount <= 2*primitiveCount-1);
+		}
+
+		// The blocks of a file being written, in order, each placed at the
+		// next aligned offset.  Nothing is copied; each block's memory must
+		// stay valid and unchanged until Write.
+		class FileLayout
+		{
+		public:
+			FileLayout()
+				: size(0)
+			{}
+
+			// Returns the block's offset from the start of the file.
+			uint64_t Add(const void* data, size_t bytes)
+			{
+				Block block;
+				block.data=data;
+				block.bytes=bytes;
+				block.offset=(size+SCENE_FILE_ALIGNMENT-1)/SCENE_FILE_ALIGNMENT*SCENE_FILE_ALIGNMENT;
+				blockList.push_back(block);
+				size=block.offset+bytes;
+				return block.offset;
+			}
+
+			uint64_t GetSize() const
+			{
+				return size;
+			}
+
+			void Write(std::ofstream& output) const
+			{
+				const char padding[SCENE_FILE_ALIGNMENT]={0};
+				uint64_t position=0;
+				for (size_t b = 0; b < blockList.size(); ++b)
+				{
+					const Block& block=blockList[b];
+					output.write(padding,static_cast<std::streamsize>(block.offset-position));
+					output.write(static_cast<const char*>(block.data),static_cast<std::streamsize>(block.bytes));
+					position=block.offset+block.bytes;
+				}
+			}
+
+		private:
+			struct Block
+			{
+				const void* data;
+				size_t bytes;
+				uint64_t offset;
+			};
+
+			std::vector<Block> blockList;
+			uint64_t size;
+		};
+
+		// Returns the count records of type T that start offset bytes
+		// into the file, after checking they lie inside it.
+		template <typename T>
+		const T* FileArray(const MappedFile& file, uint64_t offset, uint64_t count)
+		{
+			const uint64_t fileBytes=file.GetSize();
+			if ((offset > fileBytes) || (count > (fileBytes-offset)/sizeof(T)) || ((offset % alignof(T)) != 0))
+			{
+				throw ImageException("Scene file is corrupt.");
+			}
+			return reinterpret_cast<const T*>(file.GetData()+offset);
+		}
+	}
+
+	void Scene::SaveSceneFile(const char * fileName) const
+	{
+		FileHeader header;
+		memset(&header,0,sizeof(header));
+		memcpy(header.magic,SCENE_FILE_MAGIC,sizeof(header.magic));
+		header.version=SCENE_FILE_VERSION;
+		header.byteOrderMark=BYTE_ORDER_MARK;
+		header.nodeBytes=sizeof(BoundingVolumeHierarchy::Node);
+		StoreColor(backgroundColor,header.backgroundColor);
+		header.ambientRefraction=ambientRefraction;
+
+		FileLayout layout;
+		layout.Add(&header,sizeof(header));
+
+		std::string text;
+		auto storeTag=[&](const std::string& tag)
+		{
+			TagRecord record;
+			record.offset=text.size();
+			record.bytes=tag.size();
+			text+=tag;
+			return record;
+		};
+
+		std::vector<LightRecord> lightRecordList(lightSourceList.size());
+		for (size_t k = 0; k < lightSourceList.size(); ++k)
+		{
+			const LightSource& source=lightSourceList[k];
+			LightRecord& record=lightRecordList[k];
+			StoreVector(source.location,record.location);
+			StoreColor(source.color,record.color);
+			record.tag=storeTag(source.GetTag());
+		}
+
+		// A deque, so the blocks already added stay where they are.
+		std::deque<std::vector<OpticsRecord> > materialBlockList;
+
+		std::vector<SolidRecord> solidRecordList(solidObjectList.size());
+		for (size_t k = 0; k < solidObjectList.size(); ++k)
+		{
+			const SolidObject& solid=*solidObjectList[k];
+			SolidRecord& record=solidRecordList[k];
+			memset(&record,0,sizeof(record));
+			record.tag=storeTag(solid.GetTag());
+			StoreVector(solid.Center(),record.center);
+			record.uniformOptics=StoreOptics(solid.GetUniformOptics());
+			record.refractiveIndex=solid.GetRefractiveIndex();
+
+			// Exact types only: a subclass may behave differently.
+			if (typeid(solid) == typeid(Sphere))
+			{
+				record.type=SOLID_SPHERE;
+				record.radius=static_cast<const Sphere&>(solid).GetRadius();
+			}
+			else if (typeid(solid) == typeid(SphereBatch))
+			{
+				const SphereBatch& batch=static_cast<const SphereBatch&>(solid);
+				const SphereBatch::SphereArrays arrays=batch.GetSphereArrays();
+				const BoundingVolumeHierarchy& hierarchy=batch.GetHierarchy();
+
+				materialBlockList.push_back(std::vector<OpticsRecord>());
+				std::vector<OpticsRecord>& materialBlock=materialBlockList.back();
+				for (size_t m = 0; m < batch.GetMaterialCount(); ++m)
+				{
+					materialBlock.push_back(StoreOptics(batch.GetMaterial(m)));
+				}
+
+				record.type=SOLID_SPHERE_BATCH;
+				record.sphereCount=arrays.sphereCount;
+				record.paddedCount=arrays.paddedCount;
+				record.materialCount=materialBlock.size();
+				record.nodeCount=hierarchy.GetNodeCount();
+				record.centerXOffset=layout.Add(arrays.centerX,arrays.paddedCount*sizeof(double));
+				record.centerYOffset=layout.Add(arrays.centerY,arrays.paddedCount*sizeof(double));
+				record.centerZOffset=layout.Add(arrays.centerZ,arrays.paddedCount*sizeof(double));
+				record.radiusOffset=layout.Add(arrays.radius,arrays.paddedCount*sizeof(double));
+				record.materialIndexOffset=layout.Add(arrays.materialIndex,arrays.sphereCount*sizeof(unsigned int));
+				record.materialOffset=layout.Add(materialBlock.data(),materialBlock.size()*sizeof(OpticsRecord));
+				record.nodeOffset=layout.Add(hierarchy.GetNodes(),hierarchy.GetNodeCount()*sizeof(BoundingVolumeHierarchy::Node));
+				record.primitiveOrderOffset=layout.Add(hierarchy.GetPrimitiveOrder().Data(),hierarchy.GetPrimitiveCount()*sizeof(unsigned int));
+			}
+			else
+			{
+				throw ImageException("Scene files can only hold Sphere and SphereBatch solids.");
+			}
+		}
+
+		header.lightCount=lightRecordList.size();
+		header.lightOffset=layout.Add(lightRecordList.data(),lightRecordList.size()*sizeof(LightRecord));
+		header.solidCount=solidRecordList.size();
+		header.solidOffset=layout.Add(solidRecordList.data(),solidRecordList.size()*sizeof(SolidRecord));
+		header.textBytes=text.size();
+		header.textOffset=layout.Add(text.data(),text.size());
+
+		// Saved as a render would use it, so loading need not build it.
+		PrepareAccelerationStructure();
+		header.hierarchyNodeCount=hierarchy.GetNodeCount();
+		header.hierarchyNodeOffset=layout.Add(hierarchy.GetNodes(),hierarchy.GetNodeCount()*sizeof(BoundingVolumeHierarchy::Node));
+		header.hierarchyPrimitiveCount=hierarchy.GetPrimitiveCount();
+		header.hierarchyPrimitiveOrderOffset=layout.Add(hierarchy.GetPrimitiveOrder().Data(),hierarchy.GetPrimitiveCount()*sizeof(unsigned int));
+		header.fileBytes=layout.GetSize();
+
+		std::ofstream output(fileName,std::ios::binary);
+		if (!output)
+		{
+			throw ImageException("Cannot open scene file for writing.");
+		}
+		layout.Write(output);
+		output.close();
+		if (!output)
+		{
+			throw ImageException("Cannot write scene file.");
+		}
+	}
+
+	void Scene::LoadSceneFile(const char * fileName)
+	{
+		ClearSolidObjectList();
+		lightSourceList.clear();
+		isLightHierarchyStale=true;
+
+		// Solids that read from the file keep it mapped.
+		const std::shared_ptr<const MappedFile> file=std::make_shared<MappedFile>(fileName);
+
+		try
+		{
+			if (file->GetSize() < sizeof(FileHeader))
+			{
+				throw ImageException("Not a scene file.");
+			}
+			const FileHeader& header=*FileArray<FileHeader>(*file,0,1);
+			if (memcmp(header.magic,SCENE_FILE_MAGIC,sizeof(header.magic)) != 0)
+			{
+				throw ImageException("Not a scene file.");
+			}
+			if (header.version != SCENE_FILE_VERSION)
+			{
+				throw ImageException("Scene file version is not supported.");
+			}
+			if ((header.byteOrderMark != BYTE_ORDER_MARK) || (header.nodeBytes != sizeof(BoundingVolumeHierarchy::Node)))
+			{
+				throw ImageException("Scene file was written by an incompatible build or machine.");
+			}
+			if (header.fileBytes != file->GetSize())
+			{
+				throw ImageException("Scene file is truncated.");
+			}
+
+			const char* text=FileArray<char>(*file,header.textOffset,header.textBytes);
+			auto loadTag=[&](const TagRecord& record)
+			{
+				if ((record.offset > header.textBytes) || (record.bytes > header.textBytes-record.offset))
+				{
+					throw ImageException("Scene file is corrupt.");
+				}
+				return std::string(text+record.offset,static_cast<size_t>(record.bytes));
+			};
+
+			backgroundColor=LoadColor(header.backgroundColor);
+			SetAmbientRefraction(header.ambientRefraction);
+
+			const LightRecord* lightRecordList=FileArray<LightRecord>(*file,header.lightOffset,header.lightCount);
+			for (size_t k = 0; k < header.lightCount; ++k)
+			{
+				const LightRecord& record=lightRecordList[k];
+				AddLightSource(LightSource(LoadVector(record.location),LoadColor(record.color),loadTag(record.tag)));
+			}
+
+			const SolidRecord* solidRecordList=FileArray<SolidRecord>(*file,header.solidOffset,header.solidCount);
+			for (size_t k = 0; k < header.solidCount; ++k)
+			{
+				const SolidRecord& record=solidRecordList[k];
+				SolidObject* solid=NULL;
+				if (record.type == SOLID_SPHERE)
+				{
+					if (!IsValidRadius(record.radius))
+					{
+						throw ImageException("Scene file is corrupt.");
+					}
+					solid=&AddSolidObject(new Sphere(LoadVector(record.center),record.radius));
+				}
+				else if (record.type == SOLID_SPHERE_BATCH)
+				{
+					SphereBatch* batch=new SphereBatch(LoadVector(record.center));
+					AddSolidObject(batch);
+					solid=batch;
+
+					const OpticsRecord* materialList=FileArray<OpticsRecord>(*file,record.materialOffset,record.materialCount);
+					for (size_t m = 0; m < record.materialCount; ++m)
+					{
+						batch->AddMaterial(LoadOptics(materialList[m]));
+					}
+
+					if (record.sphereCount > 0)
+					{
+						if (!IsValidNodeCount(record.nodeCount,record.sphereCount))
+						{
+							throw ImageException("Scene file is corrupt.");
+						}
+
+						SphereBatch::SphereArrays arrays;
+						arrays.centerX=FileArray<double>(*file,record.centerXOffset,record.paddedCount);
+						arrays.centerY=FileArray<double>(*file,record.centerYOffset,record.paddedCount);
+						arrays.centerZ=FileArray<double>(*file,record.centerZOffset,record.paddedCount);
+						arrays.radius=FileArray<double>(*file,record.radiusOffset,record.paddedCount);
+						arrays.materialIndex=FileArray<unsigned int>(*file,record.materialIndexOffset,record.sphereCount);
+						arrays.sphereCount=static_cast<size_t>(record.sphereCount);
+						arrays.paddedCount=static_cast<size_t>(record.paddedCount);
+						const BoundingVolumeHierarchy::Node* nodes=FileArray<BoundingVolumeHierarchy::Node>(*file,record.nodeOffset,record.nodeCount);
+						const unsigned int* primitiveOrder=FileArray<unsigned int>(*file,record.primitiveOrderOffset,record.sphereCount);
+
+						// The padding after the spheres is NaN by design.
+						for (size_t i = 0; i < arrays.sphereCount; ++i)
+						{
+							if (!IsValidRadius(arrays.radius[i]))
+							{
+								throw ImageException("Scene file is corrupt.");
+							}
+						}
+						try
+						{
+							// Checks the material indexes and the hierarchy,
+							// which rendering trusts.
+							batch->BorrowSpheres(arrays,nodes,static_cast<size_t>(record.nodeCount),primitiveOrder,file);
+						}
+						catch (const ImageException&)
+						{
+							throw ImageException("Scene file is corrupt.");
+						}
+					}
+				}
+				else
+				{
+					throw ImageException("Scene file is corrupt.");
+				}
+
+				solid->SetTag(loadTag(record.tag));
+				solid->SetUniformOptics(LoadOptics(record.uniformOptics));
+				solid->SetRefraction(record.refractiveIndex);
+			}
+
+			if (!IsValidNodeCount(header.hierarchyNodeCount,header.hierarchyPrimitiveCount))
+			{
+				throw ImageException("Scene file is corrupt.");
+			}
+			const BoundingVolumeHierarchy::Node* nodes=FileArray<BoundingVolumeHierarchy::Node>(*file,header.hierarchyNodeOffset,header.hierarchyNodeCount);
+			const unsigned int* primitiveOrder=FileArray<unsigned int>(*file,header.hierarchyPrimitiveOrderOffset,header.hierarchyPrimitiveCount);
+			try
+			{
+				// Checks the hierarchy against the solids just loaded.
+				BorrowHierarchy(nodes,static_cast<size_t>(header.hierarchyNodeCount),primitiveOrder,static_cast<size_t>(header.hierarchyPrimitiveCount),file);
+			}
+			catch (const ImageException&)
+			{
+				throw ImageException("Scene file is corrupt.");
+			}
+		}
+		catch (...)
+		{
+			ClearSolidObjectList();
+			lightSourceList.clear();
+			throw;
+		}
+	}
+}
@@ -2,28 +2,150 @@
 
 namespace Imager
 {
-	
+	int PickClosestIntersection(const IntersectionList & list, Intersection & intersection)
+	{
+		// Returns the number of intersections tied for closest,
+		// so the caller can detect ambiguous hits.
+		const size_t count=list.size();
+		switch (count)
+		{
+		case 0:
+			return 0;
+
+		case 1:
+			intersection=list[0];
+			return 1;
+
+		default:
+			IntersectionList::const_iterator iter=list.begin();
+			IntersectionList::const_iterator end=list.end();
+			IntersectionList::const_iterator closest=iter;
+			int tieCount=1;
+			for (++iter; iter != end; ++iter)
+			{
+				const double diff=iter->distanceSquared-closest->distanceSquared;
+				if (fabs(diff) < EPSILON)
+				{
+					++tieCount;
+				}
+				else if (diff < 0.0)
+				{
+					tieCount=1;
+					closest=iter;
+				}
+			}
+			intersection=*closest;
+			return tieCount;
+		}
+	}
 
-	
 	SolidObject::SolidObject(const Vector3 & _center, bool _isFullyEnclosed)
 		:isFullyEnclosed(_isFullyEnclosed)
 	{
 		center = _center;
 		refractiveIndex = REFRACTION_GLASS;
+		materialIndex = 0;
+		surfaceMaterialIndex = 0;
 	}
 
 	int SolidObject::FindClosestIntersection(const Vector3 & vantage, const Vector3 & direction, Intersection & intersection) const
 	{
+		// Solids are shared by every render thread, so the scratch
+		// list has to belong to the thread rather than to the solid.
+		static thread_local IntersectionList cachedIntersectionList;
+
 		cachedIntersectionList.clear();
 		AppendAllIntersections(vantage,direction,cachedIntersectionList);
 		return PickClosestIntersection(cachedIntersectionList,intersection);
 	}
 
+	int SolidObject::FindClosestHit(const Vector3 & vantage, const Vector3 & direction, double maxDistanceSquared, RayHit & hit) const
+	{
+		Intersection intersection;
+		const int numClosest=FindClosestIntersection(vantage,direction,intersection);
+		if ((numClosest == 0) || !(intersection.distanceSquared < maxDistanceSquared))
+		{
+			return 0;
+		}
+
+		hit.distanceSquared=intersection.distanceSquared;
+		hit.t=sqrt(intersection.distanceSquared/direction.MagnetitudeSquared());
+		hit.solid=intersection.solid;
+		hit.context=intersection.context;
+		return numClosest;
+	}
+
+	void SolidObject::CompleteIntersection(const Vector3 & vantage, const Vector3 & direction, const RayHit &, Intersection & intersection) const
+	{
+		// Without a cheaper way to rebuild the winning intersection,
+		// repeat the search.  This runs once per ray, not once per candidate.
+		FindClosestIntersection(vantage,direction,intersection);
+	}
+
+	void SolidObject::FindClosestHits(const RayPacket & packet, const double * maxDistanceSquared, RayHit * hits, int * numClosest) const
+	{
+		for (size_t k = 0; k < packet.count; ++k)
+		{
+			numClosest[k]=FindClosestHit(packet.vantage,packet.Direction(k),maxDistanceSquared[k],hits[k]);
+		}
+	}
+
+	bool SolidObject::HasHitWithin(const Vector3 & vantage, const Vector3 & direction, double maxDistanceSquared) const
+	{
+		RayHit hit;
+		return FindClosestHit(vantage,direction,maxDistanceSquared,hit) != 0;
+	}
+
+	bool SolidObject::Contains(const Vector3 & point) const
+	{
+		if (isFullyEnclosed)
+		{
+			// Cast a ray from the point in an arbitrary direction.
+			// A point inside a closed surface crosses it an odd number of times.
+			static thread_local IntersectionList enclosedList;
+
+			enclosedList.clear();
+			AppendAllIntersections(point,Vector3(0.0,0.0,1.0),enclosedList);
+			return (enclosedList.size()%2)==1;
+		}
+
+		// A surface that does not enclose a volume contains nothing.
+		return false;
+	}
+
 	
 
-	Optics SolidObject::SurfaceOptics(const Vector3 & surfacePoint, const void * context) const
+	BoundingBox SolidObject::GetBoundingBox() const
 	{
-		return uniformOptics;
+		return BoundingBox::Infinite();
+	}
+
+	void SolidObject::Prepare() const
+	{
+	}
+
+	void SolidObject::AppendMaterials(MaterialList & materialList, SharedMaterialMap & sharedMaterialMap) const
+	{
+		materialIndex=materialList.size();
+		materialList.push_back(Material(uniformOptics));
+		surfaceMaterialIndex=AppendSurfaceMaterials(materialList,sharedMaterialMap);
+	}
+
+	size_t SolidObject::AppendSharedMaterials(MaterialList & materialList, SharedMaterialMap & sharedMaterialMap) const
+	{
+		SharedMaterialMap::const_iterator found=sharedMaterialMap.find(this);
+		if (found != sharedMaterialMap.end())
+		{
+			return found->second;
+		}
+		const size_t first=AppendSurfaceMaterials(materialList,sharedMaterialMap);
+		sharedMaterialMap[this]=first;
+		return first;
+	}
+
+	size_t SolidObject::SurfaceMaterial(const Vector3 &, const void *) const
+	{
+		return 0;
 	}
 
 	double SolidObject::GetRefractiveIndex() const
@@ -86,6 +208,11 @@ namespace Imager
 	{
 		return uniformOptics;
 	}
+
+	size_t SolidObject::AppendSurfaceMaterials(MaterialList & materialList, SharedMaterialMap &) const
+	{
+		return materialList.size();
+	}
 	
 
 
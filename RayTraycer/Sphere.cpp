@@ -1,18 +1,238 @@
 #include"Imager.h"
-#include"stdafx.h"
 
 namespace Imager
 {
+	namespace
+	{
+		// The discriminant b*b-4ac of a ray/sphere quadratic.  In float,
+		// b*b and 4ac nearly cancel for small, distant spheres and most of
+		// the digits are lost, so float builds use the equivalent
+		// 4a(r*r - d*d), with d the ray's closest approach to the center.
+		// Other builds keep the arithmetic of the packet kernels.
+		inline SolveScalar SphereRadicand(
+			SolveScalar a,
+			SolveScalar b,
+			SolveScalar c,
+			const SolveVector3& dir,
+			const SolveVector3& displacement,
+			SolveScalar radius)
+		{
+#if IMAGER_PRECISION == IMAGER_PRECISION_FLOAT
+			const SolveVector3 closestApproach=displacement-(b/(2.0f*a))*dir;
+			return 4.0f*a*(radius*radius-closestApproach.MagnetitudeSquared());
+#else
+			return b*b-4.0*a*c;
+#endif
+		}
+	}
+
 
 	Sphere::Sphere(const Vector3 & _center, double _radius):SolidObject(_center)
 	{
 		radius=_radius;
 		SetTag("Sphere");
+		Prepare();
+	}
+	double Sphere::GetRadius() const
+	{
+		return radius;
+	}
+	void Sphere::AppendAllIntersections(const Vector3 & vantage, const Vector3 & direction, IntersectionList & intersectionList) const
+	{
+		const SolveVector3 dir(direction);
+		const SolveVector3 displacement=SolveVector3(vantage)-hot.center;
+		const SolveScalar a=dir.MagnetitudeSquared();
+		const SolveScalar b=2.0*DotProduct(dir,displacement);
+		const SolveScalar c=displacement.MagnetitudeSquared()-hot.radiusSquared;
+
+		const SolveScalar radicand=SphereRadicand(a,b,c,dir,displacement,hot.radius);
+		if (radicand >= 0.0)
+		{
+			const SolveScalar root=sqrt(radicand);
+			const SolveScalar denom=2.0*a;
+			const SolveScalar u[2]={(-b+root)/denom,(-b-root)/denom};
+			for (int i = 0; i < 2; ++i)
+			{
+				// Ignore hits behind the vantage point, and the vantage
+				// point itself when it already lies on the surface.
+				if (u[i] > EPSILON)
+				{
+					Intersection intersection;
+					const SolveVector3 vantageToSurface=u[i]*dir;
+					const SolveVector3 point=SolveVector3(vantage)+vantageToSurface;
+					intersection.point=Vector3(point);
+					intersection.surfaceNormal=Vector3(hot.inverseRadius*(point-hot.center));
+					intersection.distanceSquared=vantageToSurface.MagnetitudeSquared();
+					intersection.solid=this;
+					intersectionList.push_back(intersection);
+				}
+			}
+		}
+	}
+	int Sphere::FindClosestHit(const Vector3 & vantage, const Vector3 & direction, double maxDistanceSquared, RayHit & hit) const
+	{
+		// Same arithmetic as AppendAllIntersections, so both paths
+		// agree exactly on which hits exist and how far away they are.
+		const SolveVector3 dir(direction);
+		const SolveVector3 displacement=SolveVector3(vantage)-hot.center;
+		const SolveScalar a=dir.MagnetitudeSquared();
+		const SolveScalar b=2.0*DotProduct(dir,displacement);
+		const SolveScalar c=displacement.MagnetitudeSquared()-hot.radiusSquared;
+
+		const SolveScalar radicand=SphereRadicand(a,b,c,dir,displacement,hot.radius);
+		if (radicand < 0.0)
+		{
+			return 0;
+		}
+
+		const SolveScalar root=sqrt(radicand);
+		const SolveScalar denom=2.0*a;
+		const SolveScalar u[2]={(-b+root)/denom,(-b-root)/denom};
+
+		int numClosest=0;
+		SolveScalar closestU=0.0;
+		double closestDistanceSquared=maxDistanceSquared;
+		for (int i = 0; i < 2; ++i)
+		{
+			if (u[i] > EPSILON)
+			{
+				const double distanceSquared=(u[i]*dir).MagnetitudeSquared();
+				if (numClosest == 0)
+				{
+					if (distanceSquared < maxDistanceSquared)
+					{
+						numClosest=1;
+						closestU=u[i];
+						closestDistanceSquared=distanceSquared;
+					}
+				}
+				else
+				{
+					// A ray grazing the sphere enters and leaves at the same point.
+					const double diff=distanceSquared-closestDistanceSquared;
+					if (fabs(diff) < EPSILON)
+					{
+						++numClosest;
+					}
+					else if (diff < 0.0)
+					{
+						closestU=u[i];
+						closestDistanceSquared=distanceSquared;
+					}
+				}
+			}
+		}
+
+		if (numClosest > 0)
+		{
+			hit.distanceSquared=closestDistanceSquared;
+			hit.t=closestU;
+			hit.solid=this;
+			hit.context=NULL;
+		}
+		return numClosest;
+	}
+
+	void Sphere::CompleteIntersection(const Vector3 & vantage, const Vector3 & direction, const RayHit & hit, Intersection & intersection) const
+	{
+		// Solved in the same precision as the hit itself.
+		const SolveVector3 point=SolveVector3(vantage)+static_cast<SolveScalar>(hit.t)*SolveVector3(direction);
+		intersection.point=Vector3(point);
+		intersection.surfaceNormal=Vector3(hot.inverseRadius*(point-hot.center));
+		intersection.distanceSquared=hit.distanceSquared;
+		intersection.solid=this;
+		intersection.context=NULL;
+	}
+
+	void Sphere::FindClosestHits(const RayPacket & packet, const double * maxDistanceSquared, RayHit * hits, int * numClosest) const
+	{
+		// The kernels work in double whatever the build's precision.
+		const Vector3T<double> displacement=Vector3T<double>(packet.vantage)-Vector3T<double>(Center());
+
+		PacketKernels::SpherePacketInput input;
+		input.dirX=packet.dirX;
+		input.dirY=packet.dirY;
+		input.dirZ=packet.dirZ;
+		input.count=packet.count;
+		input.dispX=displacement.x;
+		input.dispY=displacement.y;
+		input.dispZ=displacement.z;
+		input.c=displacement.MagnetitudeSquared()-hot.radiusSquared;
+		input.epsilon=EPSILON;
+
+		alignas(64) double distanceSquared[RayPacket::MAX_SIZE];
+		alignas(64) double t[RayPacket::MAX_SIZE];
+		alignas(64) double count[RayPacket::MAX_SIZE];
+
+		PacketKernels::SpherePacketOutput output;
+		output.distanceSquared=distanceSquared;
+		output.t=t;
+		output.numClosest=count;
+
+		PacketKernels::IntersectSpherePacket(input,maxDistanceSquared,output);
+
+		for (size_t k = 0; k < packet.count; ++k)
+		{
+			numClosest[k]=static_cast<int>(count[k]);
+			if (numClosest[k] > 0)
+			{
+				hits[k].distanceSquared=distanceSquared[k];
+				hits[k].t=t[k];
+				hits[k].solid=this;
+				hits[k].context=NULL;
+			}
+		}
+	}
+
+	bool Sphere::HasHitWithin(const Vector3 & vantage, const Vector3 & direction, double maxDistanceSquared) const
+	{
+		const SolveVector3 dir(direction);
+		const SolveVector3 displacement=SolveVector3(vantage)-hot.center;
+		const SolveScalar a=dir.MagnetitudeSquared();
+		const SolveScalar b=2.0*DotProduct(dir,displacement);
+		const SolveScalar c=displacement.MagnetitudeSquared()-hot.radiusSquared;
+
+		const SolveScalar radicand=SphereRadicand(a,b,c,dir,displacement,hot.radius);
+		if (radicand < 0.0)
+		{
+			return false;
+		}
+
+		const SolveScalar root=sqrt(radicand);
+		const SolveScalar denom=2.0*a;
+
+		// Try the nearer root first; the farther one only matters
+		// when the nearer one is behind the vantage point.
+		const SolveScalar u[2]={(-b-root)/denom,(-b+root)/denom};
+		for (int i = 0; i < 2; ++i)
+		{
+			if ((u[i] > EPSILON) && ((u[i]*dir).MagnetitudeSquared() < maxDistanceSquared))
+			{
+				return true;
+			}
+		}
+		return false;
 	}
+
 	bool Sphere::Contains(const Vector3 & point) const
 	{
-		const double r=radius+EPSILON;
-		return (point-Center()).MagnetitudeSquared()<=(r*r);
+		return (SolveVector3(point)-hot.center).MagnetitudeSquared()<=hot.containsRadiusSquared;
+	}
+	BoundingBox Sphere::GetBoundingBox() const
+	{
+		return bounds;
+	}
+	void Sphere::Prepare() const
+	{
+		hot.center=SolveVector3(Center());
+		hot.radius=static_cast<SolveScalar>(radius);
+		hot.inverseRadius=static_cast<SolveScalar>(1.0/radius);
+		hot.radiusSquared=radius*radius;
+		const SolveScalar r=radius+EPSILON;
+		hot.containsRadiusSquared=r*r;
+
+		const Vector3 extent(radius,radius,radius);
+		bounds=BoundingBox(Center()-extent,Center()+extent);
 	}
 	SolidObject & Sphere::RotateX(double angleInDegrees)
 	{
@@ -26,4 +246,11 @@ namespace Imager
 	{
 		return *this;
 	}
+	SolidObject & Sphere::Translate(double dx, double dy, double dz)
+	{
+		// Cheap enough to redo at once, so a sphere is never stale.
+		SolidObject::Translate(dx,dy,dz);
+		Prepare();
+		return *this;
+	}
 }
\ No newline at end of file
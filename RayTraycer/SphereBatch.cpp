@@ -0,0 +1,647 @@
+#include"Imager.h"
+#include<algorithm>
+
+namespace Imager
+{
+	namespace
+	{
+		// Puts list[order[i]] at list[i] for every i.
+		template <typename T>
+		void Permute(std::vector<T>& list, const CopyOnWriteArray<unsigned int>& order)
+		{
+			std::vector<T> sorted(order.Size());
+			for (size_t i = 0; i < order.Size(); ++i)
+			{
+				sorted[i]=list[order[i]];
+			}
+			list.swap(sorted);
+		}
+
+		// Like the kernels, a batch stores its spheres and
+		// solves for hits in double whatever the build's precision.
+		typedef Vector3T<double> BatchVector3;
+	}
+
+	SphereBatch::SphereBatch(const Vector3 & _center):SolidObject(_center)
+	{
+		sphereCount=0;
+		isHierarchyStale=true;
+		isBoundsStale=false;
+		SetTag("SphereBatch");
+	}
+
+	size_t SphereBatch::AddMaterial(const Optics & optics)
+	{
+		materialList.push_back(optics);
+		return materialList.size()-1;
+	}
+
+	void SphereBatch::AddSphere(const Vector3 & sphereCenter, double radius)
+	{
+		if (!(radius > 0.0))
+		{
+			throw ImageException("Sphere radius must be positive.");
+		}
+
+		RemovePadding();
+		centerXList.Edit().push_back(sphereCenter.x);
+		centerYList.Edit().push_back(sphereCenter.y);
+		centerZList.Edit().push_back(sphereCenter.z);
+		radiusList.Edit().push_back(radius);
+		materialIndexList.Edit().push_back(UNIFORM_MATERIAL);
+		++sphereCount;
+		isHierarchyStale=true;
+	}
+
+	void SphereBatch::AddSphere(const Vector3 & sphereCenter, double radius, size_t materialIndex)
+	{
+		if (materialIndex >= materialList.size())
+		{
+			throw ImageException("Sphere batch material index is out of range.");
+		}
+
+		AddSphere(sphereCenter,radius);
+		materialIndexList.Edit().back()=static_cast<unsigned int>(materialIndex+1);
+	}
+
+	void SphereBatch::ReserveSpheres(size_t count)
+	{
+		centerXList.Edit().reserve(count);
+		centerYList.Edit().reserve(count);
+		centerZList.Edit().reserve(count);
+		radiusList.Edit().reserve(count);
+		materialIndexList.Edit().reserve(count);
+	}
+
+	size_t SphereBatch::GetSphereCount() const
+	{
+		return sphereCount;
+	}
+
+	size_t SphereBatch::GetMaterialCount() const
+	{
+		return materialList.size();
+	}
+
+	const Optics & SphereBatch::GetMaterial(size_t materialIndex) const
+	{
+		return materialList.at(materialIndex);
+	}
+
+	SphereBatch::SphereArrays SphereBatch::GetSphereArrays() const
+	{
+		PrepareHierarchy();
+
+		SphereArrays arrays;
+		arrays.centerX=centerXList.Data();
+		arrays.centerY=centerYList.Data();
+		arrays.centerZ=centerZList.Data();
+		arrays.radius=radiusList.Data();
+		arrays.materialIndex=materialIndexList.Data();
+		arrays.sphereCount=sphereCount;
+		arrays.paddedCount=radiusList.Size();
+		return arrays;
+	}
+
+	const BoundingVolumeHierarchy & SphereBatch::GetHierarchy() const
+	{
+		PrepareHierarchy();
+		return hierarchy;
+	}
+
+	void SphereBatch::BorrowSpheres(
+		const SphereArrays & arrays,
+		const BoundingVolumeHierarchy::Node * nodes,
+		size_t nodeCount,
+		const unsigned int * primitiveOrder,
+		const std::shared_ptr<const void>& owner)
+	{
+		if (arrays.paddedCount < arrays.sphereCount+PacketKernels::MAX_REGISTER_WIDTH)
+		{
+			throw ImageException("Sphere batch arrays have too little padding.");
+		}
+		for (size_t i = 0; i < arrays.sphereCount; ++i)
+		{
+			if (arrays.materialIndex[i] > materialList.size())
+			{
+				throw ImageException("Sphere batch material index is out of range.");
+			}
+		}
+
+		// Checks the hierarchy before anything else changes.
+		hierarchy.Borrow(nodes,nodeCount,primitiveOrder,arrays.sphereCount);
+		borrowedOwner=owner;
+		centerXList.Borrow(arrays.centerX,arrays.paddedCount);
+		centerYList.Borrow(arrays.centerY,arrays.paddedCount);
+		centerZList.Borrow(arrays.centerZ,arrays.paddedCount);
+		radiusList.Borrow(arrays.radius,arrays.paddedCount);
+		materialIndexList.Borrow(arrays.materialIndex,arrays.sphereCount);
+		sphereCount=arrays.sphereCount;
+		isHierarchyStale=false;
+		isBoundsStale=false;
+	}
+
+	void SphereBatch::AppendAllIntersections(const Vector3 & vantage, const Vector3 & direction, IntersectionList & intersectionList) const
+	{
+		CheckPrepared();
+
+		// The same arithmetic as Sphere::AppendAllIntersections, one sphere at a time.
+		const BatchVector3 dir(direction);
+		const double a=dir.MagnetitudeSquared();
+		auto visitor=[&](unsigned int first, unsigned int count, double&)
+		{
+			for (size_t i = first; i < first+count; ++i)
+			{
+				const BatchVector3 center(centerXList[i],centerYList[i],centerZList[i]);
+				const BatchVector3 displacement=BatchVector3(vantage)-center;
+				const double b=2.0*DotProduct(dir,displacement);
+				const double c=displacement.MagnetitudeSquared()-radiusList[i]*radiusList[i];
+
+				const double radicand=b*b-4.0*a*c;
+				if (radicand >= 0.0)
+				{
+					const double root=sqrt(radicand);
+					const double denom=2.0*a;
+					const double u[2]={(-b+root)/denom,(-b-root)/denom};
+					for (int k = 0; k < 2; ++k)
+					{
+						if (u[k] > EPSILON)
+						{
+							Intersection intersection;
+							const BatchVector3 vantageToSurface=u[k]*dir;
+							const BatchVector3 point=BatchVector3(vantage)+vantageToSurface;
+							intersection.point=Vector3(point);
+							intersection.surfaceNormal=Vector3((point-center).UnitVector());
+							intersection.distanceSquared=vantageToSurface.MagnetitudeSquared();
+							intersection.solid=this;
+							intersection.context=&materialIndexList[i];
+							intersectionList.push_back(intersection);
+						}
+					}
+				}
+			}
+			return false;
+		};
+		hierarchy.TraverseLeaves(vantage,direction,HUGE_VAL,visitor);
+	}
+
+	int SphereBatch::FindClosestHit(const Vector3 & vantage, const Vector3 & direction, double maxDistanceSquared, RayHit & hit) const
+	{
+		CheckPrepared();
+
+		PacketKernels::SphereBatchInput input;
+		SetKernelInput(input,vantage,direction);
+
+		alignas(64) double distanceSquared[KERNEL_BATCH_SIZE];
+		alignas(64) double t[KERNEL_BATCH_SIZE];
+		alignas(64) double count[KERNEL_BATCH_SIZE];
+
+		PacketKernels::SpherePacketOutput output;
+		output.distanceSquared=distanceSquared;
+		output.t=t;
+		output.numClosest=count;
+
+		// Combines the spheres' hits with the same tie rule the scene
+		// uses to combine solids, so a batch finds the same closest hit
+		// as the equivalent list of Sphere objects.
+		const double directionMagnitudeSquared=direction.MagnetitudeSquared();
+		double reachSquared=maxDistanceSquared;
+		int tieCount=0;
+		size_t closestIndex=0;
+		auto visitor=[&](unsigned int first, unsigned int numSpheres, double& tMax)
+		{
+			for (size_t start = first; start < first+numSpheres; start += KERNEL_BATCH_SIZE)
+			{
+				input.centerX=&centerXList[start];
+				input.centerY=&centerYList[start];
+				input.centerZ=&centerZList[start];
+				input.radius=&radiusList[start];
+				input.count=std::min<size_t>(KERNEL_BATCH_SIZE,first+numSpheres-start);
+				PacketKernels::IntersectSphereBatch(input,reachSquared,output);
+
+				for (size_t k = 0; k < input.count; ++k)
+				{
+					if (count[k] > 0.0)
+					{
+						const int numClosest=static_cast<int>(count[k]);
+						if (tieCount == 0)
+						{
+							tieCount=numClosest;
+							closestIndex=start+k;
+							hit.distanceSquared=distanceSquared[k];
+							hit.t=t[k];
+						}
+						else
+						{
+							const double diff=distanceSquared[k]-hit.distanceSquared;
+							if (fabs(diff) < EPSILON)
+							{
+								tieCount+=numClosest;
+							}
+							else if (diff < 0.0)
+							{
+								tieCount=numClosest;
+								closestIndex=start+k;
+								hit.distanceSquared=distanceSquared[k];
+								hit.t=t[k];
+							}
+						}
+
+						const double tieReachSquared=hit.distanceSquared+2.0*EPSILON;
+						if (tieReachSquared < reachSquared)
+						{
+							reachSquared=tieReachSquared;
+						}
+					}
+				}
+			}
+
+			tMax=sqrt(reachSquared/directionMagnitudeSquared);
+			return false;
+		};
+		hierarchy.TraverseLeaves(vantage,direction,sqrt(maxDistanceSquared/directionMagnitudeSquared),visitor);
+
+		if (tieCount > 0)
+		{
+			hit.solid=this;
+			hit.context=&materialIndexList[closestIndex];
+		}
+		return tieCount;
+	}
+
+	void SphereBatch::FindClosestHits(const RayPacket & packet, const double * maxDistanceSquared, RayHit * hits, int * numClosest) const
+	{
+		CheckPrepared();
+
+		// Here the vector kernel runs across the rays rather than across
+		// the spheres: every sphere in a leaf the packet reaches is tested
+		// against all of its rays at once, as Sphere::FindClosestHits does,
+		// and each ray combines its hits the way FindClosestHit does.
+		alignas(64) double reachSquared[RayPacket::MAX_SIZE];
+		double tMax[RayPacket::MAX_SIZE];
+		double directionMagnitudeSquared[RayPacket::MAX_SIZE];
+		size_t closestIndex[RayPacket::MAX_SIZE];
+		for (size_t k = 0; k < RayPacket::MAX_SIZE; ++k)
+		{
+			numClosest[k]=0;
+			reachSquared[k]=maxDistanceSquared[k];
+		}
+		for (size_t k = 0; k < packet.count; ++k)
+		{
+			directionMagnitudeSquared[k]=packet.Direction(k).MagnetitudeSquared();
+			tMax[k]=sqrt(reachSquared[k]/directionMagnitudeSquared[k]);
+		}
+
+		PacketKernels::SpherePacketInput input;
+		input.dirX=packet.dirX;
+		input.dirY=packet.dirY;
+		input.dirZ=packet.dirZ;
+		input.count=packet.count;
+		input.epsilon=EPSILON;
+
+		alignas(64) double distanceSquared[RayPacket::MAX_SIZE];
+		alignas(64) double t[RayPacket::MAX_SIZE];
+		alignas(64) double count[RayPacket::MAX_SIZE];
+
+		PacketKernels::SpherePacketOutput output;
+		output.distanceSquared=distanceSquared;
+		output.t=t;
+		output.numClosest=count;
+
+		auto visitor=[&](unsigned int first, unsigned int numSpheres)
+		{
+			for (size_t i = first; i < first+numSpheres; ++i)
+			{
+				const BatchVector3 displacement=BatchVector3(packet.vantage)-BatchVector3(centerXList[i],centerYList[i],centerZList[i]);
+				input.dispX=displacement.x;
+				input.dispY=displacement.y;
+				input.dispZ=displacement.z;
+				input.c=displacement.MagnetitudeSquared()-radiusList[i]*radiusList[i];
+				PacketKernels::IntersectSpherePacket(input,reachSquared,output);
+
+				for (size_t k = 0; k < packet.count; ++k)
+				{
+					if (count[k] > 0.0)
+					{
+						const int numHits=static_cast<int>(count[k]);
+						if (numClosest[k] == 0)
+						{
+							numClosest[k]=numHits;
+							closestIndex[k]=i;
+							hits[k].distanceSquared=distanceSquared[k];
+							hits[k].t=t[k];
+						}
+						else
+						{
+							const double diff=distanceSquared[k]-hits[k].distanceSquared;
+							if (fabs(diff) < EPSILON)
+							{
+								numClosest[k]+=numHits;
+							}
+							else if (diff < 0.0)
+							{
+								numClosest[k]=numHits;
+								closestIndex[k]=i;
+								hits[k].distanceSquared=distanceSquared[k];
+								hits[k].t=t[k];
+							}
+						}
+
+						const double tieReachSquared=hits[k].distanceSquared+2.0*EPSILON;
+						if (tieReachSquared < reachSquared[k])
+						{
+							reachSquared[k]=tieReachSquared;
+							tMax[k]=sqrt(reachSquared[k]/directionMagnitudeSquared[k]);
+						}
+					}
+				}
+			}
+		};
+		hierarchy.TraversePacketLeaves(packet,tMax,visitor);
+
+		for (size_t k = 0; k < packet.count; ++k)
+		{
+			if (numClosest[k] > 0)
+			{
+				hits[k].solid=this;
+				hits[k].context=&materialIndexList[closestIndex[k]];
+			}
+		}
+	}
+
+	void SphereBatch::CompleteIntersection(const Vector3 & vantage, const Vector3 & direction, const RayHit & hit, Intersection & intersection) const
+	{
+		// The context points at the sphere's entry in materialIndexList,
+		// which tells us both the sphere and its material.
+		const unsigned int* materialIndex=static_cast<const unsigned int*>(hit.context);
+		const size_t i=materialIndex-&materialIndexList[0];
+		const BatchVector3 center(centerXList[i],centerYList[i],centerZList[i]);
+
+		const BatchVector3 point=BatchVector3(vantage)+hit.t*BatchVector3(direction);
+		intersection.point=Vector3(point);
+		intersection.surfaceNormal=Vector3((point-center).UnitVector());
+		intersection.distanceSquared=hit.distanceSquared;
+		intersection.solid=this;
+		intersection.context=hit.context;
+	}
+
+	bool SphereBatch::HasHitWithin(const Vector3 & vantage, const Vector3 & direction, double maxDistanceSquared) const
+	{
+		CheckPrepared();
+
+		PacketKernels::SphereBatchInput input;
+		SetKernelInput(input,vantage,direction);
+
+		alignas(64) double distanceSquared[KERNEL_BATCH_SIZE];
+		alignas(64) double t[KERNEL_BATCH_SIZE];
+		alignas(64) double count[KERNEL_BATCH_SIZE];
+
+		PacketKernels::SpherePacketOutput output;
+		output.distanceSquared=distanceSquared;
+		output.t=t;
+		output.numClosest=count;
+
+		bool isHit=false;
+		auto visitor=[&](unsigned int first, unsigned int numSpheres, double&)
+		{
+			for (size_t start = first; start < first+numSpheres; start += KERNEL_BATCH_SIZE)
+			{
+				input.centerX=&centerXList[start];
+				input.centerY=&centerYList[start];
+				input.centerZ=&centerZList[start];
+				input.radius=&radiusList[start];
+				input.count=std::min<size_t>(KERNEL_BATCH_SIZE,first+numSpheres-start);
+				PacketKernels::IntersectSphereBatch(input,maxDistanceSquared,output);
+
+				for (size_t k = 0; k < input.count; ++k)
+				{
+					if (count[k] > 0.0)
+					{
+						isHit=true;
+					}
+				}
+			}
+			return isHit;
+		};
+		hierarchy.TraverseLeaves(vantage,direction,sqrt(maxDistanceSquared/direction.MagnetitudeSquared()),visitor);
+		return isHit;
+	}
+
+	bool SphereBatch::Contains(const Vector3 & point) const
+	{
+		auto isInside=[&](size_t i)
+		{
+			const double dx=point.x-centerXList[i];
+			const double dy=point.y-centerYList[i];
+			const double dz=point.z-centerZList[i];
+			const double r=radiusList[i]+EPSILON;
+			return (dx*dx+dy*dy+dz*dz) <= (r*r);
+		};
+
+		if (isHierarchyStale || isBoundsStale)
+		{
+			// Padding, if any, is at the end, and the spheres do not
+			// have to be sorted for this; any order will do.
+			for (size_t i = 0; i < sphereCount; ++i)
+			{
+				if (isInside(i))
+				{
+					return true;
+				}
+			}
+			return false;
+		}
+
+		// Only spheres in leaves whose boxes reach the point can contain it.
+		bool isContained=false;
+		auto visitor=[&](unsigned int first, unsigned int count)
+		{
+			for (size_t i = first; i < first+count; ++i)
+			{
+				if (isInside(i))
+				{
+					isContained=true;
+					return true;
+				}
+			}
+			return false;
+		};
+		hierarchy.TraverseOverlappingLeaves(BoundingBox(point,point).Expanded(CONTAINMENT_MARGIN),visitor);
+		return isContained;
+	}
+
+	BoundingBox SphereBatch::GetBoundingBox() const
+	{
+		PrepareHierarchy();
+		return hierarchy.GetBounds();
+	}
+
+	void SphereBatch::Prepare() const
+	{
+		PrepareHierarchy();
+	}
+
+	size_t SphereBatch::SurfaceMaterial(const Vector3 &, const void * context) const
+	{
+		return *static_cast<const unsigned int*>(context);
+	}
+
+	size_t SphereBatch::AppendSurfaceMaterials(MaterialList & outMaterialList, SharedMaterialMap &) const
+	{
+		const size_t first=outMaterialList.size();
+		for (size_t k = 0; k < materialList.size(); ++k)
+		{
+			outMaterialList.push_back(Material(materialList[k]));
+		}
+		return first;
+	}
+
+	SolidObject & SphereBatch::RotateX(double angleInDegrees)
+	{
+		RotateCenters(centerYList,centerZList,Center().y,Center().z,angleInDegrees);
+		return *this;
+	}
+
+	SolidObject & SphereBatch::RotateY(double angleInDegrees)
+	{
+		RotateCenters(centerZList,centerXList,Center().z,Center().x,angleInDegrees);
+		return *this;
+	}
+
+	SolidObject & SphereBatch::RotateZ(double angleInDegrees)
+	{
+		RotateCenters(centerXList,centerYList,Center().x,Center().y,angleInDegrees);
+		return *this;
+	}
+
+	SolidObject & SphereBatch::Translate(double dx, double dy, double dz)
+	{
+		SolidObject::Translate(dx,dy,dz);
+		std::vector<double>& xList=centerXList.Edit();
+		std::vector<double>& yList=centerYList.Edit();
+		std::vector<double>& zList=centerZList.Edit();
+		for (size_t i = 0; i < xList.size(); ++i)
+		{
+			xList[i]+=dx;
+			yList[i]+=dy;
+			zList[i]+=dz;
+		}
+		isBoundsStale=true;
+		return *this;
+	}
+
+	void SphereBatch::PrepareHierarchy() const
+	{
+		if (isHierarchyStale)
+		{
+			BuildHierarchy();
+		}
+		else if (isBoundsStale)
+		{
+			// Moving spheres changes the boxes but not which spheres
+			// are in each leaf, so refitting is enough.
+			std::vector<BoundingBox> boundsList;
+			CollectSphereBounds(boundsList);
+			hierarchy.Refit(boundsList);
+			isBoundsStale=false;
+		}
+	}
+
+	void SphereBatch::BuildHierarchy() const
+	{
+		hierarchy.Clear();
+
+		std::vector<BoundingBox> boundsList;
+		CollectSphereBounds(boundsList);
+		hierarchy.Build(boundsList);
+
+		// Sort the spheres into the order the leaves list them, so that
+		// each leaf is a contiguous run the kernel can load directly.
+		const CopyOnWriteArray<unsigned int>& order=hierarchy.GetPrimitiveOrder();
+		Permute(centerXList.Edit(),order);
+		Permute(centerYList.Edit(),order);
+		Permute(centerZList.Edit(),order);
+		Permute(radiusList.Edit(),order);
+		Permute(materialIndexList.Edit(),order);
+
+		// The kernel reads whole registers, which for the last leaf
+		// can reach past the last sphere.
+		const size_t paddedCount=sphereCount+PacketKernels::MAX_REGISTER_WIDTH;
+		const double padding=std::numeric_limits<double>::quiet_NaN();
+		centerXList.Edit().resize(paddedCount,padding);
+		centerYList.Edit().resize(paddedCount,padding);
+		centerZList.Edit().resize(paddedCount,padding);
+		radiusList.Edit().resize(paddedCount,padding);
+
+		isHierarchyStale=false;
+		isBoundsStale=false;
+	}
+
+	void SphereBatch::CollectSphereBounds(std::vector<BoundingBox>& boundsList) const
+	{
+		// Boxes are indexed the way the hierarchy knows the spheres: before
+		// the first build that is the order they were added in, and after
+		// it, sphere i of the sorted arrays is primitive order[i].
+		const CopyOnWriteArray<unsigned int>& order=hierarchy.GetPrimitiveOrder();
+		const bool isSorted=!hierarchy.IsEmpty();
+
+		boundsList.resize(sphereCount);
+		for (size_t i = 0; i < sphereCount; ++i)
+		{
+			const Vector3 center(centerXList[i],centerYList[i],centerZList[i]);
+			const Vector3 extent(radiusList[i],radiusList[i],radiusList[i]);
+			boundsList[isSorted ? order[i] : i]=BoundingBox(center-extent,center+extent);
+		}
+	}
+
+	void SphereBatch::RemovePadding()
+	{
+		// Adding spheres means a rebuild, which forgets the current order.
+		hierarchy.Clear();
+		centerXList.Edit().resize(sphereCount);
+		centerYList.Edit().resize(sphereCount);
+		centerZList.Edit().resize(sphereCount);
+		radiusList.Edit().resize(sphereCount);
+		materialIndexList.Edit().resize(sphereCount);
+	}
+
+	void SphereBatch::CheckPrepared() const
+	{
+		// Building the hierarchy reorders the spheres, which is not safe
+		// while render threads are reading them, so it has to happen first.
+		if (isHierarchyStale || isBoundsStale)
+		{
+			throw ImageException("Sphere batch changed after the scene's acceleration structure was built.");
+		}
+	}
+
+	void SphereBatch::RotateCenters(CopyOnWriteArray<double>& aArray, CopyOnWriteArray<double>& bArray, double pivotA, double pivotB, double angleInDegrees)
+	{
+		std::vector<double>& aList=aArray.Edit();
+		std::vector<double>& bList=bArray.Edit();
+
+		// Rotates counterclockwise in the (a,b) plane about the pivot.
+		const double radians=RadiansFromDegrees(angleInDegrees);
+		const double cosine=cos(radians);
+		const double sine=sin(radians);
+		for (size_t i = 0; i < sphereCount; ++i)
+		{
+			const double a=aList[i]-pivotA;
+			const double b=bList[i]-pivotB;
+			aList[i]=pivotA+cosine*a-sine*b;
+			bList[i]=pivotB+sine*a+cosine*b;
+		}
+		isBoundsStale=true;
+	}
+
+	void SphereBatch::SetKernelInput(PacketKernels::SphereBatchInput& input, const Vector3& vantage, const Vector3& direction) const
+	{
+		input.vantageX=vantage.x;
+		input.vantageY=vantage.y;
+		input.vantageZ=vantage.z;
+		input.dirX=direction.x;
+		input.dirY=direction.y;
+		input.dirZ=direction.z;
+		input.epsilon=EPSILON;
+	}
+}
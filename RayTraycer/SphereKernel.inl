@@ -0,0 +1,171 @@
+// The bodies of the sphere kernels, shared by every instruction set.
+// Included by one translation unit per instruction set, after it defines
+// a struct of register operations named Ops:
+//
+//     Reg, Mask, WIDTH                      register type, comparison result type, doubles per register
+//     Load, Store, Set1                     unaligned load/store, broadcast
+//     Add, Sub, Mul, Div, Sqrt, Neg, Abs    arithmetic, in the same order the scalar code uses
+//     CmpLt, CmpGt, CmpGe                   ordered comparisons (false for NaN)
+//     MaskAnd, MaskOr, MaskAndNot           mask logic; MaskAndNot(a,b) is a & ~b
+//     Any(m)                                true if any lane of m is set
+//     Select(m, a, b)                       a where m is set, else b
+//
+// This file deliberately has no include guard and defines everything
+// with internal linkage, so each instruction set gets its own copy.
+
+namespace
+{
+	template <class Ops>
+	inline typename Ops::Reg DistanceSquared(
+		typename Ops::Reg u,
+		typename Ops::Reg dx,
+		typename Ops::Reg dy,
+		typename Ops::Reg dz)
+	{
+		// (u*direction).MagnetitudeSquared()
+		const typename Ops::Reg x = Ops::Mul(u, dx);
+		const typename Ops::Reg y = Ops::Mul(u, dy);
+		const typename Ops::Reg z = Ops::Mul(u, dz);
+		return Ops::Add(Ops::Add(Ops::Mul(x, x), Ops::Mul(y, y)), Ops::Mul(z, z));
+	}
+
+	// Solves the quadratic for one register of ray/sphere pairs and stores
+	// the closest hit of each lane.  p is vantage - center and c is
+	// |p|^2 - radius^2, both per lane.
+	template <class Ops>
+	inline void IntersectSphereRegister(
+		typename Ops::Reg dx,
+		typename Ops::Reg dy,
+		typename Ops::Reg dz,
+		typename Ops::Reg px,
+		typename Ops::Reg py,
+		typename Ops::Reg pz,
+		typename Ops::Reg c,
+		typename Ops::Reg maxD,
+		typename Ops::Reg epsilon,
+		double* distanceSquared,
+		double* t,
+		double* numClosest)
+	{
+		typedef typename Ops::Reg Reg;
+		typedef typename Ops::Mask Mask;
+
+		const Reg zero = Ops::Set1(0.0);
+		const Reg one = Ops::Set1(1.0);
+		const Reg two = Ops::Set1(2.0);
+		const Reg four = Ops::Set1(4.0);
+
+		// The same quadratic, in the same order, as Sphere::FindClosestHit.
+		const Reg a = Ops::Add(Ops::Add(Ops::Mul(dx, dx), Ops::Mul(dy, dy)), Ops::Mul(dz, dz));
+		const Reg b = Ops::Mul(two, Ops::Add(Ops::Add(Ops::Mul(dx, px), Ops::Mul(dy, py)), Ops::Mul(dz, pz)));
+		const Reg radicand = Ops::Sub(Ops::Mul(b, b), Ops::Mul(Ops::Mul(four, a), c));
+		const Mask hasRoots = Ops::CmpGe(radicand, zero);
+		if (!Ops::Any(hasRoots))
+		{
+			// Most rays miss most spheres; skip the square root and divisions.
+			Ops::Store(numClosest, zero);
+			return;
+		}
+
+		// Lanes without roots compute garbage (NaN) below;
+		// hasRoots keeps it out of the results.
+		const Reg root = Ops::Sqrt(radicand);
+		const Reg denom = Ops::Mul(two, a);
+		const Reg negB = Ops::Neg(b);
+		const Reg u0 = Ops::Div(Ops::Add(negB, root), denom);
+		const Reg u1 = Ops::Div(Ops::Sub(negB, root), denom);
+		const Reg d0 = DistanceSquared<Ops>(u0, dx, dy, dz);
+		const Reg d1 = DistanceSquared<Ops>(u1, dx, dy, dz);
+
+		const Mask valid0 = Ops::MaskAnd(hasRoots, Ops::CmpGt(u0, epsilon));
+		const Mask valid1 = Ops::MaskAnd(hasRoots, Ops::CmpGt(u1, epsilon));
+
+		// The first root is taken if it is in range; the second then
+		// either ties with it, beats it, or loses to it...
+		const Mask first0 = Ops::MaskAnd(valid0, Ops::CmpLt(d0, maxD));
+		const Mask both = Ops::MaskAnd(first0, valid1);
+		const Reg diff = Ops::Sub(d1, d0);
+		const Mask tie = Ops::MaskAnd(both, Ops::CmpLt(Ops::Abs(diff), epsilon));
+		const Mask closer1 = Ops::MaskAndNot(Ops::MaskAnd(both, Ops::CmpLt(diff, zero)), tie);
+
+		// ...otherwise the second root is taken alone if it is in range.
+		const Mask only1 = Ops::MaskAndNot(Ops::MaskAnd(valid1, Ops::CmpLt(d1, maxD)), first0);
+		const Mask use1 = Ops::MaskOr(closer1, only1);
+		const Mask any = Ops::MaskOr(first0, only1);
+
+		Ops::Store(distanceSquared, Ops::Select(use1, d1, d0));
+		Ops::Store(t, Ops::Select(use1, u1, u0));
+		Ops::Store(numClosest, Ops::Select(tie, two, Ops::Select(any, one, zero)));
+	}
+
+	// One sphere, many rays: the sphere is broadcast, the rays are loaded.
+	template <class Ops>
+	void IntersectSpherePacketTemplate(
+		const Imager::PacketKernels::SpherePacketInput& input,
+		const double* maxDistanceSquared,
+		const Imager::PacketKernels::SpherePacketOutput& output)
+	{
+		typedef typename Ops::Reg Reg;
+
+		const Reg px = Ops::Set1(input.dispX);
+		const Reg py = Ops::Set1(input.dispY);
+		const Reg pz = Ops::Set1(input.dispZ);
+		const Reg c = Ops::Set1(input.c);
+		const Reg epsilon = Ops::Set1(input.epsilon);
+
+		for (size_t k = 0; k < input.count; k += Ops::WIDTH)
+		{
+			IntersectSphereRegister<Ops>(
+				Ops::Load(input.dirX + k),
+				Ops::Load(input.dirY + k),
+				Ops::Load(input.dirZ + k),
+				px, py, pz, c,
+				Ops::Load(maxDistanceSquared + k),
+				epsilon,
+				output.distanceSquared + k,
+				output.t + k,
+				output.numClosest + k);
+		}
+	}
+
+	// One ray, many spheres: the ray is broadcast, the spheres are loaded.
+	template <class Ops>
+	void IntersectSphereBatchTemplate(
+		const Imager::PacketKernels::SphereBatchInput& input,
+		double maxDistanceSquared,
+		const Imager::PacketKernels::SpherePacketOutput& output)
+	{
+		typedef typename Ops::Reg Reg;
+
+		const Reg vx = Ops::Set1(input.vantageX);
+		const Reg vy = Ops::Set1(input.vantageY);
+		const Reg vz = Ops::Set1(input.vantageZ);
+		const Reg dx = Ops::Set1(input.dirX);
+		const Reg dy = Ops::Set1(input.dirY);
+		const Reg dz = Ops::Set1(input.dirZ);
+		const Reg maxD = Ops::Set1(maxDistanceSquared);
+		const Reg epsilon = Ops::Set1(input.epsilon);
+
+		for (size_t k = 0; k < input.count; k += Ops::WIDTH)
+		{
+			// displacement=vantage-Center();
+			// c=displacement.MagnetitudeSquared()-radius*radius;
+			const Reg px = Ops::Sub(vx, Ops::Load(input.centerX + k));
+			const Reg py = Ops::Sub(vy, Ops::Load(input.centerY + k));
+			const Reg pz = Ops::Sub(vz, Ops::Load(input.centerZ + k));
+			const Reg r = Ops::Load(input.radius + k);
+			const Reg c = Ops::Sub(
+				Ops::Add(Ops::Add(Ops::Mul(px, px), Ops::Mul(py, py)), Ops::Mul(pz, pz)),
+				Ops::Mul(r, r));
+
+			IntersectSphereRegister<Ops>(
+				dx, dy, dz,
+				px, py, pz, c,
+				maxD,
+				epsilon,
+				output.distanceSquared + k,
+				output.t + k,
+				output.numClosest + k);
+		}
+	}
+}
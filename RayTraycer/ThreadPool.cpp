@@ -0,0 +1,206 @@
+#include"Imager.h"
+
+namespace Imager
+{
+	ThreadPool::ThreadPool(size_t _numThreads)
+	{
+		numThreads=_numThreads;
+		if (numThreads == 0)
+		{
+			numThreads = std::thread::hardware_concurrency();
+			if (numThreads == 0)
+			{
+				// The platform could not tell us how many cores it has.
+				numThreads = 1;
+			}
+		}
+
+		currentTask = NULL;
+		generation = 0;
+		numBusyWorkers = 0;
+		isShuttingDown = false;
+
+		for (size_t w = 0; w < numThreads; ++w)
+		{
+			queues.push_back(new WorkQueue());
+		}
+
+		// Worker 0 is whichever thread calls ParallelFor,
+		// so we only need to start numThreads-1 background threads.
+		for (size_t w = 1; w < numThreads; ++w)
+		{
+			threads.push_back(std::thread(&ThreadPool::WorkerLoop, this, w));
+		}
+	}
+
+	ThreadPool::~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			isShuttingDown = true;
+		}
+		workAvailable.notify_all();
+
+		for (size_t t = 0; t < threads.size(); ++t)
+		{
+			threads[t].join();
+		}
+
+		for (size_t w = 0; w < queues.size(); ++w)
+		{
+			delete queues[w];
+			queues[w] = NULL;
+		}
+	}
+
+	size_t ThreadPool::GetThreadCount() const
+	{
+		return numThreads;
+	}
+
+	void ThreadPool::ParallelFor(size_t numTasks, const std::function<void(size_t, size_t)>& task)
+	{
+		if (numTasks == 0)
+		{
+			return;
+		}
+
+		if (numThreads == 1)
+		{
+			// Nothing to share the work with.
+			for (size_t t = 0; t < numTasks; ++t)
+			{
+				task(t, 0);
+			}
+			return;
+		}
+
+		// Give each worker a contiguous run of tasks to start with.
+		// Neighboring tasks are usually neighboring tiles, which tend
+		// to touch the same objects and so share cache contents.
+		for (size_t w = 0; w < numThreads; ++w)
+		{
+			const size_t first = (w * numTasks) / numThreads;
+			const size_t last = ((w + 1) * numTasks) / numThreads;
+
+			std::lock_guard<std::mutex> queueLock(queues[w]->mutex);
+			for (size_t t = first; t < last; ++t)
+			{
+				queues[w]->taskIndexes.push_back(t);
+			}
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			currentTask = &task;
+			firstError = std::exception_ptr();
+			numBusyWorkers = numThreads - 1;
+			++generation;
+		}
+		workAvailable.notify_all();
+
+		RunTasks(0);
+
+		std::exception_ptr error;
+		{
+			// Wait until every background worker has let go of currentTask,
+			// not just until the last task has finished.
+			std::unique_lock<std::mutex> lock(mutex);
+			while (numBusyWorkers > 0)
+			{
+				workFinished.wait(lock);
+			}
+			currentTask = NULL;
+			error = firstError;
+			firstError = std::exception_ptr();
+		}
+
+		if (error)
+		{
+			std::rethrow_exception(error);
+		}
+	}
+
+	void ThreadPool::WorkerLoop(size_t workerIndex)
+	{
+		size_t lastGeneration = 0;
+		for(;;)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				while (!isShuttingDown && (generation == lastGeneration))
+				{
+					workAvailable.wait(lock);
+				}
+
+				if (isShuttingDown)
+				{
+					return;
+				}
+
+				lastGeneration = generation;
+			}
+
+			RunTasks(workerIndex);
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				--numBusyWorkers;
+			}
+			workFinished.notify_all();
+		}
+	}
+
+	void ThreadPool::RunTasks(size_t workerIndex)
+	{
+		size_t taskIndex;
+		while (PopTask(workerIndex, taskIndex))
+		{
+			try
+			{
+				(*currentTask)(taskIndex, workerIndex);
+			}
+			catch (...)
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!firstError)
+				{
+					firstError = std::current_exception();
+				}
+			}
+		}
+	}
+
+	bool ThreadPool::PopTask(size_t workerIndex, size_t& taskIndex)
+	{
+		// Take work from the front of our own queue first...
+		{
+			WorkQueue& own = *queues[workerIndex];
+			std::lock_guard<std::mutex> queueLock(own.mutex);
+			if (!own.taskIndexes.empty())
+			{
+				taskIndex = own.taskIndexes.front();
+				own.taskIndexes.pop_front();
+				return true;
+			}
+		}
+
+		// ...then steal from the back of the other workers' queues,
+		// which is the work they would have reached last.
+		for (size_t k = 1; k < numThreads; ++k)
+		{
+			WorkQueue& victim = *queues[(workerIndex + k) % numThreads];
+			std::lock_guard<std::mutex> queueLock(victim.mutex);
+			if (!victim.taskIndexes.empty())
+			{
+				taskIndex = victim.taskIndexes.back();
+				victim.taskIndexes.pop_back();
+				return true;
+			}
+		}
+
+		// No queued work is left anywhere.  Tasks may still be
+		// running on other workers, but ParallelFor waits for those.
+		return false;
+	}
+}
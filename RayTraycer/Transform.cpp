@@ -0,0 +1,121 @@
+#include"Imager.h"
+
+namespace Imager
+{
+	namespace
+	{
+		// Rotates counterclockwise in the (a,b) plane, the way
+		// SphereBatch::RotateCenters moves sphere centers.
+		Transform Rotation(int a, int b, double angleInDegrees)
+		{
+			const double radians=RadiansFromDegrees(angleInDegrees);
+			const double cosine=cos(radians);
+			const double sine=sin(radians);
+
+			Transform rotation;
+			rotation.m[a][a]=cosine;
+			rotation.m[a][b]=-sine;
+			rotation.m[b][a]=sine;
+			rotation.m[b][b]=cosine;
+			return rotation;
+		}
+	}
+
+	Transform Transform::RotationX(double angleInDegrees)
+	{
+		return Rotation(1,2,angleInDegrees);
+	}
+
+	Transform Transform::RotationY(double angleInDegrees)
+	{
+		return Rotation(2,0,angleInDegrees);
+	}
+
+	Transform Transform::RotationZ(double angleInDegrees)
+	{
+		return Rotation(0,1,angleInDegrees);
+	}
+
+	Transform Transform::operator*(const Transform & other) const
+	{
+		Transform product;
+		for (int i = 0; i < 3; ++i)
+		{
+			for (int j = 0; j < 4; ++j)
+			{
+				// The implied bottom row of other is (0, 0, 0, 1).
+				double sum=(j == 3) ? m[i][3] : 0.0;
+				for (int k = 0; k < 3; ++k)
+				{
+					sum+=m[i][k]*other.m[k][j];
+				}
+				product.m[i][j]=sum;
+			}
+		}
+		return product;
+	}
+
+	Transform Transform::Inverse() const
+	{
+		// The inverse of the linear part is its adjugate over its determinant.
+		const double cofactor00=m[1][1]*m[2][2]-m[1][2]*m[2][1];
+		const double cofactor01=m[1][2]*m[2][0]-m[1][0]*m[2][2];
+		const double cofactor02=m[1][0]*m[2][1]-m[1][1]*m[2][0];
+		const double determinant=m[0][0]*cofactor00+m[0][1]*cofactor01+m[0][2]*cofactor02;
+		if ((determinant == 0.0) || !std::isfinite(determinant))
+		{
+			throw ImageException("Transform cannot be inverted.");
+		}
+		const double scale=1.0/determinant;
+
+		Transform inverse;
+		inverse.m[0][0]=scale*cofactor00;
+		inverse.m[0][1]=scale*(m[0][2]*m[2][1]-m[0][1]*m[2][2]);
+		inverse.m[0][2]=scale*(m[0][1]*m[1][2]-m[0][2]*m[1][1]);
+		inverse.m[1][0]=scale*cofactor01;
+		inverse.m[1][1]=scale*(m[0][0]*m[2][2]-m[0][2]*m[2][0]);
+		inverse.m[1][2]=scale*(m[0][2]*m[1][0]-m[0][0]*m[1][2]);
+		inverse.m[2][0]=scale*cofactor02;
+		inverse.m[2][1]=scale*(m[0][1]*m[2][0]-m[0][0]*m[2][1]);
+		inverse.m[2][2]=scale*(m[0][0]*m[1][1]-m[0][1]*m[1][0]);
+
+		// Undo the translation after the linear part has been undone.
+		for (int i = 0; i < 3; ++i)
+		{
+			inverse.m[i][3]=-(inverse.m[i][0]*m[0][3]+inverse.m[i][1]*m[1][3]+inverse.m[i][2]*m[2][3]);
+		}
+		return inverse;
+	}
+
+	BoundingBox Transform::ApplyToBox(const BoundingBox & box) const
+	{
+		if (box.IsEmpty())
+		{
+			return box;
+		}
+		if (!box.IsFinite())
+		{
+			return BoundingBox::Infinite();
+		}
+
+		// Each output coordinate is a sum of terms, one per input axis,
+		// and each term is smallest at one end of the box and largest
+		// at the other, so there is no need to transform all eight corners.
+		const double low[3]={box.minCorner.x,box.minCorner.y,box.minCorner.z};
+		const double high[3]={box.maxCorner.x,box.maxCorner.y,box.maxCorner.z};
+		double outLow[3];
+		double outHigh[3];
+		for (int i = 0; i < 3; ++i)
+		{
+			outLow[i]=outHigh[i]=m[i][3];
+			for (int j = 0; j < 3; ++j)
+			{
+				const double a=m[i][j]*low[j];
+				const double b=m[i][j]*high[j];
+				outLow[i]+=(a < b) ? a : b;
+				outHigh[i]+=(a < b) ? b : a;
+			}
+		}
+		return BoundingBox(Vector3(outLow[0],outLow[1],outLow[2]),Vector3(outHigh[0],outHigh[1],outHigh[2]));
+	}
+}
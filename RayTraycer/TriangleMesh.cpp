@@ -0,0 +1,905 @@
+#include"Imager.h"
+#include<algorithm>
+#include<cctype>
+#include<cstdlib>
+#include<cstring>
+#include<sstream>
+
+namespace Imager
+{
+	namespace
+	{
+		inline SolveScalar Component(const Vector3& v, int axis)
+		{
+			return (axis == 0) ? v.x : ((axis == 1) ? v.y : v.z);
+		}
+
+		// A ray set up for the watertight ray/triangle test of Woop, Benthin
+		// and Wald.  kz is the axis along which the direction is largest, and
+		// the shear (sx, sy, sz) maps the direction onto it, which reduces the
+		// test to 2D.  A vertex shared by several triangles goes through
+		// exactly the same arithmetic in each, so they agree on its edges.
+		struct ShearedRay
+		{
+			int kx;
+			int ky;
+			int kz;
+			SolveScalar sx;
+			SolveScalar sy;
+			SolveScalar sz;
+			SolveScalar vantage[3];
+		};
+
+		ShearedRay ShearRay(const Vector3& vantage, const Vector3& direction)
+		{
+			const SolveScalar dir[3]={direction.x,direction.y,direction.z};
+
+			ShearedRay ray;
+			ray.kz=0;
+			if (fabs(dir[1]) > fabs(dir[ray.kz])) ray.kz=1;
+			if (fabs(dir[2]) > fabs(dir[ray.kz])) ray.kz=2;
+			ray.kx=(ray.kz+1)%3;
+			ray.ky=(ray.kx+1)%3;
+
+			// Keeps the triangles' winding, and so the sign of det.
+			if (dir[ray.kz] < 0.0)
+			{
+				std::swap(ray.kx,ray.ky);
+			}
+
+			ray.sx=dir[ray.kx]/dir[ray.kz];
+			ray.sy=dir[ray.ky]/dir[ray.kz];
+			ray.sz=1.0f/dir[ray.kz];
+			ray.vantage[0]=vantage.x;
+			ray.vantage[1]=vantage.y;
+			ray.vantage[2]=vantage.z;
+			return ray;
+		}
+
+		// Whether a ray passing exactly through an edge, which runs along
+		// (ex, ey) in the sheared plane, hits the triangle.  Two triangles
+		// that share the edge run it in opposite directions, so exactly one
+		// of them gets the hit.  Seen from behind, a triangle's edges run
+		// the other way.
+		inline bool OwnsEdge(SolveScalar ex, SolveScalar ey, bool isFrontFacing)
+		{
+			if (!isFrontFacing)
+			{
+				ex=-ex;
+				ey=-ey;
+			}
+			return (ey > 0.0) || ((ey == 0.0) && (ex > 0.0));
+		}
+
+		// Returns true, and the ray parameter of the hit in t, if the ray
+		// passes through triangle (a, b, c).  t may be negative.
+		bool IntersectTriangle(const ShearedRay& ray, const Vector3& a, const Vector3& b, const Vector3& c, SolveScalar& t)
+		{
+			const SolveScalar az=Component(a,ray.kz)-ray.vantage[ray.kz];
+			const SolveScalar bz=Component(b,ray.kz)-ray.vantage[ray.kz];
+			const SolveScalar cz=Component(c,ray.kz)-ray.vantage[ray.kz];
+			const SolveScalar ax=(Component(a,ray.kx)-ray.vantage[ray.kx])-ray.sx*az;
+			const SolveScalar ay=(Component(a,ray.ky)-ray.vantage[ray.ky])-ray.sy*az;
+			const SolveScalar bx=(Component(b,ray.kx)-ray.vantage[ray.kx])-ray.sx*bz;
+			const SolveScalar by=(Component(b,ray.ky)-ray.vantage[ray.ky])-ray.sy*bz;
+			const SolveScalar cx=(Component(c,ray.kx)-ray.vantage[ray.kx])-ray.sx*cz;
+			const SolveScalar cy=(Component(c,ray.ky)-ray.vantage[ray.ky])-ray.sy*cz;
+
+			// Twice the signed areas of the triangles the ray makes with each edge.
+			const SolveScalar u=cx*by-cy*bx;    // edge b to c
+			const SolveScalar v=ax*cy-ay*cx;    // edge c to a
+			const SolveScalar w=bx*ay-by*ax;    // edge a to b
+			if (((u < 0.0) || (v < 0.0) || (w < 0.0)) && ((u > 0.0) || (v > 0.0) || (w > 0.0)))
+			{
+				return false;
+			}
+
+			// Zero for a triangle seen edge on, or with no area.
+			const SolveScalar det=u+v+w;
+			if (det == 0.0)
+			{
+				return false;
+			}
+
+			const bool isFrontFacing=(det > 0.0);
+			if (((u == 0.0) && !OwnsEdge(cx-bx,cy-by,isFrontFacing)) ||
+				((v == 0.0) && !OwnsEdge(ax-cx,ay-cy,isFrontFacing)) ||
+				((w == 0.0) && !OwnsEdge(bx-ax,by-ay,isFrontFacing)))
+			{
+				return false;
+			}
+
+			t=ray.sz*(u*az+v*bz+w*cz)/det;
+			return true;
+		}
+
+		// The scalar types a PLY property can have.
+		enum PlyType
+		{
+			PLY_INT8,
+			PLY_UINT8,
+			PLY_INT16,
+			PLY_UINT16,
+			PLY_INT32,
+			PLY_UINT32,
+			PLY_FLOAT32,
+			PLY_FLOAT64
+		};
+
+		PlyType ParsePlyType(const std::string& name)
+		{
+			if ((name == "char") || (name == "int8")) return PLY_INT8;
+			if ((name == "uchar") || (name == "uint8")) return PLY_UINT8;
+			if ((name == "short") || (name == "int16")) return PLY_INT16;
+			if ((name == "ushort") || (name == "uint16")) return PLY_UINT16;
+			if ((name == "int") || (name == "int32")) return PLY_INT32;
+			if ((name == "uint") || (name == "uint32")) return PLY_UINT32;
+			if ((name == "float") || (name == "float32")) return PLY_FLOAT32;
+			if ((name == "double") || (name == "float64")) return PLY_FLOAT64;
+			throw ImageException("Unknown PLY property type.");
+		}
+
+		struct PlyProperty
+		{
+			std::string name;
+			bool isList;
+			PlyType countType;      // lists only
+			PlyType type;           // of the value, or of each list entry
+		};
+
+		struct PlyElement
+		{
+			std::string name;
+			size_t count;
+			std::vector<PlyProperty> propertyList;
+
+			// Index in propertyList, or -1 if there is no such property.
+			int FindProperty(const char* propertyName) const
+			{
+				for (size_t i = 0; i < propertyList.size(); ++i)
+				{
+					if (propertyList[i].name == propertyName)
+					{
+						return static_cast<int>(i);
+					}
+				}
+				return -1;
+			}
+		};
+
+		// Reads the values after a PLY header one at a time.
+		class PlyReader
+		{
+		public:
+			enum Format
+			{
+				ASCII,
+				BINARY_LITTLE_ENDIAN,
+				BINARY_BIG_ENDIAN
+			};
+
+			PlyReader(std::istream& _input, Format _format)
+				: input(_input)
+				, format(_format)
+			{
+				const unsigned short one=1;
+				unsigned char firstByte;
+				memcpy(&firstByte,&one,1);
+				const Format hostFormat=(firstByte == 1) ? BINARY_LITTLE_ENDIAN : BINARY_BIG_ENDIAN;
+				isSwapped=(format != ASCII) && (format != hostFormat);
+			}
+
+			double Read(PlyType type)
+			{
+				if (format == ASCII)
+				{
+					double value;
+					if (!(input >> value))
+					{
+						throw ImageException("PLY file ends early or has an invalid value.");
+					}
+					return value;
+				}
+
+				static const size_t sizeList[]={1,1,2,2,4,4,4,8};
+				const size_t size=sizeList[type];
+				unsigned char bytes[8];
+				if (!input.read(reinterpret_cast<char*>(bytes),size))
+				{
+					throw ImageException("PLY file ends early.");
+				}
+				if (isSwapped)
+				{
+					std::reverse(bytes,bytes+size);
+				}
+
+				switch (type)
+				{
+				case PLY_INT8:    return Convert<signed char>(bytes);
+				case PLY_UINT8:   return Convert<unsigned char>(bytes);
+				case PLY_INT16:   return Convert<short>(bytes);
+				case PLY_UINT16:  return Convert<unsigned short>(bytes);
+				case PLY_INT32:   return Convert<int>(bytes);
+				case PLY_UINT32:  return Convert<unsigned int>(bytes);
+				case PLY_FLOAT32: return Convert<float>(bytes);
+				default:          return Convert<double>(bytes);
+				}
+			}
+
+		private:
+			template <typename T>
+			static double Convert(const unsigned char* bytes)
+			{
+				T value;
+				memcpy(&value,bytes,sizeof(T));
+				return static_cast<double>(value);
+			}
+
+			std::istream& input;
+			const Format format;
+			bool isSwapped;
+		};
+
+		// Reads a PLY vertex index and checks that it is a whole number.
+		size_t ReadPlyIndex(PlyReader& reader, PlyType type)
+		{
+			const double index=reader.Read(type);
+			if (!(index >= 0.0) || (index != floor(index)))
+			{
+				throw ImageException("Invalid PLY vertex index.");
+			}
+			return static_cast<size_t>(index);
+		}
+
+		inline const char* SkipSpace(const char* p)
+		{
+			while (isspace(static_cast<unsigned char>(*p)))
+			{
+				++p;
+			}
+			return p;
+		}
+	}
+
+	TriangleMesh::TriangleMesh(const Vector3 & _center, bool _isClosed)
+		: SolidObject(_center,_isClosed)
+		, isClosed(_isClosed)
+	{
+		isHierarchyStale=true;
+		isBoundsStale=false;
+		SetTag("TriangleMesh");
+	}
+
+	size_t TriangleMesh::AddVertex(const Vector3 & point)
+	{
+		// Triangles store vertex indexes as unsigned int.
+		if (vertexList.size() >= std::numeric_limits<unsigned int>::max())
+		{
+			throw ImageException("Triangle mesh has too many vertices.");
+		}
+
+		vertexList.push_back(point);
+		return vertexList.size()-1;
+	}
+
+	void TriangleMesh::AddTriangle(size_t a, size_t b, size_t c)
+	{
+		if ((a >= vertexList.size()) || (b >= vertexList.size()) || (c >= vertexList.size()))
+		{
+			throw ImageException("Triangle mesh vertex index is out of range.");
+		}
+
+		indexList.push_back(static_cast<unsigned int>(a));
+		indexList.push_back(static_cast<unsigned int>(b));
+		indexList.push_back(static_cast<unsigned int>(c));
+		isHierarchyStale=true;
+	}
+
+	void TriangleMesh::ReserveVertices(size_t count)
+	{
+		vertexList.reserve(count);
+	}
+
+	void TriangleMesh::ReserveTriangles(size_t count)
+	{
+		indexList.reserve(3*count);
+	}
+
+	void TriangleMesh::LoadObj(const char * filename)
+	{
+		std::ifstream infile(filename);
+		if (!infile)
+		{
+			throw ImageException("Cannot open OBJ file.");
+		}
+
+		// Positive indexes count from 1 at the first vertex this file adds;
+		// negative ones count back from the last vertex read so far.
+		const size_t firstVertex=vertexList.size();
+		std::vector<size_t> face;
+		std::string line;
+		while (std::getline(infile,line))
+		{
+			const char* p=SkipSpace(line.c_str());
+			if ((p[0] == 'v') && isspace(static_cast<unsigned char>(p[1])))
+			{
+				// "v x y z [w]"
+				double coord[3];
+				p+=1;
+				for (int k = 0; k < 3; ++k)
+				{
+					char* end;
+					coord[k]=strtod(p,&end);
+					if (end == p)
+					{
+						throw ImageException("Invalid OBJ vertex.");
+					}
+					p=end;
+				}
+				AddVertex(Vector3(coord[0],coord[1],coord[2]));
+			}
+			else if ((p[0] == 'f') && isspace(static_cast<unsigned char>(p[1])))
+			{
+				// "f v1 v2 v3 ...", where each entry may be v, v/vt, v//vn or v/vt/vn.
+				face.clear();
+				p=SkipSpace(p+1);
+				while ((*p != '\0') && (*p != '#'))
+				{
+					char* end;
+					const long index=strtol(p,&end,10);
+					if ((end == p) || (index == 0))
+					{
+						throw ImageException("Invalid OBJ face.");
+					}
+
+					const long long vertex=(index > 0)
+						? static_cast<long long>(firstVertex)+index-1
+						: static_cast<long long>(vertexList.size())+index;
+					if ((vertex < 0) || (vertex >= static_cast<long long>(vertexList.size())))
+					{
+						throw ImageException("OBJ face refers to a missing vertex.");
+					}
+					face.push_back(static_cast<size_t>(vertex));
+
+					// Skip any texture coordinate and normal indexes.
+					p=end;
+					while ((*p != '\0') && !isspace(static_cast<unsigned char>(*p)))
+					{
+						++p;
+					}
+					p=SkipSpace(p);
+				}
+
+				if (face.size() < 3)
+				{
+					throw ImageException("OBJ face has fewer than three vertices.");
+				}
+				for (size_t k = 2; k < face.size(); ++k)
+				{
+					AddTriangle(face[0],face[k-1],face[k]);
+				}
+			}
+		}
+
+		if (infile.bad())
+		{
+			throw ImageException("Error reading OBJ file.");
+		}
+	}
+
+	void TriangleMesh::LoadPly(const char * filename)
+	{
+		std::ifstream infile(filename,std::ios::in|std::ios::binary);
+		if (!infile)
+		{
+			throw ImageException("Cannot open PLY file.");
+		}
+
+		// The header is text, whatever the format of the data after it.
+		PlyReader::Format format=PlyReader::ASCII;
+		bool hasFormat=false;
+		std::vector<PlyElement> elementList;
+		std::string line;
+		bool isFirstLine=true;
+		for(;;)
+		{
+			if (!std::getline(infile,line))
+			{
+				throw ImageException("PLY header has no end_header.");
+			}
+			if (!line.empty() && (line[line.size()-1] == '\r'))
+			{
+				line.erase(line.size()-1);
+			}
+
+			std::istringstream words(line);
+			std::string keyword;
+			words >> keyword;
+			if (isFirstLine)
+			{
+				if (keyword != "ply")
+				{
+					throw ImageException("Not a PLY file.");
+				}
+				isFirstLine=false;
+			}
+			else if (keyword == "format")
+			{
+				std::string name;
+				words >> name;
+				if (name == "ascii") format=PlyReader::ASCII;
+				else if (name == "binary_little_endian") format=PlyReader::BINARY_LITTLE_ENDIAN;
+				else if (name == "binary_big_endian") format=PlyReader::BINARY_BIG_ENDIAN;
+				else throw ImageException("Unknown PLY format.");
+				hasFormat=true;
+			}
+			else if (keyword == "element")
+			{
+				PlyElement element;
+				if (!(words >> element.name >> element.count))
+				{
+					throw ImageException("Invalid PLY element.");
+				}
+				elementList.push_back(element);
+			}
+			else if (keyword == "property")
+			{
+				if (elementList.empty())
+				{
+					throw ImageException("PLY property comes before any element.");
+				}
+
+				PlyProperty property;
+				std::string typeName;
+				words >> typeName;
+				property.isList=(typeName == "list");
+				if (property.isList)
+				{
+					std::string countTypeName;
+					words >> countTypeName >> typeName;
+					property.countType=ParsePlyType(countTypeName);
+				}
+				else
+				{
+					property.countType=PLY_UINT8;
+				}
+				property.type=ParsePlyType(typeName);
+				if (!(words >> property.name))
+				{
+					throw ImageException("Invalid PLY property.");
+				}
+				elementList.back().propertyList.push_back(property);
+			}
+			else if (keyword == "end_header")
+			{
+				break;
+			}
+			// Anything else, such as comment and obj_info, is ignored.
+		}
+
+		if (!hasFormat)
+		{
+			throw ImageException("PLY header has no format.");
+		}
+
+		// The header's counts are not trusted to size the lists: each
+		// property of an element takes at least a byte, so no more
+		// elements than that can follow.
+		size_t remainingBytes=0;
+		const std::streampos dataStart=infile.tellg();
+		if ((dataStart != std::streampos(-1)) && infile.seekg(0,std::ios::end))
+		{
+			const std::streampos fileEnd=infile.tellg();
+			if (fileEnd > dataStart)
+			{
+				remainingBytes=static_cast<size_t>(fileEnd-dataStart);
+			}
+		}
+		infile.clear();
+		infile.seekg(dataStart);
+
+		// Vertex indexes count from the first vertex this file adds.
+		const size_t firstVertex=vertexList.size();
+		size_t fileVertexCount=0;
+		std::vector<size_t> face;
+		PlyReader reader(infile,format);
+		for (size_t e = 0; e < elementList.size(); ++e)
+		{
+			const PlyElement& element=elementList[e];
+			const std::vector<PlyProperty>& propertyList=element.propertyList;
+			const size_t reserveCount=propertyList.empty() ? 0 :
+				std::min(element.count,remainingBytes/propertyList.size());
+
+			// The properties this mesh uses; -1 for none.
+			int x=-1, y=-1, z=-1, indexes=-1;
+			if (element.name == "vertex")
+			{
+				x=element.FindProperty("x");
+				y=element.FindProperty("y");
+				z=element.FindProperty("z");
+				if ((x < 0) || (y < 0) || (z < 0) ||
+					propertyList[x].isList || propertyList[y].isList || propertyList[z].isList)
+				{
+					throw ImageException("PLY vertices have no x, y and z.");
+				}
+				ReserveVertices(vertexList.size()+reserveCount);
+			}
+			else if (element.name == "face")
+			{
+				indexes=element.FindProperty("vertex_indices");
+				if (indexes < 0)
+				{
+					indexes=element.FindProperty("vertex_index");
+				}
+				if ((indexes < 0) || !propertyList[indexes].isList)
+				{
+					throw ImageException("PLY faces have no vertex_indices.");
+				}
+				ReserveTriangles(GetTriangleCount()+reserveCount);
+			}
+
+			for (size_t i = 0; i < element.count; ++i)
+			{
+				double coord[3]={0.0,0.0,0.0};
+				for (int p = 0; p < static_cast<int>(propertyList.size()); ++p)
+				{
+					const PlyProperty& property=propertyList[p];
+					if (p == indexes)
+					{
+						face.clear();
+						const size_t count=ReadPlyIndex(reader,property.countType);
+						for (size_t k = 0; k < count; ++k)
+						{
+							const size_t index=ReadPlyIndex(reader,property.type);
+							if (index >= fileVertexCount)
+							{
+								throw ImageException("PLY face refers to a missing vertex.");
+							}
+							face.push_back(firstVertex+index);
+						}
+					}
+					else if (property.isList)
+					{
+						const size_t count=ReadPlyIndex(reader,property.countType);
+						for (size_t k = 0; k < count; ++k)
+						{
+							reader.Read(property.type);
+						}
+					}
+					else
+					{
+						const double value=reader.Read(property.type);
+						if (p == x) coord[0]=value;
+						else if (p == y) coord[1]=value;
+						else if (p == z) coord[2]=value;
+					}
+				}
+
+				if (x >= 0)
+				{
+					AddVertex(Vector3(coord[0],coord[1],coord[2]));
+					++fileVertexCount;
+				}
+				else if (indexes >= 0)
+				{
+					if (face.size() < 3)
+					{
+						throw ImageException("PLY face has fewer than three vertices.");
+					}
+					for (size_t k = 2; k < face.size(); ++k)
+					{
+						AddTriangle(face[0],face[k-1],face[k]);
+					}
+				}
+			}
+		}
+	}
+
+	size_t TriangleMesh::GetVertexCount() const
+	{
+		return vertexList.size();
+	}
+
+	size_t TriangleMesh::GetTriangleCount() const
+	{
+		return indexList.size()/3;
+	}
+
+	void TriangleMesh::AppendAllIntersections(const Vector3 & vantage, const Vector3 & direction, IntersectionList & intersectionList) const
+	{
+		CheckPrepared();
+
+		const ShearedRay ray=ShearRay(vantage,direction);
+		const SolveVector3 dir(direction);
+		auto visitor=[&](unsigned int first, unsigned int count, double&)
+		{
+			for (size_t i = first; i < first+count; ++i)
+			{
+				const unsigned int* triangle=&indexList[3*i];
+				SolveScalar t;
+				if (IntersectTriangle(ray,vertexList[triangle[0]],vertexList[triangle[1]],vertexList[triangle[2]],t) && (t > EPSILON))
+				{
+					Intersection intersection;
+					RayHit hit;
+					hit.t=t;
+					hit.distanceSquared=(t*dir).MagnetitudeSquared();
+					hit.context=triangle;
+					CompleteIntersection(vantage,direction,hit,intersection);
+					intersectionList.push_back(intersection);
+				}
+			}
+			return false;
+		};
+		hierarchy.TraverseLeaves(vantage,direction,HUGE_VAL,visitor);
+	}
+
+	int TriangleMesh::FindClosestHit(const Vector3 & vantage, const Vector3 & direction, double maxDistanceSquared, RayHit & hit) const
+	{
+		CheckPrepared();
+
+		const ShearedRay ray=ShearRay(vantage,direction);
+		const SolveVector3 dir(direction);
+		const unsigned int* closestTriangle=NULL;
+		SolveScalar closestT=0.0;
+		double closestDistanceSquared=maxDistanceSquared;
+		auto visitor=[&](unsigned int first, unsigned int count, double& tMax)
+		{
+			for (size_t i = first; i < first+count; ++i)
+			{
+				const unsigned int* triangle=&indexList[3*i];
+				SolveScalar t;
+				if (IntersectTriangle(ray,vertexList[triangle[0]],vertexList[triangle[1]],vertexList[triangle[2]],t) && (t > EPSILON))
+				{
+					const double distanceSquared=(t*dir).MagnetitudeSquared();
+					if (distanceSquared < closestDistanceSquared)
+					{
+						closestTriangle=triangle;
+						closestT=t;
+						closestDistanceSquared=distanceSquared;
+						tMax=t;
+					}
+				}
+			}
+			return false;
+		};
+		hierarchy.TraverseLeaves(vantage,direction,sqrt(maxDistanceSquared/direction.MagnetitudeSquared()),visitor);
+
+		if (closestTriangle == NULL)
+		{
+			return 0;
+		}
+
+		// Triangles of one mesh meet only at edges, which the edge rule
+		// gives to just one of them, so the mesh never ties with itself.
+		hit.distanceSquared=closestDistanceSquared;
+		hit.t=closestT;
+		hit.solid=this;
+		hit.context=closestTriangle;
+		return 1;
+	}
+
+	void TriangleMesh::CompleteIntersection(const Vector3 & vantage, const Vector3 & direction, const RayHit & hit, Intersection & intersection) const
+	{
+		// The context points at the triangle's entries in indexList.
+		const unsigned int* triangle=static_cast<const unsigned int*>(hit.context);
+		const SolveVector3 a(vertexList[triangle[0]]);
+		const SolveVector3 b(vertexList[triangle[1]]);
+		const SolveVector3 c(vertexList[triangle[2]]);
+
+		const SolveVector3 dir(direction);
+		const SolveVector3 point=SolveVector3(vantage)+static_cast<SolveScalar>(hit.t)*dir;
+		SolveVector3 normal=CrossProduct(b-a,c-a).UnitVector();
+		if (!isClosed && (DotProduct(normal,dir) > 0.0))
+		{
+			normal=-normal;
+		}
+
+		intersection.point=Vector3(point);
+		intersection.surfaceNormal=Vector3(normal);
+		intersection.distanceSquared=hit.distanceSquared;
+		intersection.solid=this;
+		intersection.context=NULL;
+	}
+
+	bool TriangleMesh::HasHitWithin(const Vector3 & vantage, const Vector3 & direction, double maxDistanceSquared) const
+	{
+		CheckPrepared();
+
+		const ShearedRay ray=ShearRay(vantage,direction);
+		const SolveVector3 dir(direction);
+		bool isHit=false;
+		auto visitor=[&](unsigned int first, unsigned int count, double&)
+		{
+			for (size_t i = first; i < first+count; ++i)
+			{
+				const unsigned int* triangle=&indexList[3*i];
+				SolveScalar t;
+				if (IntersectTriangle(ray,vertexList[triangle[0]],vertexList[triangle[1]],vertexList[triangle[2]],t) &&
+					(t > EPSILON) && ((t*dir).MagnetitudeSquared() < maxDistanceSquared))
+				{
+					isHit=true;
+					return true;
+				}
+			}
+			return false;
+		};
+		hierarchy.TraverseLeaves(vantage,direction,sqrt(maxDistanceSquared/direction.MagnetitudeSquared()),visitor);
+		return isHit;
+	}
+
+	bool TriangleMesh::Contains(const Vector3 & point) const
+	{
+		if (!isClosed)
+		{
+			return false;
+		}
+
+		// Cast a ray from the point, as SolidObject::Contains does, and count
+		// the triangles it crosses.  The watertight test never counts a crossing
+		// at a shared edge twice or not at all, so the parity is exact.
+		const Vector3 direction(0.0,0.0,1.0);
+		const ShearedRay ray=ShearRay(point,direction);
+		size_t crossingCount=0;
+		auto countCrossings=[&](size_t first, size_t count)
+		{
+			for (size_t i = first; i < first+count; ++i)
+			{
+				const unsigned int* triangle=&indexList[3*i];
+				SolveScalar t;
+				if (IntersectTriangle(ray,vertexList[triangle[0]],vertexList[triangle[1]],vertexList[triangle[2]],t) && (t > 0.0))
+				{
+					++crossingCount;
+				}
+			}
+		};
+
+		if (isHierarchyStale || isBoundsStale)
+		{
+			countCrossings(0,GetTriangleCount());
+		}
+		else
+		{
+			if (!hierarchy.GetBounds().Expanded(CONTAINMENT_MARGIN).Contains(point))
+			{
+				return false;
+			}
+
+			auto visitor=[&](unsigned int first, unsigned int count, double&)
+			{
+				countCrossings(first,count);
+				return false;
+			};
+			hierarchy.TraverseLeaves(point,direction,HUGE_VAL,visitor);
+		}
+		return (crossingCount%2) == 1;
+	}
+
+	BoundingBox TriangleMesh::GetBoundingBox() const
+	{
+		PrepareHierarchy();
+		return hierarchy.GetBounds();
+	}
+
+	void TriangleMesh::Prepare() const
+	{
+		PrepareHierarchy();
+	}
+
+	SolidObject & TriangleMesh::RotateX(double angleInDegrees)
+	{
+		RotateVertices(&Vector3::y,&Vector3::z,angleInDegrees);
+		return *this;
+	}
+
+	SolidObject & TriangleMesh::RotateY(double angleInDegrees)
+	{
+		RotateVertices(&Vector3::z,&Vector3::x,angleInDegrees);
+		return *this;
+	}
+
+	SolidObject & TriangleMesh::RotateZ(double angleInDegrees)
+	{
+		RotateVertices(&Vector3::x,&Vector3::y,angleInDegrees);
+		return *this;
+	}
+
+	SolidObject & TriangleMesh::Translate(double dx, double dy, double dz)
+	{
+		SolidObject::Translate(dx,dy,dz);
+		const Vector3 offset(dx,dy,dz);
+		for (size_t i = 0; i < vertexList.size(); ++i)
+		{
+			vertexList[i]+=offset;
+		}
+		isBoundsStale=true;
+		return *this;
+	}
+
+	void TriangleMesh::PrepareHierarchy() const
+	{
+		if (isHierarchyStale)
+		{
+			// Triangles were added, so the current order means nothing to
+			// the hierarchy any more; collect their boxes in list order.
+			hierarchy.Clear();
+
+			std::vector<BoundingBox> boundsList;
+			CollectTriangleBounds(boundsList);
+			hierarchy.Build(boundsList);
+
+			// Sort the triangles into the order the leaves list them, so
+			// each leaf's triangles are next to each other in memory.
+			const CopyOnWriteArray<unsigned int>& order=hierarchy.GetPrimitiveOrder();
+			std::vector<unsigned int> sortedList(indexList.size());
+			for (size_t i = 0; i < order.Size(); ++i)
+			{
+				const unsigned int* triangle=&indexList[3*order[i]];
+				sortedList[3*i]=triangle[0];
+				sortedList[3*i+1]=triangle[1];
+				sortedList[3*i+2]=triangle[2];
+			}
+			indexList.swap(sortedList);
+		}
+		else if (isBoundsStale)
+		{
+			// Moving vertices changes the boxes but not which triangles
+			// are in each leaf, so refitting is enough.
+			std::vector<BoundingBox> boundsList;
+			CollectTriangleBounds(boundsList);
+			hierarchy.Refit(boundsList);
+		}
+		isHierarchyStale=false;
+		isBoundsStale=false;
+	}
+
+	void TriangleMesh::CollectTriangleBounds(std::vector<BoundingBox>& boundsList) const
+	{
+		// Boxes are indexed the way the hierarchy knows the triangles,
+		// as SphereBatch::CollectSphereBounds explains.
+		const CopyOnWriteArray<unsigned int>& order=hierarchy.GetPrimitiveOrder();
+		const bool isSorted=!hierarchy.IsEmpty();
+
+		const size_t triangleCount=GetTriangleCount();
+		boundsList.resize(triangleCount);
+		for (size_t i = 0; i < triangleCount; ++i)
+		{
+			BoundingBox box;
+			box.Include(vertexList[indexList[3*i]]);
+			box.Include(vertexList[indexList[3*i+1]]);
+			box.Include(vertexList[indexList[3*i+2]]);
+
+			// Grown a little, because a ray through a vertex or edge on the
+			// surface of the box can miss it by rounding in the slab test,
+			// which would undo the watertight triangle test.
+			boundsList[isSorted ? order[i] : i]=box.Expanded(EPSILON);
+		}
+	}
+
+	void TriangleMesh::CheckPrepared() const
+	{
+		// Building the hierarchy reorders the triangles, which is not safe
+		// while render threads are reading them, so it has to happen first.
+		if (isHierarchyStale || isBoundsStale)
+		{
+			throw ImageException("Triangle mesh changed after the scene's acceleration structure was built.");
+		}
+	}
+
+	void TriangleMesh::RotateVertices(Scalar Vector3::*a, Scalar Vector3::*b, double angleInDegrees)
+	{
+		// Rotates counterclockwise in the (a,b) plane about the mesh's center.
+		const double pivotA=Center().*a;
+		const double pivotB=Center().*b;
+		const double radians=RadiansFromDegrees(angleInDegrees);
+		const double cosine=cos(radians);
+		const double sine=sin(radians);
+		for (size_t i = 0; i < vertexList.size(); ++i)
+		{
+			const double da=vertexList[i].*a-pivotA;
+			const double db=vertexList[i].*b-pivotB;
+			vertexList[i].*a=static_cast<Scalar>(pivotA+cosine*da-sine*db);
+			vertexList[i].*b=static_cast<Scalar>(pivotB+sine*da+cosine*db);
+		}
+		isBoundsStale=true;
+	}
+}
@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/benchmark.dir/Benchmark/Benchmark.cpp.o"
+  "CMakeFiles/benchmark.dir/Benchmark/Benchmark.cpp.o.d"
+  "benchmark"
+  "benchmark.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/benchmark.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,38 @@
+
+# Consider dependencies only in project.
+set(CMAKE_DEPENDS_IN_PROJECT_ONLY OFF)
+
+# The set of languages for which implicit dependencies are needed:
+set(CMAKE_DEPENDS_LANGUAGES
+  )
+
+# The set of dependency files which are needed:
+set(CMAKE_DEPENDS_DEPENDENCY_FILES
+  "/root/repo/RayTraycer/Algebra.cpp" "CMakeFiles/imager.dir/RayTraycer/Algebra.cpp.o" "gcc" "CMakeFiles/imager.dir/RayTraycer/Algebra.cpp.o.d"
+  "/root/repo/RayTraycer/BoundingVolumeHierarchy.cpp" "CMakeFiles/imager.dir/RayTraycer/BoundingVolumeHierarchy.cpp.o" "gcc" "CMakeFiles/imager.dir/RayTraycer/BoundingVolumeHierarchy.cpp.o.d"
+  "/root/repo/RayTraycer/FrameEncoder.cpp" "CMakeFiles/imager.dir/RayTraycer/FrameEncoder.cpp.o" "gcc" "CMakeFiles/imager.dir/RayTraycer/FrameEncoder.cpp.o.d"
+  "/root/repo/RayTraycer/ImageBuffer.cpp" "CMakeFiles/imager.dir/RayTraycer/ImageBuffer.cpp.o" "gcc" "CMakeFiles/imager.dir/RayTraycer/ImageBuffer.cpp.o.d"
+  "/root/repo/RayTraycer/Instance.cpp" "CMakeFiles/imager.dir/RayTraycer/Instance.cpp.o" "gcc" "CMakeFiles/imager.dir/RayTraycer/Instance.cpp.o.d"
+  "/root/repo/RayTraycer/MappedFile.cpp" "CMakeFiles/imager.dir/RayTraycer/MappedFile.cpp.o" "gcc" "CMakeFiles/imager.dir/RayTraycer/MappedFile.cpp.o.d"
+  "/root/repo/RayTraycer/Optics.cpp" "CMakeFiles/imager.dir/RayTraycer/Optics.cpp.o" "gcc" "CMakeFiles/imager.dir/RayTraycer/Optics.cpp.o.d"
+  "/root/repo/RayTraycer/PacketKernels.cpp" "CMakeFiles/imager.dir/RayTraycer/PacketKernels.cpp.o" "gcc" "CMakeFiles/imager.dir/RayTraycer/PacketKernels.cpp.o.d"
+  "/root/repo/RayTraycer/PacketKernelsAvx2.cpp" "CMakeFiles/imager.dir/RayTraycer/PacketKernelsAvx2.cpp.o" "gcc" "CMakeFiles/imager.dir/RayTraycer/PacketKernelsAvx2.cpp.o.d"
+  "/root/repo/RayTraycer/PacketKernelsAvx512.cpp" "CMakeFiles/imager.dir/RayTraycer/PacketKernelsAvx512.cpp.o" "gcc" "CMakeFiles/imager.dir/RayTraycer/PacketKernelsAvx512.cpp.o.d"
+  "/root/repo/RayTraycer/PngWriter.cpp" "CMakeFiles/imager.dir/RayTraycer/PngWriter.cpp.o" "gcc" "CMakeFiles/imager.dir/RayTraycer/PngWriter.cpp.o.d"
+  "/root/repo/RayTraycer/RenderStatistics.cpp" "CMakeFiles/imager.dir/RayTraycer/RenderStatistics.cpp.o" "gcc" "CMakeFiles/imager.dir/RayTraycer/RenderStatistics.cpp.o.d"
+  "/root/repo/RayTraycer/Scene.cpp" "CMakeFiles/imager.dir/RayTraycer/Scene.cpp.o" "gcc" "CMakeFiles/imager.dir/RayTraycer/Scene.cpp.o.d"
+  "/root/repo/RayTraycer/SceneFile.cpp" "CMakeFiles/imager.dir/RayTraycer/SceneFile.cpp.o" "gcc" "CMakeFiles/imager.dir/RayTraycer/SceneFile.cpp.o.d"
+  "/root/repo/RayTraycer/SolidObject.cpp" "CMakeFiles/imager.dir/RayTraycer/SolidObject.cpp.o" "gcc" "CMakeFiles/imager.dir/RayTraycer/SolidObject.cpp.o.d"
+  "/root/repo/RayTraycer/Sphere.cpp" "CMakeFiles/imager.dir/RayTraycer/Sphere.cpp.o" "gcc" "CMakeFiles/imager.dir/RayTraycer/Sphere.cpp.o.d"
+  "/root/repo/RayTraycer/SphereBatch.cpp" "CMakeFiles/imager.dir/RayTraycer/SphereBatch.cpp.o" "gcc" "CMakeFiles/imager.dir/RayTraycer/SphereBatch.cpp.o.d"
+  "/root/repo/RayTraycer/ThreadPool.cpp" "CMakeFiles/imager.dir/RayTraycer/ThreadPool.cpp.o" "gcc" "CMakeFiles/imager.dir/RayTraycer/ThreadPool.cpp.o.d"
+  "/root/repo/RayTraycer/Transform.cpp" "CMakeFiles/imager.dir/RayTraycer/Transform.cpp.o" "gcc" "CMakeFiles/imager.dir/RayTraycer/Transform.cpp.o.d"
+  "/root/repo/RayTraycer/TriangleMesh.cpp" "CMakeFiles/imager.dir/RayTraycer/TriangleMesh.cpp.o" "gcc" "CMakeFiles/imager.dir/RayTraycer/TriangleMesh.cpp.o.d"
+  )
+
+# Targets to which this target links.
+set(CMAKE_TARGET_LINKED_INFO_FILES
+  )
+
+# Fortran module output directory.
+set(CMAKE_Fortran_TARGET_MODULE_DIR "")
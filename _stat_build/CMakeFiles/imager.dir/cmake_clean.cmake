@@ -0,0 +1,49 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/imager.dir/RayTraycer/Algebra.cpp.o"
+  "CMakeFiles/imager.dir/RayTraycer/Algebra.cpp.o.d"
+  "CMakeFiles/imager.dir/RayTraycer/BoundingVolumeHierarchy.cpp.o"
+  "CMakeFiles/imager.dir/RayTraycer/BoundingVolumeHierarchy.cpp.o.d"
+  "CMakeFiles/imager.dir/RayTraycer/FrameEncoder.cpp.o"
+  "CMakeFiles/imager.dir/RayTraycer/FrameEncoder.cpp.o.d"
+  "CMakeFiles/imager.dir/RayTraycer/ImageBuffer.cpp.o"
+  "CMakeFiles/imager.dir/RayTraycer/ImageBuffer.cpp.o.d"
+  "CMakeFiles/imager.dir/RayTraycer/Instance.cpp.o"
+  "CMakeFiles/imager.dir/RayTraycer/Instance.cpp.o.d"
+  "CMakeFiles/imager.dir/RayTraycer/MappedFile.cpp.o"
+  "CMakeFiles/imager.dir/RayTraycer/MappedFile.cpp.o.d"
+  "CMakeFiles/imager.dir/RayTraycer/Optics.cpp.o"
+  "CMakeFiles/imager.dir/RayTraycer/Optics.cpp.o.d"
+  "CMakeFiles/imager.dir/RayTraycer/PacketKernels.cpp.o"
+  "CMakeFiles/imager.dir/RayTraycer/PacketKernels.cpp.o.d"
+  "CMakeFiles/imager.dir/RayTraycer/PacketKernelsAvx2.cpp.o"
+  "CMakeFiles/imager.dir/RayTraycer/PacketKernelsAvx2.cpp.o.d"
+  "CMakeFiles/imager.dir/RayTraycer/PacketKernelsAvx512.cpp.o"
+  "CMakeFiles/imager.dir/RayTraycer/PacketKernelsAvx512.cpp.o.d"
+  "CMakeFiles/imager.dir/RayTraycer/PngWriter.cpp.o"
+  "CMakeFiles/imager.dir/RayTraycer/PngWriter.cpp.o.d"
+  "CMakeFiles/imager.dir/RayTraycer/RenderStatistics.cpp.o"
+  "CMakeFiles/imager.dir/RayTraycer/RenderStatistics.cpp.o.d"
+  "CMakeFiles/imager.dir/RayTraycer/Scene.cpp.o"
+  "CMakeFiles/imager.dir/RayTraycer/Scene.cpp.o.d"
+  "CMakeFiles/imager.dir/RayTraycer/SceneFile.cpp.o"
+  "CMakeFiles/imager.dir/RayTraycer/SceneFile.cpp.o.d"
+  "CMakeFiles/imager.dir/RayTraycer/SolidObject.cpp.o"
+  "CMakeFiles/imager.dir/RayTraycer/SolidObject.cpp.o.d"
+  "CMakeFiles/imager.dir/RayTraycer/Sphere.cpp.o"
+  "CMakeFiles/imager.dir/RayTraycer/Sphere.cpp.o.d"
+  "CMakeFiles/imager.dir/RayTraycer/SphereBatch.cpp.o"
+  "CMakeFiles/imager.dir/RayTraycer/SphereBatch.cpp.o.d"
+  "CMakeFiles/imager.dir/RayTraycer/ThreadPool.cpp.o"
+  "CMakeFiles/imager.dir/RayTraycer/ThreadPool.cpp.o.d"
+  "CMakeFiles/imager.dir/RayTraycer/Transform.cpp.o"
+  "CMakeFiles/imager.dir/RayTraycer/Transform.cpp.o.d"
+  "CMakeFiles/imager.dir/RayTraycer/TriangleMesh.cpp.o"
+  "CMakeFiles/imager.dir/RayTraycer/TriangleMesh.cpp.o.d"
+  "libimager.a"
+  "libimager.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/imager.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()